@@ -16,6 +16,7 @@ KERNEL_SRCFILES += \
 	kernel/arch/${ARCH}/drivers/sp804.c \
 	kernel/arch/${ARCH}/mach/realview/realview.c \
 	kernel/arch/${ARCH}/mach/mach.c \
+	kernel/arch/${ARCH}/mm/arch_uaccess.S \
 	kernel/arch/${ARCH}/mm/arch_vm.c \
 	kernel/arch/${ARCH}/process/arch_process.c \
 	kernel/arch/${ARCH}/process/arch_signal.c \
@@ -8,13 +8,13 @@ sys_arch_get_num(void)
 {
   struct Process *current = process_current();
 
-  int *pc = (int *) (current->thread->tf->pc - 4);
-  int r;
+  uintptr_t pc = current->thread->tf->pc - 4;
+  int insn, r;
 
-  if ((r = vm_user_check_buf(current->vm->pgtab, (uintptr_t) pc, sizeof(int), VM_READ)) < 0)
+  if ((r = vm_copy_in(current->vm, &insn, pc, sizeof insn)) < 0)
     return r;
 
-  return *pc & 0xFFFFFF;
+  return insn & 0xFFFFFF;
 }
 
 // Get the n-th argument from the current process' trap frame.
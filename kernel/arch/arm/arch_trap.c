@@ -17,7 +17,11 @@
 
 #include <arch/arm/regs.h>
 
+// Exception table entries are pairs of instruction and fixup addresses
+extern uintptr_t __ex_table_begin__[], __ex_table_end__[];
+
 static void trap_handle_abort(struct TrapFrame *);
+static uintptr_t trap_fixup_lookup(uintptr_t);
 
 /**
  * Common entry point for all traps, including system calls. The TrapFrame
@@ -89,23 +93,57 @@ trap_handle_abort(struct TrapFrame *tf)
 {
   uint32_t address, status;
   struct Process *process;
+  uintptr_t fixup = 0;
+  int access, r;
 
   // Read the contents of the corresponsing Fault Address Register (FAR) and 
   // the Fault Status Register (FSR).
   address = tf->trapno == T_DABT ? cp15_dfar_get() : cp15_ifar_get();
   status  = tf->trapno == T_DABT ? cp15_dfsr_get() : cp15_ifsr_get();
 
-  // If abort happened in kernel mode, print the trap frame and panic
+  // The kernel may only fault while accessing user memory on behalf of the
+  // current process. Otherwise, print the trap frame and panic
   if ((tf->psr & PSR_M_MASK) != PSR_M_USR) {
-    print_trapframe(tf);
-    panic("kernel fault va %p status %#x", address, status);
+    if ((tf->trapno != T_DABT) || ((fixup = trap_fixup_lookup(tf->pc)) == 0)) {
+      print_trapframe(tf);
+      panic("kernel fault va %p status %#x", address, status);
+    }
   }
 
   process = process_current();
   assert(process != NULL);
 
-  // Try to handle VM fault first (it may be caused by copy-on-write pages)
-  if (((status & 0xF) == 0xF) && vm_handle_fault(process->vm->pgtab, address) == 0) {
+  if (tf->trapno == T_PABT)
+    access = VM_EXEC;
+  else
+    access = (status & FSR_WNR) ? VM_WRITE : VM_READ;
+
+  // Try to handle VM fault first (it may be caused by copy-on-write pages or
+  // by the first access to a page that is not yet allocated)
+  switch (status & FSR_FS_MASK) {
+  case FSR_FS_TRANS_SECT:
+  case FSR_FS_TRANS_PAGE:
+  case FSR_FS_PERM_PAGE:
+    // Interrupts were disabled, so the kernel code holds a spinlock and the
+    // fault handler must not sleep. Fail the access instead.
+    if ((fixup != 0) && (tf->psr & PSR_I))
+      break;
+
+    // Bringing in file-backed pages may need to sleep
+    k_irq_enable();
+    r = vm_handle_fault(process->vm, address, access);
+    k_irq_disable();
+
+    if (r == 0)
+      return;
+    break;
+  default:
+    break;
+  }
+
+  // Let the kernel code that caused the fault report the error
+  if (fixup != 0) {
+    tf->pc = fixup;
     return;
   }
 
@@ -118,6 +156,20 @@ trap_handle_abort(struct TrapFrame *tf)
     panic("sending SIGSEGV failed");
 }
 
+// Find the fixup address for an instruction that accesses user memory (see
+// arch_uaccess.S). The table is small, so a linear search is sufficient
+static uintptr_t
+trap_fixup_lookup(uintptr_t pc)
+{
+  uintptr_t *entry;
+
+  for (entry = __ex_table_begin__; entry < __ex_table_end__; entry += 2)
+    if (entry[0] == pc)
+      return entry[1];
+
+  return 0;
+}
+
 // Returns a human-readable name for the given trap number
 static const char *
 get_trap_name(unsigned trapno)
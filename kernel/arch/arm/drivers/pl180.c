@@ -1,10 +1,18 @@
 #include <kernel/drivers/sd.h>
+#include <kernel/interrupt.h>
+#include <kernel/thread.h>
 #include <arch/arm/pl180.h>
 
 /*******************************************************************************
  * ARM PrimeCell Multimedia Card Interface (PL180) driver.
  * 
  * Note: this code works in QEMU but hasn't been tested on real hardware!
+ *
+ * Instead of polling the status register, the calling thread enables the
+ * interrupts for the status flags it is waiting for and sleeps until the
+ * interrupt arrives. Data is moved through the FIFO in half-FIFO bursts, one
+ * interrupt per burst. Before the scheduler is started (e.g. while the card
+ * is being initialized), the status register is polled instead.
  * 
  * See ARM PrimeCell Multimedia Card Interface (PL180) Technical Reference
  * Manual.
@@ -61,6 +69,12 @@ enum {
   MCI_DATA_CTRL_DIRECTION = (1 << 1),   // From card to controller
 };
 
+// FIFO depth in 32-bit words
+#define MCI_FIFO_SIZE       16
+// The number of words that can be moved at once when the FIFO is half full
+// (or half empty)
+#define MCI_FIFO_HALF_SIZE  (MCI_FIFO_SIZE / 2)
+
 // Status flags
 enum {
   MCI_CMD_CRC_FAIL   = (1 << 0),    // Command CRC check failed
@@ -87,37 +101,69 @@ enum {
   MCI_RX_DATA_AVLBL  = (1 << 21),   // Receive FIFO data available
 };
 
+static int pl180_irq(int, void *);
+
 /**
  * Initialize the MMCI driver.
  *
  * @param pl180 Pointer to the driver instance.
  * @param base Memory base address.
+ * @param irq Interrupt number.
  *
  * @return 0 on success, a non-zero value on error. 
  */
 int
-pl180_init(struct PL180 *pl180, void *base)
+pl180_init(struct PL180 *pl180, void *base, int irq)
 { 
   pl180->base = (volatile uint32_t *) base;
 
+  k_semaphore_init(&pl180->semaphore, 0);
+
   // Power on, 3.6 volts, rod control.
   pl180->base[MCI_POWER] = MCI_POWER_CTRL_ON | (0xF << 2) | MCI_POWER_ROD;
 
+  // Interrupts are only enabled while waiting for them
+  pl180->base[MCI_MASK0] = 0;
+  pl180->base[MCI_MASK1] = 0;
+
+  interrupt_attach(irq, pl180_irq, pl180);
+
   return 0;
 }
 
-/**
- * Enable interrupts on the card.
- * 
- * @param pl180 Pointer to the driver instance.
- */
+// Disable further interrupts and wake up the waiting thread, which checks the
+// status register itself.
 static int
-pl180_irq_enable(void *ctx)
+pl180_irq(int irq, void *arg)
 {
-  struct PL180 *pl180 = (struct PL180 *) ctx;
+  struct PL180 *pl180 = (struct PL180 *) arg;
 
-  pl180->base[MCI_MASK0] = MCI_TX_FIFO_EMPTY | MCI_RX_DATA_AVLBL;
-  return 0;
+  (void) irq;
+
+  pl180->base[MCI_MASK0] = 0;
+  k_semaphore_put(&pl180->semaphore);
+
+  return 1;
+}
+
+// Wait until any of the given status flags is set and return the status.
+static uint32_t
+pl180_wait(struct PL180 *pl180, uint32_t flags)
+{
+  uint32_t status;
+
+  while (!((status = pl180->base[MCI_STATUS]) & flags)) {
+    // Cannot sleep yet
+    if (k_thread_current() == NULL)
+      continue;
+
+    // The interrupt is raised immediately if a flag has been set in the
+    // meantime, so no wakeup can be lost
+    pl180->base[MCI_MASK0] = flags;
+    k_semaphore_get(&pl180->semaphore);
+  }
+
+  return status;
 }
 
 /**
@@ -158,9 +204,7 @@ pl180_send_cmd(void *ctx, uint32_t cmd, uint32_t arg, int resp_type,
         ? err_flags | MCI_CMD_RESP_END
         : err_flags | MCI_CMD_SENT;
 
-  do {
-    status = pl180->base[MCI_STATUS];
-  } while (!(status & flags));
+  status = pl180_wait(pl180, flags);
 
   // Receive response, if present.
   if ((status & MCI_CMD_RESP_END) && (resp != NULL)) {
@@ -218,31 +262,36 @@ pl180_receive_data(void *ctx, void *buf, size_t n)
 {
   struct PL180 *pl180 = (struct PL180 *) ctx;
   uint32_t status, err_flags, flags, *dst;
+  int i;
 
   // Static flags to be checked.
   err_flags = MCI_DATA_CRC_FAIL | MCI_DATA_TIME_OUT | MCI_RX_OVERRUN
             | MCI_START_BIT_ERR;
   flags = err_flags | MCI_DATA_BLOCK_END;
 
-  // Transfer data from the card.
+  // Transfer data from the card, half a FIFO at a time while possible.
   dst = (uint32_t *) buf;
   while (n > 0) {
-    status = pl180->base[MCI_STATUS];
-
-    if (status & err_flags)
-      break;
-
-    if (!(status & MCI_RX_DATA_AVLBL))
-      continue;
+    if (n >= MCI_FIFO_HALF_SIZE * sizeof(uint32_t)) {
+      status = pl180_wait(pl180, err_flags | MCI_RX_FIFO_HALF);
+      if (status & err_flags)
+        break;
+
+      for (i = 0; i < MCI_FIFO_HALF_SIZE; i++)
+        *dst++ = pl180->base[MCI_FIFO];
+      n -= MCI_FIFO_HALF_SIZE * sizeof(uint32_t);
+    } else {
+      status = pl180_wait(pl180, err_flags | MCI_RX_DATA_AVLBL);
+      if (status & err_flags)
+        break;
 
-    *dst++ = pl180->base[MCI_FIFO];
-    n -= sizeof(uint32_t);
+      *dst++ = pl180->base[MCI_FIFO];
+      n -= sizeof(uint32_t);
+    }
   }
 
   // Make sure the data block is completely received.
-  do {
-    status = pl180->base[MCI_STATUS];
-  } while (!(status & flags));
+  status = pl180_wait(pl180, flags);
 
   // Clear status flags.
   pl180->base[MCI_CLEAR] = status & flags;
@@ -265,31 +314,28 @@ pl180_send_data(void *ctx, const void *buf, size_t n)
   struct PL180 *pl180 = (struct PL180 *) ctx;
   uint32_t status, err_flags, flags;
   const uint32_t *src;
+  int i;
 
   // Static flags to be checked.
   err_flags = MCI_DATA_CRC_FAIL | MCI_DATA_TIME_OUT | MCI_TX_UNDERRUN
             | MCI_START_BIT_ERR;
   flags = err_flags | MCI_DATA_BLOCK_END;
 
-  // Transfer data to the card.
+  // Transfer data to the card, filling the FIFO each time it is half empty.
   src = (const uint32_t *) buf;
   while (n > 0) {
-    status = pl180->base[MCI_STATUS];
-
+    status = pl180_wait(pl180, err_flags | MCI_TX_FIFO_HALF);
     if (status & err_flags)
       break;
 
-    if (status & MCI_TX_FIFO_FULL)
-      continue;
-
-    pl180->base[MCI_FIFO] = *src++;
-    n -= sizeof(uint32_t);
+    for (i = 0; (i < MCI_FIFO_HALF_SIZE) && (n > 0); i++) {
+      pl180->base[MCI_FIFO] = *src++;
+      n -= sizeof(uint32_t);
+    }
   }
 
   // Make sure the data block is completely transferred.
-  do {
-    status = pl180->base[MCI_STATUS];
-  } while (!(status & flags));
+  status = pl180_wait(pl180, flags);
 
   // Clear status flags.
   pl180->base[MCI_CLEAR] = status & flags;
@@ -299,7 +345,6 @@ pl180_send_data(void *ctx, const void *buf, size_t n)
 
 struct SDOps pl180_ops = {
   .begin_transfer = pl180_begin_transfer,
-  .irq_enable = pl180_irq_enable,
   .receive_data = pl180_receive_data,
   .send_data = pl180_send_data,
   .send_cmd = pl180_send_cmd,
@@ -2,13 +2,15 @@
 #define __KERNEL_DRIVERS_SD_PL180_H__
 
 #include <stdint.h>
+#include <kernel/core/semaphore.h>
 #include <kernel/drivers/sd.h>
 
 struct PL180 {
   volatile uint32_t *base;
+  struct KSemaphore  semaphore;   // Signalled by the interrupt handler
 };
 
-int  pl180_init(struct PL180 *, void *);
+int  pl180_init(struct PL180 *, void *, int);
 
 extern struct SDOps pl180_ops;
 
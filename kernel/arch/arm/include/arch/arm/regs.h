@@ -75,6 +75,17 @@
 #define CP15_SCTLR_TE     (1 << 30)   ///< Thumb Exception enable
 /** @} */
 
+/** @defgroup FsrBits Fault Status Register bits
+ *  @{
+ */
+#define FSR_FS_MASK       0xF         ///< Fault status bits
+#define FSR_FS_TRANS_SECT 0x5         ///<   Translation fault, section
+#define FSR_FS_TRANS_PAGE 0x7         ///<   Translation fault, page
+#define FSR_FS_PERM_SECT  0xD         ///<   Permission fault, section
+#define FSR_FS_PERM_PAGE  0xF         ///<   Permission fault, page
+#define FSR_WNR           (1 << 11)   ///< Write not Read (DFSR only)
+/** @} */
+
 /** @defgroup CPAccessRights Coprocessor Access Rights
  *  @{
  */
@@ -188,6 +199,35 @@ cp15_tlbimva(uintptr_t va)
   asm volatile ("mcr p15, 0, %0, c8, c7, 1" : : "r"(va));
 }
 
+/**
+ * Invalidate entire unified TLB on all processors in the Inner Shareable
+ * domain.
+ */
+static inline void
+cp15_tlbiallis(void)
+{
+  asm volatile (
+    "dsb\n"
+    "mcr p15, 0, %0, c8, c3, 0\n"
+    "dsb\n"
+    "isb\n"
+    : : "r"(0) : "memory");
+}
+
+/**
+ * TLB Invalidate by MVA on all processors in the Inner Shareable domain.
+ */
+static inline void
+cp15_tlbimvais(uintptr_t va)
+{
+  asm volatile (
+    "dsb\n"
+    "mcr p15, 0, %0, c8, c3, 1\n"
+    "dsb\n"
+    "isb\n"
+    : : "r"(va) : "memory");
+}
+
 /**
  * Get the value of the R11 (FP) register.
  *
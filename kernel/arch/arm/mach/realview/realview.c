@@ -174,22 +174,12 @@ realview_pb_a8_timer_init_percpu(void)
 struct PL180 mmci;
 static struct SD sd;
 
-void
-realview_storage_request(struct Buf *buf)
-{
-  sd_request(&sd, buf);
-}
-
-struct BlockDev storage_dev = {
-  .request = realview_storage_request,
-};
-
 int
 realview_storage_init(void)
 {
-  pl180_init(&mmci, PA2KVA(PHYS_MMCI));
-  sd_init(&sd, &pl180_ops, &mmci, IRQ_MCIA);
-  dev_register_block(0, &storage_dev);
+  pl180_init(&mmci, PA2KVA(PHYS_MMCI), IRQ_MCIA);
+  sd_init(&sd, &pl180_ops, &mmci);
+  dev_register_block(0, &sd.dev);
   return 0;
 }
 
@@ -1,8 +1,12 @@
+#include <errno.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include <kernel/mm/memlayout.h>
+#include <kernel/types.h>
 #include <kernel/vm.h>
 #include <kernel/page.h>
+#include <kernel/swap.h>
 
 #include <arch/arm/regs.h>
 #include <arch/arm/mmu.h>
@@ -22,6 +26,23 @@
  * kernel manages physical memory in units of 4K pages, we fit two second-level
  * tables in one page (and use the remaining space to store extra flags that are
  * not provided by the hardware for each page table entry).
+ *
+ * Suitably aligned blocks of user memory may be mapped using 64K large pages
+ * to save TLB entries. The large page descriptor is repeated in 16
+ * consecutive entries, but each entry keeps its own extra flags and every 4K
+ * page of the block keeps its own reference counter, so the rest of the kernel
+ * can treat them as separate pages. Before any entry of a large page is
+ * modified, the large page is split back into small pages.
+ *
+ * Pages that have been swapped out are represented by invalid entries holding
+ * the swap slot number, with VM_SWAP set in the extra flags. Pages marked with
+ * VM_OLD are mapped with no user access, so that the next user access goes
+ * through the fault handler and tells the swapper the page is still in use.
+ *
+ * To make fork() cheap, pages of second-level tables may be shared between
+ * several user page tables (the reference counter of the page tracks the
+ * number of sharers). A shared table is never modified: the first attempt to
+ * change an entry through arch_vm_lookup() gives the caller its own copy.
  */
 
 #define MAKE_L1_SECTION(pa, ap) \
@@ -60,6 +81,9 @@ static void *kernel_pgtab;
 
 #define L2_TABLES_PER_PAGE  2
 
+// The number of page table entries occupied by a large page
+#define L2_LG_ENTRIES       (L2_PAGE_LG_SIZE / L2_PAGE_SM_SIZE)
+
 /**
  * Load a page table.
  *
@@ -104,8 +128,22 @@ pte_ext(void *pte)
 int
 arch_vm_pte_valid(void *pte)
 {
-  // In our implementation, all valid PTEs map small pages 
-  return (*(l2_desc_t *) pte & L2_DESC_TYPE_SM) == L2_DESC_TYPE_SM;
+  // Bit 1 set means a small page (bit 0 is then the XN bit)
+  return (*(l2_desc_t *) pte & L2_DESC_TYPE_MASK) != L2_DESC_TYPE_FAULT;
+}
+
+// Check whether the page table entry refers to a swap slot
+static int
+pte_is_swap(void *pte)
+{
+  return !arch_vm_pte_valid(pte) && (*pte_ext(pte) & VM_SWAP);
+}
+
+// Check whether the page table entry is a part of a large page
+static int
+pte_is_large(void *pte)
+{
+  return (*(l2_desc_t *) pte & L2_DESC_TYPE_MASK) == L2_DESC_TYPE_LG;
 }
 
 /**
@@ -118,7 +156,15 @@ arch_vm_pte_valid(void *pte)
 physaddr_t
 arch_vm_pte_addr(void *pte)
 {
-  return L2_DESC_SM_BASE(*(l2_desc_t *) pte);
+  unsigned idx;
+
+  if (!pte_is_large(pte))
+    return L2_DESC_SM_BASE(*(l2_desc_t *) pte);
+
+  // All entries of a large page hold the same base address, use the position
+  // of the entry to find the corresponding small page
+  idx = ((uintptr_t) pte / sizeof(l2_desc_t)) % L2_LG_ENTRIES;
+  return L2_DESC_LG_BASE(*(l2_desc_t *) pte) + idx * L2_PAGE_SM_SIZE;
 }
 
 /**
@@ -144,6 +190,26 @@ static int prot_to_ap[] = {
   [VM_USER | PROT_READ | PROT_WRITE] = AP_BOTH_RW, 
 };
 
+// Get the descriptor bits for the given mapping flags
+static l2_desc_t
+pte_bits(int flags, l2_desc_t xn)
+{
+  l2_desc_t bits;
+  int ap_flags = flags & (PROT_WRITE | PROT_READ | VM_USER);
+
+  // Revoke user access to detect the next use of an old page
+  if (flags & VM_OLD)
+    ap_flags &= ~VM_USER;
+
+  bits = L2_DESC_AP(prot_to_ap[ap_flags]);
+  if ((flags & VM_USER) && !(flags & PROT_EXEC))
+    bits |= xn;
+  if (!(flags & PROT_NOCACHE))
+    bits |= (L2_DESC_B | L2_DESC_C);
+
+  return bits;
+}
+
 /**
  * Set a page table entry.
  * 
@@ -154,16 +220,83 @@ static int prot_to_ap[] = {
 void
 arch_vm_pte_set(void *pte, physaddr_t pa, int flags)
 {
-  int bits;
+  *(l2_desc_t *) pte = pa | pte_bits(flags, L2_DESC_SM_XN) | L2_DESC_TYPE_SM;
+  *pte_ext(pte) = flags;
+}
 
-  bits = L2_DESC_AP(prot_to_ap[flags & (PROT_WRITE | PROT_READ | VM_USER)]);
-  if ((flags & VM_USER) && !(flags & PROT_EXEC))
-    bits |= L2_DESC_SM_XN;
-  if (!(flags & PROT_NOCACHE))
-    bits |= (L2_DESC_B | L2_DESC_C);
+/**
+ * Map a large page. All entries covered by the large page must be invalid and
+ * must not refer to swap slots.
+ * 
+ * @param pte   Pointer to the first page table entry of the large page
+ * @param pa    Base physical address (must be aligned to the large page size)
+ * @param flags Mapping flags
+ */
+void
+arch_vm_pte_set_large(void *pte, physaddr_t pa, int flags)
+{
+  l2_desc_t *ptes = (l2_desc_t *) pte;
+  l2_desc_t desc;
+  unsigned i;
 
-  *(l2_desc_t *) pte = pa | bits | L2_DESC_TYPE_SM;
-  *pte_ext(pte) = flags;
+  assert((pa % L2_PAGE_LG_SIZE) == 0);
+  assert((((uintptr_t) pte / sizeof(l2_desc_t)) % L2_LG_ENTRIES) == 0);
+
+  desc = pa | pte_bits(flags, L2_DESC_LG_XN) | L2_DESC_TYPE_LG;
+
+  for (i = 0; i < L2_LG_ENTRIES; i++) {
+    assert(!arch_vm_pte_valid(&ptes[i]));
+    assert(!pte_is_swap(&ptes[i]));
+
+    ptes[i] = desc;
+    *pte_ext(&ptes[i]) = flags;
+  }
+}
+
+/**
+ * Make the page table entry refer to a swap slot.
+ * 
+ * @param pte  Pointer to the page table entry
+ * @param slot The swap slot number
+ */
+void
+arch_vm_pte_set_swap(void *pte, unsigned long slot)
+{
+  // The entry remains invalid for the MMU
+  *(l2_desc_t *) pte = (slot << 2) | L2_DESC_TYPE_FAULT;
+  *pte_ext(pte) = VM_SWAP;
+}
+
+/**
+ * Return the swap slot number stored in the given page table entry.
+ * 
+ * @param pte Pointer to the page table entry (must refer to a swap slot)
+ *
+ * @return The swap slot number
+ */
+unsigned long
+arch_vm_pte_swap_slot(void *pte)
+{
+  assert(pte_is_swap(pte));
+  return *(l2_desc_t *) pte >> 2;
+}
+
+// Replace the large page containing the given entry with small pages mapping
+// the same physical memory with the same flags
+static void
+pte_split_large(l2_desc_t *pte, uintptr_t va)
+{
+  l2_desc_t *ptes;
+  unsigned i;
+
+  ptes = pte - (((uintptr_t) pte / sizeof(l2_desc_t)) % L2_LG_ENTRIES);
+  va   = ROUND_DOWN(va, L2_PAGE_LG_SIZE);
+
+  for (i = 0; i < L2_LG_ENTRIES; i++)
+    arch_vm_pte_set(&ptes[i], arch_vm_pte_addr(&ptes[i]), *pte_ext(&ptes[i]));
+
+  for (i = 0; i < L2_LG_ENTRIES; i++)
+    arch_vm_invalidate(va + i * L2_PAGE_SM_SIZE);
 }
 
 /**
@@ -179,14 +312,96 @@ arch_vm_pte_clear(void *pte)
 }
 
 /**
- * Invalidate TLB entries matching the specified virtual address.
+ * Invalidate TLB entries matching the specified virtual address on all
+ * processors, since other CPUs may still be running the same address space.
  *
  * @param va The virtual address of the page to invalidate
  */
 void
 arch_vm_invalidate(uintptr_t va)
 {
-  cp15_tlbimva(va);
+  cp15_tlbimvais(va);
+}
+
+// Drop a reference to the page containing two second-level tables. When the
+// last reference is dropped, release all pages mapped in these tables and free
+// the page itself.
+static void
+arch_vm_table_put(struct Page *page)
+{
+  l2_desc_t *pt;
+  unsigned i;
+
+  if (page_ref_dec(page) > 0)
+    return;
+
+  pt = (l2_desc_t *) page2kva(page);
+
+  for (i = 0; i < L2_NR_ENTRIES * L2_TABLES_PER_PAGE; i++) {
+    struct Page *mapped;
+
+    if (pte_is_swap(&pt[i]))
+      swap_free(arch_vm_pte_swap_slot(&pt[i]));
+
+    if (!arch_vm_pte_valid(&pt[i]) || !(*pte_ext(&pt[i]) & VM_PAGE))
+      continue;
+
+    mapped = pa2page(arch_vm_pte_addr(&pt[i]));
+    if (page_ref_dec(mapped) == 0)
+      page_free_one(mapped);
+  }
+
+  page_free_one(page);
+}
+
+// If the page containing the second-level table for the given L1 index is
+// shared with other page tables, replace it with a private copy.
+static int
+arch_vm_unshare(l1_desc_t *tt, unsigned idx)
+{
+  struct Page *page, *copy;
+  l2_desc_t *pt, *copy_pt;
+  physaddr_t pa;
+  unsigned i;
+
+  idx &= ~(L2_TABLES_PER_PAGE - 1);
+
+  // Other page tables can only drop their references concurrently, so at worst
+  // the table is copied needlessly
+  page = pa2page(L2_DESC_SM_BASE(tt[idx]));
+  if (page->ref_count == 1)
+    return 0;
+
+  if ((copy = page_alloc_one(0, PAGE_TAG_PGTAB)) == NULL)
+    return -ENOMEM;
+
+  pt      = (l2_desc_t *) page2kva(page);
+  copy_pt = (l2_desc_t *) page2kva(copy);
+
+  // Copy both tables together with the extra flags
+  memmove(copy_pt, pt, PAGE_SIZE);
+
+  // Each table holds its own references to the mapped pages and swap slots
+  for (i = 0; i < L2_NR_ENTRIES * L2_TABLES_PER_PAGE; i++) {
+    if (arch_vm_pte_valid(&copy_pt[i]) && (*pte_ext(&copy_pt[i]) & VM_PAGE))
+      page_ref_inc(pa2page(arch_vm_pte_addr(&copy_pt[i])));
+    else if (pte_is_swap(&copy_pt[i]))
+      swap_dup(arch_vm_pte_swap_slot(&copy_pt[i]));
+  }
+
+  copy->ref_count++;
+
+  pa = page2pa(copy);
+  tt[idx + 0] = pa | L1_DESC_TYPE_TABLE;
+  tt[idx + 1] = (pa + L2_TABLE_SIZE) | L1_DESC_TYPE_TABLE;
+
+  // The MMU may cache translation table walks
+  cp15_tlbiallis();
+
+  // The other sharers may have made their own copies in the meantime
+  arch_vm_table_put(page);
+
+  return 0;
 }
 
 /**
@@ -194,8 +409,10 @@ arch_vm_invalidate(uintptr_t va)
  * 
  * @param pgtab Pointer to the page table
  * @param va    The virtual address
- * @param alloc Whether to allocate memory for the relevant entry if it doesn't
- *              exist
+ * @param alloc Whether the entry is going to be modified. If so, allocate
+ *              memory for the relevant entry if it doesn't exist, make a
+ *              private copy of the second-level table if it is shared, and
+ *              split the large page containing the entry
  * 
  * @return Pointer to the page table entry for the specified virtual address
  *         or NULL if the relevant entry does not exist
@@ -232,12 +449,116 @@ arch_vm_lookup(void *pgtab, uintptr_t va, int alloc)
   } else if ((*tte & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_TABLE) {
     // trying to remap a fixed section
     panic("not a page table");
+  } else if (alloc && (arch_vm_unshare(tt, L1_IDX(va)) != 0)) {
+    return NULL;
   }
 
   pte = PA2KVA(L1_DESC_TABLE_BASE(*tte));
+
+  if (alloc && pte_is_large(&pte[L2_IDX(va)]))
+    pte_split_large(&pte[L2_IDX(va)], va);
+
   return &pte[L2_IDX(va)];
 }
 
+/**
+ * Free the second-level page tables covering the given range of user addresses
+ * that no longer contain any valid entries.
+ *
+ * @param pgtab Pointer to the page table
+ * @param start The starting virtual address
+ * @param end   The ending virtual address
+ */
+void
+arch_vm_trim(void *pgtab, uintptr_t start, uintptr_t end)
+{
+  l1_desc_t *tt = (l1_desc_t *) pgtab;
+  unsigned i, j;
+  int trimmed = 0;
+
+  if ((end <= start) || (end > VIRT_KERNEL_BASE))
+    panic("invalid va range: [%p,%p)", start, end);
+
+  for (i = L1_IDX(start) & ~(L2_TABLES_PER_PAGE - 1);
+       i <= L1_IDX(end - 1);
+       i += L2_TABLES_PER_PAGE) {
+    struct Page *page;
+    l2_desc_t *pt;
+
+    if (!tt[i])
+      continue;
+
+    page = pa2page(L2_DESC_SM_BASE(tt[i]));
+    pt   = (l2_desc_t *) page2kva(page);
+
+    for (j = 0; j < L2_NR_ENTRIES * L2_TABLES_PER_PAGE; j++)
+      if (arch_vm_pte_valid(&pt[j]) || pte_is_swap(&pt[j]))
+        break;
+    if (j < L2_NR_ENTRIES * L2_TABLES_PER_PAGE)
+      continue;
+
+    tt[i + 0] = 0;
+    tt[i + 1] = 0;
+    trimmed = 1;
+
+    arch_vm_table_put(page);
+  }
+
+  // The MMU may cache translation table walks
+  if (trimmed)
+    cp15_tlbiallis();
+}
+
+/**
+ * Share all second-level tables of the source user page table with the
+ * destination page table. Neither page table may be modified directly after
+ * this call: the tables are copied on the first modification through
+ * arch_vm_lookup().
+ *
+ * @param dst Pointer to the destination page table (must be empty)
+ * @param src Pointer to the source page table
+ */
+void
+arch_vm_share(void *dst, void *src)
+{
+  l1_desc_t *dst_tt = (l1_desc_t *) dst;
+  l1_desc_t *src_tt = (l1_desc_t *) src;
+  unsigned i;
+
+  for (i = 0; i < L1_IDX(VIRT_KERNEL_BASE); i += L2_TABLES_PER_PAGE) {
+    if (!src_tt[i])
+      continue;
+
+    if (dst_tt[i])
+      panic("destination page table is not empty");
+
+    dst_tt[i + 0] = src_tt[i + 0];
+    dst_tt[i + 1] = src_tt[i + 1];
+
+    page_ref_inc(pa2page(L2_DESC_SM_BASE(src_tt[i])));
+  }
+}
+
+/**
+ * Check whether the second-level table for the given virtual address is shared
+ * with other page tables.
+ *
+ * @param pgtab Pointer to the page table
+ * @param va    The virtual address
+ *
+ * @return 1 if the table is shared, 0 otherwise
+ */
+int
+arch_vm_shared(void *pgtab, uintptr_t va)
+{
+  l1_desc_t *tte = &((l1_desc_t *) pgtab)[L1_IDX(va)];
+
+  if ((*tte & L1_DESC_TYPE_MASK) != L1_DESC_TYPE_TABLE)
+    return 0;
+
+  return pa2page(L2_DESC_SM_BASE(*tte))->ref_count > 1;
+}
+
 /**
  * Set a 1Mb section entry.
  * 
@@ -381,8 +702,8 @@ arch_vm_create(void)
 /**
  * Destroy a page table.
  * 
- * The caller must remove all mappings from the page table before calling
- * this function.
+ * Pages still mapped in second-level tables that are not shared with other
+ * page tables are released.
  * 
  * @param pgtab Pointer to the page table to be destroyed.
  */
@@ -392,28 +713,15 @@ arch_vm_destroy(void *pgtab)
   struct Page *page;
   l1_desc_t *trtab;
   
-  unsigned i, j;
+  unsigned i;
   
   trtab = (l1_desc_t *) pgtab;
 
-  // Free all allocated second-level page tables
-  for (i = 0; i < L1_IDX(VIRT_KERNEL_BASE); i += L2_TABLES_PER_PAGE) {
-    l2_desc_t *pt;
-
-    if (!trtab[i])
-      continue;
-
-    page = pa2page(L2_DESC_SM_BASE(trtab[i]));
-    pt   = (l2_desc_t *) page2kva(page);
-
-    // Check that the caller has removed all mappings
-    for (j = 0; j < L2_NR_ENTRIES * L2_TABLES_PER_PAGE; j++)
-      if (arch_vm_pte_valid(&pt[j]))
-        panic("pte still in use");
-
-    if (--page->ref_count == 0)
-      page_free_one(page);
-  }
+  // Free all allocated second-level page tables (tables shared with other page
+  // tables keep their mappings)
+  for (i = 0; i < L1_IDX(VIRT_KERNEL_BASE); i += L2_TABLES_PER_PAGE)
+    if (trtab[i])
+      arch_vm_table_put(pa2page(L2_DESC_SM_BASE(trtab[i])));
 
   // Finally, free the first-level translation table itself
   page = kva2page(trtab);
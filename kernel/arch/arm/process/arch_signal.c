@@ -18,7 +18,7 @@ arch_signal_prepare(struct Process *process, struct SignalFrame *frame)
   frame->ucontext.uc_mcontext.pc  = process->thread->tf->pc;
   frame->ucontext.uc_mcontext.psr = process->thread->tf->psr;
 
-  if (vm_copy_out(process->vm->pgtab, frame, ctx_va, sizeof *frame) != 0)
+  if (vm_copy_out(process->vm, frame, ctx_va, sizeof *frame) != 0)
     return SIGKILL;
 
   process->thread->tf->r0 = ctx_va;
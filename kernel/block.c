@@ -0,0 +1,215 @@
+#include <kernel/assert.h>
+
+#include <kernel/block.h>
+#include <kernel/console.h>
+#include <kernel/dev.h>
+#include <kernel/fs/buf.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Block request queues
+ * ----------------------------------------------------------------------------
+ *
+ * Buffers submitted for I/O are kept on the pending list of their device,
+ * sorted by sector. When the device becomes idle, the elevator picks the
+ * first pending buffer at or after the current position (wrapping around to
+ * the lowest sector, C-SCAN) and merges the following buffers into the same
+ * batch as long as they are physically adjacent and transferred in the same
+ * direction. The driver transfers the whole batch with a single command,
+ * scattering the data into (or gathering it from) the individual buffers, and
+ * calls block_complete() when done.
+ *
+ * A buffer is in flight while (flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID.
+ * Completion sets BUF_VALID after a read and clears BUF_DIRTY after a write.
+ */
+
+// Starting sector of the buffer
+#define BLOCK_BUF_SECTOR(buf) \
+  ((unsigned long) (buf)->block_no * ((buf)->block_size / BLOCK_SECTOR_SIZE))
+
+/**
+ * Initialize the request queue of a block device.
+ *
+ * @param dev         Pointer to the block device
+ * @param start       Driver function to start transferring a batch
+ * @param ctx         Driver-specific data
+ * @param max_sectors The maximum number of sectors in one batch
+ */
+void
+block_dev_init(struct BlockDev *dev,
+               void (*start)(struct BlockDev *, struct BlockRequest *),
+               void *ctx, size_t max_sectors)
+{
+  dev->start       = start;
+  dev->ctx         = ctx;
+  dev->max_sectors = max_sectors;
+  dev->busy        = 0;
+  dev->next_sector = 0;
+
+  k_spinlock_init(&dev->lock, "block_dev");
+  k_list_init(&dev->pending);
+  k_list_init(&dev->request.bufs);
+}
+
+// Form the next batch and pass it to the driver.
+static void
+block_start_locked(struct BlockDev *dev)
+{
+  struct BlockRequest *req = &dev->request;
+  struct KListLink *l, *next;
+  struct Buf *buf;
+
+  assert(k_spinlock_holding(&dev->lock));
+  assert(!dev->busy);
+
+  if (k_list_is_empty(&dev->pending))
+    return;
+
+  KLIST_FOREACH(&dev->pending, l) {
+    buf = KLIST_CONTAINER(l, struct Buf, queue_link);
+    if (BLOCK_BUF_SECTOR(buf) >= dev->next_sector)
+      break;
+  }
+
+  // Nothing ahead of the current position, start over from the beginning
+  if (l == &dev->pending)
+    l = dev->pending.next;
+
+  buf = KLIST_CONTAINER(l, struct Buf, queue_link);
+
+  req->sector   = BLOCK_BUF_SECTOR(buf);
+  req->nsectors = 0;
+  req->write    = (buf->flags & BUF_DIRTY) != 0;
+
+  for (;;) {
+    next = buf->queue_link.next;
+
+    k_list_remove(&buf->queue_link);
+    k_list_add_back(&req->bufs, &buf->queue_link);
+    req->nsectors += buf->block_size / BLOCK_SECTOR_SIZE;
+
+    if (next == &dev->pending)
+      break;
+
+    buf = KLIST_CONTAINER(next, struct Buf, queue_link);
+
+    if ((BLOCK_BUF_SECTOR(buf) != req->sector + req->nsectors) ||
+        (((buf->flags & BUF_DIRTY) != 0) != req->write) ||
+        (req->nsectors + buf->block_size / BLOCK_SECTOR_SIZE > dev->max_sectors))
+      break;
+  }
+
+  dev->next_sector = req->sector + req->nsectors;
+  dev->busy        = 1;
+
+  dev->start(dev, req);
+}
+
+/**
+ * Queue the buffer for I/O: write it if BUF_DIRTY is set, read it otherwise.
+ * The function returns without waiting for the transfer to complete.
+ *
+ * If a callback is given, it is called from the driver's completion context
+ * once the transfer is done and takes over the buffer; the submitter must not
+ * wait for the buffer in that case. Otherwise, use block_wait().
+ *
+ * @param buf  Pointer to the buffer
+ * @param done Completion callback, or NULL
+ * @param arg  Argument for the callback
+ */
+void
+block_submit(struct Buf *buf, void (*done)(struct Buf *, void *), void *arg)
+{
+  struct BlockDev *dev;
+  struct KListLink *l;
+  unsigned long sector;
+
+  if ((buf->flags & (BUF_DIRTY | BUF_VALID)) == BUF_VALID)
+    panic("nothing to do");
+  if ((buf->block_size == 0) || (buf->block_size % BLOCK_SECTOR_SIZE != 0))
+    panic("block size must be a multiple of %u", BLOCK_SECTOR_SIZE);
+
+  if ((dev = dev_lookup_block(buf->dev)) == NULL)
+    panic("no block device %d found", buf->dev);
+
+  buf->done     = done;
+  buf->done_arg = arg;
+
+  sector = BLOCK_BUF_SECTOR(buf);
+
+  k_spinlock_acquire(&dev->lock);
+
+  // Keep the pending list sorted by sector
+  KLIST_FOREACH(&dev->pending, l)
+    if (BLOCK_BUF_SECTOR(KLIST_CONTAINER(l, struct Buf, queue_link)) > sector)
+      break;
+  k_list_add_back(l, &buf->queue_link);
+
+  if (!dev->busy)
+    block_start_locked(dev);
+
+  k_spinlock_release(&dev->lock);
+}
+
+/**
+ * Wait until the transfer of a buffer submitted without a callback completes.
+ *
+ * @param buf Pointer to the buffer
+ */
+void
+block_wait(struct Buf *buf)
+{
+  struct BlockDev *dev;
+
+  if ((dev = dev_lookup_block(buf->dev)) == NULL)
+    panic("no block device %d found", buf->dev);
+
+  k_spinlock_acquire(&dev->lock);
+
+  // TODO: deal with errors!
+  while ((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID)
+    k_waitqueue_sleep(&buf->wait_queue, &dev->lock);
+
+  k_spinlock_release(&dev->lock);
+}
+
+/**
+ * Finish the batch being transferred and start the next one. Called by the
+ * driver once all buffers of the batch have been transferred.
+ *
+ * @param dev Pointer to the block device
+ */
+void
+block_complete(struct BlockDev *dev)
+{
+  struct BlockRequest *req = &dev->request;
+  struct Buf *buf;
+
+  k_spinlock_acquire(&dev->lock);
+
+  assert(dev->busy);
+
+  while (!k_list_is_empty(&req->bufs)) {
+    buf = KLIST_CONTAINER(req->bufs.next, struct Buf, queue_link);
+    k_list_remove(&buf->queue_link);
+
+    if (req->write)
+      buf->flags &= ~BUF_DIRTY;
+    else
+      buf->flags |= BUF_VALID;
+
+    if (buf->done != NULL) {
+      // The batch stays busy, so the request cannot be touched meanwhile
+      k_spinlock_release(&dev->lock);
+      buf->done(buf, buf->done_arg);
+      k_spinlock_acquire(&dev->lock);
+    } else {
+      k_waitqueue_wakeup_all(&buf->wait_queue);
+    }
+  }
+
+  dev->busy = 0;
+  block_start_locked(dev);
+
+  k_spinlock_release(&dev->lock);
+}
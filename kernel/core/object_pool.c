@@ -206,6 +206,26 @@ k_object_pool_put(struct KObjectPool *pool, void *obj)
   k_spinlock_release(&pool->lock);
 }
 
+/**
+ * Call the given function for each object pool in the system. The function is
+ * called with the pool list locked and must not create or destroy pools.
+ *
+ * @param func Pointer to the function
+ * @param arg  The argument to be passed to the function
+ */
+void
+k_object_pool_foreach(void (*func)(struct KObjectPool *, void *), void *arg)
+{
+  struct KListLink *l;
+
+  k_spinlock_acquire(&pool_list.lock);
+
+  KLIST_FOREACH(&pool_list.head, l)
+    func(KLIST_CONTAINER(l, struct KObjectPool, link), arg);
+
+  k_spinlock_release(&pool_list.lock);
+}
+
 /**
  * Initialize the object pool system. This must be called only after the page
  * allocator has been initialized.
@@ -355,6 +375,9 @@ k_object_pool_init(struct KObjectPool *pool,
   pool->obj_dtor        = dtor;
   pool->color_max       = wastage;
   pool->color_next      = 0;
+  pool->slab_count      = 0;
+  pool->used_count      = 0;
+  pool->peak_count      = 0;
 
   k_spinlock_acquire(&pool_list.lock);
   k_list_add_back(&pool_list.head, &pool->link);
@@ -455,6 +478,7 @@ k_object_pool_slab_create(struct KObjectPool *pool)
   // Add the newly allocated slab to the full list
   // object_pool_alloc will move it to the partial list
   k_list_add_back(&pool->slabs_full, &slab->link);
+  pool->slab_count++;
 
   return slab;
 }
@@ -496,6 +520,8 @@ k_object_pool_slab_destroy(struct KObjectSlab *slab)
 
   page->ref_count--;
   page_free_block(page, pool->slab_page_order);
+
+  pool->slab_count--;
 }
 
 /**
@@ -520,6 +546,9 @@ k_object_pool_slab_get(struct KObjectSlab *slab)
   slab->free = tag->next;
   slab->used_count++;
 
+  if (++pool->used_count > pool->peak_count)
+    pool->peak_count = pool->used_count;
+
   // The slab becomes empty: move it into the corresponding list
   if (slab->used_count == pool->slab_capacity) {
     assert(slab->free == NULL);
@@ -553,6 +582,7 @@ k_object_pool_slab_put(struct KObjectSlab *slab, void *obj)
   slab->free = tag;
 
   slab->used_count--;
+  pool->used_count--;
 
   if (slab->used_count == 0) {
     // Slab becomes full
@@ -0,0 +1,303 @@
+#include <kernel/assert.h>
+
+#include <kernel/core/rbtree.h>
+
+#define K_RB_RED    0
+#define K_RB_BLACK  1
+
+#define k_rbtree_is_red(node)   (((node) != NULL) && ((node)->color == K_RB_RED))
+
+/**
+ * Initialize an empty tree.
+ *
+ * @param tree    Pointer to the tree
+ * @param augment Callback to recompute the augmented data of a node, or NULL
+ */
+void
+k_rbtree_init(struct KRBTree *tree, void (*augment)(struct KRBNode *))
+{
+  tree->root    = NULL;
+  tree->augment = augment;
+}
+
+// Make the parent of 'old' point to 'node' instead.
+static void
+k_rbtree_replace_child(struct KRBTree *tree, struct KRBNode *parent,
+                       struct KRBNode *old, struct KRBNode *node)
+{
+  if (parent == NULL)
+    tree->root = node;
+  else if (parent->left == old)
+    parent->left = node;
+  else
+    parent->right = node;
+}
+
+static void
+k_rbtree_rotate_left(struct KRBTree *tree, struct KRBNode *x)
+{
+  struct KRBNode *y = x->right;
+
+  x->right = y->left;
+  if (y->left != NULL)
+    y->left->parent = x;
+
+  y->parent = x->parent;
+  k_rbtree_replace_child(tree, x->parent, x, y);
+
+  y->left   = x;
+  x->parent = y;
+
+  // The subtree as a whole is unchanged, only x and y need to be updated
+  if (tree->augment != NULL) {
+    tree->augment(x);
+    tree->augment(y);
+  }
+}
+
+static void
+k_rbtree_rotate_right(struct KRBTree *tree, struct KRBNode *x)
+{
+  struct KRBNode *y = x->left;
+
+  x->left = y->right;
+  if (y->right != NULL)
+    y->right->parent = x;
+
+  y->parent = x->parent;
+  k_rbtree_replace_child(tree, x->parent, x, y);
+
+  y->right  = x;
+  x->parent = y;
+
+  if (tree->augment != NULL) {
+    tree->augment(x);
+    tree->augment(y);
+  }
+}
+
+/**
+ * Recompute the augmented data of the given node and all of its ancestors.
+ * Must be called after the data the augmentation depends on is modified.
+ *
+ * @param tree Pointer to the tree
+ * @param node Pointer to the modified node
+ */
+void
+k_rbtree_update(struct KRBTree *tree, struct KRBNode *node)
+{
+  if (tree->augment == NULL)
+    return;
+
+  for ( ; node != NULL; node = node->parent)
+    tree->augment(node);
+}
+
+/**
+ * Link a new node into the tree and rebalance it.
+ *
+ * @param tree   Pointer to the tree
+ * @param parent Pointer to the parent node (NULL if the tree is empty)
+ * @param link   Pointer to the child link of the parent (or the root link)
+ * @param node   Pointer to the node to be inserted
+ */
+void
+k_rbtree_insert(struct KRBTree *tree, struct KRBNode *parent,
+                struct KRBNode **link, struct KRBNode *node)
+{
+  node->parent = parent;
+  node->left   = NULL;
+  node->right  = NULL;
+  node->color  = K_RB_RED;
+  *link = node;
+
+  k_rbtree_update(tree, node);
+
+  while (k_rbtree_is_red(parent = node->parent)) {
+    // The root is always black, so the grandparent exists
+    struct KRBNode *gparent = parent->parent;
+    struct KRBNode *uncle;
+
+    if (parent == gparent->left) {
+      uncle = gparent->right;
+
+      if (k_rbtree_is_red(uncle)) {
+        parent->color  = K_RB_BLACK;
+        uncle->color   = K_RB_BLACK;
+        gparent->color = K_RB_RED;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        k_rbtree_rotate_left(tree, parent);
+        node   = parent;
+        parent = node->parent;
+      }
+
+      parent->color  = K_RB_BLACK;
+      gparent->color = K_RB_RED;
+      k_rbtree_rotate_right(tree, gparent);
+    } else {
+      uncle = gparent->left;
+
+      if (k_rbtree_is_red(uncle)) {
+        parent->color  = K_RB_BLACK;
+        uncle->color   = K_RB_BLACK;
+        gparent->color = K_RB_RED;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        k_rbtree_rotate_right(tree, parent);
+        node   = parent;
+        parent = node->parent;
+      }
+
+      parent->color  = K_RB_BLACK;
+      gparent->color = K_RB_RED;
+      k_rbtree_rotate_left(tree, gparent);
+    }
+  }
+
+  tree->root->color = K_RB_BLACK;
+}
+
+// Replace the subtree rooted at 'old' with the subtree rooted at 'node'.
+static void
+k_rbtree_transplant(struct KRBTree *tree, struct KRBNode *old,
+                    struct KRBNode *node)
+{
+  k_rbtree_replace_child(tree, old->parent, old, node);
+  if (node != NULL)
+    node->parent = old->parent;
+}
+
+// Restore the red-black properties after removing a black node. 'x' is the
+// node that took its place (possibly NULL) and 'parent' is its parent.
+static void
+k_rbtree_remove_fixup(struct KRBTree *tree, struct KRBNode *x,
+                      struct KRBNode *parent)
+{
+  struct KRBNode *w;
+
+  while ((x != tree->root) && !k_rbtree_is_red(x)) {
+    if (x == parent->left) {
+      w = parent->right;
+
+      if (k_rbtree_is_red(w)) {
+        w->color      = K_RB_BLACK;
+        parent->color = K_RB_RED;
+        k_rbtree_rotate_left(tree, parent);
+        w = parent->right;
+      }
+
+      if (!k_rbtree_is_red(w->left) && !k_rbtree_is_red(w->right)) {
+        w->color = K_RB_RED;
+        x        = parent;
+        parent   = x->parent;
+        continue;
+      }
+
+      if (!k_rbtree_is_red(w->right)) {
+        w->left->color = K_RB_BLACK;
+        w->color       = K_RB_RED;
+        k_rbtree_rotate_right(tree, w);
+        w = parent->right;
+      }
+
+      w->color      = parent->color;
+      parent->color = K_RB_BLACK;
+      if (w->right != NULL)
+        w->right->color = K_RB_BLACK;
+      k_rbtree_rotate_left(tree, parent);
+    } else {
+      w = parent->left;
+
+      if (k_rbtree_is_red(w)) {
+        w->color      = K_RB_BLACK;
+        parent->color = K_RB_RED;
+        k_rbtree_rotate_right(tree, parent);
+        w = parent->left;
+      }
+
+      if (!k_rbtree_is_red(w->left) && !k_rbtree_is_red(w->right)) {
+        w->color = K_RB_RED;
+        x        = parent;
+        parent   = x->parent;
+        continue;
+      }
+
+      if (!k_rbtree_is_red(w->left)) {
+        w->right->color = K_RB_BLACK;
+        w->color        = K_RB_RED;
+        k_rbtree_rotate_left(tree, w);
+        w = parent->left;
+      }
+
+      w->color      = parent->color;
+      parent->color = K_RB_BLACK;
+      if (w->left != NULL)
+        w->left->color = K_RB_BLACK;
+      k_rbtree_rotate_right(tree, parent);
+    }
+
+    x = tree->root;
+    break;
+  }
+
+  if (x != NULL)
+    x->color = K_RB_BLACK;
+}
+
+/**
+ * Remove the node from the tree and rebalance it.
+ *
+ * @param tree Pointer to the tree
+ * @param node Pointer to the node to be removed
+ */
+void
+k_rbtree_remove(struct KRBTree *tree, struct KRBNode *node)
+{
+  struct KRBNode *x, *parent, *y;
+  int color = node->color;
+
+  if (node->left == NULL) {
+    x      = node->right;
+    parent = node->parent;
+    k_rbtree_transplant(tree, node, x);
+  } else if (node->right == NULL) {
+    x      = node->left;
+    parent = node->parent;
+    k_rbtree_transplant(tree, node, x);
+  } else {
+    // Replace the node with its successor
+    for (y = node->right; y->left != NULL; y = y->left)
+      ;
+
+    color = y->color;
+    x     = y->right;
+
+    if (y->parent == node) {
+      parent = y;
+    } else {
+      parent = y->parent;
+      k_rbtree_transplant(tree, y, x);
+
+      y->right = node->right;
+      y->right->parent = y;
+    }
+
+    k_rbtree_transplant(tree, node, y);
+
+    y->left = node->left;
+    y->left->parent = y;
+    y->color = node->color;
+  }
+
+  k_rbtree_update(tree, parent);
+
+  if (color == K_RB_BLACK)
+    k_rbtree_remove_fixup(tree, x, parent);
+}
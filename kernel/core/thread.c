@@ -144,6 +144,30 @@ k_thread_create(struct Process *process, void (*entry)(void *), void *arg,
   return thread;
 }
 
+/**
+ * Free a thread that has been created but never resumed, e.g. if setting up
+ * the process it belongs to has failed.
+ *
+ * @param thread Pointer to the thread to be freed
+ */
+void
+k_thread_destroy(struct KThread *thread)
+{
+  struct Page *kstack_page;
+
+  if (thread->state != THREAD_STATE_SUSPENDED)
+    panic("thread already started");
+
+  _k_timeout_fini(&thread->timer);
+
+  kstack_page = kva2page(thread->kstack);
+  kstack_page->ref_count--;
+  assert(kstack_page->ref_count == 0);
+  page_free_one(kstack_page);
+
+  k_object_pool_put(thread_cache, thread);
+}
+
 /**
  * Destroy the specified thread
  */
@@ -1,13 +1,16 @@
 #include <kernel/assert.h>
 #include <kernel/drivers/sd.h>
 #include <kernel/fs/buf.h>
-#include <kernel/interrupt.h>
+#include <kernel/thread.h>
 
 /*******************************************************************************
  * SD Card Driver
  *
- * The driver keeps the list of pending buffer requests in a queue, processing
- * them one at a time.
+ * Requests are queued and merged by the generic block layer. Each batch of
+ * adjacent buffers is transferred with a single (multiple block) command,
+ * moving the data for each buffer in turn. Transfers are performed by a
+ * dedicated thread, so that the host controller driver can sleep while
+ * waiting for the card.
  * 
  * For details on SD card programming, see "SD Specifications. Part 1. Physical
  * Layer Simplified Specification. Version 1.10".
@@ -36,12 +39,13 @@ enum {
   OCR_BUSY     = (1 << 31),     // Card power up status bit
 };
 
-static int  sd_irq_thread(int, void *);
-static void sd_start_transfer(struct SD *, struct Buf *);
+static void sd_thread_entry(void *);
+static void sd_start_transfer(struct BlockDev *, struct BlockRequest *);
 
 int
-sd_init(struct SD *sd, struct SDOps *ops, void *ctx, int irq)
+sd_init(struct SD *sd, struct SDOps *ops, void *ctx)
 {
+  struct KThread *thread;
   uint32_t resp[4], rca;
 
   // Put each card into Idle State
@@ -70,120 +74,86 @@ sd_init(struct SD *sd, struct SDOps *ops, void *ctx, int irq)
   sd->ops = ops;
   sd->ctx = ctx;
 
-  // Initialize the buffer queue
-  k_list_init(&sd->queue);
-  k_spinlock_init(&sd->lock, "sd_queue");
+  // Initialize the request queue
+  block_dev_init(&sd->dev, sd_start_transfer, sd, SD_MAX_BLOCKS);
 
-  // Enable interrupts
-  sd->ops->irq_enable(sd->ctx);
+  k_semaphore_init(&sd->semaphore, 0);
 
-  interrupt_attach_thread(irq, sd_irq_thread, sd);
+  if ((thread = k_thread_create(NULL, sd_thread_entry, sd, 0)) == NULL)
+    panic("cannot create the SD thread");
+
+  k_thread_resume(thread);
 
   return 0;
 }
 
-void
-sd_request(struct SD *sd, struct Buf *buf)
+// Called by the block layer with the queue locked, so just wake up the SD
+// thread.
+static void
+sd_start_transfer(struct BlockDev *dev, struct BlockRequest *req)
 {
-  if (buf->block_size % SD_BLOCKLEN != 0)
-    panic("block size must be a multiple of %u", SD_BLOCKLEN);
-
-  k_spinlock_acquire(&sd->lock);
+  struct SD *sd = (struct SD *) dev->ctx;
 
-  // Add buffer to the queue.
-  k_list_add_back(&sd->queue, &buf->queue_link);
+  assert(k_spinlock_holding(&dev->lock));
+  assert((req->nsectors > 0) && (req->nsectors <= SD_MAX_BLOCKS));
 
-  // If the buffer is at the front of the queue, immediately send it to the
-  // hardware.
-  if (sd->queue.next == &buf->queue_link)
-    sd_start_transfer(sd, buf);
-
-  // Wait for the R/W operation to finish.
-  // TODO: deal with errors!
-  while ((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID)
-    k_waitqueue_sleep(&buf->wait_queue, &sd->lock);
-
-  k_spinlock_release(&sd->lock);
+  k_semaphore_put(&sd->semaphore);
 }
 
-// Send the data transfer request to the hardware.
+// Transfer the data for each buffer of the batch.
 static void
-sd_start_transfer(struct SD *sd, struct Buf *buf)
+sd_transfer(struct SD *sd, struct BlockRequest *req)
 {
+  struct KListLink *l;
+  struct Buf *buf;
   uint32_t cmd, arg;
-  size_t nblocks;
-
-  assert(k_spinlock_holding(&sd->lock));
-  assert(buf->queue_link.prev == &sd->queue);
-  assert(buf->block_size % SD_BLOCKLEN == 0);
+  size_t len;
 
-  nblocks = buf->block_size / SD_BLOCKLEN;
+  len = req->nsectors * SD_BLOCKLEN;
 
-  if (buf->flags & BUF_DIRTY) {
-    sd->ops->begin_transfer(sd->ctx, buf->block_size, 0);
-    cmd = (nblocks > 1) ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
+  if (req->write) {
+    sd->ops->begin_transfer(sd->ctx, len, 0);
+    cmd = (req->nsectors > 1) ? CMD_WRITE_MULTIPLE_BLOCK : CMD_WRITE_BLOCK;
   } else {
-    sd->ops->begin_transfer(sd->ctx, buf->block_size, 1);
-    cmd = (nblocks > 1) ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
+    sd->ops->begin_transfer(sd->ctx, len, 1);
+    cmd = (req->nsectors > 1) ? CMD_READ_MULTIPLE_BLOCK : CMD_READ_SINGLE_BLOCK;
   }
 
-  arg = buf->block_no * buf->block_size;
+  arg = req->sector * SD_BLOCKLEN;
 
   if (sd->ops->send_cmd(sd->ctx, cmd, arg, SD_RESPONSE_R1, NULL) != 0)
     panic("error sending cmd %d, arg %d", cmd, arg);
-}
-
-// Handle the SD card interrupts. Complete the current data transfer operation
-// and wake up the corresponding task.
-static int
-sd_irq_thread(int irq, void *arg)
-{
-  struct SD *sd = (struct SD *) arg;
-  struct KListLink *link;
-  struct Buf *buf, *next_buf;
-
-  (void) irq;
-
-  k_spinlock_acquire(&sd->lock);
 
-  if (k_list_is_empty(&sd->queue))
-    panic("queue is empty");
-
-  // Grab the first buffer in the queue to find out whether a read or write
-  // operation is happening
-  link = sd->queue.next;
-  k_list_remove(link);
-
-  buf = KLIST_CONTAINER(link, struct Buf, queue_link);
-
-  assert((buf->flags & (BUF_DIRTY | BUF_VALID)) != BUF_VALID);
-  assert(buf->block_size % SD_BLOCKLEN == 0);
-
-  // Transfer the data and update the corresponding buffer flags.
-  if (buf->flags & BUF_DIRTY) {
-    if (sd->ops->send_data(sd->ctx, buf->data, buf->block_size) != 0)
-      panic("error writing block %d", buf->block_no);
-    buf->flags &= ~BUF_DIRTY;
-  } else {
-    if (sd->ops->receive_data(sd->ctx, buf->data, buf->block_size) != 0)
-      panic("error reading block %d", buf->block_no);
-    buf->flags |= BUF_VALID;
+  // The buffers are adjacent, so the data for each one follows the previous
+  KLIST_FOREACH(&req->bufs, l) {
+    buf = KLIST_CONTAINER(l, struct Buf, queue_link);
+
+    if (req->write) {
+      if (sd->ops->send_data(sd->ctx, buf->data, buf->block_size) != 0)
+        panic("error writing block %d", buf->block_no);
+    } else {
+      if (sd->ops->receive_data(sd->ctx, buf->data, buf->block_size) != 0)
+        panic("error reading block %d", buf->block_no);
+    }
   }
 
   // Multiple block transfers must be stopped manually by issuing CMD12.
-  if (buf->block_size > SD_BLOCKLEN)
+  if (req->nsectors > 1)
     sd->ops->send_cmd(sd->ctx, CMD_STOP_TRANSMISSION, 0, SD_RESPONSE_R1B, NULL);
+}
 
-  // Begin processing the next buffer in the queue.
-  if (!k_list_is_empty(&sd->queue)) {
-    next_buf = KLIST_CONTAINER(sd->queue.next, struct Buf, queue_link);
-    sd_start_transfer(sd, next_buf);
-  }
+static void
+sd_thread_entry(void *arg)
+{
+  struct SD *sd = (struct SD *) arg;
 
-  // Resume the task waiting for the buf data.
-  k_waitqueue_wakeup_all(&buf->wait_queue);
+  for (;;) {
+    k_semaphore_get(&sd->semaphore);
 
-  k_spinlock_release(&sd->lock);
+    sd_transfer(sd, &sd->dev.request);
 
-  return 1;
+    // Update the buffer flags, resume the waiting tasks and start the next
+    // batch
+    block_complete(&sd->dev);
+  }
 }
@@ -1,25 +1,103 @@
 #include <kernel/assert.h>
+#include <errno.h>
+
+#include <kernel/block.h>
 #include <kernel/dev.h>
 #include <kernel/console.h>
 #include <kernel/fs/buf.h>
+#include <kernel/hash.h>
 #include <kernel/core/list.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/core/tick.h>
 #include <kernel/object_pool.h>
 #include <kernel/spinlock.h>
 #include <kernel/page.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
 
 struct KObjectPool *buf_pool;
 
+// Buffer headers reserved for buf_io_reserved()
+static struct Buf   *buf_io_bufs[PAGE_SIZE / BLOCK_SECTOR_SIZE];
+static struct KMutex buf_io_mutex;
+
 static void buf_request(struct Buf *);
+static void buf_flusher_create(int);
+
+/*
+ * Cached buffers are looked up by (dev, block_no) in a hash table. Buffers
+ * with no references are also kept on the LRU list, and when the cache reaches
+ * its maximum size, the least recently used of them is reused for another
+ * block.
+ *
+ * The hash buckets and the reference counters of the buffers they contain are
+ * protected by one of several spinlocks, selected by the bucket index. The LRU
+ * list and the cache size are protected by a separate spinlock, which is
+ * always acquired after the bucket lock. The buffer data is protected by the
+ * buffer mutex.
+ *
+ * Modified buffers are not written out on release. Instead, they are put on
+ * the dirty list of their device, ordered by the time they were first
+ * modified, and written back later by the flusher thread of that device, so
+ * that repeated updates of the same block result in a single write. Buffers
+ * on the dirty list are never put on the LRU list and thus cannot be evicted.
+ * The dirty lists are protected by the flusher spinlocks, acquired after the
+ * bucket lock. Buffers are only removed from a dirty list while holding the
+ * bucket lock as well.
+ */
 
 // Maximum size of the buffer cache
 #define BUF_CACHE_MAX_SIZE   1024
 
+#define BUF_CACHE_NBUCKET    256
+#define BUF_CACHE_NLOCK      16
+
+#define BUF_CACHE_KEY(dev, block_no) \
+  ((unsigned long) (block_no) ^ ((unsigned long) (dev) << 16))
+
+// Write back buffers that have been dirty for longer than this (in seconds)
+#define BUF_DIRTY_AGE         5
+// Write back regardless of age once a device has this many dirty buffers
+#define BUF_DIRTY_BACKGROUND  (BUF_CACHE_MAX_SIZE / 8)
+// Write through once a device has this many dirty buffers
+#define BUF_DIRTY_MAX         (BUF_CACHE_MAX_SIZE / 2)
+// How often the flusher threads check the dirty lists (in milliseconds)
+#define BUF_FLUSH_INTERVAL    1000
+// The maximum number of buffers submitted for writing back at once
+#define BUF_FLUSH_BATCH       16
+
 static struct {
-  size_t          size;
-  struct KListLink head;
-  struct KSpinLock lock;
+  HASH_DECLARE(table, BUF_CACHE_NBUCKET);
+  struct {
+    struct KSpinLock lock;
+    unsigned long    hits;
+    unsigned long    misses;
+  } shards[BUF_CACHE_NLOCK];
+
+  struct KListLink lru;
+  size_t           size;
+  unsigned long    evictions;
+  struct KSpinLock lru_lock;
 } buf_cache;
 
+// Get the spinlock protecting the hash bucket for the given key
+#define BUF_CACHE_SHARD(key)  (&buf_cache.shards[(key) % BUF_CACHE_NLOCK])
+
+#define BUF_FLUSHER_MAX       256
+
+struct BufFlusher {
+  struct KListLink  dirty;          // Dirty buffers, oldest first
+  unsigned long     dirty_count;    // The number of dirty buffers
+  struct KSpinLock  lock;           // Protects the dirty list
+  struct KMutex     mutex;          // Serializes writing back
+  struct KSemaphore semaphore;      // Used to wake up the flusher thread
+};
+
+// Flushers for each block device major number
+static struct BufFlusher *buf_flushers[BUF_FLUSHER_MAX];
+
+#define BUF_FLUSHER(dev)      (buf_flushers[((dev) >> 8) % BUF_FLUSHER_MAX])
+
 static void
 buf_ctor(void *ptr, size_t)
 {
@@ -35,6 +113,8 @@ buf_ctor(void *ptr, size_t)
 void
 buf_init(void)
 {
+  int i, major;
+
   buf_pool = k_object_pool_create("buf_pool",
                                   sizeof(struct Buf),
                                   0,
@@ -43,8 +123,22 @@ buf_init(void)
   if (buf_pool == NULL)
     panic("cannot allocate buf_pool");
 
-  k_spinlock_init(&buf_cache.lock, "buf_cache");
-  k_list_init(&buf_cache.head);
+  HASH_INIT(buf_cache.table);
+  for (i = 0; i < BUF_CACHE_NLOCK; i++)
+    k_spinlock_init(&buf_cache.shards[i].lock, "buf_cache");
+
+  k_list_init(&buf_cache.lru);
+  k_spinlock_init(&buf_cache.lru_lock, "buf_cache_lru");
+
+  for (i = 0; i < (int) ARRAY_SIZE(buf_io_bufs); i++)
+    if ((buf_io_bufs[i] = (struct Buf *) k_object_pool_get(buf_pool)) == NULL)
+      panic("cannot allocate the reserved buffers");
+  k_mutex_init(&buf_io_mutex, "buf_io");
+
+  // Block devices have been registered by now
+  for (major = 0; major < BUF_FLUSHER_MAX; major++)
+    if (dev_lookup_block(major << 8) != NULL)
+      buf_flusher_create(major);
 }
 
 static uint8_t *
@@ -86,87 +180,207 @@ buf_free_data(void *data, size_t block_size)
   page_free_block(page, page_order);
 }
 
+// Allocate a new buffer if the cache hasn't reached its maximum size yet.
 static struct Buf *
 buf_alloc(size_t block_size)
 {
   struct Buf *buf;
 
-  assert(k_spinlock_holding(&buf_cache.lock));
-  assert(buf_cache.size < BUF_CACHE_MAX_SIZE);
+  k_spinlock_acquire(&buf_cache.lru_lock);
 
-  if ((buf = (struct Buf *) k_object_pool_get(buf_pool)) == NULL)
+  if (buf_cache.size >= BUF_CACHE_MAX_SIZE) {
+    k_spinlock_release(&buf_cache.lru_lock);
     return NULL;
+  }
 
-  if ((buf->data = buf_alloc_data(block_size)) == NULL) {
-    k_object_pool_put(buf_pool, buf);
+  buf_cache.size++;
+
+  k_spinlock_release(&buf_cache.lru_lock);
+
+  if ((buf = (struct Buf *) k_object_pool_get(buf_pool)) != NULL) {
+    if ((buf->data = buf_alloc_data(block_size)) == NULL) {
+      k_object_pool_put(buf_pool, buf);
+      buf = NULL;
+    }
+  }
+
+  if (buf == NULL) {
+    k_spinlock_acquire(&buf_cache.lru_lock);
+    buf_cache.size--;
+    k_spinlock_release(&buf_cache.lru_lock);
     return NULL;
   }
 
-  buf->block_no   = 0;
-  buf->dev        = 0;
-  buf->flags      = 0;
-  buf->ref_count  = 0;
   buf->block_size = block_size;
-  buf->cache_link.prev = NULL;
-  buf->cache_link.next = NULL;
-  buf->queue_link.prev = NULL;
-  buf->queue_link.next = NULL;
-
-  k_list_add_front(&buf_cache.head, &buf->cache_link);
-  buf_cache.size++;
+  k_list_null(&buf->hash_link);
+  k_list_null(&buf->lru_link);
+  k_list_null(&buf->dirty_link);
+  k_list_null(&buf->queue_link);
+  buf->done = NULL;
 
   return buf;
 }
 
-// Scan the cache for a buffer with the given block number and device.
+// Take the least recently used buffer off the LRU list and remove it from the
+// hash table.
 static struct Buf *
-buf_get(unsigned block_no, size_t block_size, dev_t dev)
+buf_evict(void)
+{
+  struct Buf *buf;
+  unsigned long key;
+
+  for (;;) {
+    k_spinlock_acquire(&buf_cache.lru_lock);
+
+    if (k_list_is_empty(&buf_cache.lru)) {
+      k_spinlock_release(&buf_cache.lru_lock);
+      return NULL;
+    }
+
+    buf = KLIST_CONTAINER(buf_cache.lru.prev, struct Buf, lru_link);
+
+    // Not in the hash table, so no one else can find it
+    if (k_list_is_null(&buf->hash_link)) {
+      k_list_remove(&buf->lru_link);
+      k_spinlock_release(&buf_cache.lru_lock);
+      return buf;
+    }
+
+    key = BUF_CACHE_KEY(buf->dev, buf->block_no);
+
+    k_spinlock_release(&buf_cache.lru_lock);
+
+    // Respect the lock order, then check that the buffer hasn't been reused
+    // in the meantime
+    k_spinlock_acquire(&BUF_CACHE_SHARD(key)->lock);
+    k_spinlock_acquire(&buf_cache.lru_lock);
+
+    if (!k_list_is_null(&buf->lru_link) &&
+        !k_list_is_null(&buf->hash_link) &&
+        (BUF_CACHE_KEY(buf->dev, buf->block_no) == key)) {
+      assert(buf->ref_count == 0);
+
+      k_list_remove(&buf->lru_link);
+      HASH_REMOVE(&buf->hash_link);
+      buf_cache.evictions++;
+
+      k_spinlock_release(&buf_cache.lru_lock);
+      k_spinlock_release(&BUF_CACHE_SHARD(key)->lock);
+
+      return buf;
+    }
+
+    k_spinlock_release(&buf_cache.lru_lock);
+    k_spinlock_release(&BUF_CACHE_SHARD(key)->lock);
+  }
+}
+
+// Get a reference to a cached buffer, taking it off the LRU list if it was
+// unused. The bucket lock must be held.
+static void
+buf_hold(struct Buf *buf)
+{
+  // Unused buffers waiting to be written back are not on the LRU list
+  if ((buf->ref_count++ == 0) && !k_list_is_null(&buf->lru_link)) {
+    k_spinlock_acquire(&buf_cache.lru_lock);
+    k_list_remove(&buf->lru_link);
+    k_spinlock_release(&buf_cache.lru_lock);
+  }
+}
+
+// Find a cached buffer and get a reference to it. The bucket lock must be held.
+static struct Buf *
+buf_lookup(unsigned long key, unsigned block_no, size_t block_size, dev_t dev)
 {
   struct KListLink *l;
-  struct Buf *b, *unused = NULL;
+  struct Buf *b;
 
-  k_spinlock_acquire(&buf_cache.lock);
+  assert(k_spinlock_holding(&BUF_CACHE_SHARD(key)->lock));
 
-  // TODO: use a hash table for faster lookups
-  KLIST_FOREACH(&buf_cache.head, l) {
-    b = KLIST_CONTAINER(l, struct Buf, cache_link);
+  HASH_FOREACH_ENTRY(buf_cache.table, l, key) {
+    b = KLIST_CONTAINER(l, struct Buf, hash_link);
 
     if ((b->block_no == block_no) &&
         (b->dev == dev) &&
         (b->block_size == block_size)) {
-      b->ref_count++;
-
-      k_spinlock_release(&buf_cache.lock);
-
+      buf_hold(b);
       return b;
     }
+  }
+
+  return NULL;
+}
+
+// Put an unused buffer to the LRU list. Buffers that do not hold valid data
+// are placed at the tail to be reused first.
+static void
+buf_lru_add(struct Buf *buf)
+{
+  k_spinlock_acquire(&buf_cache.lru_lock);
 
-    // Remember the least recently used free buffer.
-    if (b->ref_count == 0)
-      unused = b;
+  if (buf->flags & BUF_VALID)
+    k_list_add_front(&buf_cache.lru, &buf->lru_link);
+  else
+    k_list_add_back(&buf_cache.lru, &buf->lru_link);
+
+  k_spinlock_release(&buf_cache.lru_lock);
+}
+
+// Drop a reference to the buffer. Unused buffers that are not waiting to be
+// written back are returned to the LRU list.
+static void
+buf_put(struct Buf *buf)
+{
+  struct KSpinLock *lock;
+
+  lock = &BUF_CACHE_SHARD(BUF_CACHE_KEY(buf->dev, buf->block_no))->lock;
+
+  k_spinlock_acquire(lock);
+
+  if ((--buf->ref_count == 0) &&
+      !(buf->flags & BUF_DIRTY) &&
+      k_list_is_null(&buf->dirty_link))
+    buf_lru_add(buf);
+
+  k_spinlock_release(lock);
+}
+
+// Get a buffer for the given block number and device.
+static struct Buf *
+buf_get(unsigned block_no, size_t block_size, dev_t dev)
+{
+  unsigned long key = BUF_CACHE_KEY(dev, block_no);
+  struct KSpinLock *lock = &BUF_CACHE_SHARD(key)->lock;
+  struct Buf *b, *cached;
+
+  k_spinlock_acquire(lock);
+
+  if ((b = buf_lookup(key, block_no, block_size, dev)) != NULL) {
+    BUF_CACHE_SHARD(key)->hits++;
+    k_spinlock_release(lock);
+    return b;
   }
 
+  BUF_CACHE_SHARD(key)->misses++;
+
+  k_spinlock_release(lock);
+
   // Grow the buffer cache. If the maximum cache size is already reached, try
   // to reuse a buffer that held a different block.
-  if ((buf_cache.size >= BUF_CACHE_MAX_SIZE) ||
-      ((b = buf_alloc(block_size)) == NULL))
-    b = unused;
-
-  if (b == NULL) {
+  if (((b = buf_alloc(block_size)) == NULL) && ((b = buf_evict()) == NULL))
     // Out of free blocks.
-    k_spinlock_release(&buf_cache.lock);
     return NULL;
-  }
 
   // TODO: realloc
   if (b->block_size != block_size) {
     buf_free_data(b->data, b->block_size);
 
     if ((b->data = buf_alloc_data(block_size)) == NULL) {
-      k_list_remove(&b->cache_link);
       k_object_pool_put(buf_pool, b);
 
-      k_spinlock_release(&buf_cache.lock);
+      k_spinlock_acquire(&buf_cache.lru_lock);
+      buf_cache.size--;
+      k_spinlock_release(&buf_cache.lru_lock);
 
       return NULL;
     }
@@ -174,13 +388,26 @@ buf_get(unsigned block_no, size_t block_size, dev_t dev)
     b->block_size = block_size;
   }
 
-  b->block_size = block_size;
   b->block_no   = block_no;
   b->dev        = dev;
   b->ref_count  = 1;
   b->flags      = 0;
 
-  k_spinlock_release(&buf_cache.lock);
+  k_spinlock_acquire(lock);
+
+  // Another thread may have cached the same block in the meantime
+  if ((cached = buf_lookup(key, block_no, block_size, dev)) != NULL) {
+    k_spinlock_release(lock);
+
+    b->ref_count = 0;
+    buf_lru_add(b);
+
+    return cached;
+  }
+
+  HASH_PUT(buf_cache.table, &b->hash_link, key);
+
+  k_spinlock_release(lock);
 
   return b;
 }
@@ -214,9 +441,9 @@ buf_read(unsigned block_no, size_t block_size, dev_t dev)
 }
 
 /**
- * Write the buffer data to the disk. This function must be called before
- * releasing the buffer, if its data has changed. The caller must hold
- * 'buf->mutex'.
+ * Write the buffer data to the disk immediately. Modified buffers that are
+ * only marked with BUF_DIRTY are written back later by the flusher thread.
+ * The caller must hold 'buf->mutex'.
  * 
  * @param buf Pointer to the Buf structure to be written.
  */
@@ -230,8 +457,44 @@ buf_write(struct Buf *buf)
   buf_request(buf);
 }
 
+// Put a modified buffer on the dirty list of its device, unless it is already
+// there. Returns non-zero if the buffer has to be written through instead.
+static int
+buf_dirty_add(struct Buf *buf)
+{
+  struct BufFlusher *flusher;
+  unsigned long dirty_count;
+
+  if ((flusher = BUF_FLUSHER(buf->dev)) == NULL)
+    return -1;
+
+  k_spinlock_acquire(&flusher->lock);
+
+  if (k_list_is_null(&buf->dirty_link)) {
+    if (flusher->dirty_count >= BUF_DIRTY_MAX) {
+      k_spinlock_release(&flusher->lock);
+      k_semaphore_put(&flusher->semaphore);
+      return -1;
+    }
+
+    buf->dirty_time = k_tick_get();
+    k_list_add_back(&flusher->dirty, &buf->dirty_link);
+    flusher->dirty_count++;
+  }
+
+  dirty_count = flusher->dirty_count;
+
+  k_spinlock_release(&flusher->lock);
+
+  if (dirty_count >= BUF_DIRTY_BACKGROUND)
+    k_semaphore_put(&flusher->semaphore);
+
+  return 0;
+}
+
 /**
- * Release the buffer.
+ * Release the buffer. If the buffer data has been modified (BUF_DIRTY is
+ * set), it will be written back later.
  * 
  * @param buf Pointer to the Buf structure to be released.
  */
@@ -241,7 +504,8 @@ buf_release(struct Buf *buf)
   if (!(buf->flags & BUF_VALID))
     warn("buffer not valid");
 
-  if (buf->flags & BUF_DIRTY) {
+  // Too many dirty buffers, or no flusher for this device
+  if ((buf->flags & BUF_DIRTY) && (buf_dirty_add(buf) != 0)) {
     buf_write(buf);
 
     if (buf->flags & BUF_DIRTY) {
@@ -251,15 +515,427 @@ buf_release(struct Buf *buf)
   
   k_mutex_unlock(&buf->mutex);
 
-  k_spinlock_acquire(&buf_cache.lock);
+  // Return the buffer to the cache.
+  buf_put(buf);
+}
+
+// Invalidate a stale cached copy of the block, if any, so that it is neither
+// read from the cache nor written back later. If the copy is being written
+// back or used, wait until it is released, so that the old contents cannot
+// overwrite the new ones afterwards.
+static void
+buf_invalidate(unsigned block_no, dev_t dev)
+{
+  unsigned long key = BUF_CACHE_KEY(dev, block_no);
+  struct KSpinLock *lock = &BUF_CACHE_SHARD(key)->lock;
+  struct KListLink *l;
+  struct Buf *b;
+
+  for (;;) {
+    k_spinlock_acquire(lock);
+
+    b = NULL;
+
+    HASH_FOREACH_ENTRY(buf_cache.table, l, key) {
+      struct Buf *c = KLIST_CONTAINER(l, struct Buf, hash_link);
+
+      if ((c->block_no == block_no) && (c->dev == dev) &&
+          ((c->flags & (BUF_VALID | BUF_DIRTY)) ||
+           !k_list_is_null(&c->dirty_link))) {
+        b = c;
+        break;
+      }
+    }
+
+    if (b == NULL) {
+      k_spinlock_release(lock);
+      return;
+    }
+
+    buf_hold(b);
 
-  if (--buf->ref_count == 0) {
-    // Return the buffer to the cache.
-    k_list_remove(&buf->cache_link);
-    k_list_add_front(&buf_cache.head, &buf->cache_link);
+    k_spinlock_release(lock);
+
+    // The flusher thread holds the mutex until the write completes
+    k_mutex_lock(&b->mutex);
+
+    k_spinlock_acquire(lock);
+
+    b->flags &= ~(BUF_VALID | BUF_DIRTY);
+
+    // The stale copy need not be written back
+    if (!k_list_is_null(&b->dirty_link)) {
+      struct BufFlusher *flusher = BUF_FLUSHER(dev);
+
+      k_spinlock_acquire(&flusher->lock);
+      k_list_remove(&b->dirty_link);
+      flusher->dirty_count--;
+      k_spinlock_release(&flusher->lock);
+    }
+
+    k_spinlock_release(lock);
+
+    k_mutex_unlock(&b->mutex);
+
+    // Puts the invalid buffer on the LRU list to be reused first
+    buf_put(b);
   }
+}
+
+// Submit a transfer of a single block bypassing the buffer cache, using the
+// given buffer header.
+static void
+buf_io_start(struct Buf *buf, unsigned block_no, size_t block_size, dev_t dev,
+             void *data, int write)
+{
+  buf_invalidate(block_no, dev);
+
+  buf->block_no   = block_no;
+  buf->dev        = dev;
+  buf->flags      = write ? (BUF_VALID | BUF_DIRTY) : 0;
+  buf->ref_count  = 1;
+  buf->block_size = block_size;
+  buf->data       = (uint8_t *) data;
+  k_list_null(&buf->hash_link);
+  k_list_null(&buf->lru_link);
+  k_list_null(&buf->dirty_link);
+  k_list_null(&buf->queue_link);
 
-  k_spinlock_release(&buf_cache.lock);
+  block_submit(buf, NULL, NULL);
+}
+
+/**
+ * Transfer several blocks directly between the device and the given memory
+ * area, bypassing the buffer cache. File data is cached in the page cache, so
+ * only the metadata blocks have to be kept here. If a stale copy of a block
+ * is still cached (e.g. the block used to hold metadata), it is invalidated.
+ *
+ * All blocks are submitted at once, so that physically adjacent blocks are
+ * transferred by a single device command.
+ *
+ * @param block_nos  The filesystem block numbers; zero entries are skipped.
+ * @param nblocks    The number of blocks.
+ * @param block_size The filesystem block size.
+ * @param dev        ID of the device the blocks belong to.
+ * @param data       Pointer to the memory area of nblocks * block_size bytes.
+ * @param write      Non-zero to write the data to the device, zero to read.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+int
+buf_io(const uint32_t *block_nos, unsigned nblocks, size_t block_size,
+       dev_t dev, void *data, int write)
+{
+  struct Buf *bufs[PAGE_SIZE / BLOCK_SECTOR_SIZE];
+  unsigned i, n;
+  int r = 0;
+
+  if (nblocks > ARRAY_SIZE(bufs))
+    panic("too many blocks");
+
+  for (i = n = 0; i < nblocks; i++) {
+    if (block_nos[i] == 0)
+      continue;
+
+    if ((bufs[n] = (struct Buf *) k_object_pool_get(buf_pool)) == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+
+    buf_io_start(bufs[n++], block_nos[i], block_size, dev,
+                 (uint8_t *) data + i * block_size, write);
+  }
+
+  // Wait for the blocks already submitted even on failure, since they refer
+  // to the caller's memory
+  for (i = 0; i < n; i++) {
+    // TODO: check for I/O errors
+    block_wait(bufs[i]);
+    k_object_pool_put(buf_pool, bufs[i]);
+  }
+
+  return r;
+}
+
+/**
+ * Same as buf_io(), but use the buffer headers reserved at boot, so that no
+ * memory is allocated. Used to write pages out when memory runs low. The
+ * callers are serialized.
+ *
+ * @param block_nos  The filesystem block numbers; zero entries are skipped.
+ * @param nblocks    The number of blocks.
+ * @param block_size The filesystem block size.
+ * @param dev        ID of the device the blocks belong to.
+ * @param data       Pointer to the memory area of nblocks * block_size bytes.
+ * @param write      Non-zero to write the data to the device, zero to read.
+ *
+ * @return 0 on success, a negative error code otherwise.
+ */
+int
+buf_io_reserved(const uint32_t *block_nos, unsigned nblocks, size_t block_size,
+                dev_t dev, void *data, int write)
+{
+  unsigned i, n;
+
+  if (nblocks > ARRAY_SIZE(buf_io_bufs))
+    panic("too many blocks");
+
+  k_mutex_lock(&buf_io_mutex);
+
+  for (i = n = 0; i < nblocks; i++) {
+    if (block_nos[i] == 0)
+      continue;
+
+    buf_io_start(buf_io_bufs[n++], block_nos[i], block_size, dev,
+                 (uint8_t *) data + i * block_size, write);
+  }
+
+  for (i = 0; i < n; i++) {
+    // TODO: check for I/O errors
+    block_wait(buf_io_bufs[i]);
+  }
+
+  k_mutex_unlock(&buf_io_mutex);
+
+  return 0;
+}
+
+/**
+ * Get the buffer cache statistics.
+ *
+ * @param stat Pointer to the structure to store the statistics
+ */
+void
+buf_cache_stat(struct BufCacheStat *stat)
+{
+  int i;
+
+  stat->hits   = 0;
+  stat->misses = 0;
+
+  for (i = 0; i < BUF_CACHE_NLOCK; i++) {
+    k_spinlock_acquire(&buf_cache.shards[i].lock);
+    stat->hits   += buf_cache.shards[i].hits;
+    stat->misses += buf_cache.shards[i].misses;
+    k_spinlock_release(&buf_cache.shards[i].lock);
+  }
+
+  k_spinlock_acquire(&buf_cache.lru_lock);
+  stat->size      = buf_cache.size;
+  stat->evictions = buf_cache.evictions;
+  k_spinlock_release(&buf_cache.lru_lock);
+
+  stat->dirty = 0;
+
+  for (i = 0; i < BUF_FLUSHER_MAX; i++) {
+    if (buf_flushers[i] == NULL)
+      continue;
+
+    k_spinlock_acquire(&buf_flushers[i]->lock);
+    stat->dirty += buf_flushers[i]->dirty_count;
+    k_spinlock_release(&buf_flushers[i]->lock);
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Write-back
+ * ----------------------------------------------------------------------------
+ */
+
+// Take the oldest dirty buffer of the device off the dirty list, provided
+// that it was modified no later than 'before', and get a reference to it.
+static struct Buf *
+buf_flush_take(struct BufFlusher *flusher, unsigned long long before)
+{
+  struct KSpinLock *lock;
+  struct Buf *buf;
+  unsigned long key;
+
+  for (;;) {
+    k_spinlock_acquire(&flusher->lock);
+
+    if (k_list_is_empty(&flusher->dirty)) {
+      k_spinlock_release(&flusher->lock);
+      return NULL;
+    }
+
+    buf = KLIST_CONTAINER(flusher->dirty.next, struct Buf, dirty_link);
+
+    if (buf->dirty_time > before) {
+      k_spinlock_release(&flusher->lock);
+      return NULL;
+    }
+
+    key  = BUF_CACHE_KEY(buf->dev, buf->block_no);
+    lock = &BUF_CACHE_SHARD(key)->lock;
+
+    k_spinlock_release(&flusher->lock);
+
+    // Respect the lock order, then check that the buffer hasn't been taken
+    // off the list in the meantime
+    k_spinlock_acquire(lock);
+    k_spinlock_acquire(&flusher->lock);
+
+    if (!k_list_is_null(&buf->dirty_link) &&
+        (BUF_CACHE_KEY(buf->dev, buf->block_no) == key))
+      break;
+
+    k_spinlock_release(&flusher->lock);
+    k_spinlock_release(lock);
+  }
+
+  k_list_remove(&buf->dirty_link);
+  flusher->dirty_count--;
+
+  // Buffers on the dirty list cannot be on the LRU list
+  buf_hold(buf);
+
+  k_spinlock_release(&flusher->lock);
+  k_spinlock_release(lock);
+
+  return buf;
+}
+
+// Wait for the buffers submitted by buf_flush_batch() and release them.
+static void
+buf_flush_finish(struct Buf **bufs, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    // TODO: check for I/O errors
+    block_wait(bufs[i]);
+    k_mutex_unlock(&bufs[i]->mutex);
+    buf_put(bufs[i]);
+  }
+}
+
+// Write back up to BUF_FLUSH_BATCH of the oldest dirty buffers of the device
+// that were modified no later than 'before'. All of them are submitted before
+// waiting, so that adjacent blocks are written together. Returns the number
+// of buffers taken off the dirty list. The caller must hold the flusher mutex.
+static int
+buf_flush_batch(struct BufFlusher *flusher, unsigned long long before)
+{
+  struct Buf *bufs[BUF_FLUSH_BATCH], *buf;
+  int count, n;
+
+  assert(k_mutex_holding(&flusher->mutex));
+
+  for (count = n = 0; count < BUF_FLUSH_BATCH; count++) {
+    if ((buf = buf_flush_take(flusher, before)) == NULL)
+      break;
+
+    // Do not sleep on a buffer mutex while holding others, since its owner
+    // may be waiting for one of them. Finish the current batch first.
+    if ((n > 0) && (k_mutex_try_lock(&buf->mutex) != 0)) {
+      buf_flush_finish(bufs, n);
+      n = 0;
+    }
+
+    if (!k_mutex_holding(&buf->mutex))
+      k_mutex_lock(&buf->mutex);
+
+    // The buffer may have been written through or invalidated in the meantime
+    if (buf->flags & BUF_DIRTY)
+      block_submit(buf, NULL, NULL);
+
+    bufs[n++] = buf;
+  }
+
+  buf_flush_finish(bufs, n);
+
+  return count;
+}
+
+static void
+buf_flusher_entry(void *arg)
+{
+  struct BufFlusher *flusher = (struct BufFlusher *) arg;
+  unsigned long long now, before;
+
+  for (;;) {
+    k_semaphore_timed_get(&flusher->semaphore, ms2ticks(BUF_FLUSH_INTERVAL));
+
+    k_mutex_lock(&flusher->mutex);
+
+    now = k_tick_get();
+
+    do {
+      // Too many dirty buffers, write back the oldest ones regardless of age
+      if (flusher->dirty_count >= BUF_DIRTY_BACKGROUND)
+        before = now;
+      else if (now > seconds2ticks(BUF_DIRTY_AGE))
+        before = now - seconds2ticks(BUF_DIRTY_AGE);
+      else
+        before = 0;
+    } while (buf_flush_batch(flusher, before) == BUF_FLUSH_BATCH);
+
+    k_mutex_unlock(&flusher->mutex);
+  }
+}
+
+// Create the flusher thread for the given block device major number
+static void
+buf_flusher_create(int major)
+{
+  struct BufFlusher *flusher;
+  struct KThread *thread;
+
+  if ((flusher = (struct BufFlusher *) k_malloc(sizeof(*flusher))) == NULL)
+    panic("cannot allocate the buffer flusher");
+
+  k_list_init(&flusher->dirty);
+  flusher->dirty_count = 0;
+  k_spinlock_init(&flusher->lock, "buf_flusher");
+  k_mutex_init(&flusher->mutex, "buf_flusher");
+  k_semaphore_init(&flusher->semaphore, 0);
+
+  if ((thread = k_thread_create(NULL, buf_flusher_entry, flusher, 0)) == NULL)
+    panic("cannot create the buffer flusher thread");
+
+  buf_flushers[major] = flusher;
+
+  k_thread_resume(thread);
+}
+
+/**
+ * Write back all buffers of the given device that were modified before the
+ * call.
+ *
+ * @param dev ID of the device
+ */
+void
+buf_sync(dev_t dev)
+{
+  struct BufFlusher *flusher;
+  unsigned long long now;
+
+  if ((flusher = BUF_FLUSHER(dev)) == NULL)
+    return;
+
+  now = k_tick_get();
+
+  // Holding the mutex also waits for the buffer being written by the flusher
+  // thread, if any
+  k_mutex_lock(&flusher->mutex);
+  while (buf_flush_batch(flusher, now) == BUF_FLUSH_BATCH)
+    ;
+  k_mutex_unlock(&flusher->mutex);
+}
+
+/**
+ * Write back all modified buffers of all devices.
+ */
+void
+buf_sync_all(void)
+{
+  int major;
+
+  for (major = 0; major < BUF_FLUSHER_MAX; major++)
+    if (buf_flushers[major] != NULL)
+      buf_sync(major << 8);
 }
 
 /**
@@ -271,15 +947,9 @@ buf_release(struct Buf *buf)
 static void
 buf_request(struct Buf *buf)
 {
-  struct BlockDev *dev;
-
   if (!k_mutex_holding(&buf->mutex))
     panic("buf not locked");
-  if ((buf->flags & (BUF_DIRTY | BUF_VALID)) == BUF_VALID)
-    panic("nothing to do");
-
-  if ((dev = dev_lookup_block(buf->dev)) == NULL)
-    panic("no block device %d found", buf->dev);
 
-  dev->request(buf);
+  block_submit(buf, NULL, NULL);
+  block_wait(buf);
 }
@@ -3,10 +3,14 @@
 #include <string.h>
 
 #include <kernel/fs/fs.h>
+#include <kernel/kmeminfo.h>
 #include <kernel/object_pool.h>
 #include <kernel/console.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
 
 #include "devfs.h"
+#include "ext2.h"
 
 static struct DevfsNode {
   ino_t ino;
@@ -23,8 +27,15 @@ static struct DevfsNode {
   { 7, "tty4", S_IFCHR | 0666, 0x0104 },
   { 8, "tty5", S_IFCHR | 0666, 0x0105 },
   { 9, "zero", S_IFCHR | 0666, 0x0202 },
+  { 10, "kmeminfo", S_IFREG | 0444, 0x0000 },
+  { 11, "ext2frag", S_IFREG | 0444, 0x0000 },
 };
 
+// Kernel memory usage report (see kmeminfo_print())
+#define DEVFS_KMEMINFO_INO  10
+// Fragmentation of the root filesystem (see ext2_frag_print())
+#define DEVFS_EXT2FRAG_INO  11
+
 #define NDEV  (sizeof(devices) / sizeof devices[0])
 
 static struct Inode *
@@ -54,6 +65,12 @@ devfs_inode_read(struct Inode *inode)
     inode->uid   = 0;
     inode->gid   = 0;
     inode->size  = inode->ino == 2 ? NDEV : 0;
+
+    // The actual length of the report is not known in advance
+    if (inode->ino == DEVFS_KMEMINFO_INO)
+      inode->size = KMEMINFO_SIZE_MAX;
+    else if (inode->ino == DEVFS_EXT2FRAG_INO)
+      inode->size = EXT2_FRAG_SIZE_MAX;
     inode->atime = 0;
     inode->mtime = 0;
     inode->ctime = 0;
@@ -80,11 +97,48 @@ devfs_inode_delete(struct Inode *inode)
 ssize_t
 devfs_read(struct Inode *inode, uintptr_t va, size_t n, off_t offset)
 {
+  struct Inode *root;
+  char *buf;
+  size_t len, size;
+  int r;
+
   assert(inode->dev == 1);
-  (void) va;
-  (void) n;
-  (void) offset;
-  return -ENOSYS;
+
+  // The reports are regenerated on each read
+  if (inode->ino == DEVFS_KMEMINFO_INO) {
+    size = KMEMINFO_SIZE_MAX;
+    if ((buf = (char *) k_malloc(size)) == NULL)
+      return -ENOMEM;
+
+    len = kmeminfo_print(buf, size);
+  } else if (inode->ino == DEVFS_EXT2FRAG_INO) {
+    root = fs_root->inode;
+
+    if (strcmp(root->fs->name, "ext2") != 0)
+      return -ENOSYS;
+
+    size = EXT2_FRAG_SIZE_MAX;
+    if ((buf = (char *) k_malloc(size)) == NULL)
+      return -ENOMEM;
+
+    len = ext2_frag_print(root->fs, buf, size);
+  } else {
+    return -ENOSYS;
+  }
+
+  // Never copy out anything past the end of the buffer
+  len = MIN(len, size - 1);
+
+  n = ((size_t) offset < len) ? MIN(n, len - (size_t) offset) : 0;
+
+  if ((n > 0) && ((r = vm_space_copy_out(&buf[offset], va, n)) < 0)) {
+    k_free(buf);
+    return r;
+  }
+
+  k_free(buf);
+
+  return n;
 }
 
 ssize_t
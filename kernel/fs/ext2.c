@@ -28,6 +28,9 @@ ext2_inode_get(struct FS *fs, ino_t inum)
     inode->fs = fs;
     if ((inode->extra = k_malloc(sizeof(struct Ext2InodeExtra))) == NULL)
       panic("TODO");
+    ((struct Ext2InodeExtra *) inode->extra)->dir_index = NULL;
+    ((struct Ext2InodeExtra *) inode->extra)->goal      = 0;
+    k_list_null(&((struct Ext2InodeExtra *) inode->extra)->rsv.link);
   }
 
   return inode;
@@ -142,8 +145,6 @@ ext2_mknod(struct Inode *dirp, char *name, mode_t mode, dev_t dev,
   return 0;
 }
 
-#define DE_NAME_OFFSET    offsetof(struct Ext2DirEntry, name)
-
 ssize_t
 ext2_dirent_read(struct Inode *dir, struct Ext2DirEntry *de, off_t off)
 {
@@ -185,6 +186,14 @@ ext2_lookup(struct Inode *dirp, const char *name)
   if (!S_ISDIR(dirp->mode))
     panic("not a directory");
 
+  switch (ext2_dir_index_lookup(dirp, name, &de, &off)) {
+  case 0:
+    return ext2_inode_get(dirp->fs, de.inode);
+  case -ENOENT:
+    return NULL;
+  }
+
+  // The directory is not indexed
   name_len = strlen(name);
 
   for (off = 0; off < dirp->size; off += de.rec_len) {
@@ -203,15 +212,62 @@ ext2_lookup(struct Inode *dirp, const char *name)
   return NULL;
 }
 
+// Insert a new entry into the given range of the directory, either reusing an
+// unused entry or splitting an entry that has enough free space after it.
+static int
+ext2_dir_insert(struct Inode *dir, struct Ext2DirEntry *new_de,
+                off_t start, off_t end, off_t *off_store)
+{
+  struct Ext2DirEntry de;
+  ssize_t de_len, new_len;
+  off_t off;
+
+  new_len = EXT2_DE_LEN(new_de->name_len);
+
+  for (off = start; off < end; off += de.rec_len) {
+    ext2_dirent_read(dir, &de, off);
+
+    if (de.inode == 0) {
+      if (de.rec_len < new_len)
+        continue;
+      
+      // Reuse an empty entry
+      new_de->rec_len = de.rec_len;
+
+      ext2_dirent_write(dir, new_de, off);
+
+      *off_store = off;
+      return 0;
+    }
+
+    de_len = EXT2_DE_LEN(de.name_len);
+
+    if ((de.rec_len - de_len) >= new_len) {
+      // Found enough space
+      new_de->rec_len = de.rec_len - de_len;
+      de.rec_len = de_len;
+
+      ext2_dirent_write(dir, &de, off);
+      ext2_dirent_write(dir, new_de, off + de_len);
+
+      *off_store = off + de_len;
+      return 0;
+    }
+  }
+
+  return -ENOSPC;
+}
+
 int
 ext2_link(struct Inode *dir, char *name, struct Inode *inode)
 {
   struct Inode *existing_inode;
-  struct Ext2DirEntry de, new_de;
+  struct Ext2DirEntry new_de;
   off_t off;
-  ssize_t name_len, de_len, new_len;
+  ssize_t name_len;
   uint8_t file_type;
   struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (dir->fs->extra);
+  int r;
 
   if ((existing_inode = ext2_lookup(dir, name)) != NULL) {
     fs_inode_put(existing_inode);
@@ -241,59 +297,39 @@ ext2_link(struct Inode *dir, char *name, struct Inode *inode)
     return -EINVAL;
   }
 
-  new_len = ROUND_UP(DE_NAME_OFFSET + name_len, sizeof(uint32_t));
-
   new_de.inode     = inode->ino;
   new_de.name_len  = name_len;
   new_de.file_type = file_type;
   strncpy(new_de.name, name, ROUND_UP(name_len, sizeof(uint32_t)));
 
-  for (off = 0; off < dir->size; off += de.rec_len) {
-    ext2_dirent_read(dir, &de, off);
-
-    if (de.inode == 0) {
-      if (de.rec_len < new_len)
-        continue;
-      
-      // Reuse an empty entry
-      new_de.rec_len = de.rec_len;
-
-      inode->ctime = time_get_seconds();
-      inode->nlink++;
-      inode->flags |= FS_INODE_DIRTY;
+  // For an indexed directory, only look into a block known to have enough
+  // free space
+  off = ext2_dir_index_find_space(dir, EXT2_DE_LEN(name_len));
+  if (off == -ENODEV)
+    r = ext2_dir_insert(dir, &new_de, 0, dir->size, &off);
+  else if (off >= 0)
+    r = ext2_dir_insert(dir, &new_de, off, off + sb->block_size, &off);
+  else
+    r = -ENOSPC;
 
-      return ext2_dirent_write(dir, &new_de, off);
-    }
-
-    de_len = ROUND_UP(DE_NAME_OFFSET + de.name_len, sizeof(uint32_t));
+  if (r < 0) {
+    // Append a new block
+    assert(dir->size % sb->block_size == 0);
 
-    if ((de.rec_len - de_len) >= new_len) {
-      // Found enough space
-      new_de.rec_len = de.rec_len - de_len;
-      de.rec_len = de_len;
+    off = dir->size;
 
-      inode->ctime = time_get_seconds();
-      inode->nlink++;
-      inode->flags |= FS_INODE_DIRTY;
+    new_de.rec_len = sb->block_size;
+    dir->size = off + sb->block_size;
 
-      ext2_dirent_write(dir, &de, off);
-      ext2_dirent_write(dir, &new_de, off + de_len);
-
-      return 0;
-    }
+    ext2_dirent_write(dir, &new_de, off);
   }
 
-  assert(off % sb->block_size == 0);
-
-  new_de.rec_len = sb->block_size;
-  dir->size = off + sb->block_size;
+  ext2_dir_index_add(dir, name, inode->ino, off);
 
   inode->ctime = time_get_seconds();
   inode->nlink++;
   inode->flags |= FS_INODE_DIRTY;
 
-  ext2_dirent_write(dir, &new_de, off);
-
   return 0;
 }
 
@@ -324,21 +360,32 @@ ext2_dir_empty(struct Inode *dir)
 int
 ext2_unlink(struct Inode *dir, struct Inode *ip)
 {
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (dir->fs->extra);
   struct Ext2DirEntry de;
-  off_t off, prev_off;
+  off_t off, prev_off, start, end;
   size_t rec_len;
 
   if (dir->ino == ip->ino)
     return -EBUSY;
 
-  for (prev_off = off = 0; off < dir->size; prev_off = off, off += de.rec_len) {
+  // For an indexed directory, only scan the block containing the entry
+  if ((off = ext2_dir_index_find_ino(dir, ip->ino)) >= 0) {
+    start = ROUND_DOWN(off, (off_t) sb->block_size);
+    end   = start + sb->block_size;
+  } else {
+    start = 0;
+    end   = dir->size;
+  }
+
+  for (prev_off = off = start; off < end; prev_off = off, off += de.rec_len) {
     ext2_dirent_read(dir, &de, off);
 
     if (de.inode != ip->ino)
       continue;
 
-    if (prev_off == off) {
-      // Removed the first entry - create an unused entry
+    // Entries never span blocks
+    if ((off % sb->block_size) == 0) {
+      // Removed the first entry in a block - create an unused entry
       memset(de.name, 0, de.name_len);
       de.name_len  = 0;
       de.file_type = 0;
@@ -354,6 +401,8 @@ ext2_unlink(struct Inode *dir, struct Inode *ip)
       ext2_dirent_write(dir, &de, prev_off);
     }
 
+    ext2_dir_index_remove(dir, ip->ino, off);
+
     if (--ip->nlink > 0)
       ip->ctime = time_get_seconds();
     ip->flags |= FS_INODE_DIRTY;
@@ -385,6 +434,8 @@ ext2_rmdir(struct Inode *dir, struct Inode *ip)
 void
 ext2_inode_delete(struct Inode *inode)
 {
+  ext2_dir_index_free(inode);
+
   ext2_trunc(inode, 0);
 
   inode->mode = 0;
@@ -394,6 +445,27 @@ ext2_inode_delete(struct Inode *inode)
   ext2_inode_free((struct Ext2SuperblockData *) (inode->fs->extra), inode->dev, inode->ino);
 }
 
+// Free the in-memory data of an inode evicted from the inode cache
+void
+ext2_inode_release(struct Inode *inode)
+{
+  if (inode->extra != NULL) {
+    ext2_dir_index_free(inode);
+    ext2_rsv_discard((struct Ext2SuperblockData *) (inode->fs->extra),
+                     &((struct Ext2InodeExtra *) inode->extra)->rsv);
+    k_free(inode->extra);
+    inode->extra = NULL;
+  }
+}
+
+// The blocks reserved for a file are unlikely to be needed once it is closed
+void
+ext2_inode_close(struct Inode *inode)
+{
+  ext2_rsv_discard((struct Ext2SuperblockData *) (inode->fs->extra),
+                   &((struct Ext2InodeExtra *) inode->extra)->rsv);
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Superblock operations
@@ -421,7 +493,7 @@ ext2_sb_sync(struct Ext2SuperblockData *sb, dev_t dev)
   raw->wtime             = sb->wtime;
   raw->free_blocks_count = sb->free_blocks_count;
 
-  buf->flags = BUF_DIRTY;
+  buf->flags |= BUF_DIRTY;
 
   buf_release(buf);
 
@@ -466,21 +538,26 @@ ext2_readlink(struct Inode *inode, char *buf, size_t n)
 }
 
 struct FSOps ext2fs_ops = {
-  .inode_read   = ext2_inode_read,
-  .inode_write  = ext2_inode_write,
-  .inode_delete = ext2_inode_delete,
-  .read         = ext2_read,
-  .write        = ext2_write,
-  .trunc        = ext2_trunc,
-  .rmdir        = ext2_rmdir,
-  .readdir      = ext2_readdir,
-  .readlink     = ext2_readlink,
-  .create       = ext2_create,
-  .mkdir        = ext2_mkdir,
-  .mknod        = ext2_mknod,
-  .link         = ext2_link,
-  .unlink       = ext2_unlink,
-  .lookup       = ext2_lookup,
+  .inode_read    = ext2_inode_read,
+  .inode_write   = ext2_inode_write,
+  .inode_delete  = ext2_inode_delete,
+  .inode_release = ext2_inode_release,
+  .inode_close   = ext2_inode_close,
+  .read          = ext2_read,
+  .write         = ext2_write,
+  .read_page     = ext2_read_page,
+  .write_page    = ext2_write_page,
+  .bmap          = ext2_bmap,
+  .trunc         = ext2_trunc,
+  .rmdir         = ext2_rmdir,
+  .readdir       = ext2_readdir,
+  .readlink      = ext2_readlink,
+  .create        = ext2_create,
+  .mkdir         = ext2_mkdir,
+  .mknod         = ext2_mknod,
+  .link          = ext2_link,
+  .unlink        = ext2_unlink,
+  .lookup        = ext2_lookup,
 };
 
 struct Inode *
@@ -497,6 +574,11 @@ ext2_mount(dev_t dev)
     panic("cannt allocate superblock");
 
   k_mutex_init(&sb->mutex, "ext2_sb_mutex");
+  k_list_init(&sb->rsv_windows);
+
+  sb->alloc_count     = 0;
+  sb->alloc_goal_hits = 0;
+  sb->rsv_hits        = 0;
   
   if ((buf = buf_read(1, 1024, dev)) == NULL)
     panic("cannot read the superblock");
@@ -1,6 +1,7 @@
 #ifndef __KERNEL_FS_EXT2_H__
 #define __KERNEL_FS_EXT2_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -48,9 +49,27 @@ struct Ext2Superblock {
   uint16_t block_group_nr;
 } __attribute__((packed));
 
+/**
+ * A range of blocks set aside for future allocations by one inode (see
+ * ext2_block_alloc.c).
+ */
+struct Ext2RsvWindow {
+  struct KListLink link;
+  uint32_t         start;
+  uint32_t         end;
+};
+
 struct Ext2SuperblockData {
   struct KMutex mutex;
 
+  // Reservation windows of all inodes
+  struct KListLink rsv_windows;
+
+  // Block allocation statistics
+  unsigned long alloc_count;
+  unsigned long alloc_goal_hits;
+  unsigned long rsv_hits;
+
   uint32_t inodes_count;
   uint32_t block_count;
   uint32_t r_blocks_count;
@@ -64,6 +83,10 @@ struct Ext2SuperblockData {
   uint32_t block_size;
 };
 
+// The first block of the group containing the given inode
+#define EXT2_GROUP_FIRST_BLOCK(sb, ino) \
+  (((ino) - 1) / (sb)->inodes_per_group * (sb)->blocks_per_group)
+
 /**
  * Block Group Descriptor 
  */
@@ -107,9 +130,31 @@ struct Ext2Inode {
   uint8_t  osd2[12];
 } __attribute__((packed));
 
+struct Ext2DirIndex;
+
+/**
+ * A run of consecutive logical blocks stored in consecutive physical blocks.
+ */
+struct Ext2BlockExtent {
+  uint32_t logical;
+  uint32_t physical;
+  uint32_t count;           ///< 0 if the slot is unused
+};
+
+// The number of extents cached per inode
+#define EXT2_BMAP_CACHE_SIZE  4
+
 struct Ext2InodeExtra {
   uint32_t        blocks;
   uint32_t        block[15];
+  // In-memory index of a large directory (see ext2_dir_index.c)
+  struct Ext2DirIndex *dir_index;
+  // Where to allocate the next block and the reservation window
+  uint32_t        goal;
+  struct Ext2RsvWindow rsv;
+  // Recently resolved indirect block mappings (see ext2_inode_get_block)
+  struct Ext2BlockExtent bmap[EXT2_BMAP_CACHE_SIZE];
+  unsigned        bmap_next;
 };
 
 // File format
@@ -146,6 +191,12 @@ struct Ext2DirEntry {
   char     name[255];
 } __attribute__((packed));
 
+#define DE_NAME_OFFSET    offsetof(struct Ext2DirEntry, name)
+
+// The space occupied by a directory entry with the given name length
+#define EXT2_DE_LEN(name_len) \
+  ROUND_UP(DE_NAME_OFFSET + (name_len), sizeof(uint32_t))
+
 #define EXT2_FT_UNKNOWN   0
 #define EXT2_FT_REG_FILE  1
 #define EXT2_FT_DIR       2
@@ -159,12 +210,19 @@ struct Inode;
 
 extern struct FS ext2fs;
 
-int           ext2_bitmap_alloc(struct Ext2SuperblockData *, uint32_t, size_t, dev_t, uint32_t *);
+int           ext2_bitmap_alloc(struct Ext2SuperblockData *, uint32_t, size_t, size_t, dev_t, uint32_t *);
 int           ext2_bitmap_free(struct Ext2SuperblockData *, uint32_t, dev_t, uint32_t);
+void          ext2_bitmap_free_extents(struct Ext2SuperblockData *, uint32_t, size_t, dev_t, uint32_t *, uint32_t *);
 
-int           ext2_block_alloc(struct Ext2SuperblockData *, dev_t, uint32_t *);
+int           ext2_block_alloc(struct Ext2SuperblockData *, dev_t, struct Ext2RsvWindow *, uint32_t, uint32_t *);
 void          ext2_block_free(struct Ext2SuperblockData *, dev_t, uint32_t);
 int           ext2_block_zero(struct Ext2SuperblockData *, uint32_t, uint32_t);
+void          ext2_rsv_discard(struct Ext2SuperblockData *, struct Ext2RsvWindow *);
+
+/** The maximum size of the fragmentation report (including the terminating NUL) */
+#define EXT2_FRAG_SIZE_MAX  4096
+
+size_t        ext2_frag_print(struct FS *, char *, size_t);
 
 int           ext2_inode_alloc(struct Ext2SuperblockData *, mode_t, dev_t, dev_t, uint32_t *, uint32_t);
 void          ext2_inode_free(struct Ext2SuperblockData *, dev_t, uint32_t);
@@ -174,6 +232,8 @@ struct Inode *ext2_mount(dev_t);
 int           ext2_inode_read(struct Inode *);
 int           ext2_inode_write(struct Inode *);
 void          ext2_inode_delete(struct Inode *);
+void          ext2_inode_release(struct Inode *);
+void          ext2_inode_close(struct Inode *);
 
 int           ext2_create(struct Inode *, char *, mode_t,
                                 struct Inode **);
@@ -186,9 +246,20 @@ int           ext2_mknod(struct Inode *, char *, mode_t, dev_t, struct Inode **)
 void          ext2_trunc(struct Inode *, off_t);
 ssize_t       ext2_read(struct Inode *, uintptr_t, size_t, off_t);
 ssize_t       ext2_write(struct Inode *, uintptr_t, size_t, off_t);
+int           ext2_read_page(struct Inode *, void *, off_t);
+int           ext2_write_page(struct Inode *, const void *, off_t, size_t, size_t);
+int           ext2_bmap(struct Inode *, off_t, size_t, size_t, uint32_t *);
 
 ssize_t       ext2_readdir(struct Inode *, void *, FillDirFunc, off_t);
 ssize_t       ext2_readlink(struct Inode *, char *, size_t);
 uint32_t      ext2_inode_get_block(struct Inode *, uint32_t, int);
 
+ssize_t       ext2_dirent_read(struct Inode *, struct Ext2DirEntry *, off_t);
+int           ext2_dir_index_lookup(struct Inode *, const char *, struct Ext2DirEntry *, off_t *);
+off_t         ext2_dir_index_find_ino(struct Inode *, uint32_t);
+off_t         ext2_dir_index_find_space(struct Inode *, size_t);
+void          ext2_dir_index_add(struct Inode *, const char *, uint32_t, off_t);
+void          ext2_dir_index_remove(struct Inode *, uint32_t, off_t);
+void          ext2_dir_index_free(struct Inode *);
+
 #endif  // !__KERNEL_FS_EXT2_H__
@@ -31,21 +31,23 @@ bit_clear(uint32_t *bmap, size_t n)
  * Try to allocate a bit from the bitmap.
  * 
  * @param bstart Starting block ID of the bitmap.
+ * @param start  The bit number to start searching from.
  * @param blen   The length of the bitmap (in bits).
  * @param dev    The device where the bitmap is located.
  * @param bstore Pointer to the memory location to store the allocated bit
  *               number of.
  * 
  * @retval 0       on success
- * @retval -ENOMEM if there are no unused bits
+ * @retval -ENOMEM if there are no unused bits between start and blen
  */
 int
-ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen, dev_t dev, uint32_t *bstore)
+ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t start,
+                  size_t blen, dev_t dev, uint32_t *bstore)
 {
   uint32_t bits_per_block = sb->block_size * BITS_PER_BYTE;
   uint32_t b, bi;
 
-  for (b = 0; b < blen; b += bits_per_block) {
+  for (b = ROUND_DOWN(start, bits_per_block); b < blen; b += bits_per_block) {
     struct Buf *buf;
     uint32_t *bmap;
 
@@ -55,7 +57,13 @@ ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen, d
 
     bmap = (uint32_t *) buf->data;
 
-    for (bi = 0; bi < MIN(bits_per_block, blen - b); bi++) {
+    for (bi = (b < start) ? start - b : 0; bi < MIN(bits_per_block, blen - b); bi++) {
+      // Skip words with all bits set
+      if (((bi % BITS_PER_WORD) == 0) && (bmap[bi / BITS_PER_WORD] == ~0U)) {
+        bi += BITS_PER_WORD - 1;
+        continue;
+      }
+
       if (bit_test(bmap, bi))
         continue;
 
@@ -76,6 +84,55 @@ ext2_bitmap_alloc(struct Ext2SuperblockData *sb, uint32_t bstart, size_t blen, d
   return -ENOMEM;
 }
 
+/**
+ * Count the runs of unused bits in the bitmap.
+ * 
+ * @param bstart        Starting block ID of the bitmap.
+ * @param blen          The length of the bitmap (in bits).
+ * @param dev           The device where the bitmap is located.
+ * @param count_store   Pointer to the memory location to store the number of
+ *                      runs.
+ * @param largest_store Pointer to the memory location to store the length of
+ *                      the longest run.
+ */
+void
+ext2_bitmap_free_extents(struct Ext2SuperblockData *sb, uint32_t bstart,
+                         size_t blen, dev_t dev, uint32_t *count_store,
+                         uint32_t *largest_store)
+{
+  uint32_t bits_per_block = sb->block_size * BITS_PER_BYTE;
+  uint32_t b, bi, run, count, largest;
+
+  run = count = largest = 0;
+
+  for (b = 0; b < blen; b += bits_per_block) {
+    struct Buf *buf;
+    uint32_t *bmap;
+
+    if ((buf = buf_read(bstart + b / bits_per_block, sb->block_size, dev)) == NULL)
+      // TODO: recover from I/O errors
+      panic("cannot read the bitmap block %d", bstart + b / bits_per_block);
+
+    bmap = (uint32_t *) buf->data;
+
+    for (bi = 0; bi < MIN(bits_per_block, blen - b); bi++) {
+      if (bit_test(bmap, bi)) {
+        run = 0;
+        continue;
+      }
+
+      if (run++ == 0)
+        count++;
+      largest = MAX(largest, run);
+    }
+
+    buf_release(buf);
+  }
+
+  *count_store   = count;
+  *largest_store = largest;
+}
+
 /**
  * Free the allocated bit.
  * 
@@ -1,5 +1,7 @@
 #include <kernel/assert.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <kernel/fs/buf.h>
@@ -33,49 +35,242 @@ ext2_block_zero(struct Ext2SuperblockData *sb, uint32_t block_id, uint32_t dev)
   return 0;
 }
 
-// Try to allocate a block from the block group descriptor pointed to by `gd`.
-// If there is a free block, mark it as used and store its number (relative to
-// the group) into the memory location pointed to by `bstore`. Otherwise,
-// return `-ENOMEM`.
+/*
+ * ----------------------------------------------------------------------------
+ * Block allocation
+ * ----------------------------------------------------------------------------
+ *
+ * Each allocation is given a goal: the block following the one most recently
+ * allocated to the same inode, or the first block of the inode's group if it
+ * has no blocks yet. The search starts at the goal and proceeds through the
+ * following groups, so that the blocks of a file end up close to each other
+ * and to its inode.
+ *
+ * Goals alone do not help when several files grow at the same time, since
+ * their blocks interleave. To avoid this, an inode allocating data blocks
+ * reserves a window of EXT2_RSV_BLOCKS consecutive blocks starting at the goal
+ * and takes its next blocks from there. Other inodes skip the windows they do
+ * not own, unless there are no other free blocks left. Windows only exist in
+ * memory: the blocks stay free in the bitmap until actually allocated, and the
+ * window is dropped when the last open file of the inode is closed, or when
+ * the inode is truncated, deleted or evicted from the inode cache. All windows are kept on
+ * a list protected by the superblock mutex, which is held for the whole
+ * allocation.
+ */
+
+// The size of a reservation window, in blocks
+#define EXT2_RSV_BLOCKS   32
+// How many windows to try before falling back to a plain search
+#define EXT2_RSV_TRIES    8
+
+// Blocks past the last complete group are never allocated
+#define EXT2_BLOCKS_END(sb) \
+  ((sb)->block_count / (sb)->blocks_per_group * (sb)->blocks_per_group)
+
+// Read the group descriptor table block containing the descriptor of the
+// given group
+static struct Buf *
+ext2_block_group_read(struct Ext2SuperblockData *sb, dev_t dev, uint32_t group,
+                      struct Ext2BlockGroup **gd_store)
+{
+  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
+  uint32_t gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
+  struct Buf *buf;
+
+  if ((buf = buf_read(gd_start + (group / gds_per_block), sb->block_size, dev)) == NULL)
+    // TODO: recover from I/O errors
+    panic("cannot read the group descriptor table");
+
+  *gd_store = (struct Ext2BlockGroup *) buf->data + (group % gds_per_block);
+
+  return buf;
+}
+
+// Try to allocate a block in the range [from, to), which must lie within one
+// group, skipping the blocks reserved by windows other than `rsv` unless
+// `steal` is nonzero. If there is a free block, mark it as used and store its
+// number into the memory location pointed to by `bstore`. Otherwise, return
+// `-ENOMEM`.
 static int
-ext2_block_group_alloc(struct Ext2SuperblockData *sb, struct Ext2BlockGroup *gd, dev_t dev, uint32_t *bstore)
+ext2_block_group_alloc(struct Ext2SuperblockData *sb, dev_t dev,
+                       struct Ext2RsvWindow *rsv, uint32_t from, uint32_t to,
+                       int steal, uint32_t *bstore)
 {
-  if (gd->free_blocks_count == 0)
-    return -ENOMEM;
+  uint32_t group = from / sb->blocks_per_group;
+  uint32_t base  = group * sb->blocks_per_group;
+  struct Ext2BlockGroup *gd;
+  struct KListLink *l;
+  struct Buf *buf;
+  uint32_t limit, bit;
+  int retry;
 
-  if (ext2_bitmap_alloc(sb, gd->block_bitmap, sb->blocks_per_group, dev,
-                        bstore) < 0)
-    // If free_blocks_count isn't zero, but we couldn't find a free block, the
-    // filesystem is corrupted.
-    panic("no free blocks");
+  assert(k_mutex_holding(&sb->mutex));
 
-  gd->free_blocks_count--;
+  buf = ext2_block_group_read(sb, dev, group, &gd);
 
-  return 0;
+  while ((gd->free_blocks_count > 0) && (from < to)) {
+    // Find the first range not reserved by other inodes
+    limit = to;
+    retry = 0;
+
+    KLIST_FOREACH(&sb->rsv_windows, l) {
+      struct Ext2RsvWindow *w = KLIST_CONTAINER(l, struct Ext2RsvWindow, link);
+
+      if (steal)
+        break;
+
+      if ((w == rsv) || (w->end <= from) || (w->start >= limit))
+        continue;
+
+      if (w->start <= from) {
+        from  = w->end;
+        retry = 1;
+        break;
+      }
+
+      limit = w->start;
+    }
+
+    if (retry)
+      continue;
+
+    if (ext2_bitmap_alloc(sb, gd->block_bitmap, from - base, limit - base, dev,
+                          &bit) == 0) {
+      gd->free_blocks_count--;
+      buf->flags |= BUF_DIRTY;
+
+      buf_release(buf);
+      // TODO: recover from I/O errors
+
+      *bstore = base + bit;
+
+      return 0;
+    }
+
+    from = limit;
+  }
+
+  buf_release(buf);
+
+  return -ENOMEM;
+}
+
+// Try to allocate a block from the reservation window, moving the window to
+// the goal if necessary
+static int
+ext2_rsv_alloc(struct Ext2SuperblockData *sb, dev_t dev,
+               struct Ext2RsvWindow *rsv, uint32_t goal, uint32_t *bstore)
+{
+  struct KListLink *l;
+  uint32_t group_end;
+  int i, retry;
+
+  if (!k_list_is_null(&rsv->link)) {
+    if ((goal >= rsv->start) && (goal < rsv->end) &&
+        (ext2_block_group_alloc(sb, dev, rsv, goal, rsv->end, 0, bstore) == 0)) {
+      sb->rsv_hits++;
+      return 0;
+    }
+
+    k_list_remove(&rsv->link);
+  }
+
+  for (i = 0; i < EXT2_RSV_TRIES; i++) {
+    group_end = ROUND_DOWN(goal, sb->blocks_per_group) + sb->blocks_per_group;
+
+    // Start the new window at the first block not reserved by another inode
+    rsv->start = goal;
+    rsv->end   = MIN(goal + EXT2_RSV_BLOCKS, group_end);
+
+    do {
+      retry = 0;
+
+      KLIST_FOREACH(&sb->rsv_windows, l) {
+        struct Ext2RsvWindow *w = KLIST_CONTAINER(l, struct Ext2RsvWindow, link);
+
+        if ((w->end <= rsv->start) || (w->start >= rsv->end))
+          continue;
+
+        if (w->start <= rsv->start) {
+          rsv->start = w->end;
+          rsv->end   = MIN(rsv->start + EXT2_RSV_BLOCKS, group_end);
+          retry      = 1;
+          break;
+        }
+
+        rsv->end = w->start;
+      }
+    } while (retry && (rsv->start < group_end));
+
+    if (rsv->start < group_end) {
+      k_list_add_back(&sb->rsv_windows, &rsv->link);
+
+      if (ext2_block_group_alloc(sb, dev, rsv, rsv->start, rsv->end, 0,
+                                 bstore) == 0)
+        return 0;
+
+      k_list_remove(&rsv->link);
+    }
+
+    // Try the next range, possibly in the next group
+    goal = (rsv->end < EXT2_BLOCKS_END(sb)) ? rsv->end : 0;
+  }
+
+  return -ENOMEM;
+}
+
+// Scan all groups for a free block, starting at the goal. If `steal` is
+// nonzero, blocks reserved by other inodes may be taken as well
+static int
+ext2_goal_alloc(struct Ext2SuperblockData *sb, dev_t dev,
+                struct Ext2RsvWindow *rsv, uint32_t goal, int steal,
+                uint32_t *bstore)
+{
+  uint32_t groups_total = sb->block_count / sb->blocks_per_group;
+  uint32_t first, group, i;
+
+  first = goal / sb->blocks_per_group;
+
+  for (i = 0; i < groups_total; i++) {
+    group = (first + i) % groups_total;
+
+    if (ext2_block_group_alloc(sb, dev, rsv,
+                               (i == 0) ? goal : group * sb->blocks_per_group,
+                               (group + 1) * sb->blocks_per_group, steal,
+                               bstore) == 0)
+      return 0;
+  }
+
+  // Finally, try the part of the first group before the goal
+  if (goal % sb->blocks_per_group)
+    return ext2_block_group_alloc(sb, dev, rsv, first * sb->blocks_per_group,
+                                  goal, steal, bstore);
+
+  return -ENOMEM;
 }
 
 /**
  * Allocate a zeroed block.
  * 
  * @param dev    The device to allocate block from.
+ * @param rsv    The reservation window of the inode for which the allocation
+ *               is performed, or NULL.
+ * @param goal   The preferred block number (used as a hint where to begin the
+ *               search).
  * @param bstore Pointer to the memory location where to store the allocated
  *               block number.
- * @param inode  The number of the inode for which the allocation is performed
- *               (used as a hint where to begin the search).
  *
  * @retval 0       Success
+ * @retval -ENOSPC The filesystem is full.
  * @retval -ENOMEM Couldn't find a free block.
  */
 int
-ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore)
+ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev,
+                 struct Ext2RsvWindow *rsv, uint32_t goal, uint32_t *bstore)
 {
   struct Process *my_process = process_current();
-  
-  uint32_t gd_start      = sb->block_size > 1024U ? 1 : 2;
-  uint32_t gds_total     = sb->block_count / sb->blocks_per_group;
-  uint32_t gds_per_block = sb->block_size / sizeof(struct Ext2BlockGroup);
-
-  uint32_t g, gi;
+  uint32_t block_id;
+  int r;
 
   k_mutex_lock(&sb->mutex);
   
@@ -90,52 +285,53 @@ ext2_block_alloc(struct Ext2SuperblockData *sb, dev_t dev, uint32_t *bstore)
     return -ENOSPC;
   }
 
-  sb->free_blocks_count--;
-
-  k_mutex_unlock(&sb->mutex);
-
-  // TODO: do not exceed r_blocks_count for ordinary users!
-  // TODO: update free_blocks_count
+  if (goal >= EXT2_BLOCKS_END(sb))
+    goal = 0;
 
-  // TODO: try to allocate a new block in the same group as its inode
-  // TODO: try to allocate consecutive sequences of blocks
+  r = -ENOMEM;
+  if (rsv != NULL)
+    r = ext2_rsv_alloc(sb, dev, rsv, goal, &block_id);
+  if (r != 0)
+    r = ext2_goal_alloc(sb, dev, rsv, goal, 0, &block_id);
+  // As the last resort, take a block reserved by another inode
+  if (r != 0)
+    r = ext2_goal_alloc(sb, dev, rsv, goal, 1, &block_id);
 
-  // Scan all group descriptors for a free block
-  for (g = 0; g < gds_total; g += gds_per_block) {
-    struct Buf *buf;
-
-    if ((buf = buf_read(gd_start + (g / gds_per_block), sb->block_size, dev)) == NULL)
-      // TODO: recover from I/O errors
-      panic("cannot read the group descriptor table");
+  if (r != 0) {
+    k_mutex_unlock(&sb->mutex);
+    return r;
+  }
 
-    for (gi = 0; gi < MIN(gds_per_block, gds_total - g); gi++) {
-      struct Ext2BlockGroup *gd = (struct Ext2BlockGroup *) buf->data + gi;
-      uint32_t block_id;
+  sb->free_blocks_count--;
 
-      if (ext2_block_group_alloc(sb, gd, dev, &block_id) == 0) {
-        buf->flags |= BUF_DIRTY;
+  sb->alloc_count++;
+  if (block_id == goal)
+    sb->alloc_goal_hits++;
 
-        buf_release(buf);
-        // TODO: recover from I/O errors
+  k_mutex_unlock(&sb->mutex);
 
-        block_id += (g + gi) * sb->blocks_per_group;
+  ext2_block_zero(sb, block_id, dev);
 
-        ext2_block_zero(sb, block_id, dev);
+  *bstore = block_id;
 
-        *bstore = block_id;
+  return 0;
+}
 
-        return 0;
-      }
-    }
+/**
+ * Drop the reservation window, making the blocks it covers available to other
+ * inodes.
+ *
+ * @param rsv Pointer to the reservation window.
+ */
+void
+ext2_rsv_discard(struct Ext2SuperblockData *sb, struct Ext2RsvWindow *rsv)
+{
+  k_mutex_lock(&sb->mutex);
 
-    buf_release(buf);
-  }
+  if (!k_list_is_null(&rsv->link))
+    k_list_remove(&rsv->link);
 
-  k_mutex_lock(&sb->mutex);
-  sb->free_blocks_count++;
   k_mutex_unlock(&sb->mutex);
-
-  return -ENOMEM;
 }
 
 /**
@@ -172,3 +368,110 @@ ext2_block_free(struct Ext2SuperblockData *sb, dev_t dev, uint32_t bno)
   sb->free_blocks_count++;
   k_mutex_unlock(&sb->mutex);
 }
+
+/*
+ * ----------------------------------------------------------------------------
+ * Fragmentation report
+ * ----------------------------------------------------------------------------
+ *
+ * Read from /dev/ext2frag. For each group, the report lists the number of free
+ * blocks, the number of free extents (runs of consecutive free blocks) and the
+ * length of the longest one. A well-laid-out filesystem has few extents per
+ * group compared to the number of free blocks.
+ */
+
+struct Ext2FragBuf {
+  char   *s;
+  size_t  n;
+  size_t  len;
+};
+
+// Append formatted text to the report, silently truncating it if the buffer
+// is full
+static void
+ext2_frag_printf(struct Ext2FragBuf *buf, const char *format, ...)
+{
+  va_list ap;
+
+  if (buf->len + 1 >= buf->n)
+    return;
+
+  va_start(ap, format);
+  buf->len += vsnprintf(&buf->s[buf->len], buf->n - buf->len, format, ap);
+  va_end(ap);
+
+  buf->len = MIN(buf->len, buf->n - 1);
+}
+
+/**
+ * Generate the fragmentation report for an ext2 filesystem.
+ *
+ * @param fs Pointer to the filesystem
+ * @param s  Pointer to the buffer to store the NUL-terminated report
+ * @param n  Size of the buffer in bytes
+ *
+ * @return The length of the report (excluding the terminating NUL)
+ */
+size_t
+ext2_frag_print(struct FS *fs, char *s, size_t n)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) fs->extra;
+  uint32_t groups_total = sb->block_count / sb->blocks_per_group;
+  uint32_t group, count, largest, total_count, total_largest;
+  struct Ext2FragBuf buf;
+  struct KListLink *l;
+  unsigned windows;
+
+  buf.s   = s;
+  buf.n   = n;
+  buf.len = 0;
+
+  if (n == 0)
+    return 0;
+  s[0] = '\0';
+
+  k_mutex_lock(&sb->mutex);
+
+  windows = 0;
+  KLIST_FOREACH(&sb->rsv_windows, l)
+    windows++;
+
+  ext2_frag_printf(&buf, "Block allocation:\n");
+  ext2_frag_printf(&buf, "  %-12s %8lu\n", "allocated", sb->alloc_count);
+  ext2_frag_printf(&buf, "  %-12s %8lu\n", "at goal", sb->alloc_goal_hits);
+  ext2_frag_printf(&buf, "  %-12s %8lu\n", "in window", sb->rsv_hits);
+  ext2_frag_printf(&buf, "  %-12s %8u\n", "windows", windows);
+
+  ext2_frag_printf(&buf, "Free space:\n");
+  ext2_frag_printf(&buf, "  %-12s %8s %8s %8s\n",
+                   "group", "free", "extents", "largest");
+
+  total_count = total_largest = 0;
+
+  for (group = 0; group < groups_total; group++) {
+    struct Ext2BlockGroup *gd;
+    struct Buf *gd_buf;
+    uint32_t bitmap, free;
+
+    gd_buf = ext2_block_group_read(sb, fs->dev, group, &gd);
+    bitmap = gd->block_bitmap;
+    free   = gd->free_blocks_count;
+    buf_release(gd_buf);
+
+    ext2_bitmap_free_extents(sb, bitmap, sb->blocks_per_group, fs->dev,
+                             &count, &largest);
+
+    total_count  += count;
+    total_largest = MAX(total_largest, largest);
+
+    ext2_frag_printf(&buf, "  %-12u %8u %8u %8u\n",
+                     group, free, count, largest);
+  }
+
+  ext2_frag_printf(&buf, "  %-12s %8u %8u %8u\n", "total",
+                   sb->free_blocks_count, total_count, total_largest);
+
+  k_mutex_unlock(&sb->mutex);
+
+  return buf.len;
+}
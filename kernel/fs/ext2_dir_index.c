@@ -0,0 +1,427 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <kernel/console.h>
+#include <kernel/fs/fs.h>
+#include <kernel/object_pool.h>
+#include <kernel/types.h>
+
+#include "ext2.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * In-memory directory index
+ * ----------------------------------------------------------------------------
+ *
+ * Searching a large directory entry by entry makes every lookup linear in the
+ * directory size. Instead, the first lookup in a directory of at least
+ * EXT2_DIR_INDEX_MIN_BLOCKS blocks scans it once and records the offset of
+ * each entry in two hash tables: one keyed by the name hash, used by lookups,
+ * and one keyed by the inode number, used by unlink. The index also remembers
+ * the largest record that can be inserted into each block, so that a new
+ * entry goes straight to a block with enough free space.
+ *
+ * The on-disk format is not changed, and directories are still readable by
+ * any ext2 implementation. The index lives as long as the inode stays in the
+ * inode cache and is kept up to date by ext2_link() and ext2_unlink(). If the
+ * index cannot be updated due to lack of memory, it is simply dropped and
+ * rebuilt on the next lookup. All operations require the directory inode to
+ * be locked.
+ */
+
+// Only index directories of at least this many blocks
+#define EXT2_DIR_INDEX_MIN_BLOCKS   2
+// Average number of directory entries per hash bucket
+#define EXT2_DIR_INDEX_LOAD         4
+// Limits for the number of hash buckets
+#define EXT2_DIR_INDEX_MIN_BUCKETS  16
+#define EXT2_DIR_INDEX_MAX_BUCKETS  1024
+
+struct Ext2DirIndexEntry {
+  struct KListLink  name_link;        // Link into the name hash chain
+  struct KListLink  ino_link;         // Link into the inode number chain
+  uint32_t          hash;             // Hash of the entry name
+  uint32_t          ino;              // Inode number
+  off_t             off;              // Offset of the entry in the directory
+};
+
+struct Ext2DirIndex {
+  struct KListLink *names;            // Entries hashed by name
+  struct KListLink *inos;             // Entries hashed by inode number
+  size_t            nbuckets;         // The number of buckets in each table
+  uint16_t         *space;            // Largest insertable record per block
+  size_t            nblocks;          // The number of directory blocks
+};
+
+static uint32_t
+ext2_dir_index_hash(const char *name, size_t name_len)
+{
+  uint32_t hash = 0;
+
+  while (name_len-- > 0)
+    hash = hash * 31 + (unsigned char) *name++;
+
+  return hash;
+}
+
+static size_t
+ext2_dir_index_block_size(struct Inode *dir)
+{
+  return ((struct Ext2SuperblockData *) dir->fs->extra)->block_size;
+}
+
+static void
+ext2_dir_index_destroy(struct Ext2DirIndex *index)
+{
+  size_t i;
+
+  for (i = 0; i < index->nbuckets; i++) {
+    while (!k_list_is_empty(&index->names[i])) {
+      struct Ext2DirIndexEntry *entry;
+
+      entry = KLIST_CONTAINER(index->names[i].next,
+                              struct Ext2DirIndexEntry, name_link);
+      k_list_remove(&entry->name_link);
+      k_list_remove(&entry->ino_link);
+      k_free(entry);
+    }
+  }
+
+  if (index->space != NULL)
+    k_free(index->space);
+  k_free(index->inos);
+  k_free(index->names);
+  k_free(index);
+}
+
+// Add an entry to the index.
+static int
+ext2_dir_index_insert(struct Ext2DirIndex *index, const char *name,
+                      size_t name_len, uint32_t ino, off_t off)
+{
+  struct Ext2DirIndexEntry *entry;
+
+  entry = (struct Ext2DirIndexEntry *) k_malloc(sizeof(*entry));
+  if (entry == NULL)
+    return -ENOMEM;
+
+  entry->hash = ext2_dir_index_hash(name, name_len);
+  entry->ino  = ino;
+  entry->off  = off;
+
+  k_list_null(&entry->name_link);
+  k_list_null(&entry->ino_link);
+  k_list_add_back(&index->names[entry->hash % index->nbuckets],
+                  &entry->name_link);
+  k_list_add_back(&index->inos[ino % index->nbuckets], &entry->ino_link);
+
+  return 0;
+}
+
+// Make room for the given number of blocks in the free space map.
+static int
+ext2_dir_index_grow(struct Ext2DirIndex *index, size_t nblocks)
+{
+  uint16_t *space;
+
+  if (nblocks <= index->nblocks)
+    return 0;
+
+  if ((space = (uint16_t *) k_malloc(nblocks * sizeof(uint16_t))) == NULL)
+    return -ENOMEM;
+
+  if (index->space != NULL) {
+    memmove(space, index->space, index->nblocks * sizeof(uint16_t));
+    k_free(index->space);
+  }
+  memset(&space[index->nblocks], 0,
+         (nblocks - index->nblocks) * sizeof(uint16_t));
+
+  index->space   = space;
+  index->nblocks = nblocks;
+
+  return 0;
+}
+
+// Scan one directory block and record the largest record that could be
+// inserted into it. If add is non-zero, also index all entries found.
+static int
+ext2_dir_index_scan(struct Inode *dir, struct Ext2DirIndex *index,
+                    size_t block, int add)
+{
+  size_t block_size = ext2_dir_index_block_size(dir);
+  struct Ext2DirEntry de;
+  off_t off, end;
+  size_t space = 0, free_len;
+  int r;
+
+  off = (off_t) block * block_size;
+  end = MIN(off + (off_t) block_size, dir->size);
+
+  for ( ; off < end; off += de.rec_len) {
+    ext2_dirent_read(dir, &de, off);
+
+    if (de.inode == 0) {
+      free_len = de.rec_len;
+    } else {
+      free_len = de.rec_len - EXT2_DE_LEN(de.name_len);
+
+      if (add && ((r = ext2_dir_index_insert(index, de.name, de.name_len,
+                                             de.inode, off)) < 0))
+        return r;
+    }
+
+    space = MAX(space, free_len);
+  }
+
+  index->space[block] = space;
+
+  return 0;
+}
+
+// Build the index for the given directory.
+static struct Ext2DirIndex *
+ext2_dir_index_build(struct Inode *dir)
+{
+  size_t block_size = ext2_dir_index_block_size(dir);
+  struct Ext2DirIndex *index;
+  size_t i, nblocks, nbuckets;
+
+  nblocks = dir->size / block_size;
+
+  // Assume an average entry size of 32 bytes
+  nbuckets = EXT2_DIR_INDEX_MIN_BUCKETS;
+  while ((nbuckets < EXT2_DIR_INDEX_MAX_BUCKETS) &&
+         (nbuckets * EXT2_DIR_INDEX_LOAD * 32 < (size_t) dir->size))
+    nbuckets *= 2;
+
+  if ((index = (struct Ext2DirIndex *) k_malloc(sizeof(*index))) == NULL)
+    return NULL;
+
+  index->names    = (struct KListLink *) k_malloc(nbuckets * sizeof(struct KListLink));
+  index->inos     = (struct KListLink *) k_malloc(nbuckets * sizeof(struct KListLink));
+  index->nbuckets = nbuckets;
+  index->space    = NULL;
+  index->nblocks  = 0;
+
+  if ((index->names == NULL) || (index->inos == NULL)) {
+    if (index->names != NULL)
+      k_free(index->names);
+    if (index->inos != NULL)
+      k_free(index->inos);
+    k_free(index);
+    return NULL;
+  }
+
+  for (i = 0; i < nbuckets; i++) {
+    k_list_init(&index->names[i]);
+    k_list_init(&index->inos[i]);
+  }
+
+  if (ext2_dir_index_grow(index, nblocks) < 0) {
+    ext2_dir_index_destroy(index);
+    return NULL;
+  }
+
+  for (i = 0; i < nblocks; i++) {
+    if (ext2_dir_index_scan(dir, index, i, 1) < 0) {
+      ext2_dir_index_destroy(index);
+      return NULL;
+    }
+  }
+
+  return index;
+}
+
+// Get the index of the directory, building it if necessary. Returns NULL if
+// the directory is too small to be indexed or out of memory.
+static struct Ext2DirIndex *
+ext2_dir_index_get(struct Inode *dir)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+  size_t block_size = ext2_dir_index_block_size(dir);
+
+  assert(k_mutex_holding(&dir->mutex));
+  assert(S_ISDIR(dir->mode));
+
+  if (extra->dir_index != NULL)
+    return extra->dir_index;
+
+  if (dir->size < (off_t) (EXT2_DIR_INDEX_MIN_BLOCKS * block_size))
+    return NULL;
+
+  return extra->dir_index = ext2_dir_index_build(dir);
+}
+
+/**
+ * Find a directory entry by name using the index.
+ *
+ * @param dir       Pointer to the locked directory inode
+ * @param name      The name to look for
+ * @param de        Pointer to the structure to read the entry into
+ * @param off_store Pointer to the memory location to store the entry offset
+ *
+ * @retval 0       The entry was found
+ * @retval -ENOENT The directory has no entry with this name
+ * @retval -ENODEV The directory is not indexed
+ */
+int
+ext2_dir_index_lookup(struct Inode *dir, const char *name,
+                      struct Ext2DirEntry *de, off_t *off_store)
+{
+  struct Ext2DirIndex *index;
+  struct KListLink *l;
+  size_t name_len;
+  uint32_t hash;
+
+  if ((index = ext2_dir_index_get(dir)) == NULL)
+    return -ENODEV;
+
+  name_len = strlen(name);
+  hash     = ext2_dir_index_hash(name, name_len);
+
+  KLIST_FOREACH(&index->names[hash % index->nbuckets], l) {
+    struct Ext2DirIndexEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct Ext2DirIndexEntry, name_link);
+    if (entry->hash != hash)
+      continue;
+
+    ext2_dirent_read(dir, de, entry->off);
+
+    if ((de->name_len == name_len) && (strncmp(de->name, name, name_len) == 0)) {
+      *off_store = entry->off;
+      return 0;
+    }
+  }
+
+  return -ENOENT;
+}
+
+/**
+ * Find the offset of a directory entry referring to the given inode.
+ *
+ * @param dir Pointer to the locked directory inode
+ * @param ino The inode number
+ *
+ * @return The offset of the entry, or a negative value if the directory is
+ *         not indexed or has no such entry.
+ */
+off_t
+ext2_dir_index_find_ino(struct Inode *dir, uint32_t ino)
+{
+  struct Ext2DirIndex *index;
+  struct KListLink *l;
+
+  if ((index = ext2_dir_index_get(dir)) == NULL)
+    return -1;
+
+  KLIST_FOREACH(&index->inos[ino % index->nbuckets], l) {
+    struct Ext2DirIndexEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct Ext2DirIndexEntry, ino_link);
+    if (entry->ino == ino)
+      return entry->off;
+  }
+
+  return -1;
+}
+
+/**
+ * Find a directory block with enough free space to insert a record.
+ *
+ * @param dir Pointer to the locked directory inode
+ * @param len The record length
+ *
+ * @return The offset of the block, -ENOSPC if no block has enough space, or
+ *         -ENODEV if the directory is not indexed.
+ */
+off_t
+ext2_dir_index_find_space(struct Inode *dir, size_t len)
+{
+  struct Ext2DirIndex *index;
+  size_t i;
+
+  if ((index = ext2_dir_index_get(dir)) == NULL)
+    return -ENODEV;
+
+  for (i = 0; i < index->nblocks; i++)
+    if (index->space[i] >= len)
+      return (off_t) i * ext2_dir_index_block_size(dir);
+
+  return -ENOSPC;
+}
+
+/**
+ * Update the index after a new entry has been written to the directory.
+ *
+ * @param dir  Pointer to the locked directory inode
+ * @param name The entry name
+ * @param ino  The inode number
+ * @param off  Offset of the entry
+ */
+void
+ext2_dir_index_add(struct Inode *dir, const char *name, uint32_t ino, off_t off)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+  struct Ext2DirIndex *index = extra->dir_index;
+  size_t block_size = ext2_dir_index_block_size(dir);
+
+  if (index == NULL)
+    return;
+
+  if ((ext2_dir_index_insert(index, name, strlen(name), ino, off) < 0) ||
+      (ext2_dir_index_grow(index, dir->size / block_size) < 0) ||
+      (ext2_dir_index_scan(dir, index, off / block_size, 0) < 0))
+    ext2_dir_index_free(dir);
+}
+
+/**
+ * Update the index after an entry has been removed from the directory.
+ *
+ * @param dir Pointer to the locked directory inode
+ * @param ino The inode number the entry referred to
+ * @param off Offset of the entry
+ */
+void
+ext2_dir_index_remove(struct Inode *dir, uint32_t ino, off_t off)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+  struct Ext2DirIndex *index = extra->dir_index;
+  struct KListLink *l;
+
+  if (index == NULL)
+    return;
+
+  KLIST_FOREACH(&index->inos[ino % index->nbuckets], l) {
+    struct Ext2DirIndexEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct Ext2DirIndexEntry, ino_link);
+    if ((entry->ino == ino) && (entry->off == off)) {
+      k_list_remove(&entry->name_link);
+      k_list_remove(&entry->ino_link);
+      k_free(entry);
+      break;
+    }
+  }
+
+  ext2_dir_index_scan(dir, index, off / ext2_dir_index_block_size(dir), 0);
+}
+
+/**
+ * Drop the index of the directory, if any.
+ *
+ * @param dir Pointer to the directory inode
+ */
+void
+ext2_dir_index_free(struct Inode *dir)
+{
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) dir->extra;
+
+  if ((extra != NULL) && (extra->dir_index != NULL)) {
+    ext2_dir_index_destroy(extra->dir_index);
+    extra->dir_index = NULL;
+  }
+}
@@ -6,12 +6,15 @@
 #include <kernel/console.h>
 #include <kernel/fs/buf.h>
 #include <kernel/fs/fs.h>
+#include <kernel/page.h>
 #include <kernel/types.h>
 #include <kernel/vmspace.h>
 #include <kernel/process.h>
 
 #include "ext2.h"
 
+static void ext2_bmap_cache_clear(struct Ext2InodeExtra *);
+
 /**
  * @brief Get inode location on the disk
  * 
@@ -93,6 +96,8 @@ ext2_inode_read(struct Inode *inode)
   extra->blocks = raw->blocks;
   memmove(extra->block, raw->block, sizeof(extra->block));
 
+  ext2_bmap_cache_clear(extra);
+
   if (S_ISCHR(inode->mode) || S_ISBLK(inode->mode)) {
     ext2_read(inode, (uintptr_t) &inode->rdev, sizeof(inode->rdev), 0);
   }
@@ -143,6 +148,83 @@ ext2_inode_write(struct Inode *inode)
 
 #define EXT2_MAX_DIRECT_BLOCKS  12
 
+/*
+ * Resolving a block past the direct ones takes one to three indirect block
+ * reads. To avoid repeating the walk for every block during sequential I/O,
+ * each lookup that reaches an existing block also records how many of the
+ * following entries in the same indirect block point to consecutive physical
+ * blocks. The next lookups within that extent are answered from the cache.
+ *
+ * A mapping only changes when the file is truncated, which clears the cache.
+ * Allocation only fills holes, and holes are never cached, so the cached
+ * extents stay valid.
+ */
+
+static void
+ext2_bmap_cache_clear(struct Ext2InodeExtra *extra)
+{
+  unsigned i;
+
+  for (i = 0; i < EXT2_BMAP_CACHE_SIZE; i++)
+    extra->bmap[i].count = 0;
+  extra->bmap_next = 0;
+}
+
+// Find the physical block for the logical block `n` in the cache, or return 0
+static uint32_t
+ext2_bmap_cache_lookup(struct Ext2InodeExtra *extra, uint32_t n)
+{
+  unsigned i;
+
+  for (i = 0; i < EXT2_BMAP_CACHE_SIZE; i++)
+    if ((n - extra->bmap[i].logical) < extra->bmap[i].count)
+      return extra->bmap[i].physical + (n - extra->bmap[i].logical);
+
+  return 0;
+}
+
+// Remember the extent starting at the logical block `n`. `ids` points to the
+// entry for `n` in an indirect block, followed by `len - 1` more entries.
+static void
+ext2_bmap_cache_fill(struct Ext2InodeExtra *extra, uint32_t n, uint32_t *ids,
+                     uint32_t len)
+{
+  struct Ext2BlockExtent *ext;
+  uint32_t count;
+
+  for (count = 1; count < len; count++)
+    if (ids[count] != ids[0] + count)
+      break;
+
+  ext = &extra->bmap[extra->bmap_next];
+  extra->bmap_next = (extra->bmap_next + 1) % EXT2_BMAP_CACHE_SIZE;
+
+  ext->logical  = n;
+  ext->physical = ids[0];
+  ext->count    = count;
+}
+
+// Allocate a block for the inode, preferably right after the one allocated
+// most recently
+static int
+ext2_inode_block_alloc(struct Inode *inode, uint32_t *id_store)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  uint32_t goal;
+  int r;
+
+  if ((goal = extra->goal) == 0)
+    goal = EXT2_GROUP_FIRST_BLOCK(sb, inode->ino);
+
+  if ((r = ext2_block_alloc(sb, inode->dev, &extra->rsv, goal, id_store)) < 0)
+    return r;
+
+  extra->goal = *id_store + 1;
+
+  return 0;
+}
+
 uint32_t
 ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
 {
@@ -152,6 +234,7 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
   uint32_t lvl_limit, lvl_idx_mask, lvl_idx_shift;
   uint32_t id, *id_store;
   struct Ext2InodeExtra *extra = (struct Ext2InodeExtra *) inode->extra;
+  uint32_t logical = n;
   int lvl;
 
   if (n < EXT2_MAX_DIRECT_BLOCKS) {
@@ -159,7 +242,7 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
     id_store = &extra->block[n];
 
     if ((id = *id_store) == 0) {
-      if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0))
+      if (!alloc || (ext2_inode_block_alloc(inode, &id) != 0))
         return 0;
 
       *id_store = id;
@@ -171,6 +254,9 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
     return id;
   }
 
+  if ((id = ext2_bmap_cache_lookup(extra, n)) != 0)
+    return id;
+
   n -= EXT2_MAX_DIRECT_BLOCKS;
 
   lvl_limit     = (1U << shift_per_lvl);
@@ -195,7 +281,7 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
   // Get the ID of the first indirect block in the chain
   id_store = &extra->block[EXT2_MAX_DIRECT_BLOCKS + lvl];
   if ((id = *id_store) == 0) {
-    if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0))
+    if (!alloc || (ext2_inode_block_alloc(inode, &id) != 0))
       return 0;
 
     *id_store = id;
@@ -215,7 +301,7 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
     id_store += (n >> lvl_idx_shift) & lvl_idx_mask;
 
     if ((id = *id_store) == 0) {
-      if (!alloc || (ext2_block_alloc(sb, inode->dev, &id) != 0)) {
+      if (!alloc || (ext2_inode_block_alloc(inode, &id) != 0)) {
         buf_release(buf);
         return 0;
       }
@@ -225,6 +311,9 @@ ext2_inode_get_block(struct Inode *inode, uint32_t n, int alloc)
       inode->flags |= FS_INODE_DIRTY;
 
       buf->flags |= BUF_DIRTY;
+    } else if (lvl == 0) {
+      ext2_bmap_cache_fill(extra, logical, id_store,
+                           lvl_idx_mask + 1 - (n & lvl_idx_mask));
     }
     buf_release(buf);
   
@@ -281,6 +370,13 @@ ext2_trunc(struct Inode *inode, off_t length)
 
   int lvl;
 
+  ext2_bmap_cache_clear(extra);
+
+  // The reserved blocks are unlikely to be needed soon
+  ext2_rsv_discard(sb, &extra->rsv);
+  if (length == 0)
+    extra->goal = 0;
+
   // Free direct blocks
   for ( ; (n < end) && (n < EXT2_MAX_DIRECT_BLOCKS); n++) {
     if (extra->block[n] != 0) {
@@ -374,3 +470,97 @@ ext2_write(struct Inode *inode, uintptr_t va, size_t nbyte, off_t off)
 
   return total;
 }
+
+/**
+ * Read one page of regular file data directly from the disk into the page
+ * cache. Blocks that lie entirely beyond the end of the file are not read.
+ *
+ * @param inode Pointer to the locked inode
+ * @param page  Kernel address of the zero-filled page
+ * @param off   Page-aligned offset within the file
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+ext2_read_page(struct Inode *inode, void *page, off_t off)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  // Blocks are at least 1024 bytes
+  uint32_t block_ids[PAGE_SIZE / 1024];
+  unsigned n;
+  size_t i;
+
+  for (i = n = 0; (i < PAGE_SIZE) && (off + (off_t) i < inode->size); i += sb->block_size)
+    block_ids[n++] = ext2_inode_get_block(inode, (off + i) / sb->block_size, 0);
+
+  // Read all blocks at once, so that adjacent ones are merged. Zero blocks in
+  // a sparse file are skipped, the page is already filled with zeros.
+  return buf_io(block_ids, n, sb->block_size, inode->dev, page, 0);
+}
+
+/**
+ * Write a range of a cached page directly to the disk, allocating the blocks
+ * as needed. The range is extended to whole blocks, so the page must contain
+ * valid data for all of them.
+ *
+ * @param inode Pointer to the locked inode
+ * @param page  Kernel address of the cached page
+ * @param off   Page-aligned offset within the file
+ * @param start Offset of the first byte to write within the page
+ * @param end   Offset of the byte following the last one within the page
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+ext2_write_page(struct Inode *inode, const void *page, off_t off,
+                size_t start, size_t end)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  const uint8_t *data = (const uint8_t *) page;
+  // Blocks are at least 1024 bytes
+  uint32_t block_ids[PAGE_SIZE / 1024];
+  int r;
+
+  if ((r = ext2_bmap(inode, off, start, end, block_ids)) < 0)
+    return r;
+
+  start = ROUND_DOWN(start, sb->block_size);
+
+  // Write all blocks at once, so that adjacent ones are merged
+  return buf_io(block_ids, r, sb->block_size, inode->dev,
+                (void *) &data[start], 1);
+}
+
+/**
+ * Map a range of a page to disk blocks, allocating the missing ones. Used to
+ * reserve the space for data that is written back later.
+ *
+ * @param inode     Pointer to the locked inode
+ * @param off       Page-aligned offset within the file
+ * @param start     Offset of the first byte within the page
+ * @param end       Offset of the byte following the last one within the page
+ * @param block_ids Array to store the block numbers of the whole blocks
+ *                  covering the range, or NULL
+ *
+ * @return The number of blocks mapped, or -ENOSPC if out of disk space
+ */
+int
+ext2_bmap(struct Inode *inode, off_t off, size_t start, size_t end,
+          uint32_t *block_ids)
+{
+  struct Ext2SuperblockData *sb = (struct Ext2SuperblockData *) (inode->fs->extra);
+  uint32_t block_id;
+  size_t i;
+  int n;
+
+  for (i = ROUND_DOWN(start, sb->block_size), n = 0; i < end; i += sb->block_size) {
+    if ((block_id = ext2_inode_get_block(inode, (off + i) / sb->block_size, 1)) == 0)
+      return -ENOSPC;
+
+    if (block_ids != NULL)
+      block_ids[n] = block_id;
+    n++;
+  }
+
+  return n;
+}
@@ -17,7 +17,7 @@ ext2_inode_group_alloc(struct Ext2SuperblockData *sb, struct Ext2BlockGroup *gd,
   if (gd->free_inodes_count == 0)
     return -ENOMEM;
 
-  if (ext2_bitmap_alloc(sb, gd->inode_bitmap, sb->inodes_per_group, dev, istore))
+  if (ext2_bitmap_alloc(sb, gd->inode_bitmap, 0, sb->inodes_per_group, dev, istore))
     // If free_inodes_count isn't zero, but we cannot find a free inode, the
     // filesystem is corrupted.
     panic("no free inodes");
@@ -50,7 +50,8 @@ ext2_inode_init(struct Ext2SuperblockData *sb, dev_t dev, uint32_t table, uint32
 
   if (((mode & EXT2_S_IFMASK) == EXT2_S_IFBLK) ||
       ((mode & EXT2_S_IFMASK) == EXT2_S_IFCHR)) {
-    ext2_block_alloc(sb, dev, &raw->block[0]);
+    ext2_block_alloc(sb, dev, NULL, EXT2_GROUP_FIRST_BLOCK(sb, inum),
+                     &raw->block[0]);
     struct Buf *block_buf;
 
     block_buf = buf_read(raw->block[0], sb->block_size, dev);
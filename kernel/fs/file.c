@@ -41,6 +41,10 @@ file_alloc(struct File **fstore)
   f->socket    = 0;
   f->pipe      = NULL;
 
+  f->readahead.next = 0;
+  f->readahead.end  = 0;
+  f->readahead.size = 0;
+
   if (fstore != NULL)
     *fstore = f;
   
@@ -120,8 +120,6 @@ fs_open(const char *path, int oflag, mode_t mode, struct File **file_store)
       goto out2;
   }
 
-  file->node = path_node;
-
   if (oflag & O_RDONLY) {
     // TODO: check group and other permissions
     if (!(inode->mode & S_IRUSR)) {
@@ -141,6 +139,9 @@ fs_open(const char *path, int oflag, mode_t mode, struct File **file_store)
   if (oflag & O_APPEND)
     file->offset = inode->size;
 
+  file->node = path_node;
+  inode->open_count++;
+
   fs_inode_unlock(inode);
   fs_inode_put(inode);
 
@@ -160,12 +161,25 @@ out1:
 int
 fs_close(struct File *file)
 {
+  struct Inode *inode;
+
   if (file->type != FD_INODE)
     panic("not a file");
 
-  // TODO: add a comment, when node can be NULL?
-  if (file->node != NULL) 
+  // The node is NULL if fs_open() failed
+  if (file->node != NULL) {
+    inode = fs_path_inode(file->node);
+    fs_inode_lock(inode);
+
+    // Let the filesystem drop the state kept for open files only
+    if ((--inode->open_count == 0) && (inode->fs->ops->inode_close != NULL))
+      inode->fs->ops->inode_close(inode);
+
+    fs_inode_unlock(inode);
+    fs_inode_put(inode);
+
     fs_path_put(file->node);
+  }
 
   return 0;
 }
@@ -212,6 +226,7 @@ ssize_t
 fs_read(struct File *file, uintptr_t va, size_t nbytes)
 {
   struct Inode *inode;
+  off_t off;
   ssize_t r;
 
   if (file->type != FD_INODE)
@@ -223,8 +238,12 @@ fs_read(struct File *file, uintptr_t va, size_t nbytes)
   inode = fs_path_inode(file->node);
   fs_inode_lock(inode);
 
+  off = file->offset;
   r = fs_inode_read_locked(inode, va, nbytes, &file->offset);
 
+  if ((r > 0) && S_ISREG(inode->mode))
+    page_cache_readahead(inode, &file->readahead, off, r);
+
   fs_inode_unlock(inode);
   fs_inode_put(inode);
 
@@ -11,75 +11,206 @@
 #include <kernel/time.h>
 #include <kernel/fs/buf.h>
 #include <kernel/fs/fs.h>
+#include <kernel/fs/page_cache.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
 #include <kernel/process.h>
 #include <kernel/vmspace.h>
 #include <kernel/dev.h>
 
 #include "ext2.h"
 
+/*
+ * Inodes are looked up by (dev, ino) in a hash table. The cache has no fixed
+ * size limit: inodes are allocated from an object pool as needed. Once the
+ * last reference is dropped, a valid inode stays in the hash table together
+ * with its filesystem-specific data and cached pages, and is put on the LRU
+ * list. When free memory runs low, the least recently used inodes are evicted
+ * and returned to the pool.
+ *
+ * The hash table, the LRU list and the reference counters are protected by
+ * inode_cache.lock.
+ */
+
+#define INODE_CACHE_NBUCKET   256
+
+// Start evicting unused inodes when less than 1/INODE_CACHE_RESERVE of the
+// physical memory is free
+#define INODE_CACHE_RESERVE   8
+// The number of inodes to evict at once
+#define INODE_CACHE_RECLAIM   16
+
+#define INODE_CACHE_KEY(dev, ino) \
+  ((unsigned long) (ino) ^ ((unsigned long) (dev) << 16))
+
 static struct {
-  struct Inode    buf[INODE_CACHE_SIZE];
+  HASH_DECLARE(table, INODE_CACHE_NBUCKET);
+  struct KListLink lru;
   struct KSpinLock lock;
-  struct KListLink head;
 } inode_cache;
 
+static struct KObjectPool *inode_pool;
+
+static void
+fs_inode_ctor(void *ptr, size_t)
+{
+  struct Inode *ip = (struct Inode *) ptr;
+
+  k_mutex_init(&ip->mutex, "inode");
+  ip->open_count = 0;
+  k_list_null(&ip->hash_link);
+  k_list_null(&ip->cache_link);
+  k_list_init(&ip->pages);
+}
+
 void
 fs_inode_cache_init(void)
 {
-  struct Inode *ip;
-  
+  inode_pool = k_object_pool_create("inode_cache",
+                                    sizeof(struct Inode),
+                                    0,
+                                    fs_inode_ctor,
+                                    NULL);
+  if (inode_pool == NULL)
+    panic("cannot allocate inode_pool");
+
+  HASH_INIT(inode_cache.table);
+  k_list_init(&inode_cache.lru);
   k_spinlock_init(&inode_cache.lock, "inode_cache");
-  k_list_init(&inode_cache.head);
-
-  for (ip = inode_cache.buf; ip < &inode_cache.buf[INODE_CACHE_SIZE]; ip++) {
-    k_mutex_init(&ip->mutex, "inode");
-    k_list_add_back(&inode_cache.head, &ip->cache_link);
-  }
 }
 
-struct Inode *
-fs_inode_get(ino_t ino, dev_t dev)
+// Find a cached inode and take a reference to it.
+static struct Inode *
+fs_inode_cache_lookup(ino_t ino, dev_t dev)
 {
   struct KListLink *l;
-  struct Inode *ip, *empty;
 
-  k_spinlock_acquire(&inode_cache.lock);
+  assert(k_spinlock_holding(&inode_cache.lock));
 
-  empty = NULL;
-  KLIST_FOREACH(&inode_cache.head, l) {
-    ip = KLIST_CONTAINER(l, struct Inode, cache_link);
-    if ((ip->ino == ino) && (ip->dev == dev) && (ip->ref_count > 0)) {
-      ip->ref_count++;
-      // cprintf("[got %d, %d]\n", ino, ip->ref_count);
-
-      k_spinlock_release(&inode_cache.lock);
+  HASH_FOREACH_ENTRY(inode_cache.table, l, INODE_CACHE_KEY(dev, ino)) {
+    struct Inode *ip = KLIST_CONTAINER(l, struct Inode, hash_link);
 
+    if ((ip->ino == ino) && (ip->dev == dev)) {
+      if (ip->ref_count++ == 0)
+        k_list_remove(&ip->cache_link);
       return ip;
     }
+  }
+
+  return NULL;
+}
+
+// Return an inode that is no longer in the hash table to the pool.
+static void
+fs_inode_free(struct Inode *ip)
+{
+  k_mutex_lock(&ip->mutex);
+
+  // File data written since the last sync is still in the page cache
+  if (ip->flags & FS_INODE_VALID) {
+    page_cache_sync(ip);
 
-    if (ip->ref_count == 0)
-      empty = ip;
+    if (ip->flags & FS_INODE_DIRTY) {
+      ip->fs->ops->inode_write(ip);
+      ip->flags &= ~FS_INODE_DIRTY;
+    }
   }
 
-  if (empty != NULL) {
-    empty->ref_count = 1;
-    empty->ino       = ino;
-    empty->dev       = dev;
-    empty->fs        = NULL;
-    empty->flags     = 0;
+  page_cache_release(ip);
+
+  k_mutex_unlock(&ip->mutex);
+
+  if ((ip->fs != NULL) && (ip->fs->ops->inode_release != NULL))
+    ip->fs->ops->inode_release(ip);
 
-    // cprintf("[inode create %d]\n", ino);
+  k_object_pool_put(inode_pool, ip);
+}
+
+/**
+ * Evict up to n least recently used inodes that have no references.
+ *
+ * @param n The maximum number of inodes to evict
+ *
+ * @return The number of inodes evicted.
+ */
+unsigned
+fs_inode_cache_reclaim(unsigned n)
+{
+  struct Inode *ip;
+  unsigned count;
+
+  for (count = 0; count < n; count++) {
+    k_spinlock_acquire(&inode_cache.lock);
+
+    if (k_list_is_empty(&inode_cache.lru)) {
+      k_spinlock_release(&inode_cache.lock);
+      break;
+    }
+
+    // Once removed from the hash table, the inode cannot be found again
+    ip = KLIST_CONTAINER(inode_cache.lru.prev, struct Inode, cache_link);
+    k_list_remove(&ip->cache_link);
+    HASH_REMOVE(&ip->hash_link);
 
     k_spinlock_release(&inode_cache.lock);
 
-    return empty;
+    fs_inode_free(ip);
   }
 
-  // k_spinlock_release(&inode_cache.lock);
+  return count;
+}
+
+/**
+ * Get the inode with the given number, allocating a new cache entry if the
+ * inode is not cached yet. The inode contents are read on the first call to
+ * fs_inode_lock().
+ *
+ * @param ino The inode number
+ * @param dev The device the inode resides on
+ *
+ * @return Pointer to the inode, or NULL if out of memory.
+ */
+struct Inode *
+fs_inode_get(ino_t ino, dev_t dev)
+{
+  struct Inode *ip, *new_ip;
+
+  k_spinlock_acquire(&inode_cache.lock);
+  ip = fs_inode_cache_lookup(ino, dev);
+  k_spinlock_release(&inode_cache.lock);
 
-  panic("out of inodes\n");
+  if (ip != NULL)
+    return ip;
 
-  return NULL;
+  if (page_free_count < page_count / INODE_CACHE_RESERVE)
+    fs_inode_cache_reclaim(INODE_CACHE_RECLAIM);
+
+  if ((new_ip = (struct Inode *) k_object_pool_get(inode_pool)) == NULL)
+    return NULL;
+
+  new_ip->ino       = ino;
+  new_ip->dev       = dev;
+  new_ip->ref_count = 1;
+  new_ip->flags     = 0;
+  new_ip->fs        = NULL;
+  new_ip->extra     = NULL;
+
+  k_spinlock_acquire(&inode_cache.lock);
+
+  // Another thread may have added the same inode meanwhile
+  if ((ip = fs_inode_cache_lookup(ino, dev)) == NULL) {
+    HASH_PUT(inode_cache.table, &new_ip->hash_link, INODE_CACHE_KEY(dev, ino));
+    ip     = new_ip;
+    new_ip = NULL;
+  }
+
+  k_spinlock_release(&inode_cache.lock);
+
+  if (new_ip != NULL)
+    k_object_pool_put(inode_pool, new_ip);
+
+  return ip;
 }
 
 /**
@@ -99,6 +230,33 @@ fs_inode_duplicate(struct Inode *inode)
   return inode;
 }
 
+/**
+ * Increment the reference counter of the given inode, unless the inode is
+ * being evicted from the cache. The caller must make sure the inode structure
+ * stays allocated during the call.
+ * 
+ * @param inode Pointer to the inode
+ * 
+ * @return Pointer to the inode, or NULL if the inode is being evicted.
+ */
+struct Inode *
+fs_inode_try_duplicate(struct Inode *inode)
+{
+  k_spinlock_acquire(&inode_cache.lock);
+
+  if (k_list_is_null(&inode->hash_link)) {
+    k_spinlock_release(&inode_cache.lock);
+    return NULL;
+  }
+
+  if (inode->ref_count++ == 0)
+    k_list_remove(&inode->cache_link);
+
+  k_spinlock_release(&inode_cache.lock);
+
+  return inode;
+}
+
 /**
  * Release pointer to an inode.
  * 
@@ -106,39 +264,52 @@ fs_inode_duplicate(struct Inode *inode)
  */
 void
 fs_inode_put(struct Inode *inode)
-{   
+{
+  int ref_count;
+
   k_mutex_lock(&inode->mutex);
 
   if (inode->flags & FS_INODE_DIRTY)
     panic("inode dirty");
 
-  // If the link count reaches zero, delete inode from the filesystem before
-  // returning it to the cache
-  if ((inode->flags & FS_INODE_VALID) && (inode->nlink == 0)) {
-    int ref_count;
-
-    k_spinlock_acquire(&inode_cache.lock);
-    ref_count = inode->ref_count;
-    k_spinlock_release(&inode_cache.lock);
+  k_spinlock_acquire(&inode_cache.lock);
+  ref_count = inode->ref_count;
+  k_spinlock_release(&inode_cache.lock);
 
-    // If this is the last reference to this inode
-    if (ref_count == 1) {
+  // If this is the last reference to this inode
+  if (ref_count == 1) {
+    // If the link count reaches zero, delete inode from the filesystem before
+    // returning it to the cache
+    if ((inode->flags & FS_INODE_VALID) && (inode->nlink == 0)) {
       inode->fs->ops->inode_delete(inode);
       inode->flags &= ~FS_INODE_VALID;
+
+      page_cache_release(inode);
     }
   }
 
   k_mutex_unlock(&inode->mutex);
 
-  // Return the inode to the cache
   k_spinlock_acquire(&inode_cache.lock);
-  if (--inode->ref_count == 0) {
-    // cprintf("[inode drop %d]\n", inode->ino);
 
-    k_list_remove(&inode->cache_link);
-    k_list_add_front(&inode_cache.head, &inode->cache_link);
+  if (--inode->ref_count > 0) {
+    k_spinlock_release(&inode_cache.lock);
+    return;
+  }
+
+  // Keep the unused inode cached together with its data
+  if (inode->flags & FS_INODE_VALID) {
+    k_list_add_front(&inode_cache.lru, &inode->cache_link);
+    k_spinlock_release(&inode_cache.lock);
+    return;
   }
+
+  // The inode has been deleted (or never read), nothing worth keeping
+  HASH_REMOVE(&inode->hash_link);
+
   k_spinlock_release(&inode_cache.lock);
+
+  fs_inode_free(inode);
 }
 
 static int
@@ -214,7 +385,12 @@ fs_inode_read_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
   if (nbyte == 0)
     return 0;
 
-  if ((ret = ip->fs->ops->read(ip, va, nbyte, *off)) < 0)
+  if (S_ISREG(ip->mode) && (ip->fs->ops->read_page != NULL))
+    ret = page_cache_read(ip, va, nbyte, *off);
+  else
+    ret = ip->fs->ops->read(ip, va, nbyte, *off);
+
+  if (ret < 0)
     return ret;
 
   ip->atime  = time_get_seconds();
@@ -255,7 +431,10 @@ fs_inode_write_locked(struct Inode *ip, uintptr_t va, size_t nbyte, off_t *off)
   if (nbyte == 0)
     return 0;
 
-  total = ip->fs->ops->write(ip, va, nbyte, *off);
+  if (S_ISREG(ip->mode) && (ip->fs->ops->write_page != NULL))
+    total = page_cache_write(ip, va, nbyte, *off);
+  else
+    total = ip->fs->ops->write(ip, va, nbyte, *off);
 
   if (total > 0) {
     *off += total;
@@ -375,6 +554,7 @@ fs_inode_truncate_locked(struct Inode *inode, off_t length)
     return -EPERM;
 
   inode->fs->ops->trunc(inode, length);
+  page_cache_truncate(inode, length);
   
   inode->size = length;
   inode->ctime = inode->mtime = time_get_seconds();
@@ -520,10 +700,15 @@ fs_create(const char *path, mode_t mode, dev_t dev, struct PathNode **istore)
 
   dir_inode = fs_path_inode(dir);
 
+  // Keep lookups in this directory from caching the name as missing while it
+  // is being created
+  fs_path_node_lock(dir);
   fs_inode_lock(dir_inode);
 
   // (inode->ref_count): +1
   if ((r = fs_inode_create(dir_inode, name, mode, dev, &inode)) == 0) {
+    fs_path_forget(dir, name);
+
     if (istore != NULL) {
       struct PathNode *pp;
       
@@ -541,6 +726,7 @@ fs_create(const char *path, mode_t mode, dev_t dev, struct PathNode **istore)
   }
 
   fs_inode_unlock(dir_inode);
+  fs_path_node_unlock(dir);
   fs_inode_put(dir_inode);
 
   fs_path_put(dir); // (dir->ref_count): -1
@@ -594,13 +780,18 @@ fs_link(char *path1, char *path2)
   parent_inode = fs_path_inode(dirp);
   inode = fs_path_inode(pp);
 
+  fs_path_node_lock(dirp);
+
   // Always lock inodes in a specific order to avoid deadlocks
   fs_inode_lock_two(parent_inode, inode);
 
-  r = fs_inode_link(inode, parent_inode, name);
+  if ((r = fs_inode_link(inode, parent_inode, name)) == 0)
+    fs_path_forget(dirp, name);
 
   fs_inode_unlock_two(parent_inode, inode);
 
+  fs_path_node_unlock(dirp);
+
   fs_inode_put(inode);
   fs_inode_put(parent_inode);
 
@@ -849,12 +1040,23 @@ fs_inode_select_locked(struct Inode *inode, struct timeval *timeout)
 int
 fs_inode_sync_locked(struct Inode *inode)
 {
+  int r;
+
   if (!fs_inode_holding(inode))
     panic("not locked");
 
-  // TODO: implement
+  r = page_cache_sync(inode);
 
-  return 0;
+  // Update the on-disk inode now rather than on unlock, so that the metadata
+  // blocks are written back below
+  if (inode->flags & FS_INODE_DIRTY) {
+    inode->fs->ops->inode_write(inode);
+    inode->flags &= ~FS_INODE_DIRTY;
+  }
+
+  buf_sync(inode->dev);
+
+  return r;
 }
 
 int
@@ -0,0 +1,809 @@
+#include <kernel/assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <kernel/console.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/core/tick.h>
+#include <kernel/fs/fs.h>
+#include <kernel/fs/page_cache.h>
+#include <kernel/hash.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/vmspace.h>
+
+/*
+ * Cached pages are looked up by (inode, offset) in a global hash table. Each
+ * inode also keeps a list of its own pages, so that they can be written back
+ * or discarded without scanning the whole table. The page cache holds one
+ * reference to each page; every user mapping of the page holds another one.
+ *
+ * The cache has no fixed size limit: it grows as long as there is enough free
+ * memory, and the least recently used pages that are neither dirty, mapped nor
+ * in use are reclaimed once the number of free pages drops below the reserve.
+ *
+ * Written pages are not written to the filesystem immediately. Their blocks
+ * are allocated by write(), so that running out of disk space is reported to
+ * the writer, and the pages are put on the dirty list, ordered by the time
+ * they were first modified. The write-back thread periodically writes out the
+ * pages that have been dirty for too long, or the oldest ones once there are
+ * too many of them. Past a hard limit, write() writes the data through.
+ *
+ * The hash table, the LRU list, the dirty list, the inode page lists and the
+ * entry reference counts are protected by page_cache.lock. The page contents
+ * are protected by the inode mutex.
+ */
+
+#define PAGE_CACHE_NBUCKET  256
+
+// Keep at least 1/PAGE_CACHE_RESERVE of the physical memory free for others
+#define PAGE_CACHE_RESERVE  8
+// The number of pages to reclaim at once
+#define PAGE_CACHE_RECLAIM  16
+
+// Write back pages that have been dirty for longer than this (in seconds)
+#define PAGE_CACHE_DIRTY_AGE        5
+// Write back regardless of age once this many pages are dirty
+#define PAGE_CACHE_DIRTY_BACKGROUND (page_count / 64)
+// Write through once this many pages are dirty
+#define PAGE_CACHE_DIRTY_MAX        (page_count / 16)
+// How often the write-back thread checks the dirty list (in milliseconds)
+#define PAGE_CACHE_FLUSH_INTERVAL   1000
+// The maximum number of inodes written back at once
+#define PAGE_CACHE_FLUSH_BATCH      16
+
+static struct {
+  HASH_DECLARE(table, PAGE_CACHE_NBUCKET);
+  struct KListLink  lru;
+  struct KListLink  dirty;           // Dirty pages, oldest first
+  unsigned long     dirty_count;     // The number of pages on the dirty list
+  struct KSpinLock  lock;
+  struct KSemaphore flush_semaphore; // Used to wake up the write-back thread
+} page_cache;
+
+static struct KObjectPool *page_cache_pool;
+
+#define PAGE_CACHE_KEY(inode, off) \
+  (((uintptr_t) (inode) / sizeof(struct Inode)) ^ ((off) / PAGE_SIZE))
+
+// Initial and maximum read-ahead window size (in pages)
+#define PAGE_CACHE_RA_MIN   4U
+#define PAGE_CACHE_RA_MAX   32U
+// The maximum number of pending read-ahead requests
+#define PAGE_CACHE_RA_QUEUE 16
+
+static struct {
+  struct {
+    struct Inode   *inode;
+    off_t           off;
+    size_t          npages;
+  } queue[PAGE_CACHE_RA_QUEUE];
+  unsigned          head;
+  unsigned          count;
+  struct KSpinLock  lock;
+  struct KSemaphore semaphore;
+} page_cache_ra;
+
+static void page_cache_ra_thread_entry(void *);
+static void page_cache_flush_thread_entry(void *);
+
+void
+page_cache_init(void)
+{
+  struct KThread *thread;
+
+  page_cache_pool = k_object_pool_create("page_cache",
+                                         sizeof(struct PageCacheEntry),
+                                         0,
+                                         NULL,
+                                         NULL);
+  if (page_cache_pool == NULL)
+    panic("cannot allocate page_cache_pool");
+
+  HASH_INIT(page_cache.table);
+  k_list_init(&page_cache.lru);
+  k_list_init(&page_cache.dirty);
+  page_cache.dirty_count = 0;
+  k_spinlock_init(&page_cache.lock, "page_cache");
+  k_semaphore_init(&page_cache.flush_semaphore, 0);
+
+  k_spinlock_init(&page_cache_ra.lock, "page_cache_ra");
+  k_semaphore_init(&page_cache_ra.semaphore, 0);
+
+  thread = k_thread_create(NULL, page_cache_ra_thread_entry, NULL, 0);
+  if (thread == NULL)
+    panic("cannot create the read-ahead thread");
+
+  k_thread_resume(thread);
+
+  thread = k_thread_create(NULL, page_cache_flush_thread_entry, NULL, 0);
+  if (thread == NULL)
+    panic("cannot create the page cache write-back thread");
+
+  k_thread_resume(thread);
+}
+
+static struct PageCacheEntry *
+page_cache_lookup(struct Inode *inode, off_t offset)
+{
+  struct KListLink *l;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  HASH_FOREACH_ENTRY(page_cache.table, l, PAGE_CACHE_KEY(inode, offset)) {
+    struct PageCacheEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, hash_link);
+    if ((entry->inode == inode) && (entry->offset == offset)) {
+      entry->ref_count++;
+
+      // Move to the front of the LRU list
+      k_list_remove(&entry->lru_link);
+      k_list_add_front(&page_cache.lru, &entry->lru_link);
+
+      k_spinlock_release(&page_cache.lock);
+      return entry;
+    }
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  return NULL;
+}
+
+static void
+page_cache_remove_locked(struct PageCacheEntry *entry)
+{
+  assert(k_spinlock_holding(&page_cache.lock));
+  assert(entry->ref_count == 0);
+
+  HASH_REMOVE(&entry->hash_link);
+  k_list_remove(&entry->inode_link);
+  k_list_remove(&entry->lru_link);
+
+  if (!k_list_is_null(&entry->dirty_link)) {
+    k_list_remove(&entry->dirty_link);
+    page_cache.dirty_count--;
+  }
+
+  // The page may still be mapped into some address spaces
+  if (page_ref_dec(entry->page) == 0)
+    page_free_one(entry->page);
+
+  k_object_pool_put(page_cache_pool, entry);
+}
+
+/**
+ * Drop up to n least recently used pages that can be freed without writing
+ * them back. Called by the swapper when free memory runs low.
+ *
+ * @param n The maximum number of pages to drop
+ *
+ * @return The number of pages dropped.
+ */
+unsigned
+page_cache_reclaim(unsigned n)
+{
+  struct KListLink *l, *prev;
+  unsigned count = 0;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  for (l = page_cache.lru.prev; (count < n) && (l != &page_cache.lru); l = prev) {
+    struct PageCacheEntry *entry;
+
+    prev  = l->prev;
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, lru_link);
+
+    if ((entry->ref_count > 0) ||
+        (entry->flags & PAGE_CACHE_DIRTY) ||
+        (entry->page->ref_count > 1))
+      continue;
+
+    page_cache_remove_locked(entry);
+    count++;
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  return count;
+}
+
+/**
+ * Get the cached page containing the given file offset, reading it from the
+ * filesystem if necessary. The portion of the page beyond the end of the file
+ * is filled with zeros. The entry cannot be reclaimed until it is released by
+ * calling page_cache_put().
+ *
+ * @param inode       Pointer to the locked inode
+ * @param off         Offset within the file
+ * @param entry_store Pointer to the memory location to store the entry
+ *
+ * @retval 0       Success
+ * @retval -ENODEV The filesystem does not support the page cache
+ * @retval -ENOMEM Out of memory
+ */
+int
+page_cache_get(struct Inode *inode, off_t off, struct PageCacheEntry **entry_store)
+{
+  struct PageCacheEntry *entry;
+  struct Page *page;
+  int r;
+
+  assert(k_mutex_holding(&inode->mutex));
+
+  if (inode->fs->ops->read_page == NULL)
+    return -ENODEV;
+
+  off = ROUND_DOWN(off, PAGE_SIZE);
+
+  if ((entry = page_cache_lookup(inode, off)) != NULL) {
+    *entry_store = entry;
+    return 0;
+  }
+
+  if (page_free_count < page_count / PAGE_CACHE_RESERVE)
+    page_cache_reclaim(PAGE_CACHE_RECLAIM);
+
+  if ((entry = (struct PageCacheEntry *) k_object_pool_get(page_cache_pool)) == NULL)
+    return -ENOMEM;
+
+  if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_PAGE_CACHE)) == NULL) {
+    page_cache_reclaim(PAGE_CACHE_RECLAIM);
+    // Evicting unused inodes also frees their dirty pages, after writing them
+    // back
+    fs_inode_cache_reclaim(PAGE_CACHE_RECLAIM);
+
+    page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_PAGE_CACHE);
+    if (page == NULL) {
+      k_object_pool_put(page_cache_pool, entry);
+      return -ENOMEM;
+    }
+  }
+
+  if (off < inode->size) {
+    if ((r = inode->fs->ops->read_page(inode, page2kva(page), off)) < 0) {
+      page_free_one(page);
+      k_object_pool_put(page_cache_pool, entry);
+      return r;
+    }
+
+    // Whole blocks are read, clear the bytes past the end of the file
+    if (off + (off_t) PAGE_SIZE > inode->size) {
+      size_t n = inode->size - off;
+
+      memset((uint8_t *) page2kva(page) + n, 0, PAGE_SIZE - n);
+    }
+  }
+
+  page->ref_count++;
+
+  entry->inode     = inode;
+  entry->offset    = off;
+  entry->page      = page;
+  entry->flags     = 0;
+  entry->ref_count = 1;
+  k_list_null(&entry->dirty_link);
+
+  k_spinlock_acquire(&page_cache.lock);
+  HASH_PUT(page_cache.table, &entry->hash_link, PAGE_CACHE_KEY(inode, off));
+  k_list_add_back(&inode->pages, &entry->inode_link);
+  k_list_add_front(&page_cache.lru, &entry->lru_link);
+  k_spinlock_release(&page_cache.lock);
+
+  *entry_store = entry;
+
+  return 0;
+}
+
+/**
+ * Release the entry obtained by page_cache_get().
+ *
+ * @param entry Pointer to the page cache entry
+ */
+void
+page_cache_put(struct PageCacheEntry *entry)
+{
+  k_spinlock_acquire(&page_cache.lock);
+
+  assert(entry->ref_count > 0);
+  entry->ref_count--;
+
+  k_spinlock_release(&page_cache.lock);
+}
+
+/**
+ * Read data from a regular file through the page cache.
+ *
+ * @param inode Pointer to the locked inode
+ * @param va    User virtual address to copy the data to
+ * @param nbyte The number of bytes to read
+ * @param off   Offset within the file
+ *
+ * @return The number of bytes read, or a negative error code
+ */
+ssize_t
+page_cache_read(struct Inode *inode, uintptr_t va, size_t nbyte, off_t off)
+{
+  size_t total, n;
+
+  for (total = 0; total < nbyte; total += n, off += n, va += n) {
+    struct PageCacheEntry *entry;
+    size_t page_off = off % PAGE_SIZE;
+    int r;
+
+    n = MIN(nbyte - total, PAGE_SIZE - page_off);
+
+    if ((r = page_cache_get(inode, off, &entry)) < 0)
+      return r;
+
+    r = vm_space_copy_out((uint8_t *) page2kva(entry->page) + page_off, va, n);
+
+    page_cache_put(entry);
+
+    if (r < 0)
+      return r;
+  }
+
+  return total;
+}
+
+// Mark the page dirty and put it on the dirty list, unless it is already
+// there. Unless 'force' is set, refuses to do so once there are too many
+// dirty pages. Returns non-zero if the page has to be written through instead.
+static int
+page_cache_dirty_add(struct PageCacheEntry *entry, int force)
+{
+  unsigned long dirty_count;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  if (k_list_is_null(&entry->dirty_link)) {
+    if (!force && (page_cache.dirty_count >= PAGE_CACHE_DIRTY_MAX)) {
+      k_spinlock_release(&page_cache.lock);
+      k_semaphore_put(&page_cache.flush_semaphore);
+      return -1;
+    }
+
+    entry->flags     |= PAGE_CACHE_DIRTY;
+    entry->dirty_time = k_tick_get();
+    k_list_add_back(&page_cache.dirty, &entry->dirty_link);
+    page_cache.dirty_count++;
+  }
+
+  dirty_count = page_cache.dirty_count;
+
+  k_spinlock_release(&page_cache.lock);
+
+  if (dirty_count >= PAGE_CACHE_DIRTY_BACKGROUND)
+    k_semaphore_put(&page_cache.flush_semaphore);
+
+  return 0;
+}
+
+/**
+ * Mark a cached page modified, so that it is written back later. The blocks
+ * backing the page must have been allocated already.
+ *
+ * @param entry Pointer to the page cache entry
+ */
+void
+page_cache_dirty(struct PageCacheEntry *entry)
+{
+  page_cache_dirty_add(entry, 1);
+}
+
+/**
+ * Write data to a regular file through the page cache. The cached pages are
+ * updated and their blocks are allocated, but the data is written to the
+ * filesystem later, unless there are too many dirty pages already. The file
+ * size is extended as necessary.
+ *
+ * @param inode Pointer to the locked inode
+ * @param va    User virtual address to copy the data from
+ * @param nbyte The number of bytes to write
+ * @param off   Offset within the file
+ *
+ * @return The number of bytes written, or a negative error code
+ */
+ssize_t
+page_cache_write(struct Inode *inode, uintptr_t va, size_t nbyte, off_t off)
+{
+  size_t total, n;
+
+  if ((inode->fs->ops->write_page == NULL) || (inode->fs->ops->bmap == NULL))
+    return -ENODEV;
+
+  for (total = 0; total < nbyte; total += n, off += n, va += n) {
+    struct PageCacheEntry *entry;
+    size_t page_off = off % PAGE_SIZE;
+    size_t start = page_off;
+    off_t end;
+    uint8_t *data;
+    int r;
+
+    n = MIN(nbyte - total, PAGE_SIZE - page_off);
+
+    if ((r = page_cache_get(inode, off, &entry)) < 0)
+      return total ? (ssize_t) total : r;
+
+    data = (uint8_t *) page2kva(entry->page);
+
+    // Also write the zeroed bytes between the old end of file and the offset
+    if ((inode->size > entry->offset) && (inode->size < off))
+      start = inode->size - entry->offset;
+
+    // The whole page up to the end of file is written back later, allocate
+    // all of its blocks now
+    end = MIN((off_t) PAGE_SIZE,
+              MAX(inode->size, off + (off_t) n) - entry->offset);
+
+    if ((r = inode->fs->ops->bmap(inode, entry->offset, 0, end, NULL)) >= 0) {
+      r = vm_space_copy_in(data + page_off, va, n);
+
+      // Even a failed copy may have modified part of the page
+      if (page_cache_dirty_add(entry, r < 0) != 0)
+        r = inode->fs->ops->write_page(inode, data, entry->offset, start,
+                                       page_off + n);
+    }
+
+    page_cache_put(entry);
+
+    if (r < 0)
+      return total ? (ssize_t) total : r;
+
+    if (off + (off_t) n > inode->size)
+      inode->size = off + n;
+  }
+
+  return total;
+}
+
+// Take the entry off the dirty list. Unless 'keep' is set, the page is also
+// marked clean.
+static void
+page_cache_clean_locked(struct PageCacheEntry *entry, int keep)
+{
+  assert(k_spinlock_holding(&page_cache.lock));
+
+  if (!keep)
+    entry->flags &= ~PAGE_CACHE_DIRTY;
+
+  if (!k_list_is_null(&entry->dirty_link)) {
+    k_list_remove(&entry->dirty_link);
+    page_cache.dirty_count--;
+  }
+}
+
+/**
+ * Write all dirty pages of the given inode back to the filesystem.
+ *
+ * Pages that are still mapped into some address space remain dirty, since
+ * they can be modified again without notice, but are left to be written back
+ * when unmapped or synced explicitly. So are the pages that could not be
+ * written because of an error.
+ *
+ * @param inode Pointer to the locked inode
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+page_cache_sync(struct Inode *inode)
+{
+  struct KListLink *l;
+  int r, ret = 0;
+
+  assert(k_mutex_holding(&inode->mutex));
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  KLIST_FOREACH(&inode->pages, l) {
+    struct PageCacheEntry *entry;
+    size_t n;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, inode_link);
+    if (!(entry->flags & PAGE_CACHE_DIRTY))
+      continue;
+
+    // Nothing to write beyond the end of file
+    if (entry->offset >= inode->size) {
+      page_cache_clean_locked(entry, 0);
+      continue;
+    }
+
+    // Keep the entry (and thus the link to the next one) in place while
+    // writing it
+    entry->ref_count++;
+    k_spinlock_release(&page_cache.lock);
+
+    n = MIN(PAGE_SIZE, (size_t) (inode->size - entry->offset));
+
+    r = inode->fs->ops->write_page(inode, page2kva(entry->page), entry->offset,
+                                   0, n);
+
+    k_spinlock_acquire(&page_cache.lock);
+    entry->ref_count--;
+
+    if (r < 0) {
+      page_cache_clean_locked(entry, 1);
+      ret = r;
+      continue;
+    }
+
+    page_cache_clean_locked(entry, entry->page->ref_count > 1);
+
+    inode->mtime  = time_get_seconds();
+    inode->flags |= FS_INODE_DIRTY;
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  return ret;
+}
+
+/**
+ * Discard cached pages that lie entirely beyond the given file length and
+ * clear the tail of the last partial page.
+ *
+ * @param inode  Pointer to the locked inode
+ * @param length The new file length
+ */
+void
+page_cache_truncate(struct Inode *inode, off_t length)
+{
+  struct KListLink *l, *next;
+
+  assert(k_mutex_holding(&inode->mutex));
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  for (l = inode->pages.next; l != &inode->pages; l = next) {
+    struct PageCacheEntry *entry;
+
+    next  = l->next;
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, inode_link);
+
+    if (entry->offset >= length) {
+      page_cache_remove_locked(entry);
+    } else if ((entry->offset + (off_t) PAGE_SIZE) > length) {
+      size_t off = length - entry->offset;
+
+      memset((uint8_t *) page2kva(entry->page) + off, 0, PAGE_SIZE - off);
+    }
+  }
+
+  k_spinlock_release(&page_cache.lock);
+}
+
+/**
+ * Discard all cached pages of the given inode. Called when the inode is
+ * deleted or evicted from the inode cache, so none of the pages can be mapped
+ * at this point and all dirty pages have already been written back.
+ *
+ * @param inode Pointer to the locked inode
+ */
+void
+page_cache_release(struct Inode *inode)
+{
+  assert(k_mutex_holding(&inode->mutex));
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  while (!k_list_is_empty(&inode->pages)) {
+    struct PageCacheEntry *entry;
+
+    entry = KLIST_CONTAINER(inode->pages.next, struct PageCacheEntry, inode_link);
+    page_cache_remove_locked(entry);
+  }
+
+  k_spinlock_release(&page_cache.lock);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Write-back
+ * ----------------------------------------------------------------------------
+ */
+
+// Write back the dirty pages of up to PAGE_CACHE_FLUSH_BATCH inodes that have
+// pages modified no later than 'before'. Returns the number of inodes written
+// back.
+static int
+page_cache_flush(unsigned long long before)
+{
+  struct Inode *inodes[PAGE_CACHE_FLUSH_BATCH];
+  struct KListLink *l;
+  int i, n = 0;
+
+  k_spinlock_acquire(&page_cache.lock);
+
+  KLIST_FOREACH(&page_cache.dirty, l) {
+    struct PageCacheEntry *entry;
+
+    entry = KLIST_CONTAINER(l, struct PageCacheEntry, dirty_link);
+    if ((entry->dirty_time > before) || (n == PAGE_CACHE_FLUSH_BATCH))
+      break;
+
+    for (i = 0; (i < n) && (inodes[i] != entry->inode); i++)
+      ;
+    if (i < n)
+      continue;
+
+    // The entry keeps the inode allocated. Inodes being evicted write back
+    // their pages themselves.
+    if ((inodes[n] = fs_inode_try_duplicate(entry->inode)) != NULL)
+      n++;
+  }
+
+  k_spinlock_release(&page_cache.lock);
+
+  for (i = 0; i < n; i++) {
+    fs_inode_lock(inodes[i]);
+    // TODO: report I/O errors
+    page_cache_sync(inodes[i]);
+    fs_inode_unlock(inodes[i]);
+
+    fs_inode_put(inodes[i]);
+  }
+
+  return n;
+}
+
+static void
+page_cache_flush_thread_entry(void *arg)
+{
+  unsigned long long now, before;
+
+  (void) arg;
+
+  for (;;) {
+    k_semaphore_timed_get(&page_cache.flush_semaphore,
+                          ms2ticks(PAGE_CACHE_FLUSH_INTERVAL));
+
+    now = k_tick_get();
+
+    do {
+      // Too many dirty pages, write back the oldest ones regardless of age
+      if (page_cache.dirty_count >= PAGE_CACHE_DIRTY_BACKGROUND)
+        before = now;
+      else if (now > seconds2ticks(PAGE_CACHE_DIRTY_AGE))
+        before = now - seconds2ticks(PAGE_CACHE_DIRTY_AGE);
+      else
+        before = 0;
+    } while (page_cache_flush(before) == PAGE_CACHE_FLUSH_BATCH);
+  }
+}
+
+/**
+ * Write back all pages of all files that were modified before the call.
+ */
+void
+page_cache_sync_all(void)
+{
+  unsigned long long now = k_tick_get();
+
+  while (page_cache_flush(now) == PAGE_CACHE_FLUSH_BATCH)
+    ;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Read-ahead
+ * ----------------------------------------------------------------------------
+ *
+ * Each open file remembers where its last read ended. While the file is read
+ * sequentially, the read-ahead thread brings the pages that follow into the
+ * cache in the background, so that later reads find them there. Another
+ * window is requested when the reader gets within half a window of the data
+ * already read ahead. The window starts at PAGE_CACHE_RA_MIN pages and
+ * doubles with each request, up to PAGE_CACHE_RA_MAX pages. A non-sequential
+ * read resets it.
+ */
+
+/**
+ * Update the sequential access state after a read and request read-ahead if
+ * appropriate.
+ *
+ * @param inode Pointer to the locked inode
+ * @param ra    Pointer to the read-ahead state of the open file
+ * @param off   Offset the data was read from
+ * @param n     The number of bytes read
+ */
+void
+page_cache_readahead(struct Inode *inode, struct PageCacheReadahead *ra,
+                     off_t off, size_t n)
+{
+  off_t end = off + n;
+  unsigned i;
+
+  assert(k_mutex_holding(&inode->mutex));
+
+  if (inode->fs->ops->read_page == NULL)
+    return;
+
+  if (off != ra->next) {
+    ra->next = end;
+    ra->end  = 0;
+    ra->size = 0;
+    return;
+  }
+
+  ra->next = end;
+
+  if (ra->end < end) {
+    ra->end  = ROUND_UP(end, PAGE_SIZE);
+    ra->size = PAGE_CACHE_RA_MIN;
+  } else if (ra->end - end >= (off_t) (ra->size * PAGE_SIZE / 2)) {
+    return;
+  }
+
+  if (ra->end >= inode->size)
+    return;
+
+  k_spinlock_acquire(&page_cache_ra.lock);
+
+  // Read-ahead is only a hint, drop the request if the queue is full
+  if (page_cache_ra.count < PAGE_CACHE_RA_QUEUE) {
+    i = (page_cache_ra.head + page_cache_ra.count++) % PAGE_CACHE_RA_QUEUE;
+
+    page_cache_ra.queue[i].inode  = fs_inode_duplicate(inode);
+    page_cache_ra.queue[i].off    = ra->end;
+    page_cache_ra.queue[i].npages = ra->size;
+
+    k_semaphore_put(&page_cache_ra.semaphore);
+  }
+
+  k_spinlock_release(&page_cache_ra.lock);
+
+  ra->end += ra->size * PAGE_SIZE;
+  ra->size = MIN(ra->size * 2, PAGE_CACHE_RA_MAX);
+}
+
+static void
+page_cache_ra_thread_entry(void *arg)
+{
+  struct PageCacheEntry *entry;
+  struct Inode *inode;
+  size_t npages;
+  off_t off;
+
+  (void) arg;
+
+  for (;;) {
+    k_semaphore_get(&page_cache_ra.semaphore);
+
+    k_spinlock_acquire(&page_cache_ra.lock);
+
+    assert(page_cache_ra.count > 0);
+
+    inode  = page_cache_ra.queue[page_cache_ra.head].inode;
+    off    = page_cache_ra.queue[page_cache_ra.head].off;
+    npages = page_cache_ra.queue[page_cache_ra.head].npages;
+
+    page_cache_ra.head = (page_cache_ra.head + 1) % PAGE_CACHE_RA_QUEUE;
+    page_cache_ra.count--;
+
+    k_spinlock_release(&page_cache_ra.lock);
+
+    // Lock the inode for one page at a time, so that the reader can consume
+    // the pages that are already there
+    for ( ; npages > 0; npages--, off += PAGE_SIZE) {
+      fs_inode_lock(inode);
+
+      if (off >= inode->size) {
+        fs_inode_unlock(inode);
+        break;
+      }
+
+      if (page_cache_get(inode, off, &entry) == 0)
+        page_cache_put(entry);
+
+      fs_inode_unlock(inode);
+    }
+
+    fs_inode_put(inode);
+  }
+}
@@ -8,6 +8,7 @@
 
 #include <kernel/console.h>
 #include <kernel/fs/fs.h>
+#include <kernel/hash.h>
 #include <kernel/object_pool.h>
 #include <kernel/process.h>
 #include <kernel/types.h>
@@ -20,6 +21,49 @@ struct PathNode *fs_root;
 static struct KObjectPool *fs_path_pool;
 static struct KSpinLock fs_path_lock = K_SPINLOCK_INITIALIZER("fs_path");
 
+/*
+ * Path nodes are looked up by (parent, name) in a hash table. A node that is
+ * referenced only by its parent stays cached on the LRU list, and the least
+ * recently used such nodes are evicted once there are more than
+ * FS_PATH_CACHE_MAX of them. Lookups of names that do not exist leave behind
+ * negative nodes (with no inode), so that repeated lookups of the same missing
+ * name do not have to search the directory again. Negative nodes are dropped
+ * when the name is created, with the parent node locked to keep lookups from
+ * racing with the creation.
+ *
+ * The hash buckets and the statistics are protected by one of several
+ * spinlocks, selected by the bucket index. The reference counts, the tree
+ * links and the LRU list are protected by fs_path_lock, which is always
+ * acquired after the bucket lock. Nodes are only removed from the hash table
+ * while holding both locks. A node being evicted has no references and is
+ * skipped by lookups.
+ */
+
+#define FS_PATH_NBUCKET     256
+#define FS_PATH_NLOCK       16
+
+// Maximum number of unused nodes to keep cached
+#define FS_PATH_CACHE_MAX   1024
+
+#define FS_PATH_KEY(parent, hash) \
+  (((uintptr_t) (parent) / sizeof(struct PathNode)) ^ (hash))
+
+static struct {
+  HASH_DECLARE(table, FS_PATH_NBUCKET);
+  struct {
+    struct KSpinLock lock;
+    unsigned long    hits;
+    unsigned long    negative_hits;
+    unsigned long    misses;
+  } shards[FS_PATH_NLOCK];
+
+  struct KListLink lru;
+  unsigned long    unused;
+} fs_path_cache;
+
+// Get the spinlock protecting the hash bucket for the given key
+#define FS_PATH_SHARD(key)  (&fs_path_cache.shards[(key) % FS_PATH_NLOCK])
+
 static void
 fs_path_node_ctor(void *ptr, size_t n)
 {
@@ -30,6 +74,8 @@ fs_path_node_ctor(void *ptr, size_t n)
   path_node->ref_count = 0;
   k_list_init(&path_node->children);
   k_list_null(&path_node->siblings);
+  k_list_null(&path_node->hash_link);
+  k_list_null(&path_node->lru_link);
   k_mutex_init(&path_node->mutex, "path_node");
 }
 
@@ -46,31 +92,164 @@ fs_path_node_dtor(void *ptr, size_t n)
   assert(!k_mutex_holding(&path_node->mutex));
 }
 
+static unsigned long
+fs_path_name_hash(const char *name)
+{
+  unsigned long hash = 0;
+
+  while (*name != '\0')
+    hash = hash * 31 + (unsigned char) *name++;
+
+  return hash;
+}
+
+// Take a reference to a node, removing it from the LRU list if necessary.
+static void
+fs_path_hold_locked(struct PathNode *path)
+{
+  assert(k_spinlock_holding(&fs_path_lock));
+
+  path->ref_count++;
+
+  if (!k_list_is_null(&path->lru_link)) {
+    k_list_remove(&path->lru_link);
+    fs_path_cache.unused--;
+  }
+}
+
+// Drop a reference to a node. Returns non-zero if that was the last reference
+// and the node must be freed.
+static int
+fs_path_unref_locked(struct PathNode *path)
+{
+  assert(k_spinlock_holding(&fs_path_lock));
+
+  if (--path->ref_count == 0) {
+    if (path->parent != NULL)
+      panic("path in bad state");
+    return 1;
+  }
+
+  // Only the link from the parent node is left, keep the node cached
+  if ((path->ref_count == 1) && !k_list_is_null(&path->siblings)) {
+    k_list_add_front(&fs_path_cache.lru, &path->lru_link);
+    fs_path_cache.unused++;
+  }
+
+  return 0;
+}
+
+// Unlink a node from the hash table and from its parent. Both the bucket lock
+// and fs_path_lock must be held. Returns the parent node if it has to be freed.
+static struct PathNode *
+fs_path_unlink_locked(struct PathNode *path)
+{
+  struct PathNode *parent = path->parent;
+
+  assert(k_spinlock_holding(&fs_path_lock));
+
+  HASH_REMOVE(&path->hash_link);
+  k_list_remove(&path->siblings);
+  path->parent = NULL;
+
+  return fs_path_unref_locked(parent) ? parent : NULL;
+}
+
+static void
+fs_path_free(struct PathNode *path)
+{
+  // cprintf("[drop %s]\n", path->name);
+
+  if (path->mounted != NULL)
+    panic("TODO: drop mountpoint");
+
+  if (path->inode != NULL)
+    fs_inode_put(path->inode);
+
+  k_object_pool_put(fs_path_pool, path);
+}
+
+// Evict an unused node. Called with fs_path_lock held, which is released.
+static void
+fs_path_evict_locked(struct PathNode *path)
+{
+  unsigned long key = FS_PATH_KEY(path->parent, path->hash);
+  struct PathNode *parent;
+
+  assert(path->ref_count == 1);
+
+  k_list_remove(&path->lru_link);
+  fs_path_cache.unused--;
+
+  // Lookups skip nodes with no references, so the node cannot be picked up
+  // again while the locks are reacquired
+  path->ref_count = 0;
+
+  k_spinlock_release(&fs_path_lock);
+
+  k_spinlock_acquire(&FS_PATH_SHARD(key)->lock);
+  k_spinlock_acquire(&fs_path_lock);
+
+  parent = fs_path_unlink_locked(path);
+
+  k_spinlock_release(&fs_path_lock);
+  k_spinlock_release(&FS_PATH_SHARD(key)->lock);
+
+  fs_path_free(path);
+  if (parent != NULL)
+    fs_path_free(parent);
+}
+
+// Evict the least recently used nodes until the cache is within its limit.
+static void
+fs_path_cache_trim(void)
+{
+  k_spinlock_acquire(&fs_path_lock);
+
+  while (fs_path_cache.unused > FS_PATH_CACHE_MAX) {
+    fs_path_evict_locked(KLIST_CONTAINER(fs_path_cache.lru.prev,
+                                         struct PathNode, lru_link));
+    k_spinlock_acquire(&fs_path_lock);
+  }
+
+  k_spinlock_release(&fs_path_lock);
+}
+
 struct PathNode *
 fs_path_node_create(const char *name, struct Inode *inode,
                     struct PathNode *parent)
 {
   struct PathNode *path;
+  unsigned long key;
 
   if ((path = (struct PathNode *) k_object_pool_get(fs_path_pool)) == NULL)
     return NULL;
 
   if (name != NULL)
     strncpy(path->name, name, NAME_MAX);
+  path->name[NAME_MAX] = '\0';
 
   path->inode  = inode;
   path->parent = parent;
+  path->hash   = fs_path_name_hash(path->name);
   path->ref_count++;
 
   if (parent) {
+    key = FS_PATH_KEY(parent, path->hash);
+
+    k_spinlock_acquire(&FS_PATH_SHARD(key)->lock);
     k_spinlock_acquire(&fs_path_lock);
   
-    parent->ref_count++;
+    fs_path_hold_locked(parent);
     
     k_list_add_front(&parent->children, &path->siblings);
     path->ref_count++;
 
     k_spinlock_release(&fs_path_lock);
+
+    HASH_PUT(fs_path_cache.table, &path->hash_link, key);
+
+    k_spinlock_release(&FS_PATH_SHARD(key)->lock);
   }
 
   //cprintf("[create %s %d]\n", name, path->ref_count);
@@ -82,7 +261,7 @@ struct PathNode *
 fs_path_duplicate(struct PathNode *path)
 {
   k_spinlock_acquire(&fs_path_lock);
-  path->ref_count++;
+  fs_path_hold_locked(path);
   k_spinlock_release(&fs_path_lock);
 
   // cprintf("[dup %s]\n", path);
@@ -93,12 +272,32 @@ fs_path_duplicate(struct PathNode *path)
 int
 fs_path_mount(struct PathNode *path, struct Inode *inode)
 {
+  struct KListLink *l;
+
   if (path->mounted)
     panic("already mounted");
 
   path->mounted = inode;
 
-  // TODO: remove all cached entries???
+  // Drop the unused (in particular, negative) entries cached for the
+  // directory being covered
+  k_spinlock_acquire(&fs_path_lock);
+
+  for (;;) {
+    KLIST_FOREACH(&path->children, l)
+      if (!k_list_is_null(&KLIST_CONTAINER(l, struct PathNode, siblings)->lru_link))
+        break;
+
+    if (l == &path->children)
+      break;
+
+    fs_path_evict_locked(KLIST_CONTAINER(l, struct PathNode, siblings));
+    k_spinlock_acquire(&fs_path_lock);
+  }
+
+  k_spinlock_release(&fs_path_lock);
+
+  // TODO: entries still in use remain visible
 
   return 0;
 }
@@ -106,70 +305,92 @@ fs_path_mount(struct PathNode *path, struct Inode *inode)
 void
 fs_path_remove(struct PathNode *path)
 {
+  unsigned long key;
+  struct PathNode *parent = NULL;
+
+  // The node is referenced by the caller, so it cannot be evicted meanwhile
+  key = FS_PATH_KEY(path->parent, path->hash);
+
+  k_spinlock_acquire(&FS_PATH_SHARD(key)->lock);
   k_spinlock_acquire(&fs_path_lock);
 
   if (path->parent) {
-    path->parent->ref_count--;
-    path->parent = NULL;
+    parent = fs_path_unlink_locked(path);
+    path->ref_count--;
   }
 
-  k_list_remove(&path->siblings);
-  path->ref_count--;
-
   k_spinlock_release(&fs_path_lock);
+  k_spinlock_release(&FS_PATH_SHARD(key)->lock);
+
+  if (parent != NULL)
+    fs_path_free(parent);
 }
 
+/**
+ * Drop the negative entry for the given name, if any, even if a concurrent
+ * lookup still holds it. Called after the name has been created, with the
+ * parent node locked.
+ *
+ * @param parent Pointer to the parent node
+ * @param name   The name that has been created
+ */
 void
-fs_path_put(struct PathNode *path)
+fs_path_forget(struct PathNode *parent, const char *name)
 {
-  k_spinlock_acquire(&fs_path_lock);
-
-  path->ref_count--;
-
-  // cprintf("[put %s %d]\n", path->name, path->ref_count);
+  unsigned long hash = fs_path_name_hash(name);
+  unsigned long key = FS_PATH_KEY(parent, hash);
+  struct PathNode *path = NULL;
+  struct KListLink *l;
 
-  if ((path->ref_count == 0) && (path->parent != NULL))
-    panic("path in bad state");
+  k_spinlock_acquire(&FS_PATH_SHARD(key)->lock);
+  k_spinlock_acquire(&fs_path_lock);
 
-  // Move up the tree and remove all unused nodes. A node is considered unused
-  // in one of two cases:
-  // a) the reference count is 0
-  // b) the reference count is 1, and it's referenced only by the parent node
-  // TODO: parent of unmounted entry??
-  while ((path != NULL) && (path->ref_count < 2)) {
-    struct PathNode *parent = path->parent;
+  HASH_FOREACH_ENTRY(fs_path_cache.table, l, key) {
+    path = KLIST_CONTAINER(l, struct PathNode, hash_link);
 
-    if ((path->ref_count == 1) && (parent == NULL))
-      // Only one link left, and this is not the parent node
+    if ((path->parent == parent) && (path->hash == hash) &&
+        (path->inode == NULL) && (path->ref_count > 0) &&
+        (strcmp(path->name, name) == 0))
       break;
 
-    if (parent) {
-      assert(path->ref_count == 1);
-      k_list_remove(&path->siblings);
-      path->ref_count--;
+    path = NULL;
+  }
+
+  if (path != NULL) {
+    if (!k_list_is_null(&path->lru_link)) {
+      k_list_remove(&path->lru_link);
+      fs_path_cache.unused--;
     }
 
-    k_spinlock_release(&fs_path_lock);
+    // The caller holds a reference to the parent
+    fs_path_unlink_locked(path);
 
-    // cprintf("[drop %s %d]\n", path->name, path->inode->ino);
+    // A lookup that has just found the entry may still hold a reference, and
+    // frees the node when it drops it
+    if (--path->ref_count > 0)
+      path = NULL;
+  }
 
-    if (path->mounted != NULL)
-      panic("TODO: drop mountpoint");
+  k_spinlock_release(&fs_path_lock);
+  k_spinlock_release(&FS_PATH_SHARD(key)->lock);
 
-    if (path->inode != NULL)
-      fs_inode_put(path->inode);
+  if (path != NULL)
+    fs_path_free(path);
+}
 
-    k_object_pool_put(fs_path_pool, path);
-    
-    k_spinlock_acquire(&fs_path_lock);
+void
+fs_path_put(struct PathNode *path)
+{
+  int last;
 
-    if (parent)
-      parent->ref_count--;
+  k_spinlock_acquire(&fs_path_lock);
+  last = fs_path_unref_locked(path);
+  k_spinlock_release(&fs_path_lock);
 
-    path = parent;
-  }
+  // cprintf("[put %s %d]\n", path->name, path->ref_count);
 
-  k_spinlock_release(&fs_path_lock);
+  if (last)
+    fs_path_free(path);
 }
 
 struct Inode *
@@ -185,7 +406,7 @@ fs_path_inode(struct PathNode *node)
 }
 
 void
-fs_fs_path_node_lock(struct PathNode *node)
+fs_path_node_lock(struct PathNode *node)
 {
   if ((node->ref_count == 1) && (node->parent != NULL))
     panic("bad path node reference");
@@ -232,31 +453,78 @@ fs_path_next(const char *path, char *name_buf, char **result)
   return n;
 }
 
+// Find a cached child node (possibly, a negative one) and take a reference
+// to it.
 static struct PathNode *
 fs_path_lookup_cached(struct PathNode *parent, const char *name)
 {
+  unsigned long hash = fs_path_name_hash(name);
+  unsigned long key = FS_PATH_KEY(parent, hash);
   struct KListLink *l;
 
-  // TODO: this is a bottleneck! 
-  // if there are many child nodes, comparing all names may take too long, and
-  // we're blocking the entire system. Could we use a per-node mutex instead?
-
-  k_spinlock_acquire(&fs_path_lock);
+  k_spinlock_acquire(&FS_PATH_SHARD(key)->lock);
 
-  KLIST_FOREACH(&parent->children, l) {
-    struct PathNode *p = KLIST_CONTAINER(l, struct PathNode, siblings);
+  HASH_FOREACH_ENTRY(fs_path_cache.table, l, key) {
+    struct PathNode *p = KLIST_CONTAINER(l, struct PathNode, hash_link);
     
-    if (strcmp(p->name, name) == 0) {
-      p->ref_count++;
+    if ((p->parent != parent) || (p->hash != hash) ||
+        (strcmp(p->name, name) != 0))
+      continue;
+
+    k_spinlock_acquire(&fs_path_lock);
+
+    // The node is being evicted
+    if (p->ref_count == 0) {
       k_spinlock_release(&fs_path_lock);
-      return p;
+      continue;
     }
+
+    fs_path_hold_locked(p);
+
+    k_spinlock_release(&fs_path_lock);
+
+    if (p->inode != NULL)
+      FS_PATH_SHARD(key)->hits++;
+    else
+      FS_PATH_SHARD(key)->negative_hits++;
+
+    k_spinlock_release(&FS_PATH_SHARD(key)->lock);
+    return p;
   }
 
-  k_spinlock_release(&fs_path_lock);
+  FS_PATH_SHARD(key)->misses++;
+
+  k_spinlock_release(&FS_PATH_SHARD(key)->lock);
   return NULL;
 }
 
+/**
+ * Get the path cache statistics.
+ *
+ * @param stat Pointer to the structure to store the statistics
+ */
+void
+fs_path_cache_stat(struct PathCacheStat *stat)
+{
+  int i;
+
+  stat->hits          = 0;
+  stat->negative_hits = 0;
+  stat->misses        = 0;
+
+  for (i = 0; i < FS_PATH_NLOCK; i++) {
+    k_spinlock_acquire(&fs_path_cache.shards[i].lock);
+    stat->hits          += fs_path_cache.shards[i].hits;
+    stat->negative_hits += fs_path_cache.shards[i].negative_hits;
+    stat->misses        += fs_path_cache.shards[i].misses;
+    k_spinlock_release(&fs_path_cache.shards[i].lock);
+  }
+
+  k_spinlock_acquire(&fs_path_lock);
+  stat->unused = fs_path_cache.unused;
+  k_spinlock_release(&fs_path_lock);
+}
+
 int
 fs_path_lookup_at(struct PathNode *start,
                   const char *path,
@@ -265,12 +533,14 @@ fs_path_lookup_at(struct PathNode *start,
                   struct PathNode **store,
                   struct PathNode **parent_store)
 {
-  struct PathNode *parent, *current;
+  struct PathNode *parent, *current, *negative;
   int r;
 
   if (*path == '\0')
     return -ENOENT;
 
+  fs_path_cache_trim();
+
   // For absolute paths, begin search from the root directory.
   // For relative paths, begin search from the specifed starting directory.
   current = fs_path_duplicate(*path == '/' ? fs_root : start);
@@ -289,7 +559,7 @@ fs_path_lookup_at(struct PathNode *start,
     parent  = current;
     current = NULL;
 
-    fs_fs_path_node_lock(parent);
+    fs_path_node_lock(parent);
 
     // Move to the parent directory
     if (strcmp(name_buf, "..") == 0) {
@@ -308,7 +578,16 @@ fs_path_lookup_at(struct PathNode *start,
 
     if ((current = fs_path_lookup_cached(parent, name_buf)) != NULL) {
       fs_path_node_unlock(parent);
-      continue;
+
+      if (current->inode != NULL)
+        continue;
+
+      // The name is known not to exist
+      fs_path_put(current);
+      current = NULL;
+
+      r = (*path == '\0') ? 0 : -ENOENT;
+      break;
     }
 
     parent_inode = fs_path_inode(parent);
@@ -326,6 +605,11 @@ fs_path_lookup_at(struct PathNode *start,
       }
     } else {
       current = NULL;
+
+      // Remember that the name does not exist
+      if ((r == 0) &&
+          ((negative = fs_path_node_create(name_buf, NULL, parent)) != NULL))
+        fs_path_put(negative);
     }
 
     fs_path_node_unlock(parent);
@@ -400,8 +684,15 @@ fs_lookup_inode(const char *path, int flags, struct Inode **inode_store)
 void
 fs_init(void)
 { 
+  int i;
+
   fs_inode_cache_init();
 
+  HASH_INIT(fs_path_cache.table);
+  for (i = 0; i < FS_PATH_NLOCK; i++)
+    k_spinlock_init(&fs_path_cache.shards[i].lock, "fs_path_cache");
+  k_list_init(&fs_path_cache.lru);
+
   fs_path_pool = k_object_pool_create("fs_path_pool",
                                       sizeof(struct PathNode),
                                       0,
@@ -0,0 +1,58 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_BLOCK_H__
+#define __KERNEL_INCLUDE_KERNEL_BLOCK_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/block.h
+ *
+ * Block device request queues.
+ */
+
+#include <stddef.h>
+
+#include <kernel/core/list.h>
+#include <kernel/spinlock.h>
+
+struct Buf;
+
+/** The unit of block device addressing, in bytes */
+#define BLOCK_SECTOR_SIZE   512
+
+/**
+ * A batch of buffers transferred by a single device command. The buffers are
+ * linked through their queue_link fields, physically adjacent and in
+ * ascending order, and are either all read or all written.
+ */
+struct BlockRequest {
+  struct KListLink    bufs;             ///< The buffers to transfer
+  unsigned long       sector;           ///< The first sector
+  size_t              nsectors;         ///< The total number of sectors
+  int                 write;            ///< Non-zero to write, zero to read
+};
+
+/**
+ * A block device together with its queue of pending requests.
+ */
+struct BlockDev {
+  /** Start transferring the batch; block_complete() is called when done */
+  void              (*start)(struct BlockDev *, struct BlockRequest *);
+  void               *ctx;              ///< Driver-specific data
+  size_t              max_sectors;      ///< Maximum sectors in one batch
+  struct KSpinLock    lock;             ///< Protects the fields below
+  struct KListLink    pending;          ///< Pending buffers, sorted by sector
+  struct BlockRequest request;          ///< The batch being transferred
+  int                 busy;             ///< Whether a batch is in progress
+  unsigned long       next_sector;      ///< Current elevator position
+};
+
+void block_dev_init(struct BlockDev *,
+                    void (*)(struct BlockDev *, struct BlockRequest *),
+                    void *, size_t);
+void block_submit(struct Buf *, void (*)(struct Buf *, void *), void *);
+void block_wait(struct Buf *);
+void block_complete(struct BlockDev *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_BLOCK_H__
@@ -0,0 +1,17 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_COMPACT_H__
+#define __KERNEL_INCLUDE_KERNEL_COMPACT_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/compact.h
+ *
+ * Compacting physical memory to reassemble high-order free blocks.
+ */
+
+void compact_init(void);
+void compact_wakeup(void);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_COMPACT_H__
@@ -0,0 +1,42 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
+#define __KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
+
+/**
+ * @file
+ *
+ * Intrusive red-black tree implementation.
+ *
+ * The tree does not compare keys itself: to insert a node, the caller walks
+ * down from the root to find the parent and the child link to attach the new
+ * node to, and then calls k_rbtree_insert() to rebalance the tree.
+ *
+ * Optionally, each node may keep data computed from its subtree (e.g. the
+ * maximum of some value). The augment callback recomputes this data for a
+ * single node from the node itself and its children, and is invoked whenever
+ * the subtree of a node changes.
+ */
+
+#include <stddef.h>
+
+struct KRBNode {
+  struct KRBNode *parent;
+  struct KRBNode *left;
+  struct KRBNode *right;
+  int             color;
+};
+
+struct KRBTree {
+  struct KRBNode  *root;
+  void           (*augment)(struct KRBNode *);
+};
+
+#define KRB_CONTAINER(node, type, member) \
+  ((type *) ((size_t) (node) - offsetof(type, member)))
+
+void k_rbtree_init(struct KRBTree *, void (*)(struct KRBNode *));
+void k_rbtree_insert(struct KRBTree *, struct KRBNode *, struct KRBNode **,
+                     struct KRBNode *);
+void k_rbtree_remove(struct KRBTree *, struct KRBNode *);
+void k_rbtree_update(struct KRBTree *, struct KRBNode *);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_CORE_RBTREE_H__
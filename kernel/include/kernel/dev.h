@@ -3,7 +3,7 @@
 
 #include <sys/types.h>
 
-struct Buf;
+struct BlockDev;
 struct timeval;
 
 struct CharDev {
@@ -13,10 +13,6 @@ struct CharDev {
   int     (*select)(dev_t, struct timeval *);
 };
 
-struct BlockDev {
-  void    (*request)(struct Buf *);
-};
-
 struct CharDev  *dev_lookup_char(dev_t);
 void             dev_register_char(int, struct CharDev *);
 
@@ -3,11 +3,12 @@
 
 #include <stdint.h>
 
-#include <kernel/core/list.h>
-#include <kernel/spinlock.h>
+#include <kernel/block.h>
+#include <kernel/core/semaphore.h>
 
 #define SD_BLOCKLEN               512         // Single block length in bytes
 #define SD_BLOCKLEN_LOG           9           // log2 of SD_BLOCKLEN
+#define SD_MAX_BLOCKS             64          // Maximum blocks per transfer
 
 // Response types
 #define SD_RESPONSE_R1            1
@@ -17,24 +18,20 @@
 #define SD_RESPONSE_R6            7
 #define SD_RESPONSE_R7            8
 
-struct Buf;
-
 struct SDOps {
   int  (*send_cmd)(void *, uint32_t, uint32_t, int, uint32_t *);
-  int  (*irq_enable)(void *);
   int  (*begin_transfer)(void *, uint32_t, int);
   int  (*receive_data)(void *, void *, size_t);
   int  (*send_data)(void *, const void *, size_t);
 };
 
 struct SD {
-  struct KListLink queue;
-  struct KSpinLock lock;
+  struct BlockDev dev;
+  struct KSemaphore semaphore;
   struct SDOps *ops;
   void *ctx;
 };
 
-int  sd_init(struct SD *, struct SDOps *, void *, int);
-void sd_request(struct SD *, struct Buf *);
+int  sd_init(struct SD *, struct SDOps *, void *);
 
 #endif  // !__KERNEL_DRIVERS_SD_H__
@@ -28,8 +28,13 @@ struct Buf {
   dev_t            dev;               ///< ID of the device this block belongs to
   int              flags;             ///< Status flags
   int              ref_count;         ///< The number of references to the block
-  struct KListLink  cache_link;        ///< Link into the buf cache
-  struct KListLink  queue_link;        ///< Link into the driver queue
+  struct KListLink  hash_link;         ///< Link into the buf cache hash table
+  struct KListLink  lru_link;          ///< Link into the list of unused buffers
+  struct KListLink  dirty_link;        ///< Link into the list of dirty buffers
+  unsigned long long dirty_time;       ///< When the buffer became dirty (ticks)
+  struct KListLink  queue_link;        ///< Link into the device queue
+  void            (*done)(struct Buf *, void *);  ///< I/O completion callback
+  void             *done_arg;          ///< Argument for the callback
   struct KWaitQueue wait_queue;      ///< Processes waiting for the block data
   struct KMutex    mutex;             ///< Mutex protecting the block data
   size_t           block_size;        ///< Must be BLOCK_SIZE
@@ -40,9 +45,26 @@ struct Buf {
 #define BUF_VALID   (1 << 0)  ///< Buffer has been read from the disk
 #define BUF_DIRTY   (1 << 1)  ///< Buffer needs to be written to the disk
 
+/**
+ * Buffer cache statistics.
+ */
+struct BufCacheStat {
+  unsigned long    size;              ///< The number of buffers allocated
+  unsigned long    hits;              ///< Lookups that found the block cached
+  unsigned long    misses;            ///< Lookups that had to read the block
+  unsigned long    evictions;         ///< Buffers reused for another block
+  unsigned long    dirty;             ///< Buffers waiting to be written back
+};
+
 void        buf_init(void);
 struct Buf *buf_read(unsigned, size_t, dev_t);
 void        buf_write(struct Buf *);
 void        buf_release(struct Buf *);
+void        buf_sync(dev_t);
+void        buf_sync_all(void);
+int         buf_io(const uint32_t *, unsigned, size_t, dev_t, void *, int);
+int         buf_io_reserved(const uint32_t *, unsigned, size_t, dev_t, void *,
+                            int);
+void        buf_cache_stat(struct BufCacheStat *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_FS_BUF_H__
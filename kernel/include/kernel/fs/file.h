@@ -7,6 +7,8 @@
 
 #include <sys/types.h>
 
+#include <kernel/fs/page_cache.h>
+
 struct Inode;
 struct stat;
 struct Pipe;
@@ -23,6 +25,7 @@ struct File {
   struct PathNode *node;        ///< Pointer to the corresponding inode
   int              socket;       ///< Socket ID
   struct Pipe     *pipe;         ///< Pointer to the correspondig pipe
+  struct PageCacheReadahead readahead;  ///< Read-ahead state
 };
 
 int          file_alloc(struct File **);
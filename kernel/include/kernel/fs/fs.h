@@ -13,8 +13,6 @@
 #include <kernel/core/list.h>
 #include <kernel/mutex.h>
 
-#define INODE_CACHE_SIZE  32
-
 struct stat;
 struct File;
 struct FS;
@@ -24,8 +22,9 @@ struct Inode {
   ino_t           ino;
   dev_t           dev;
 
-  // These two fields are protected by inode_cache.lock
+  // These fields are protected by inode_cache.lock
   int             ref_count;
+  struct KListLink hash_link;
   struct KListLink cache_link;
 
   struct KMutex   mutex;
@@ -41,13 +40,19 @@ struct Inode {
   time_t          mtime;
   time_t          ctime;
   dev_t           rdev;
+  // The number of open files referring to the inode
+  int             open_count;
 
   struct FS      *fs;
   void           *extra;
+
+  // Cached pages of file data (see page_cache.h)
+  struct KListLink pages;
 };
 
 struct PathNode {
   char            name[NAME_MAX + 1];
+  unsigned long   hash;
   int             ref_count;
 
   struct KMutex   mutex;
@@ -56,10 +61,25 @@ struct PathNode {
   struct KListLink children;
   struct KListLink siblings;
 
+  // Links into the path cache (see path.c)
+  struct KListLink hash_link;
+  struct KListLink lru_link;
+
+  // NULL for a negative entry, i.e. a name known not to exist
   struct Inode   *inode;
   struct Inode   *mounted;
 };
 
+/**
+ * Path cache statistics.
+ */
+struct PathCacheStat {
+  unsigned long    unused;            ///< Cached nodes not in use
+  unsigned long    hits;              ///< Lookups that found the name cached
+  unsigned long    negative_hits;     ///< Lookups of names known not to exist
+  unsigned long    misses;            ///< Lookups that had to search the directory
+};
+
 typedef int (*FillDirFunc)(void *, ino_t, const char *, size_t);
 
 struct FSOps {
@@ -67,8 +87,13 @@ struct FSOps {
   int             (*inode_read)(struct Inode *);
   int             (*inode_write)(struct Inode *);
   void            (*inode_delete)(struct Inode *);
+  void            (*inode_release)(struct Inode *);
+  void            (*inode_close)(struct Inode *);
   ssize_t         (*read)(struct Inode *, uintptr_t, size_t, off_t);
   ssize_t         (*write)(struct Inode *, uintptr_t, size_t, off_t);
+  int             (*read_page)(struct Inode *, void *, off_t);
+  int             (*write_page)(struct Inode *, const void *, off_t, size_t, size_t);
+  int             (*bmap)(struct Inode *, off_t, size_t, size_t, uint32_t *);
   int             (*rmdir)(struct Inode *, struct Inode *);
   ssize_t         (*readdir)(struct Inode *, void *, FillDirFunc, off_t);
   ssize_t         (*readlink)(struct Inode *, char *, size_t);
@@ -110,6 +135,7 @@ int           fs_set_pwd(struct PathNode *);
 struct Inode *fs_inode_get(ino_t ino, dev_t dev);
 void          fs_inode_put(struct Inode *);
 struct Inode *fs_inode_duplicate(struct Inode *);
+struct Inode *fs_inode_try_duplicate(struct Inode *);
 void          fs_inode_lock(struct Inode *);
 int           fs_inode_access(struct Inode *, int);
 void          fs_inode_unlock(struct Inode *);
@@ -122,6 +148,7 @@ ssize_t       fs_inode_getdents(struct Inode *, void *, size_t, off_t *);
 int           fs_inode_stat_locked(struct Inode *, struct stat *);
 int           fs_create(const char *, mode_t, dev_t, struct PathNode **);
 void          fs_inode_cache_init(void);
+unsigned      fs_inode_cache_reclaim(unsigned);
 int           fs_inode_truncate_locked(struct Inode *, off_t length);
 int           fs_inode_chmod_locked(struct Inode *, mode_t);
 int           fs_inode_ioctl_locked(struct Inode *, int, int);
@@ -159,6 +186,7 @@ int              fs_fsync(struct File *);
 struct PathNode *fs_path_node_create(const char *, struct Inode *, struct PathNode *);
 struct PathNode *fs_path_duplicate(struct PathNode *);
 void             fs_path_remove(struct PathNode *);
+void             fs_path_forget(struct PathNode *, const char *);
 void             fs_path_put(struct PathNode *);
 void             fs_path_node_lock(struct PathNode *);
 void             fs_path_node_unlock(struct PathNode *);
@@ -167,5 +195,6 @@ void             fs_path_unlock_two(struct PathNode *, struct PathNode *);
 int              fs_path_mount(struct PathNode *, struct Inode *);
 int              fs_mount(const char *, const char *);
 struct Inode    *fs_path_inode(struct PathNode *);
+void             fs_path_cache_stat(struct PathCacheStat *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_FS_FS_H__
@@ -0,0 +1,64 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_FS_PAGE_CACHE_H__
+#define __KERNEL_INCLUDE_KERNEL_FS_PAGE_CACHE_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/fs/page_cache.h
+ * 
+ * Per-inode cache of file contents in whole pages.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <kernel/core/list.h>
+
+struct Inode;
+struct Page;
+
+/**
+ * A single page of file data.
+ */
+struct PageCacheEntry {
+  struct KListLink  hash_link;         ///< Link into the page cache hash table
+  struct KListLink  inode_link;        ///< Link into the inode's page list
+  struct KListLink  lru_link;          ///< Link into the LRU list
+  struct KListLink  dirty_link;        ///< Link into the list of dirty pages
+  unsigned long long dirty_time;       ///< When the page became dirty (ticks)
+  struct Inode     *inode;             ///< The inode this page belongs to
+  off_t             offset;            ///< Page-aligned offset within the file
+  struct Page      *page;              ///< Physical page holding the data
+  int               flags;             ///< Status flags
+  int               ref_count;         ///< The number of active users
+};
+
+// Page cache entry status flags
+#define PAGE_CACHE_DIRTY  (1 << 0)  ///< Page needs to be written to the file
+
+/**
+ * Sequential access state of an open file, used for read-ahead.
+ */
+struct PageCacheReadahead {
+  off_t             next;              ///< Where a sequential read would start
+  off_t             end;               ///< End of the data already read ahead
+  size_t            size;              ///< Read-ahead window size (in pages)
+};
+
+void    page_cache_init(void);
+int     page_cache_get(struct Inode *, off_t, struct PageCacheEntry **);
+void    page_cache_put(struct PageCacheEntry *);
+ssize_t page_cache_read(struct Inode *, uintptr_t, size_t, off_t);
+ssize_t page_cache_write(struct Inode *, uintptr_t, size_t, off_t);
+void    page_cache_dirty(struct PageCacheEntry *);
+int     page_cache_sync(struct Inode *);
+void    page_cache_sync_all(void);
+void    page_cache_truncate(struct Inode *, off_t);
+void    page_cache_release(struct Inode *);
+unsigned page_cache_reclaim(unsigned);
+void    page_cache_readahead(struct Inode *, struct PageCacheReadahead *,
+                             off_t, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_FS_PAGE_CACHE_H__
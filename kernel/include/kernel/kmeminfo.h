@@ -0,0 +1,21 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_KMEMINFO_H__
+#define __KERNEL_INCLUDE_KERNEL_KMEMINFO_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/kmeminfo.h
+ *
+ * Kernel memory usage report.
+ */
+
+#include <stddef.h>
+
+/** The maximum size of the report in bytes (including the terminating NUL) */
+#define KMEMINFO_SIZE_MAX   16384
+
+size_t kmeminfo_print(char *, size_t);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_KMEMINFO_H__
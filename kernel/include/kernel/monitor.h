@@ -35,6 +35,9 @@ int mon_kerninfo(int, char **, struct TrapFrame *);
  */
 int mon_backtrace(int, char **, struct TrapFrame *);
 
+/**
+ * Display kernel memory usage.
+ */
 int mon_kmeminfo(int, char **, struct TrapFrame *);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_MONITOR_H__
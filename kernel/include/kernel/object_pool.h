@@ -54,6 +54,13 @@ struct KObjectPool {
   /** The color offset to be used by the next slab. */
   size_t            color_next;
 
+  /** The number of slabs allocated. */
+  unsigned          slab_count;
+  /** The number of objects in use. */
+  unsigned          used_count;
+  /** The maximum number of objects ever in use at the same time. */
+  unsigned          peak_count;
+
   /** Link into the global list of pool descriptors. */
   struct KListLink   link;
 
@@ -93,6 +100,9 @@ struct KObjectPool *k_object_pool_create(const char *, size_t, size_t,
 int                k_object_pool_destroy(struct KObjectPool *);
 void              *k_object_pool_get(struct KObjectPool *);
 void               k_object_pool_put(struct KObjectPool *, void *);
+void               k_object_pool_foreach(void (*)(struct KObjectPool *,
+                                                  void *),
+                                         void *);
 
 void               k_object_pool_system_init(void);
 
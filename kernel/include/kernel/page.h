@@ -32,7 +32,7 @@ struct Page {
   /** Reference counter */
   int ref_count;
   /** Page type tag (for debugging purposes) */
-  int debug_tag;
+  unsigned debug_tag;
 };
 
 enum {
@@ -48,8 +48,14 @@ enum {
   PAGE_TAG_KERNEL_VM,
   PAGE_TAG_ETH_TX,
   PAGE_TAG_PIPE,
+  PAGE_TAG_PAGE_CACHE,
+  PAGE_TAG_SWAP,
+  PAGE_TAG_END,
 };
 
+/** The number of distinct page tags */
+#define PAGE_TAG_COUNT    (PAGE_TAG_END - PAGE_TAG_MAILBOX)
+
 extern struct Page *pages;
 extern unsigned page_count;
 extern unsigned page_free_count;
@@ -113,12 +119,28 @@ kva2page(void *va)
 
 /** Fill the allocated page block with zeros. */ 
 #define PAGE_ALLOC_ZERO   (1 << 0)
+/** Return NULL instead of panicking if no block of the given order is free. */
+#define PAGE_ALLOC_TRY    (1 << 1)
+/** The allocated page can be migrated (see page_compact_begin()). */
+#define PAGE_ALLOC_MOVABLE  (1 << 2)
+
+/** The order of page blocks grouped by mobility. */
+#define PAGE_BLOCK_ORDER  8
+/** The number of pages in a page block. */
+#define PAGE_BLOCK_SIZE   (1U << PAGE_BLOCK_ORDER)
 
 void         page_init_low(void);
 void         page_init_high(void);
-struct Page *page_alloc_block(unsigned, int, int);
+struct Page *page_alloc_block(unsigned, int, unsigned);
 void         page_free_block(struct Page *, unsigned);
 void         page_free_region(physaddr_t, physaddr_t);
+void         page_ref_inc(struct Page *);
+int          page_ref_dec(struct Page *);
+unsigned     page_tag_count(unsigned);
+unsigned     page_free_block_count(unsigned);
+int          page_frag_index(unsigned);
+struct Page *page_compact_begin(void);
+void         page_compact_end(struct Page *);
 
 /**
  * Allocate a single page.
@@ -128,7 +150,7 @@ void         page_free_region(physaddr_t, physaddr_t);
  * @return Address of a page info structure or NULL if out of memory.
  */
 static inline struct Page *
-page_alloc_one(int flags, int debug_tag)
+page_alloc_one(int flags, unsigned debug_tag)
 {
   return page_alloc_block(0, flags, debug_tag);
 }
@@ -23,6 +23,8 @@
 
 struct File;
 struct KSpinLock;
+struct __spawn_action;
+struct __spawn_attr;
 struct Inode;
 struct Process;
 struct PathNode;
@@ -126,6 +128,11 @@ void           process_free(struct Process *);
 pid_t          process_copy(int);
 pid_t          process_wait(pid_t, int *, int);
 int            process_exec(const char *, uintptr_t, uintptr_t);
+int            process_exec_load(struct Process *, const char *, uintptr_t,
+                                 uintptr_t);
+pid_t          process_spawn(const char *, uintptr_t, uintptr_t,
+                             const struct __spawn_attr *,
+                             const struct __spawn_action *, int);
 void          *process_grow(ptrdiff_t);
 void           process_update_times(struct Process *, clock_t, clock_t);
 void           process_get_times(struct Process *, struct tms *);
@@ -133,5 +140,6 @@ pid_t          process_get_gid(pid_t);
 int            process_set_gid(pid_t, pid_t);
 int            process_match_pid(struct Process *, pid_t);
 int            process_set_itimer(int, struct itimerval *, struct itimerval *);
+void           process_foreach(void (*)(struct Process *, void *), void *);
 
 #endif  // __KERNEL_INCLUDE_KERNEL_PROCESS_H__
@@ -26,6 +26,7 @@ void signal_init_system(void);
 void signal_init(struct Process *);
 int  signal_generate(pid_t, int, int);
 void signal_clone(struct Process *, struct Process *);
+void signal_spawn(struct Process *, const sigset_t *, const sigset_t *);
 void signal_deliver_pending(void);
 int  signal_action_change(int, uintptr_t, struct sigaction *, struct sigaction *);
 int  signal_return(uintptr_t);
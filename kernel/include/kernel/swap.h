@@ -0,0 +1,31 @@
+#ifndef __KERNEL_INCLUDE_KERNEL_SWAP_H__
+#define __KERNEL_INCLUDE_KERNEL_SWAP_H__
+
+#ifndef __ARGENTUM_KERNEL__
+#error "This is a kernel header; user programs should not #include it"
+#endif
+
+/**
+ * @file include/swap.h
+ *
+ * Swapping anonymous memory to a swap file.
+ */
+
+struct Page;
+
+/** The number of swap slots */
+extern unsigned long swap_slot_count;
+/** The number of free swap slots */
+extern unsigned long swap_free_count;
+
+void swap_init(void);
+int  swap_on(const char *);
+int  swap_alloc(struct Page *, unsigned long *);
+void swap_dup(unsigned long);
+void swap_free(unsigned long);
+int  swap_read(unsigned long, struct Page *);
+int  swap_write(void);
+int  swap_reclaim(void);
+void swap_wakeup(void);
+
+#endif  // !__KERNEL_INCLUDE_KERNEL_SWAP_H__
@@ -21,6 +21,7 @@ int32_t sys_clock_time(void);
 int32_t sys_fork(void);
 int32_t sys_wait(void);
 int32_t sys_exec(void);
+int32_t sys_spawn(void);
 int32_t sys_open(void);
 int32_t sys_fcntl(void);
 int32_t sys_seek(void);
@@ -60,6 +61,9 @@ int32_t sys_access(void);
 int32_t sys_pipe(void);
 int32_t sys_ioctl(void);
 int32_t sys_mmap(void);
+int32_t sys_mprotect(void);
+int32_t sys_munmap(void);
+int32_t sys_mremap(void);
 int32_t sys_select(void);
 int32_t sys_sigpending(void);
 int32_t sys_sigprocmask(void);
@@ -73,5 +77,7 @@ int32_t sys_times(void);
 int32_t sys_mount(void);
 int32_t sys_gethostbyname(void);
 int32_t sys_setitimer(void);
+int32_t sys_swapon(void);
+int32_t sys_sync(void);
 
 #endif  // !__KERNEL_INCLUDE_KERNEL_SYSCALL_H__
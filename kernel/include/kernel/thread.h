@@ -81,6 +81,7 @@ void            arch_thread_idle(void);
 
 struct KThread *k_thread_current(void);
 struct KThread *k_thread_create(struct Process *, void (*)(void *), void *, int);
+void            k_thread_destroy(struct KThread *);
 void            k_thread_exit(void);
 int             k_thread_resume(struct KThread *);
 void            k_thread_suspend(void);
@@ -19,6 +19,18 @@
 #define VM_USER       (1 << 4)
 #define VM_COW        (1 << 5)
 #define VM_PAGE       (1 << 6)
+#define VM_SHARED     (1 << 7)
+#define VM_MAYWRITE   (1 << 8)   ///< Shared file mapping may be made writable
+#define VM_SWAP       (1 << 9)   ///< The page is in the swap file
+#define VM_OLD        (1 << 10)  ///< Not accessed since the last swapper scan
+
+/** Allocation order of the blocks mapped as large pages */
+#define VM_LARGE_PAGE_ORDER 4
+/** Size of a large page (64K) */
+#define VM_LARGE_PAGE_SIZE  (PAGE_SIZE << VM_LARGE_PAGE_ORDER)
+
+/** Size of the address range covered by a single second-level page table */
+#define VM_TABLE_SIZE       (1U << 20)
 
 struct Page;
 
@@ -29,30 +41,41 @@ int          arch_vm_pte_valid(void *);
 physaddr_t   arch_vm_pte_addr(void *);
 int          arch_vm_pte_flags(void *);
 void         arch_vm_pte_set(void *, physaddr_t, int);
+void         arch_vm_pte_set_large(void *, physaddr_t, int);
+void         arch_vm_pte_set_swap(void *, unsigned long);
+unsigned long arch_vm_pte_swap_slot(void *);
 void         arch_vm_pte_clear(void *);
 void         arch_vm_invalidate(uintptr_t);
+void         arch_vm_trim(void *, uintptr_t, uintptr_t);
+void         arch_vm_share(void *, void *);
+int          arch_vm_shared(void *, uintptr_t);
 void         arch_vm_init(void);
 void         arch_vm_init_percpu(void);
 void         arch_vm_load_kernel(void);
 void         arch_vm_load(void *);
+size_t       arch_vm_copy_out(uintptr_t, const void *, size_t);
+size_t       arch_vm_copy_in(void *, uintptr_t, size_t);
+size_t       arch_vm_clear(uintptr_t, size_t);
 
 struct Page *vm_page_lookup(void *, uintptr_t, int *);
 int          vm_page_insert(void *, struct Page *, uintptr_t, int);
+int          vm_page_insert_large(void *, struct Page *, uintptr_t, int);
 int          vm_page_remove(void *, uintptr_t);
+int          vm_page_protect(void *, uintptr_t, int);
+int          vm_page_lookup_cow(void *, uintptr_t, struct Page **, int *);
+int          vm_swap_lookup(void *, uintptr_t, unsigned long *);
+int          vm_swap_insert(void *, uintptr_t, unsigned long);
+int          vm_range_empty(void *, uintptr_t, size_t);
 
-int          vm_user_alloc(void *, uintptr_t, size_t, int);
-void         vm_user_free(void *, uintptr_t, size_t);
-int          vm_user_clone(void *, void *, uintptr_t, size_t, int);
-
-int          vm_copy_out(void *, const void *, uintptr_t, size_t);
-int          vm_copy_in(void *, void *, uintptr_t, size_t);
-int          vm_clear(void *, uintptr_t, size_t);
-
-int          vm_user_check_str(void *, uintptr_t, size_t *, int);
-int          vm_user_check_ptr(void *, uintptr_t, int);
-int          vm_user_check_buf(void *, uintptr_t, size_t, int);
-int          vm_user_check_args(void *, uintptr_t, size_t *, int);
-
-int          vm_handle_fault(void *, uintptr_t);
+int          vm_user_free(void *, uintptr_t, size_t);
+int          vm_user_clone_prepare(void *, uintptr_t, size_t, int);
+void         vm_user_clone(void *, void *);
+void         vm_user_destroy(void *);
+int          vm_user_move(void *, uintptr_t, uintptr_t, size_t);
+struct Page *vm_user_scan(void *, uintptr_t *, uintptr_t);
+int          vm_user_compact(void *, uintptr_t, uintptr_t, struct Page *,
+                             unsigned);
+void         vm_user_count(void *, uintptr_t, uintptr_t, unsigned long *,
+                           unsigned long *);
 
 #endif  // !__KERNEL_VM_H__
@@ -10,6 +10,7 @@
 
 #include <kernel/elf.h>
 #include <kernel/core/list.h>
+#include <kernel/core/rbtree.h>
 #include <kernel/vm.h>
 #include <kernel/spinlock.h>
 
@@ -18,27 +19,63 @@ struct Page;
 
 struct VMSpaceMapEntry {
   struct KListLink link;
+  struct KRBNode  node;
   uintptr_t       start;
   size_t          length;
   int             flags;
+
+  // Size of the unmapped gap preceding this area and the largest such gap in
+  // the subtree rooted at this area
+  size_t          gap;
+  size_t          max_gap;
+
+  // For file-backed areas, the inode and the file offset of the first page
+  struct Inode   *inode;
+  off_t           offset;
 };
 
 struct VMSpace {
-  void            *pgtab;
-  struct KSpinLock lock;
-  struct KListLink areas;
+  struct KListLink        link;         ///< Link in the list of address spaces
+  void                   *pgtab;
+  struct KSpinLock        lock;         ///< Protects the page table
+  struct KListLink        areas;        ///< Areas sorted by address
+  struct KRBTree          area_tree;    ///< Areas indexed by address
+  struct VMSpaceMapEntry *area_cache;   ///< The last area found by lookup
 };
 
 void              vm_space_init(void);
 struct VMSpace   *vm_space_create(void);
 void              vm_space_destroy(struct VMSpace *);
 struct VMSpace   *vm_space_clone(struct VMSpace *, int);
-int               vm_space_load_inode(void *, void *, struct Inode *,
-                                      size_t, off_t);
+int               vm_space_load_inode(struct VMSpace *, void *,
+                                      struct Inode *, size_t, off_t);
 
-intptr_t          vmspace_map(struct VMSpace *, uintptr_t, size_t, int);
+intptr_t          vmspace_map(struct VMSpace *, uintptr_t, size_t, int,
+                              struct Inode *, off_t);
+int               vm_space_unmap(struct VMSpace *, uintptr_t, size_t);
+int               vm_space_protect(struct VMSpace *, uintptr_t, size_t, int);
+intptr_t          vm_space_remap(struct VMSpace *, uintptr_t, size_t, size_t,
+                                 int);
 void              vm_print_areas(struct VMSpace *);
 
+int               vm_handle_fault(struct VMSpace *, uintptr_t, int);
+int               vm_space_swap_out(void);
+int               vm_space_compact(struct Page *, unsigned);
+int               vm_space_stat(struct VMSpace *, unsigned long *,
+                                unsigned long *);
+
+int               vm_copy_out(struct VMSpace *, const void *, uintptr_t,
+                              size_t);
+int               vm_copy_in(struct VMSpace *, void *, uintptr_t, size_t);
+int               vm_clear(struct VMSpace *, uintptr_t, size_t);
+
+int               vm_user_check_str(struct VMSpace *, uintptr_t, size_t *,
+                                    int);
+int               vm_user_check_ptr(struct VMSpace *, uintptr_t, int);
+int               vm_user_check_buf(struct VMSpace *, uintptr_t, size_t, int);
+int               vm_user_check_args(struct VMSpace *, uintptr_t, size_t *,
+                                     int);
+
 int               vm_space_copy_out(const void *, uintptr_t, size_t);
 int               vm_space_copy_in(void *, uintptr_t, size_t);
 int               vm_space_clear(uintptr_t, size_t);
@@ -14,6 +14,11 @@ ifdef PROCESS_NAME
 	KERNEL_MAIN_CFLAGS := -DPROCESS_NAME=$(PROCESS_NAME)
 endif
 
+# Use NEON in memcpy() and memset() (requires a CPU with the NEON extension)
+ifdef KERNEL_NEON
+	KERNEL_CFLAGS += -DKERNEL_NEON
+endif
+
 KERNEL_SRCFILES := \
 	kernel/core/cpu.c \
 	kernel/core/irq.c \
@@ -21,6 +26,7 @@ KERNEL_SRCFILES := \
 	kernel/core/semaphore.c \
 	kernel/core/mailbox.c \
 	kernel/core/object_pool.c \
+	kernel/core/rbtree.c \
 	kernel/core/timer.c \
 	kernel/core/thread.c \
 	kernel/core/sched.c \
@@ -35,6 +41,7 @@ KERNEL_SRCFILES := \
 	kernel/drivers/sd/sd.c \
 	kernel/fs/ext2_bitmap.c \
 	kernel/fs/ext2_block_alloc.c \
+	kernel/fs/ext2_dir_index.c \
 	kernel/fs/ext2_inode_alloc.c \
 	kernel/fs/ext2_inode.c \
 	kernel/fs/ext2.c \
@@ -42,9 +49,12 @@ KERNEL_SRCFILES := \
 	kernel/fs/buf.c \
 	kernel/fs/file.c \
 	kernel/fs/inode.c \
+	kernel/fs/page_cache.c \
 	kernel/fs/path.c \
 	kernel/fs/fs.c \
+	kernel/mm/compact.c \
 	kernel/mm/page.c \
+	kernel/mm/swap.c \
 	kernel/mm/vm.c \
 	kernel/net/net.c \
 	kernel/process/exec.c \
@@ -52,11 +62,13 @@ KERNEL_SRCFILES := \
 	kernel/process/process.c \
 	kernel/process/signal.c \
 	kernel/process/vmspace.c \
+	kernel/block.c \
 	kernel/console.c \
 	kernel/dev.c \
 	kernel/ipc.c \
 	kernel/interrupt.c \
 	kernel/kdebug.c \
+	kernel/kmeminfo.c \
 	kernel/monitor.c \
 	kernel/pipe.c \
 	kernel/syscall.c \
@@ -0,0 +1,220 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/kmeminfo.h>
+#include <kernel/object_pool.h>
+#include <kernel/page.h>
+#include <kernel/process.h>
+#include <kernel/swap.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Kernel memory usage report
+ * ----------------------------------------------------------------------------
+ *
+ * The report is generated from the live counters each time it is requested,
+ * and is displayed by the 'kmeminfo' monitor command and read from
+ * /dev/kmeminfo. Sizes are given in pages unless stated otherwise. The
+ * fragmentation index of each order is explained in page_frag_index().
+ */
+
+// Names of the page tags
+static const char *kmeminfo_tag_names[PAGE_TAG_COUNT] = {
+  [PAGE_TAG_MAILBOX    - PAGE_TAG_MAILBOX] = "mailbox",
+  [PAGE_TAG_SLAB       - PAGE_TAG_MAILBOX] = "slab",
+  [PAGE_TAG_KSTACK     - PAGE_TAG_MAILBOX] = "kstack",
+  [PAGE_TAG_FB         - PAGE_TAG_MAILBOX] = "fb",
+  [PAGE_TAG_ETH_RX     - PAGE_TAG_MAILBOX] = "eth_rx",
+  [PAGE_TAG_BUF        - PAGE_TAG_MAILBOX] = "buf",
+  [PAGE_TAG_ANON       - PAGE_TAG_MAILBOX] = "anon",
+  [PAGE_TAG_PGTAB      - PAGE_TAG_MAILBOX] = "pgtab",
+  [PAGE_TAG_VM         - PAGE_TAG_MAILBOX] = "vm",
+  [PAGE_TAG_KERNEL_VM  - PAGE_TAG_MAILBOX] = "kernel_vm",
+  [PAGE_TAG_ETH_TX     - PAGE_TAG_MAILBOX] = "eth_tx",
+  [PAGE_TAG_PIPE       - PAGE_TAG_MAILBOX] = "pipe",
+  [PAGE_TAG_PAGE_CACHE - PAGE_TAG_MAILBOX] = "page_cache",
+  [PAGE_TAG_SWAP       - PAGE_TAG_MAILBOX] = "swap",
+};
+
+struct KMemInfoBuf {
+  char   *s;
+  size_t  n;
+  size_t  len;
+};
+
+// The number of processes to copy while holding the process lock
+#define KMEMINFO_PROCESS_BATCH  8
+
+// The processes with the lowest IDs greater than 'after', sorted by ID. The
+// address spaces are examined after releasing the process lock.
+struct KMemInfoProcesses {
+  struct {
+    pid_t           pid;
+    struct VMSpace *vm;
+    char            name[64];
+  }                 list[KMEMINFO_PROCESS_BATCH];
+  unsigned          count;
+  pid_t             after;
+};
+
+// Append formatted text to the report, silently truncating it if the buffer
+// is full
+static void
+kmeminfo_printf(struct KMemInfoBuf *buf, const char *format, ...)
+{
+  va_list ap;
+
+  if (buf->len + 1 >= buf->n)
+    return;
+
+  va_start(ap, format);
+  buf->len += vsnprintf(&buf->s[buf->len], buf->n - buf->len, format, ap);
+  va_end(ap);
+
+  // vsnprintf() returns the length the output would have had
+  buf->len = MIN(buf->len, buf->n - 1);
+}
+
+static void
+kmeminfo_print_pool(struct KObjectPool *pool, void *arg)
+{
+  struct KMemInfoBuf *buf = (struct KMemInfoBuf *) arg;
+
+  kmeminfo_printf(buf, "  %-20s %7u %6u %8u %6u %6u\n",
+                  pool->name,
+                  pool->obj_size,
+                  pool->slab_count,
+                  pool->slab_count * pool->slab_capacity,
+                  pool->used_count,
+                  pool->peak_count);
+}
+
+static void
+kmeminfo_copy_process(struct Process *process, void *arg)
+{
+  struct KMemInfoProcesses *procs = (struct KMemInfoProcesses *) arg;
+  unsigned i;
+
+  if (process->pid <= procs->after)
+    return;
+
+  for (i = procs->count; (i > 0) && (procs->list[i - 1].pid > process->pid); i--)
+    if (i < KMEMINFO_PROCESS_BATCH)
+      procs->list[i] = procs->list[i - 1];
+
+  if (i == KMEMINFO_PROCESS_BATCH)
+    return;
+
+  procs->list[i].pid = process->pid;
+  procs->list[i].vm  = process->vm;
+  strncpy(procs->list[i].name, process->name, sizeof(procs->list[i].name) - 1);
+  procs->list[i].name[sizeof(procs->list[i].name) - 1] = '\0';
+
+  if (procs->count < KMEMINFO_PROCESS_BATCH)
+    procs->count++;
+}
+
+// Walking an address space takes long, so only the process IDs and names are
+// copied under the process lock, a few at a time
+static void
+kmeminfo_print_processes(struct KMemInfoBuf *buf)
+{
+  struct KMemInfoProcesses procs;
+  unsigned long resident, swapped;
+  unsigned i;
+
+  procs.after = -1;
+
+  do {
+    procs.count = 0;
+    process_foreach(kmeminfo_copy_process, &procs);
+
+    for (i = 0; i < procs.count; i++) {
+      resident = swapped = 0;
+
+      // Zombies have already released their address spaces. Skip processes
+      // that have exited or replaced their address space in the meantime.
+      if ((procs.list[i].vm != NULL) &&
+          (vm_space_stat(procs.list[i].vm, &resident, &swapped) < 0))
+        continue;
+
+      kmeminfo_printf(buf, "  %5d %8lu %8lu  %s\n",
+                      procs.list[i].pid, resident, swapped, procs.list[i].name);
+    }
+
+    if (procs.count > 0)
+      procs.after = procs.list[procs.count - 1].pid;
+  } while (procs.count == KMEMINFO_PROCESS_BATCH);
+}
+
+/**
+ * Generate the kernel memory usage report.
+ *
+ * @param s Pointer to the buffer to store the NUL-terminated report
+ * @param n Size of the buffer in bytes
+ *
+ * @return The length of the report (excluding the terminating NUL)
+ */
+size_t
+kmeminfo_print(char *s, size_t n)
+{
+  struct KMemInfoBuf buf;
+  struct BufCacheStat buf_stat;
+  struct PathCacheStat path_stat;
+  unsigned i, order;
+
+  buf.s   = s;
+  buf.n   = n;
+  buf.len = 0;
+
+  if (n == 0)
+    return 0;
+  s[0] = '\0';
+
+  kmeminfo_printf(&buf, "Pages:\n");
+  kmeminfo_printf(&buf, "  %-12s %8u\n", "total", page_count);
+  kmeminfo_printf(&buf, "  %-12s %8u\n", "free", page_free_count);
+  for (i = 0; i < PAGE_TAG_COUNT; i++)
+    kmeminfo_printf(&buf, "  %-12s %8u\n", kmeminfo_tag_names[i],
+                    page_tag_count(PAGE_TAG_MAILBOX + i));
+
+  kmeminfo_printf(&buf, "Free blocks:\n");
+  kmeminfo_printf(&buf, "  %-12s %8s %6s\n", "order", "blocks", "frag");
+  for (order = 0; order <= PAGE_ORDER_MAX; order++)
+    kmeminfo_printf(&buf, "  %-12u %8u %6d\n", order,
+                    page_free_block_count(order), page_frag_index(order));
+
+  kmeminfo_printf(&buf, "Swap:\n");
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "total", swap_slot_count);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "free", swap_free_count);
+
+  buf_cache_stat(&buf_stat);
+  kmeminfo_printf(&buf, "Buffer cache:\n");
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "buffers", buf_stat.size);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "hits", buf_stat.hits);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "misses", buf_stat.misses);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "evictions", buf_stat.evictions);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "dirty", buf_stat.dirty);
+
+  fs_path_cache_stat(&path_stat);
+  kmeminfo_printf(&buf, "Path cache:\n");
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "unused", path_stat.unused);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "hits", path_stat.hits);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "negative", path_stat.negative_hits);
+  kmeminfo_printf(&buf, "  %-12s %8lu\n", "misses", path_stat.misses);
+
+  kmeminfo_printf(&buf, "Object pools:\n");
+  kmeminfo_printf(&buf, "  %-20s %7s %6s %8s %6s %6s\n",
+                  "name", "objsize", "slabs", "objects", "inuse", "peak");
+  k_object_pool_foreach(kmeminfo_print_pool, &buf);
+
+  kmeminfo_printf(&buf, "Processes:\n");
+  kmeminfo_printf(&buf, "  %5s %8s %8s  %s\n", "pid", "rss", "swap", "name");
+  kmeminfo_print_processes(&buf);
+
+  return buf.len;
+}
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 
 /**
@@ -24,6 +25,30 @@ memcmp(const void *s1, const void *s2, size_t n)
   const unsigned char *p1 = (const unsigned char *) s1;
   const unsigned char *p2 = (const unsigned char *) s2;
 
+  // Skip over equal words quickly, then locate the differing byte below.
+  if ((n >= sizeof(uint32_t)) &&
+      ((((uintptr_t) p1 ^ (uintptr_t) p2) & (sizeof(uint32_t) - 1)) == 0)) {
+    const uint32_t *w1, *w2;
+
+    for ( ; ((uintptr_t) p1 & (sizeof(uint32_t) - 1)) != 0; n--) {
+      if (*p1 != *p2)
+        return (int) *p1 - *p2;
+      p1++;
+      p2++;
+    }
+
+    w1 = (const uint32_t *) p1;
+    w2 = (const uint32_t *) p2;
+
+    for ( ; (n >= sizeof(uint32_t)) && (*w1 == *w2); n -= sizeof(uint32_t)) {
+      w1++;
+      w2++;
+    }
+
+    p1 = (const unsigned char *) w1;
+    p2 = (const unsigned char *) w2;
+  }
+
   for ( ; n > 0; n--) {
     if (*p1 != *p2)
       return (int) *p1 - *p2;
@@ -1,5 +1,11 @@
+#include <stdint.h>
 #include <string.h>
 
+#if defined(__arm__) && defined(KERNEL_NEON)
+// Copies of at least this many bytes go through the NEON registers
+#define MEMCPY_NEON_MIN   256
+#endif
+
 /**
  * @brief Copy bytes in memory.
  * 
@@ -20,6 +26,78 @@ memcpy(void *s1, const void *s2, size_t n)
   char *dst = (char *) s1;
   const char *src = (const char *) s2;
 
+#if defined(__arm__) && defined(KERNEL_NEON)
+  // Move 64 bytes per iteration. VLD1/VST1 with byte elements work with any
+  // alignment, so the pointers do not have to be aligned to each other. The
+  // trap entry code does not save the VFP registers of the interrupted user
+  // code, so the registers used are saved on the stack around the loop.
+  if (n >= MEMCPY_NEON_MIN) {
+    size_t nbulk = n & ~(size_t) 63;
+
+    asm volatile(
+      ".fpu neon\n"
+      "vpush    {d0-d7}\n"
+      "1:\n"
+      "vld1.8   {d0-d3}, [%1]!\n"
+      "vld1.8   {d4-d7}, [%1]!\n"
+      "vst1.8   {d0-d3}, [%0]!\n"
+      "vst1.8   {d4-d7}, [%0]!\n"
+      "subs     %2, %2, #64\n"
+      "bne      1b\n"
+      "vpop     {d0-d7}\n"
+      : "+r" (dst), "+r" (src), "+r" (nbulk)
+      :
+      : "cc", "memory");
+
+    n &= 63;
+  }
+#endif
+
+  // Word copies are only possible if both pointers can be aligned at the same
+  // time.
+  if ((n >= sizeof(uint32_t)) &&
+      ((((uintptr_t) dst ^ (uintptr_t) src) & (sizeof(uint32_t) - 1)) == 0)) {
+    uint32_t *wdst;
+    const uint32_t *wsrc;
+
+    for ( ; ((uintptr_t) dst & (sizeof(uint32_t) - 1)) != 0; n--)
+      *dst++ = *src++;
+
+    wdst = (uint32_t *) dst;
+    wsrc = (const uint32_t *) src;
+
+#ifdef __arm__
+    // Move 32 bytes per iteration using a pair of LDM/STM instructions.
+    for ( ; n >= 8 * sizeof(uint32_t); n -= 8 * sizeof(uint32_t)) {
+      asm volatile(
+        "ldmia %1!, {r3-r10}\n"
+        "stmia %0!, {r3-r10}\n"
+        : "+r" (wdst), "+r" (wsrc)
+        :
+        : "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "memory");
+    }
+#else
+    for ( ; n >= 8 * sizeof(uint32_t); n -= 8 * sizeof(uint32_t)) {
+      wdst[0] = wsrc[0];
+      wdst[1] = wsrc[1];
+      wdst[2] = wsrc[2];
+      wdst[3] = wsrc[3];
+      wdst[4] = wsrc[4];
+      wdst[5] = wsrc[5];
+      wdst[6] = wsrc[6];
+      wdst[7] = wsrc[7];
+      wdst += 8;
+      wsrc += 8;
+    }
+#endif
+
+    for ( ; n >= sizeof(uint32_t); n -= sizeof(uint32_t))
+      *wdst++ = *wsrc++;
+
+    dst = (char *) wdst;
+    src = (const char *) wsrc;
+  }
+
   for ( ; n > 0; n--)
     *dst++ = *src++;
 
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 
 /**
@@ -27,11 +28,30 @@ memmove(void *s1, const void *s2, size_t n)
   if ((src < dst) && (src + n > dst)) {
     src += n;
     dst += n;
+
+    if ((n >= sizeof(uint32_t)) &&
+        ((((uintptr_t) dst ^ (uintptr_t) src) & (sizeof(uint32_t) - 1)) == 0)) {
+      uint32_t *wdst;
+      const uint32_t *wsrc;
+
+      for ( ; ((uintptr_t) dst & (sizeof(uint32_t) - 1)) != 0; n--)
+        *--dst = *--src;
+
+      wdst = (uint32_t *) dst;
+      wsrc = (const uint32_t *) src;
+
+      for ( ; n >= sizeof(uint32_t); n -= sizeof(uint32_t))
+        *--wdst = *--wsrc;
+
+      dst = (char *) wdst;
+      src = (const char *) wsrc;
+    }
+
     for ( ; n > 0; n--)
       *--dst = *--src;
   } else {
-    for ( ; n > 0; n--)
-      *dst++ = *src++;
+    // An ascending copy is safe, let memcpy pick the fastest strategy.
+    memcpy(dst, src, n);
   }
 
   return s1;
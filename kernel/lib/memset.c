@@ -1,5 +1,11 @@
+#include <stdint.h>
 #include <string.h>
 
+#if defined(__arm__) && defined(KERNEL_NEON)
+// Blocks of at least this many bytes are filled using the NEON registers
+#define MEMSET_NEON_MIN   256
+#endif
+
 /**
  * @brief Set bytes in memory.
  *
@@ -18,6 +24,87 @@ memset(void *s, int c, size_t n)
   unsigned char *p = (unsigned char *) s;
   unsigned char uc = (unsigned char) c;
 
+#if defined(__arm__) && defined(KERNEL_NEON)
+  // Store 64 bytes per iteration, regardless of alignment. The registers used
+  // are saved on the stack, since they may hold the state of the interrupted
+  // user code (see memcpy()).
+  if (n >= MEMSET_NEON_MIN) {
+    size_t nbulk = n & ~(size_t) 63;
+
+    asm volatile(
+      ".fpu neon\n"
+      "vpush    {d0-d3}\n"
+      "vdup.8   q0, %2\n"
+      "vmov     q1, q0\n"
+      "1:\n"
+      "vst1.8   {d0-d3}, [%0]!\n"
+      "vst1.8   {d0-d3}, [%0]!\n"
+      "subs     %1, %1, #64\n"
+      "bne      1b\n"
+      "vpop     {d0-d3}\n"
+      : "+r" (p), "+r" (nbulk)
+      : "r" ((uint32_t) uc)
+      : "cc", "memory");
+
+    n &= 63;
+  }
+#endif
+
+  if (n >= sizeof(uint32_t)) {
+    uint32_t *wp;
+    uint32_t w;
+
+    for ( ; ((uintptr_t) p & (sizeof(uint32_t) - 1)) != 0; n--)
+      *p++ = uc;
+
+    // Replicate the byte value into each byte of the word.
+    w  = uc;
+    w |= w << 8;
+    w |= w << 16;
+
+    wp = (uint32_t *) p;
+
+#ifdef __arm__
+    // Store 32 bytes per iteration using a single STM instruction.
+    if (n >= 8 * sizeof(uint32_t)) {
+      register uint32_t w0 asm("r3") = w;
+      register uint32_t w1 asm("r4") = w;
+      register uint32_t w2 asm("r5") = w;
+      register uint32_t w3 asm("r6") = w;
+      register uint32_t w4 asm("r7") = w;
+      register uint32_t w5 asm("r8") = w;
+      register uint32_t w6 asm("r9") = w;
+      register uint32_t w7 asm("r10") = w;
+
+      for ( ; n >= 8 * sizeof(uint32_t); n -= 8 * sizeof(uint32_t)) {
+        asm volatile(
+          "stmia %0!, {r3-r10}\n"
+          : "+r" (wp)
+          : "r" (w0), "r" (w1), "r" (w2), "r" (w3),
+            "r" (w4), "r" (w5), "r" (w6), "r" (w7)
+          : "memory");
+      }
+    }
+#else
+    for ( ; n >= 8 * sizeof(uint32_t); n -= 8 * sizeof(uint32_t)) {
+      wp[0] = w;
+      wp[1] = w;
+      wp[2] = w;
+      wp[3] = w;
+      wp[4] = w;
+      wp[5] = w;
+      wp[6] = w;
+      wp[7] = w;
+      wp += 8;
+    }
+#endif
+
+    for ( ; n >= sizeof(uint32_t); n -= sizeof(uint32_t))
+      *wp++ = w;
+
+    p = (unsigned char *) wp;
+  }
+
   for ( ; n > 0; n--)
     *p++ = uc;
 
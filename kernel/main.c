@@ -3,10 +3,12 @@
 #include <stdint.h>
 #include <sys/utsname.h>
 
+#include <kernel/compact.h>
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
 #include <kernel/tty.h>
 #include <kernel/fs/buf.h>
+#include <kernel/fs/page_cache.h>
 #include <kernel/fs/file.h>
 #include <kernel/core/irq.h>
 #include <kernel/core/mailbox.h>
@@ -19,6 +21,7 @@
 #include <kernel/vmspace.h>
 #include <kernel/pipe.h>
 #include <kernel/process.h>
+#include <kernel/swap.h>
 #include <kernel/ipc.h>
 #include <kernel/net.h>
 #include <kernel/interrupt.h>
@@ -68,10 +71,13 @@ main(void)
 
   // Initialize the remaining kernel services
   buf_init();           // Buffer cache
+  page_cache_init();    // Page cache
   file_init();          // File table
   vm_space_init();      // Virtual memory manager
   pipe_init();          // Pipes
   process_init();       // Process table
+  swap_init();          // Swapper
+  compact_init();       // Memory compaction
   net_init();           // Networking
 
   // ipc_init();
@@ -0,0 +1,88 @@
+#include <kernel/compact.h>
+#include <kernel/console.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/page.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/vm.h>
+#include <kernel/vmspace.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Compaction
+ * ----------------------------------------------------------------------------
+ *
+ * The compaction thread periodically checks whether free memory is too
+ * fragmented to satisfy large page allocations. If so, it selects the page
+ * block with the fewest used pages, migrates these pages elsewhere and thus
+ * frees the whole page block (see page_compact_begin() and
+ * vm_space_compact()).
+ */
+
+// The largest order regularly allocated at run time
+#define COMPACT_ORDER       VM_LARGE_PAGE_ORDER
+// Compact when the fragmentation index for COMPACT_ORDER exceeds this value
+#define COMPACT_THRESHOLD   500
+// The maximum number of page blocks to compact at once
+#define COMPACT_BATCH       4
+// How often the compaction thread checks fragmentation (in milliseconds)
+#define COMPACT_INTERVAL    1000
+
+/** Used to wake up the compaction thread */
+static struct KSemaphore compact_semaphore;
+
+static void compact_thread_entry(void *);
+
+/**
+ * Initialize the compaction thread.
+ */
+void
+compact_init(void)
+{
+  struct KThread *thread;
+
+  k_semaphore_init(&compact_semaphore, 0);
+
+  if ((thread = k_thread_create(NULL, compact_thread_entry, NULL, 0)) == NULL)
+    panic("cannot create the compaction thread");
+
+  k_thread_resume(thread);
+}
+
+/**
+ * Wake up the compaction thread after a high-order allocation failure.
+ */
+void
+compact_wakeup(void)
+{
+  k_semaphore_put(&compact_semaphore);
+}
+
+static void
+compact_thread_entry(void *arg)
+{
+  struct Page *page;
+  int i, r;
+
+  (void) arg;
+
+  for (;;) {
+    k_semaphore_timed_get(&compact_semaphore, ms2ticks(COMPACT_INTERVAL));
+
+    for (i = 0; i < COMPACT_BATCH; i++) {
+      if (page_frag_index(COMPACT_ORDER) <= COMPACT_THRESHOLD)
+        break;
+
+      if ((page = page_compact_begin()) == NULL)
+        break;
+
+      r = vm_space_compact(page, PAGE_BLOCK_SIZE);
+
+      page_compact_end(page);
+
+      // Nothing could be migrated, further attempts won't help either
+      if (r <= 0)
+        break;
+    }
+  }
+}
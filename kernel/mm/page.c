@@ -3,6 +3,7 @@
 #include <kernel/console.h>
 #include <kernel/page.h>
 #include <kernel/spinlock.h>
+#include <kernel/swap.h>
 #include <kernel/types.h>
 
 /**
@@ -25,6 +26,30 @@
  * When the block is later freed, the allocator checks whether the buddy of the
  * deallocated block is free, in which case two blocks are merged to form a
  * higher order block and placed on the higher free list.
+ *
+ * Grouping by mobility
+ * --------------------
+ *
+ * Physical memory is divided into page blocks of PAGE_BLOCK_ORDER. Each page
+ * block has a type: movable page blocks hold pages that can be migrated to
+ * another location (i.e. private anonymous user pages, see vm_user_compact()),
+ * and unmovable page blocks hold everything else. There are separate free lists
+ * for each type, and a free block is placed on the list corresponding to the
+ * type of its page block.
+ *
+ * An allocation uses blocks of its own type first. Otherwise, the largest free
+ * block of the other type is taken; if this block is large enough, the whole
+ * page block changes its type. This way, pinned kernel pages do not get
+ * scattered across the memory, and movable pages can be later migrated away to
+ * reassemble high-order blocks.
+ *
+ * Compaction
+ * ----------
+ *
+ * To compact memory, the page block with the fewest used pages is isolated:
+ * its free blocks are moved to a separate list which is never used for
+ * allocations. The pages mapped there are then migrated elsewhere, and once
+ * the page block is released, its free pages merge into higher-order blocks.
  * 
  * Initialization
  * --------------
@@ -44,15 +69,35 @@ unsigned page_count;
 /** The number of free physical pages */
 unsigned page_free_count = 0;
 
-/** The list of free pages, grouped by block order */
+enum {
+  PAGE_TYPE_UNMOVABLE,
+  PAGE_TYPE_MOVABLE,
+  PAGE_TYPE_ISOLATE,
+  PAGE_TYPE_COUNT,
+};
+
+/** The list of free pages, grouped by block order and page block type */
 static struct {
-  struct KListLink link;
+  struct KListLink link[PAGE_TYPE_COUNT];
   unsigned long  *bitmap;
+  unsigned        count;
 } page_free_list[PAGE_ORDER_MAX + 1];
+/** The type of each page block */
+static uint8_t *page_block_type;
+/** The number of allocated pages, grouped by page tag */
+static unsigned page_tag_pages[PAGE_TAG_COUNT];
 /** The spinlock protecting the allocator structures */
 static struct KSpinLock page_lock;
 /** Whether the allocator is ready to be used */
 static int page_initialized = 0;
+
+/** The number of spinlocks protecting page reference counters */
+#define PAGE_REF_LOCKS    16
+
+/** Spinlocks protecting page reference counters, selected by page number */
+static struct KSpinLock page_ref_locks[PAGE_REF_LOCKS] = {
+  [0 ... PAGE_REF_LOCKS - 1] = K_SPINLOCK_INITIALIZER("page_ref"),
+};
 // static int high = 0;
 
 #define BITS_PER_BYTE     8
@@ -64,6 +109,9 @@ static int page_initialized = 0;
 static void        *boot_alloc(size_t);
 
 static struct Page *page_buddy(struct Page *, unsigned);
+static void         page_free_locked(struct Page *, unsigned);
+static int          page_type(struct Page *);
+static void         page_block_set_type(unsigned, int);
 static void         page_list_add(struct Page *, unsigned);
 static void         page_k_list_remove(struct Page *, unsigned);
 static int          page_list_contains(struct Page *, unsigned);
@@ -74,7 +122,7 @@ static int          page_list_contains(struct Page *, unsigned);
 void
 page_init_low(void)
 {
-  unsigned i;
+  unsigned i, j;
   size_t bitmap_len;
 
   k_spinlock_init(&page_lock, "page_lock");
@@ -85,9 +133,15 @@ page_init_low(void)
   // Allocate the 'pages' array.
   pages = (struct Page *) boot_alloc(page_count * sizeof(struct Page));
 
+  // Initially, all page blocks are movable
+  page_block_type = (uint8_t *) boot_alloc(page_count >> PAGE_BLOCK_ORDER);
+  for (i = 0; i < (page_count >> PAGE_BLOCK_ORDER); i++)
+    page_block_type[i] = PAGE_TYPE_MOVABLE;
+
   // Initialize the free page list
   for (i = 0; i <= PAGE_ORDER_MAX; i++) {
-    k_list_init(&page_free_list[i].link);
+    for (j = 0; j < PAGE_TYPE_COUNT; j++)
+      k_list_init(&page_free_list[i].link[j]);
 
     bitmap_len = ROUND_UP(page_count / (1U << i), BITS_PER_BYTE);
     page_free_list[i].bitmap = (unsigned long *) boot_alloc(bitmap_len);
@@ -163,29 +217,64 @@ boot_alloc(size_t n)
  * @return Pointer to a page structure or NULL if out of memory.
  */
 struct Page *
-page_alloc_block(unsigned order, int flags, int debug_tag)
+page_alloc_block(unsigned order, int flags, unsigned debug_tag)
 {
   struct Page *page;
-  unsigned o;
+  unsigned o, i;
+  int type, other;
+
+  type  = (flags & PAGE_ALLOC_MOVABLE) ? PAGE_TYPE_MOVABLE : PAGE_TYPE_UNMOVABLE;
+  other = (flags & PAGE_ALLOC_MOVABLE) ? PAGE_TYPE_UNMOVABLE : PAGE_TYPE_MOVABLE;
 
   k_spinlock_acquire(&page_lock);
 
   for (o = order; o <= PAGE_ORDER_MAX; o++)
-    if (!k_list_is_empty(&page_free_list[o].link))
+    if (!k_list_is_empty(&page_free_list[o].link[type]))
       break;
 
   if (o > PAGE_ORDER_MAX) {
+    // Fall back to the largest block of the other type to avoid mixing types
+    // in many page blocks
+    for (o = PAGE_ORDER_MAX; o >= order; o--) {
+      if (!k_list_is_empty(&page_free_list[o].link[other]))
+        break;
+      if (o == 0) {
+        o = PAGE_ORDER_MAX + 1;
+        break;
+      }
+    }
+  } else {
+    other = type;
+  }
+
+  if ((o > PAGE_ORDER_MAX) || (o < order)) {
     // TODO: try to reclaim pages from the slab allocator
     k_spinlock_release(&page_lock);
+    // Callers may hold locks needed to free memory, so reclaim in background
+    swap_wakeup();
+    if (flags & PAGE_ALLOC_TRY)
+      return NULL;
     panic("out of memory\n");
     return NULL;
   }
 
-  page = KLIST_CONTAINER(page_free_list[o].link.next, struct Page, link);
+  page = KLIST_CONTAINER(page_free_list[o].link[other].next, struct Page, link);
 
   page_k_list_remove(page, o);
   page_free_count -= 1U << order;
 
+  // If the block taken from the other type covers at least half of a page
+  // block, claim the whole page block. The remainder of the block is placed on
+  // the free lists of the new type during the split below.
+  if ((other != type) && (o + 1 >= PAGE_BLOCK_ORDER)) {
+    if (o >= PAGE_BLOCK_ORDER) {
+      for (i = 0; i < (1U << (o - PAGE_BLOCK_ORDER)); i++)
+        page_block_type[((page - pages) >> PAGE_BLOCK_ORDER) + i] = type;
+    } else {
+      page_block_set_type((page - pages) >> PAGE_BLOCK_ORDER, type);
+    }
+  }
+
   // Split
   while (o > order) {
     o--;
@@ -199,13 +288,17 @@ page_alloc_block(unsigned order, int flags, int debug_tag)
   // if (high)
   //   cprintf(" %d\n", page_free_count);
 
+  page->debug_tag = debug_tag;
+  if ((debug_tag >= PAGE_TAG_MAILBOX) && (debug_tag < PAGE_TAG_END))
+    page_tag_pages[debug_tag - PAGE_TAG_MAILBOX] += 1U << order;
+
   k_spinlock_release(&page_lock);
 
+  swap_wakeup();
+
   if (flags & PAGE_ALLOC_ZERO)
     memset(page2kva(page), 0, PAGE_SIZE << order);
 
-  page->debug_tag = debug_tag;
-
   return page;
 }
 
@@ -218,15 +311,35 @@ page_alloc_block(unsigned order, int flags, int debug_tag)
 void
 page_free_block(struct Page *page, unsigned order)
 {
-  struct Page *buddy;
-  unsigned o;
-
   if (page->ref_count != 0)
     panic("page->ref_count != 0 (%u)", page->ref_count);
 
+  k_spinlock_acquire(&page_lock);
+
+  if ((page->debug_tag >= PAGE_TAG_MAILBOX) && (page->debug_tag < PAGE_TAG_END))
+    page_tag_pages[page->debug_tag - PAGE_TAG_MAILBOX] -= 1U << order;
   page->debug_tag = 0;
 
-  k_spinlock_acquire(&page_lock);
+  page_free_locked(page, order);
+  page_free_count += 1U << order;
+
+  k_spinlock_release(&page_lock);
+}
+
+/**
+ * Place a block of pages on the free list, merging it with its free buddies.
+ * The page allocator lock must be held.
+ *
+ * @param page  Pointer to the page structure corresponding to the block.
+ * @param order The order of the page block.
+ */
+static void
+page_free_locked(struct Page *page, unsigned order)
+{
+  struct Page *buddy;
+  unsigned o;
+
+  assert(k_spinlock_holding(&page_lock));
 
   for (o = order ; o < PAGE_ORDER_MAX; o++) {
     buddy = page_buddy(page, o);
@@ -234,6 +347,12 @@ page_free_block(struct Page *page, unsigned order)
     if (!page_list_contains(buddy, o))
       break;
 
+    // Keep the free blocks of an isolated page block on the isolated list
+    if ((o >= PAGE_BLOCK_ORDER) &&
+        ((page_type(page) == PAGE_TYPE_ISOLATE) ||
+         (page_type(buddy) == PAGE_TYPE_ISOLATE)))
+      break;
+
     // Combine with buddy
     page_k_list_remove(buddy, o);
     if (buddy < page)
@@ -241,11 +360,215 @@ page_free_block(struct Page *page, unsigned order)
   }
 
   page_list_add(page, o);
-  page_free_count += 1U << order;
+}
+
+/**
+ * Increment the reference counter of a page that may be shared between several
+ * address spaces.
+ *
+ * @param page Pointer to the page structure.
+ */
+void
+page_ref_inc(struct Page *page)
+{
+  struct KSpinLock *lock = &page_ref_locks[(page - pages) % PAGE_REF_LOCKS];
+
+  k_spinlock_acquire(lock);
+  page->ref_count++;
+  k_spinlock_release(lock);
+}
+
+/**
+ * Decrement the reference counter of a page that may be shared between several
+ * address spaces. The page is not freed: if the counter drops to zero, the
+ * caller is responsible for freeing it.
+ *
+ * @param page Pointer to the page structure.
+ *
+ * @return The new value of the reference counter.
+ */
+int
+page_ref_dec(struct Page *page)
+{
+  struct KSpinLock *lock = &page_ref_locks[(page - pages) % PAGE_REF_LOCKS];
+  int ref_count;
+
+  k_spinlock_acquire(lock);
+
+  if (page->ref_count <= 0)
+    panic("page->ref_count <= 0 (%d)", page->ref_count);
+
+  ref_count = --page->ref_count;
+
+  k_spinlock_release(lock);
+
+  return ref_count;
+}
+
+/**
+ * Calculate the fragmentation index for the given order, i.e. how much an
+ * allocation failure of this order would be due to fragmentation rather than
+ * lack of memory. Values close to 0 mean that there is not enough free memory,
+ * values close to 1000 mean that the free memory is split into small blocks.
+ *
+ * @param order The block order.
+ *
+ * @return The fragmentation index (from 0 to 1000), or -1 if a free block of
+ *         the given order is available.
+ */
+int
+page_frag_index(unsigned order)
+{
+  unsigned long blocks = 0;
+  unsigned o;
+
+  if (order > PAGE_ORDER_MAX)
+    return 0;
+
+  for (o = 0; o <= PAGE_ORDER_MAX; o++) {
+    if ((o >= order) && (page_free_list[o].count > 0))
+      return -1;
+    blocks += page_free_list[o].count;
+  }
+
+  if (blocks == 0)
+    return 0;
+
+  return 1000 - (1000 + (page_free_count * 1000UL) / (1U << order)) / blocks;
+}
+
+/**
+ * Isolate the movable page block with the fewest used pages, so that its
+ * pages can be migrated elsewhere. Until page_compact_end() is called, no
+ * allocations are made from the isolated page block. Only one page block can
+ * be isolated at a time.
+ *
+ * @return Pointer to the first page of the isolated page block, or NULL if
+ *         no page block is worth compacting.
+ */
+struct Page *
+page_compact_begin(void)
+{
+  unsigned block, best_block, best_free, nfree, npinned, idx, end, o;
+
+  best_free  = 0;
+  best_block = 0;
+
+  k_spinlock_acquire(&page_lock);
+
+  for (block = 0; block < (page_count >> PAGE_BLOCK_ORDER); block++) {
+    if (page_block_type[block] != PAGE_TYPE_MOVABLE)
+      continue;
+
+    nfree   = 0;
+    npinned = 0;
+
+    idx = block << PAGE_BLOCK_ORDER;
+    end = idx + PAGE_BLOCK_SIZE;
+
+    // Free page blocks are merged into blocks of at least PAGE_BLOCK_ORDER
+    for (o = PAGE_BLOCK_ORDER; o <= PAGE_ORDER_MAX; o++)
+      if (page_list_contains(&pages[ROUND_DOWN(idx, 1U << o)], o))
+        break;
+    if (o <= PAGE_ORDER_MAX)
+      continue;
+
+    while ((idx < end) && (npinned == 0)) {
+      for (o = PAGE_BLOCK_ORDER; o > 0; o--)
+        if (((idx % (1U << o)) == 0) && page_list_contains(&pages[idx], o))
+          break;
+
+      if (page_list_contains(&pages[idx], o)) {
+        nfree += 1U << o;
+        idx   += 1U << o;
+        continue;
+      }
+
+      // Only private anonymous pages can be migrated
+      if (pages[idx].debug_tag != PAGE_TAG_ANON)
+        npinned++;
+      idx++;
+    }
+
+    if ((npinned == 0) && (nfree > best_free)) {
+      best_free  = nfree;
+      best_block = block;
+    }
+  }
+
+  // Migrating more than half of a page block is not worth it
+  if (best_free < PAGE_BLOCK_SIZE / 2) {
+    k_spinlock_release(&page_lock);
+    return NULL;
+  }
+
+  page_block_set_type(best_block, PAGE_TYPE_ISOLATE);
+
+  k_spinlock_release(&page_lock);
+
+  return &pages[best_block << PAGE_BLOCK_ORDER];
+}
+
+/**
+ * Return the page block isolated by page_compact_begin() to the allocator.
+ *
+ * @param page Pointer to the first page of the isolated page block.
+ */
+void
+page_compact_end(struct Page *page)
+{
+  struct Page *p;
+  unsigned o;
+
+  k_spinlock_acquire(&page_lock);
+
+  assert(page_type(page) == PAGE_TYPE_ISOLATE);
+
+  page_block_type[(page - pages) >> PAGE_BLOCK_ORDER] = PAGE_TYPE_MOVABLE;
+
+  // Free the isolated blocks again to merge them with their buddies
+  for (o = 0; o <= PAGE_ORDER_MAX; o++) {
+    while (!k_list_is_empty(&page_free_list[o].link[PAGE_TYPE_ISOLATE])) {
+      p = KLIST_CONTAINER(page_free_list[o].link[PAGE_TYPE_ISOLATE].next,
+                          struct Page, link);
+      page_k_list_remove(p, o);
+      page_free_locked(p, o);
+    }
+  }
 
   k_spinlock_release(&page_lock);
 }
 
+/**
+ * Get the number of allocated pages with the given tag.
+ *
+ * @param tag The page tag.
+ *
+ * @return The number of pages.
+ */
+unsigned
+page_tag_count(unsigned tag)
+{
+  if ((tag < PAGE_TAG_MAILBOX) || (tag >= PAGE_TAG_END))
+    return 0;
+  return page_tag_pages[tag - PAGE_TAG_MAILBOX];
+}
+
+/**
+ * Get the number of free blocks of the given order.
+ *
+ * @param order The block order.
+ *
+ * @return The number of blocks.
+ */
+unsigned
+page_free_block_count(unsigned order)
+{
+  if (order > PAGE_ORDER_MAX)
+    return 0;
+  return page_free_list[order].count;
+}
+
 /**
  * Free the specified physical memory range to the page allocator.
  *
@@ -295,6 +618,36 @@ page_buddy(struct Page *page, unsigned order)
   return &pages[(page - pages) ^ (1U << order)];
 }
 
+// Get the type of the page block containing the given page
+static int
+page_type(struct Page *page)
+{
+  return page_block_type[(page - pages) >> PAGE_BLOCK_ORDER];
+}
+
+// Change the type of a page block and move its free blocks to the free lists
+// of the new type
+static void
+page_block_set_type(unsigned block, int type)
+{
+  unsigned idx, o;
+
+  assert(k_spinlock_holding(&page_lock));
+
+  page_block_type[block] = type;
+
+  for (o = 0; o < PAGE_BLOCK_ORDER; o++) {
+    for (idx = block << PAGE_BLOCK_ORDER;
+         idx < ((block + 1) << PAGE_BLOCK_ORDER);
+         idx += 1U << o) {
+      if (page_list_contains(&pages[idx], o)) {
+        k_list_remove(&pages[idx].link);
+        k_list_add_front(&page_free_list[o].link[type], &pages[idx].link);
+      }
+    }
+  }
+}
+
 /**
  * Check whether a page block is available.
  * 
@@ -328,7 +681,8 @@ page_list_add(struct Page *page, unsigned order)
   assert((block_idx % (1U << order)) == 0);
   assert(!page_list_contains(page, order));
 
-  k_list_add_front(&page_free_list[order].link, &page->link);
+  k_list_add_front(&page_free_list[order].link[page_type(page)], &page->link);
+  page_free_list[order].count++;
 
   map_idx = block_idx / (1 << order);
   page_free_list[order].bitmap[BITMAP_OFFSET(map_idx)] |= BITMAP_MASK(map_idx);
@@ -351,6 +705,7 @@ page_k_list_remove(struct Page *page, unsigned order)
   assert(page_list_contains(page, order));
 
   k_list_remove(&page->link);
+  page_free_list[order].count--;
 
   map_idx = block_idx / (1U << order);
   page_free_list[order].bitmap[BITMAP_OFFSET(map_idx)] &= ~BITMAP_MASK(map_idx);
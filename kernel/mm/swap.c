@@ -0,0 +1,489 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <kernel/block.h>
+#include <kernel/console.h>
+#include <kernel/core/semaphore.h>
+#include <kernel/fs/buf.h>
+#include <kernel/fs/fs.h>
+#include <kernel/fs/page_cache.h>
+#include <kernel/page.h>
+#include <kernel/spinlock.h>
+#include <kernel/swap.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/types.h>
+#include <kernel/vmspace.h>
+#include <kernel/waitqueue.h>
+
+/*
+ * ----------------------------------------------------------------------------
+ * Swapping
+ * ----------------------------------------------------------------------------
+ *
+ * When free memory runs low, the swapper thread writes private anonymous pages
+ * that have not been used recently to the swap file, and replaces their page
+ * table entries with references to the swap slots (see vm_space_swap_out()).
+ * The page fault handler reads the pages back on the first access.
+ *
+ * The swap file is divided into page-sized slots. Each slot has a reference
+ * counter, since after fork() the same slot may be referenced from several
+ * page tables. The slot is freed when the last such entry is removed.
+ *
+ * Only one page is written out at a time. Until the write completes, the page
+ * stays in memory and swap_read() copies the data from there. If the write
+ * fails, the page stays in memory and the write is retried later.
+ *
+ * Writing out a page must not allocate memory, since it is done when memory
+ * runs low. The blocks of all slots are allocated and looked up by swap_on(),
+ * and the pages are written directly to the device using the buffer headers
+ * reserved for that purpose.
+ *
+ * The swapper also reclaims clean pages from the page cache and evicts unused
+ * inodes (together with their cached pages), which is cheaper than swapping,
+ * and does so even if swapping is not enabled. The page
+ * allocator wakes it up as soon as free memory drops below SWAP_FREE_LOW (see
+ * swap_wakeup()).
+ */
+
+// Start reclaiming when the number of free pages drops below this limit
+#define SWAP_FREE_LOW     (page_count / 32)
+// Stop reclaiming when the number of free pages reaches this limit
+#define SWAP_FREE_HIGH    (page_count / 16)
+// How often the swapper checks the amount of free memory (in milliseconds)
+#define SWAP_INTERVAL     100
+// The maximum number of cached pages to drop at once
+#define SWAP_CACHE_BATCH  32
+// The maximum number of unused inodes to evict at once
+#define SWAP_INODE_BATCH  8
+
+/** The number of swap slots */
+unsigned long swap_slot_count;
+/** The number of free swap slots */
+unsigned long swap_free_count;
+
+/** The spinlock protecting the slot map and the pending page */
+static struct KSpinLock swap_lock = K_SPINLOCK_INITIALIZER("swap");
+/** The swap file */
+static struct Inode *swap_inode;
+/** Reference counters of all swap slots */
+static uint16_t *swap_map;
+/** Block numbers of all swap slots */
+static uint32_t *swap_blocks;
+/** The number of blocks per slot and the block size */
+static unsigned  swap_slot_blocks;
+static size_t    swap_block_size;
+/** The slot to start looking for a free one from */
+static unsigned long swap_next;
+
+/** The page being written out and its slot */
+static struct Page *swap_pending_page;
+static unsigned long swap_pending_slot;
+
+/** Used to wake up the swapper */
+static struct KSemaphore swap_semaphore;
+/** The swapper thread, NULL until swap_init() is called */
+static struct KThread *swap_thread;
+/** Threads waiting for the swapper to free some memory */
+static struct KWaitQueue swap_queue;
+
+static void swap_thread_entry(void *);
+
+/**
+ * Initialize the swapper thread.
+ */
+void
+swap_init(void)
+{
+  struct KThread *thread;
+
+  k_semaphore_init(&swap_semaphore, 0);
+  k_waitqueue_init(&swap_queue);
+
+  if ((thread = k_thread_create(NULL, swap_thread_entry, NULL, 0)) == NULL)
+    panic("cannot create the swapper thread");
+
+  swap_thread = thread;
+
+  k_thread_resume(thread);
+}
+
+/**
+ * Wake up the swapper if free memory runs low. Called by the page allocator,
+ * so must not allocate memory or sleep.
+ */
+void
+swap_wakeup(void)
+{
+  if ((swap_thread == NULL) || (page_free_count >= SWAP_FREE_LOW))
+    return;
+
+  // Don't post the semaphore on every allocation while the swapper is busy
+  if (swap_semaphore.count == 0)
+    k_semaphore_put(&swap_semaphore);
+}
+
+// Allocate and clear all blocks of the swap file and store their numbers, so
+// that writing out a page never has to allocate disk space or read the block
+// maps
+static int
+swap_file_fill(struct Inode *inode, unsigned long nslots, unsigned nblocks,
+               uint32_t *blocks)
+{
+  struct Page *page;
+  unsigned long slot;
+  uint32_t *ids;
+  int r = 0;
+
+  if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_SWAP)) == NULL)
+    return -ENOMEM;
+
+  for (slot = 0; slot < nslots; slot++) {
+    ids = &blocks[slot * nblocks];
+
+    if ((r = inode->fs->ops->bmap(inode, (off_t) slot * PAGE_SIZE, 0,
+                                  PAGE_SIZE, ids)) < 0)
+      break;
+
+    if ((r = buf_io(ids, nblocks, PAGE_SIZE / nblocks, inode->dev,
+                    page2kva(page), 1)) < 0)
+      break;
+  }
+
+  page_free_one(page);
+
+  return r;
+}
+
+/**
+ * Start swapping to the given file. The existing contents of the file are
+ * destroyed.
+ *
+ * @param path Pathname of a regular file
+ *
+ * @retval 0       Success
+ * @retval -EBUSY  Swapping is already enabled
+ * @retval -EINVAL The file is not suitable for swapping
+ * @retval -ENOMEM Out of memory
+ */
+int
+swap_on(const char *path)
+{
+  uint32_t ids[PAGE_SIZE / BLOCK_SECTOR_SIZE];
+  struct Inode *inode;
+  struct Page *map_page;
+  unsigned long nslots;
+  unsigned order, nblocks;
+  size_t slot_size;
+  int r;
+
+  if ((r = fs_lookup_inode(path, FS_LOOKUP_FOLLOW_LINKS, &inode)) < 0)
+    return r;
+
+  if ((r = fs_inode_access(inode, R_OK | W_OK)) < 0)
+    goto out1;
+
+  fs_inode_lock(inode);
+
+  if (!S_ISREG(inode->mode) || (inode->fs->ops->bmap == NULL)) {
+    r = -EINVAL;
+    goto out2;
+  }
+
+  if ((nslots = inode->size / PAGE_SIZE) == 0) {
+    r = -EINVAL;
+    goto out2;
+  }
+
+  // The slots are accessed bypassing the page cache, so write back the pages
+  // modified earlier before they can overwrite the swapped out data
+  if ((r = page_cache_sync(inode)) < 0)
+    goto out2;
+
+  // Find out how many blocks each slot takes
+  if ((r = inode->fs->ops->bmap(inode, 0, 0, PAGE_SIZE, ids)) < 0)
+    goto out2;
+  nblocks   = r;
+  slot_size = sizeof(uint16_t) + nblocks * sizeof(uint32_t);
+
+  // Use at most the largest block the page allocator can provide for both the
+  // reference counters and the block numbers
+  for (order = 0; (PAGE_SIZE << order) < nslots * slot_size; order++)
+    if (order == PAGE_ORDER_MAX)
+      break;
+  nslots = MIN(nslots, (PAGE_SIZE << order) / slot_size);
+
+  if ((map_page = page_alloc_block(order, PAGE_ALLOC_ZERO | PAGE_ALLOC_TRY,
+                                   PAGE_TAG_SWAP)) == NULL) {
+    r = -ENOMEM;
+    goto out2;
+  }
+
+  if ((swap_inode != NULL) ||
+      ((r = swap_file_fill(inode, nslots, nblocks,
+                           (uint32_t *) page2kva(map_page))) < 0)) {
+    page_free_block(map_page, order);
+    r = (r < 0) ? r : -EBUSY;
+    goto out2;
+  }
+
+  fs_inode_unlock(inode);
+
+  k_spinlock_acquire(&swap_lock);
+
+  if (swap_inode != NULL) {
+    k_spinlock_release(&swap_lock);
+    page_free_block(map_page, order);
+    r = -EBUSY;
+    goto out1;
+  }
+
+  swap_blocks      = (uint32_t *) page2kva(map_page);
+  swap_map         = (uint16_t *) (swap_blocks + nslots * nblocks);
+  swap_slot_blocks = nblocks;
+  swap_block_size  = PAGE_SIZE / nblocks;
+  swap_slot_count  = nslots;
+  swap_free_count = nslots;
+  swap_next       = 0;
+
+  // The swap file stays referenced until reboot
+  swap_inode = inode;
+
+  k_spinlock_release(&swap_lock);
+
+  cprintf("swap: %lu pages on %s\n", nslots, path);
+
+  return 0;
+
+out2:
+  fs_inode_unlock(inode);
+out1:
+  fs_inode_put(inode);
+  return r;
+}
+
+/**
+ * Allocate a free swap slot to write the given page to. Until the page is
+ * written out by swap_write(), reads of the slot return the contents of the
+ * page. The swapper holds one reference to both the slot and the page until
+ * then.
+ *
+ * @param page       Pointer to the page to be written to the slot
+ * @param slot_store Pointer to the memory location to store the slot number
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM No free slots, swapping is not enabled, or the previous
+ *                 page has not been written out yet
+ */
+int
+swap_alloc(struct Page *page, unsigned long *slot_store)
+{
+  unsigned long i, slot;
+
+  k_spinlock_acquire(&swap_lock);
+
+  if ((swap_free_count == 0) || (swap_pending_page != NULL)) {
+    k_spinlock_release(&swap_lock);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < swap_slot_count; i++) {
+    slot = (swap_next + i) % swap_slot_count;
+    if (swap_map[slot] == 0)
+      break;
+  }
+
+  assert(i < swap_slot_count);
+
+  swap_map[slot] = 1;
+  swap_free_count--;
+  swap_next = slot + 1;
+
+  swap_pending_page = page;
+  swap_pending_slot = slot;
+
+  page_ref_inc(page);
+
+  k_spinlock_release(&swap_lock);
+
+  *slot_store = slot;
+
+  return 0;
+}
+
+/**
+ * Increment the reference counter of a swap slot.
+ *
+ * @param slot The slot number
+ */
+void
+swap_dup(unsigned long slot)
+{
+  k_spinlock_acquire(&swap_lock);
+
+  if ((slot >= swap_slot_count) || (swap_map[slot] == 0))
+    panic("bad swap slot %lu", slot);
+  if (swap_map[slot] == UINT16_MAX)
+    panic("too many references to swap slot %lu", slot);
+
+  swap_map[slot]++;
+
+  k_spinlock_release(&swap_lock);
+}
+
+/**
+ * Decrement the reference counter of a swap slot. When the last reference is
+ * dropped, the slot becomes free.
+ *
+ * @param slot The slot number
+ */
+void
+swap_free(unsigned long slot)
+{
+  k_spinlock_acquire(&swap_lock);
+
+  if ((slot >= swap_slot_count) || (swap_map[slot] == 0))
+    panic("bad swap slot %lu", slot);
+
+  if (--swap_map[slot] == 0)
+    swap_free_count++;
+
+  k_spinlock_release(&swap_lock);
+}
+
+/**
+ * Read the contents of a swap slot. The caller must hold a reference to the
+ * slot.
+ *
+ * @param slot The slot number
+ * @param page Pointer to the page to read the data into
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+swap_read(unsigned long slot, struct Page *page)
+{
+  k_spinlock_acquire(&swap_lock);
+
+  // The page may have not been written out yet
+  if ((swap_pending_page != NULL) && (swap_pending_slot == slot)) {
+    memmove(page2kva(page), page2kva(swap_pending_page), PAGE_SIZE);
+    k_spinlock_release(&swap_lock);
+    return 0;
+  }
+
+  k_spinlock_release(&swap_lock);
+
+  return buf_io(&swap_blocks[slot * swap_slot_blocks], swap_slot_blocks,
+                swap_block_size, swap_inode->dev, page2kva(page), 0);
+}
+
+/**
+ * Write the page previously passed to swap_alloc() to its slot, and drop the
+ * references to the page and the slot taken by swap_alloc(). Does nothing if
+ * there is no such page.
+ *
+ * If the write fails, the page stays in memory and can be read through
+ * swap_read(), and the write is retried by the next call.
+ *
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+swap_write(void)
+{
+  struct Page *page;
+  unsigned long slot;
+  int r = 0, used;
+
+  k_spinlock_acquire(&swap_lock);
+  page = swap_pending_page;
+  slot = swap_pending_slot;
+  // No page table may refer to the slot anymore (e.g. the process has exited)
+  used = (page != NULL) && (swap_map[slot] > 1);
+  k_spinlock_release(&swap_lock);
+
+  if (page == NULL)
+    return 0;
+
+  if (used &&
+      ((r = buf_io_reserved(&swap_blocks[slot * swap_slot_blocks],
+                            swap_slot_blocks, swap_block_size, swap_inode->dev,
+                            page2kva(page), 1)) < 0)) {
+    warn("cannot write swap slot %lu: %d", slot, r);
+    return r;
+  }
+
+  k_spinlock_acquire(&swap_lock);
+  swap_pending_page = NULL;
+  k_spinlock_release(&swap_lock);
+
+  swap_free(slot);
+
+  if (page_ref_dec(page) == 0)
+    page_free_one(page);
+
+  return 0;
+}
+
+/**
+ * Wake up the swapper and wait until it tries to free some memory.
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM The swapper has not been started yet
+ */
+int
+swap_reclaim(void)
+{
+  int r;
+
+  if (swap_thread == NULL)
+    return -ENOMEM;
+
+  k_semaphore_put(&swap_semaphore);
+
+  k_spinlock_acquire(&swap_lock);
+  r = k_waitqueue_sleep(&swap_queue, &swap_lock);
+  k_spinlock_release(&swap_lock);
+
+  return r;
+}
+
+// Free one batch of memory, trying the cheapest sources first
+static int
+swap_reclaim_batch(void)
+{
+  if (page_cache_reclaim(SWAP_CACHE_BATCH) > 0)
+    return 0;
+
+  // Dirty pages of evicted inodes are written back first, so this may sleep
+  if (fs_inode_cache_reclaim(SWAP_INODE_BATCH) > 0)
+    return 0;
+
+  if ((swap_inode == NULL) || (swap_free_count == 0))
+    return -ENOMEM;
+
+  return vm_space_swap_out();
+}
+
+static void
+swap_thread_entry(void *arg)
+{
+  (void) arg;
+
+  for (;;) {
+    k_semaphore_timed_get(&swap_semaphore, ms2ticks(SWAP_INTERVAL));
+
+    // Retry the write that failed last time, if any
+    if ((swap_write() == 0) && (page_free_count < SWAP_FREE_LOW)) {
+      while ((page_free_count < SWAP_FREE_HIGH) && (swap_reclaim_batch() == 0))
+        ;
+    }
+
+    k_spinlock_acquire(&swap_lock);
+    k_waitqueue_wakeup_all(&swap_queue);
+    k_spinlock_release(&swap_lock);
+  }
+}
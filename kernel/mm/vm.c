@@ -1,14 +1,19 @@
 #include <errno.h>
 #include <kernel/console.h>
 #include <kernel/page.h>
+#include <kernel/swap.h>
 #include <kernel/vm.h>
 #include <kernel/types.h>
-#include <kernel/spinlock.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <kernel/fs/fs.h>
 
-struct KSpinLock vm_lock = K_SPINLOCK_INITIALIZER("vm_lock");
+/*
+ * The functions below do not lock anything themselves. The caller must hold
+ * the lock of the address space that owns the page table. Reference counters
+ * of the mapped pages and of shared second-level tables are protected
+ * separately (see page_ref_inc() and page_ref_dec()), since these may be
+ * referenced from several address spaces.
+ */
 
 /**
  * Find a physical page mapped at the given virtual address.
@@ -25,8 +30,6 @@ vm_page_lookup(void *pgtab, uintptr_t va, int *flags_store)
 {
   void *pte;
 
-  assert(k_spinlock_holding(&vm_lock));
-
   if ((pte = arch_vm_lookup(pgtab, va, 0)) == NULL)
     return NULL;
 
@@ -63,15 +66,13 @@ vm_page_insert(void *pgtab, struct Page *page, uintptr_t va, int flags)
 {
   void *pte;
 
-  assert(k_spinlock_holding(&vm_lock));
-
   if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
     return -ENOMEM;
 
   // Incrementing the reference counter before calling vm_page_remove() allows
   // us to elegantly handle the situation when the same page is re-inserted at
   // the same virtual address, but with different permissions
-  page->ref_count++;
+  page_ref_inc(page);
 
   // If present, remove the previous mapping
   vm_page_remove(pgtab, (uintptr_t) va);
@@ -82,39 +83,200 @@ vm_page_insert(void *pgtab, struct Page *page, uintptr_t va, int flags)
 }
 
 /**
- * Unmap the physical page at the given virtual address. If there is no page
- * mapped at this address, do nothing.
+ * Map a naturally aligned block of VM_LARGE_PAGE_SIZE bytes using a single
+ * large page. Each small page of the block is reference-counted separately.
+ * 
+ * @param pgtab Pointer to the page table
+ * @param page  Pointer to the first page of the block (allocated with order
+ *              VM_LARGE_PAGE_ORDER)
+ * @param va    The virtual address (must be aligned to VM_LARGE_PAGE_SIZE)
+ * @param flags The mapping flags
+ *
+ * @retval 0       Success
+ * @retval -EEXIST Some pages are already mapped or swapped out in the given
+ *                 range
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_page_insert_large(void *pgtab, struct Page *page, uintptr_t va, int flags)
+{
+  void *pte;
+  unsigned i;
+
+  assert((va % VM_LARGE_PAGE_SIZE) == 0);
+
+  // Swapped out pages would be overwritten along with their slot numbers
+  if (!vm_range_empty(pgtab, va, VM_LARGE_PAGE_SIZE))
+    return -EEXIST;
+
+  if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < (1U << VM_LARGE_PAGE_ORDER); i++)
+    page_ref_inc(&page[i]);
+
+  arch_vm_pte_set_large(pte, page2pa(page), flags | VM_PAGE);
+
+  return 0;
+}
+
+/**
+ * Unmap the physical page at the given virtual address, or drop the reference
+ * to the swap slot holding its contents. If there is no page mapped at this
+ * address, do nothing.
  * 
  * @param pgtab The page table
  * @param va    The virtual address
  *
- * @return 0 on success
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
  */
 int
 vm_page_remove(void *pgtab, uintptr_t va)
 {
   struct Page *page;
   void *pte;
-
-  assert(k_spinlock_holding(&vm_lock));
+  int flags;
 
   if ((pte = arch_vm_lookup(pgtab, va, 0)) == NULL)
     return 0;
 
-  if (!arch_vm_pte_valid(pte) || !(arch_vm_pte_flags(pte) & VM_PAGE))
+  flags = arch_vm_pte_flags(pte);
+  if (arch_vm_pte_valid(pte) ? !(flags & VM_PAGE) : !(flags & VM_SWAP))
     return 0;
 
-  page = pa2page(arch_vm_pte_addr(pte));
+  // The page table may be shared with another address space
+  if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
+    return -ENOMEM;
+
+  if (arch_vm_pte_valid(pte)) {
+    page = pa2page(arch_vm_pte_addr(pte));
+
+    // No CPU may access the page through a stale TLB entry once it is freed
+    arch_vm_pte_clear(pte);
+    arch_vm_invalidate(va);
+
+    if (page_ref_dec(page) == 0)
+      page_free_one(page);
+  } else {
+    unsigned long slot = arch_vm_pte_swap_slot(pte);
+
+    arch_vm_pte_clear(pte);
+    arch_vm_invalidate(va);
+
+    swap_free(slot);
+  }
+
+  return 0;
+}
+
+/**
+ * Change the mapping flags of the page mapped at the given virtual address,
+ * keeping the reference to the page.
+ *
+ * @param pgtab The page table
+ * @param va    The virtual address (a page must be mapped there)
+ * @param flags The new mapping flags
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_page_protect(void *pgtab, uintptr_t va, int flags)
+{
+  void *pte;
+
+  // The page table may be shared with another address space
+  if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
+    return -ENOMEM;
 
-  if (--page->ref_count == 0)
-    page_free_one(page);
+  assert(arch_vm_pte_valid(pte) && (arch_vm_pte_flags(pte) & VM_PAGE));
 
-  arch_vm_pte_clear(pte);
+  arch_vm_pte_set(pte, arch_vm_pte_addr(pte), flags | VM_PAGE);
   arch_vm_invalidate(va);
 
   return 0;
 }
 
+/**
+ * Find the swap slot holding the contents of the page swapped out from the
+ * given virtual address.
+ * 
+ * @param pgtab      Pointer to the page table to search
+ * @param va         The virtual address to search for
+ * @param slot_store Pointer to the memory location to store the slot number
+ *
+ * @retval 0       Success
+ * @retval -ENOENT The page at the given address is not swapped out
+ */
+int
+vm_swap_lookup(void *pgtab, uintptr_t va, unsigned long *slot_store)
+{
+  void *pte;
+
+  if ((pte = arch_vm_lookup(pgtab, va, 0)) == NULL)
+    return -ENOENT;
+
+  if (arch_vm_pte_valid(pte) || !(arch_vm_pte_flags(pte) & VM_SWAP))
+    return -ENOENT;
+
+  *slot_store = arch_vm_pte_swap_slot(pte);
+
+  return 0;
+}
+
+/**
+ * Replace the mapping at the given virtual address with a reference to the
+ * swap slot holding the contents of the page.
+ * 
+ * @param pgtab Pointer to the page table
+ * @param va    The virtual address
+ * @param slot  The swap slot number
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_swap_insert(void *pgtab, uintptr_t va, unsigned long slot)
+{
+  void *pte;
+
+  if ((pte = arch_vm_lookup(pgtab, va, 1)) == NULL)
+    return -ENOMEM;
+
+  // As in vm_page_insert(), take the new reference first
+  swap_dup(slot);
+
+  vm_page_remove(pgtab, va);
+
+  arch_vm_pte_set_swap(pte, slot);
+
+  return 0;
+}
+
+/**
+ * Check that no pages are mapped or swapped out in the given range.
+ * 
+ * @param pgtab Pointer to the page table
+ * @param va    The starting virtual address (must be page-aligned)
+ * @param n     The size of the range in bytes
+ *
+ * @return 1 if the range is empty, 0 otherwise
+ */
+int
+vm_range_empty(void *pgtab, uintptr_t va, size_t n)
+{
+  unsigned long slot;
+  uintptr_t end;
+
+  for (end = va + n; va < end; va += PAGE_SIZE)
+    if ((vm_page_lookup(pgtab, va, NULL) != NULL) ||
+        (vm_swap_lookup(pgtab, va, &slot) == 0))
+      return 0;
+
+  return 1;
+}
+
 static struct Page *
 vm_page_cow(void *pgtab, uintptr_t va, struct Page *page, int flags)
 {
@@ -125,8 +287,14 @@ vm_page_cow(void *pgtab, uintptr_t va, struct Page *page, int flags)
   flags &= ~VM_COW;
   flags |= VM_WRITE;
 
+  // Make sure the page table is not shared with another address space, so
+  // that the reference counter accounts for all mappings of the page
+  if (arch_vm_lookup(pgtab, va, 1) == NULL)
+    return NULL;
+
   // If this is the only one occurence of the page, simply re-insert it with
-  // new permissions
+  // new permissions. Other address spaces can only drop their references
+  // concurrently, so at worst the page is copied needlessly
   if (page->ref_count == 1) {
     if (vm_page_insert(pgtab, page, va, flags) < 0)
       return NULL;
@@ -134,7 +302,8 @@ vm_page_cow(void *pgtab, uintptr_t va, struct Page *page, int flags)
   }
 
   // Otherwise, insert a copy of the entire page in its place
-  if ((page_copy = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL)
+  if ((page_copy = page_alloc_one(PAGE_ALLOC_ZERO | PAGE_ALLOC_TRY |
+                                   PAGE_ALLOC_MOVABLE, PAGE_TAG_ANON)) == NULL)
     return NULL;
 
   memmove(page2kva(page_copy), page2kva(page), PAGE_SIZE);
@@ -170,13 +339,6 @@ vm_page_lookup_cow(void *pgtab, uintptr_t va, struct Page **page_store,
   return 0;
 }
 
-static void
-vm_user_assert(uintptr_t start_va, uintptr_t end_va)
-{
-  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
-    panic("invalid va range: [%p,%p)", start_va, end_va);
-}
-
 static void
 vm_user_assert_pages(uintptr_t start_va, uintptr_t end_va)
 {
@@ -186,423 +348,330 @@ vm_user_assert_pages(uintptr_t start_va, uintptr_t end_va)
     panic("invalid va range: [%p,%p)", start_va, end_va);
 }
 
+/**
+ * Unmap all pages in the given range of user addresses and free the page
+ * tables that become empty.
+ *
+ * @param vm       Pointer to the page table
+ * @param start_va The starting virtual address
+ * @param n        The size of the range in bytes
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory while making a private copy of a shared page
+ *                 table (the pages before the failing one are unmapped)
+ */
 int
-vm_clear(void *pgtab, uintptr_t dst_va, size_t n)
-{
-  vm_user_assert(dst_va, dst_va + n);
-
-  while (n != 0) {
-    struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
-    int r;
-
-    offset = dst_va % PAGE_SIZE;
-    ncopy = MIN(PAGE_SIZE - offset, n);
-
-    k_spinlock_acquire(&vm_lock);
-
-    if ((r = vm_page_lookup_cow(pgtab, dst_va, &page, NULL)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
-    }
-
-    kva = (uint8_t *) page2kva(page);
-    memset(kva + offset, 0, ncopy);
-
-    k_spinlock_release(&vm_lock);
-
-    dst_va += ncopy;
-    n      -= ncopy;
-  }
-
-  return 0;
-}
-
-int
-vm_copy_out(void *pgtab, const void *src, uintptr_t dst_va, size_t n)
-{
-  uint8_t *p = (uint8_t *) src;
-
-  vm_user_assert(dst_va, dst_va + n);
-
-  while (n != 0) {
-    struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
-    int r;
-
-    offset = dst_va % PAGE_SIZE;
-    ncopy = MIN(PAGE_SIZE - offset, n);
-
-    k_spinlock_acquire(&vm_lock);
-
-    if ((r = vm_page_lookup_cow(pgtab, dst_va, &page, NULL)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
-    }
-
-    kva = (uint8_t *) page2kva(page);
-    memmove(kva + offset, p, ncopy);
-
-    k_spinlock_release(&vm_lock);
-
-    p      += ncopy;
-    dst_va += ncopy;
-    n      -= ncopy;
-  }
-
-  return 0;
-}
-
-int
-vm_copy_in(void *vm, void *dst, uintptr_t src_va, size_t n)
-{
-  uint8_t *p = (uint8_t *) dst;
-
-  vm_user_assert(src_va, src_va + n);
-
-  while (n != 0) {
-    struct Page *page;
-    uint8_t *kva;
-    size_t offset, ncopy;
-
-    offset = src_va % PAGE_SIZE;
-    ncopy  = MIN(PAGE_SIZE - offset, n);
-
-    k_spinlock_acquire(&vm_lock);
-
-    if ((page = vm_page_lookup(vm, src_va, NULL)) == NULL) {
-      k_spinlock_release(&vm_lock);
-      return -EFAULT;
-    }
-
-    kva = (uint8_t *) page2kva(page);
-    memmove(p, kva + offset, ncopy);
-
-    k_spinlock_release(&vm_lock);
-
-    src_va += ncopy;
-    p      += ncopy;
-    n      -= ncopy;
-  }
-
-  return 0;
-}
-
-int
-vm_user_alloc(void *vm, uintptr_t start_va, size_t n, int flags)
+vm_user_free(void *vm, uintptr_t start_va, size_t n)
 {
-  struct Page *page;
   uintptr_t va, end_va;
-  int r;
+  int r = 0;
 
   end_va = ROUND_UP(start_va + n, PAGE_SIZE);
   vm_user_assert_pages(start_va, end_va);
 
-  for (va = start_va; va < end_va; va += PAGE_SIZE) {
-    k_spinlock_acquire(&vm_lock);
-
-    if ((page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL) {
-      k_spinlock_release(&vm_lock);
+  for (va = start_va; va < end_va; va += PAGE_SIZE)
+    if ((r = vm_page_remove(vm, va)) < 0)
+      break;
 
-      vm_user_free(vm, start_va, va - start_va);
-      
-      return -ENOMEM;
-    }
-
-    if ((r = (vm_page_insert(vm, page, va, flags)) != 0)) {
-      page_free_one(page);
-      k_spinlock_release(&vm_lock);
+  if (va != start_va)
+    arch_vm_trim(vm, start_va, va);
 
-      vm_user_free(vm, start_va, va - start_va);
-
-      return r;
-    }
-
-    k_spinlock_release(&vm_lock);
-  }
-
-  return 0;
-}
-
-void
-vm_user_free(void *vm, uintptr_t start_va, size_t n)
-{
-  uintptr_t va, end_va;
-
-  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
-  vm_user_assert_pages(start_va, end_va);
-
-  for (va = start_va; va < end_va; va += PAGE_SIZE) {
-    k_spinlock_acquire(&vm_lock);
-    vm_page_remove(vm, va);
-    k_spinlock_release(&vm_lock);
-  }
+  return r;
 }
 
+/**
+ * Prepare the given range of user addresses to be cloned into another address
+ * space by vm_user_clone().
+ *
+ * If the range is to be shared, all copy-on-write pages present in the range
+ * are copied, so that both address spaces refer to the same physical pages.
+ * Otherwise, all writable pages are made copy-on-write.
+ *
+ * @param vm       Pointer to the page table
+ * @param start_va The starting virtual address
+ * @param n        The size of the range in bytes
+ * @param share    Whether the range is to be shared
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory
+ */
 int
-vm_user_clone(void *src, void *dst, uintptr_t start_va, size_t n, int share)
+vm_user_clone_prepare(void *vm, uintptr_t start_va, size_t n, int share)
 {
   uintptr_t va, end_va;
+  int r;
 
   end_va = ROUND_UP(start_va + n, PAGE_SIZE);
   vm_user_assert_pages(start_va, end_va);
  
-  for (va = start_va ; va < end_va; va += PAGE_SIZE) {
+  for (va = start_va; va < end_va; va += PAGE_SIZE) {
     struct Page *page;
-    int flags, r;
+    int flags;
 
-    k_spinlock_acquire(&vm_lock);
+    // Pages that have never been touched are not present in the source page
+    // table, the fault handler will populate them in both address spaces
+    if ((page = vm_page_lookup(vm, va, &flags)) == NULL)
+      continue;
 
     if (share) {
       // When creating a shared region, remove the copy-on-write bit
-      if ((r = vm_page_lookup_cow(src, va, &page, &flags)) < 0) {
-        k_spinlock_release(&vm_lock);
+      if ((flags & VM_COW) &&
+          ((r = vm_page_lookup_cow(vm, va, NULL, NULL)) < 0))
         return r;
-      }
-    } else {
-      if ((page = vm_page_lookup(src, va, &flags)) == NULL) {
-        k_spinlock_release(&vm_lock);
-        return -EFAULT;
-      }
-
-      if (flags & VM_WRITE) {
-        flags &= ~VM_WRITE;
-        flags |= VM_COW;
-
-        if ((r = vm_page_insert(src, page, va, flags)) < 0) {
-          k_spinlock_release(&vm_lock);
-          return r;
-        }
-      }
-    }
+    } else if (flags & VM_WRITE) {
+      // Tables shared by an earlier fork have all private pages marked
+      // copy-on-write already, so they are not copied here
+      flags &= ~VM_WRITE;
+      flags |= VM_COW;
 
-    if ((r = vm_page_insert(dst, page, va, flags)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
+      if ((r = vm_page_insert(vm, page, va, flags)) < 0)
+        return r;
     }
-
-    k_spinlock_release(&vm_lock);
   }
 
   return 0;
 }
 
-static int
-vm_flags_check(int curr_flags, int flags)
+/**
+ * Clone all mappings from one user page table into another one. The page
+ * tables themselves are shared and copied only when either side modifies
+ * them, so the cost doesn't depend on the number of mapped pages.
+ *
+ * vm_user_clone_prepare() must be called for every mapped range beforehand.
+ *
+ * @param src Pointer to the source page table
+ * @param dst Pointer to the destination page table (must be empty)
+ */
+void
+vm_user_clone(void *src, void *dst)
 {
-  if (curr_flags & VM_COW) {
-    curr_flags &= ~VM_COW;
-    curr_flags |= VM_WRITE;
-  }
-
-  return (curr_flags & flags) == flags;
+  arch_vm_share(dst, src);
 }
 
-int
-vm_user_check_ptr(void *pgtab, uintptr_t va, int flags)
+/**
+ * Destroy a user page table, unmapping all pages that are still mapped.
+ *
+ * @param vm Pointer to the page table
+ */
+void
+vm_user_destroy(void *vm)
 {
-  int curr_flags;
-
-  if (va >= VIRT_KERNEL_BASE)
-    return -EFAULT;
-
-  k_spinlock_acquire(&vm_lock);
-
-  if (vm_page_lookup(pgtab, va, &curr_flags) == NULL) {
-    k_spinlock_release(&vm_lock);
-    return -EFAULT;
-  }
-
-  k_spinlock_release(&vm_lock);
-
-  if (!vm_flags_check(curr_flags, flags))
-    return -EFAULT;
-
-  return 0;
+  arch_vm_destroy(vm);
 }
 
+/**
+ * Move all pages mapped in the given range of user addresses to another range
+ * of the same page table, without copying their contents. The destination
+ * range must not overlap the source one and must not contain any mappings.
+ *
+ * @param vm     Pointer to the page table
+ * @param dst_va The destination virtual address
+ * @param src_va The source virtual address
+ * @param n      The size of the range in bytes
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM Out of memory (nothing is moved in this case)
+ */
 int
-vm_user_check_str(void *vm, uintptr_t va, size_t *len_ptr, int flags)
+vm_user_move(void *vm, uintptr_t dst_va, uintptr_t src_va, size_t n)
 {
-  size_t len = 0;
-
-  while (va < VIRT_KERNEL_BASE) {
-    const char *p;
-    struct Page *page;
-    unsigned off;
-    int curr_flags;
-
-    k_spinlock_acquire(&vm_lock);
-
-    page = vm_page_lookup(vm, va, &curr_flags);
-
-    if ((page == NULL) || !vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
-      return -EFAULT;
+  uintptr_t off, end;
+  unsigned long slot;
+
+  end = ROUND_UP(n, PAGE_SIZE);
+  vm_user_assert_pages(src_va, src_va + end);
+  vm_user_assert_pages(dst_va, dst_va + end);
+
+  // Allocate the page tables beforehand (and make private copies of the
+  // shared source ones), so that moving a page cannot fail
+  for (off = 0; off < end; off += PAGE_SIZE) {
+    if (((vm_page_lookup(vm, src_va + off, NULL) != NULL) ||
+         (vm_swap_lookup(vm, src_va + off, &slot) == 0)) &&
+        ((arch_vm_lookup(vm, src_va + off, 1) == NULL) ||
+         (arch_vm_lookup(vm, dst_va + off, 1) == NULL))) {
+      vm_user_free(vm, dst_va, end);
+      return -ENOMEM;
     }
+  }
 
-    p = (const char *) page2kva(page);
-
-    for (off = va % PAGE_SIZE; off < PAGE_SIZE; off++) {
-      if (p[off] == '\0') {
-        if (len_ptr)
-          *len_ptr = len;
-
-        k_spinlock_release(&vm_lock);
-
-        return 0;
-      }
-
-      len++;
-      va++;
+  for (off = 0; off < end; off += PAGE_SIZE) {
+    struct Page *page;
+    int flags;
+
+    if ((page = vm_page_lookup(vm, src_va + off, &flags)) != NULL) {
+      if (vm_page_insert(vm, page, dst_va + off, flags) < 0)
+        panic("cannot move page");
+    } else if (vm_swap_lookup(vm, src_va + off, &slot) == 0) {
+      if (vm_swap_insert(vm, dst_va + off, slot) < 0)
+        panic("cannot move swap slot");
+    } else {
+      continue;
     }
 
-    k_spinlock_release(&vm_lock);
+    vm_page_remove(vm, src_va + off);
   }
 
-  return -EFAULT;
+  arch_vm_trim(vm, src_va, src_va + end);
+
+  return 0;
 }
 
-int
-vm_user_check_args(void *vm, uintptr_t va, size_t *len_ptr, int flags)
+/**
+ * Look for a page to be swapped out in the given range of user addresses.
+ *
+ * Only private anonymous pages that are not mapped anywhere else can be
+ * swapped out. The MMU doesn't track accesses to pages, so the CLOCK algorithm
+ * is emulated in software: the first time a page is scanned, it is marked
+ * VM_OLD and becomes inaccessible for the user. If the page is used before the
+ * next scan, the fault handler clears the mark. Pages that are still marked
+ * on the next scan are returned.
+ *
+ * @param vm     Pointer to the page table
+ * @param va_ptr Pointer to the starting virtual address. On return, holds the
+ *               address of the page found or the ending address of the range
+ * @param end_va The ending virtual address
+ *
+ * @return Pointer to the page or NULL if no page is found
+ */
+struct Page *
+vm_user_scan(void *vm, uintptr_t *va_ptr, uintptr_t end_va)
 {
-  size_t len = 0;
-
-  if (va % sizeof(char *) != 0)
-    return -EFAULT;
-
-  while (va < VIRT_KERNEL_BASE) {
-    const char **p;
-    struct Page *page;
-    unsigned off;
-    int curr_flags;
-
-    k_spinlock_acquire(&vm_lock);
+  struct Page *page;
+  uintptr_t va;
+  int flags;
 
-    page = vm_page_lookup(vm, va, &curr_flags);
+  vm_user_assert_pages(*va_ptr, end_va);
 
-    if ((page == NULL) || !vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
-      return -EFAULT;
+  for (va = *va_ptr; va < end_va; va += PAGE_SIZE) {
+    // Skip the whole range covered by a missing second-level table
+    if (arch_vm_lookup(vm, va, 0) == NULL) {
+      va = ROUND_DOWN(va, VM_TABLE_SIZE) + VM_TABLE_SIZE - PAGE_SIZE;
+      continue;
     }
 
-    p = (const char **) page2kva(page);
-
-    for (off = (va % PAGE_SIZE) / sizeof *p; off < PAGE_SIZE / sizeof *p; off++) {
-      if (p[off] == NULL) {
-        if (len_ptr)
-          *len_ptr = len;
-
-        k_spinlock_release(&vm_lock);
+    if ((page = vm_page_lookup(vm, va, &flags)) == NULL)
+      continue;
 
-        return 0;
-      }
+    // The shared zero page and pages of shared tables have larger reference
+    // counters than the number of their mappings in this page table
+    if ((flags & VM_SHARED) || (page->debug_tag != PAGE_TAG_ANON) ||
+        (page->ref_count != 1) || arch_vm_shared(vm, va))
+      continue;
 
-      len++;
-      va += sizeof *p;
+    if (flags & VM_OLD) {
+      *va_ptr = va;
+      return page;
     }
 
-    k_spinlock_release(&vm_lock);
+    // The table is private, so this cannot fail
+    vm_page_insert(vm, page, va, flags | VM_OLD);
   }
 
-  return -EFAULT;
+  *va_ptr = end_va;
+
+  return NULL;
 }
 
+/**
+ * Migrate private anonymous pages mapped in the given range of user addresses
+ * out of the given block of physical pages. The contents of each such page is
+ * copied to a newly allocated page, which is then mapped in its place.
+ *
+ * @param vm     Pointer to the page table
+ * @param va     The starting virtual address
+ * @param end_va The ending virtual address
+ * @param start  Pointer to the first page of the block
+ * @param npages The number of pages in the block
+ *
+ * @return The number of pages migrated, or -ENOMEM if out of memory
+ */
 int
-vm_user_check_buf(void *pgtab, uintptr_t start_va, size_t n, int flags)
+vm_user_compact(void *vm, uintptr_t va, uintptr_t end_va, struct Page *start,
+                unsigned npages)
 {
-  struct Page *page;
-  uintptr_t va, end_va;
-
-  end_va = ROUND_UP(start_va + n, PAGE_SIZE);
-  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
-    return -EFAULT;
+  struct Page *page, *copy;
+  int flags, count = 0;
 
-  for (va = start_va; va < end_va; va += PAGE_SIZE) {
-    int r, curr_flags;
-
-    k_spinlock_acquire(&vm_lock);
+  vm_user_assert_pages(va, end_va);
 
-    // TODO: do not do copy-on-write before actual memory access!
-    if ((r = vm_page_lookup_cow(pgtab, va, &page, &curr_flags)) < 0) {
-      k_spinlock_release(&vm_lock);
-      return r;
+  for ( ; va < end_va; va += PAGE_SIZE) {
+    // Skip the whole range covered by a missing second-level table
+    if (arch_vm_lookup(vm, va, 0) == NULL) {
+      va = ROUND_DOWN(va, VM_TABLE_SIZE) + VM_TABLE_SIZE - PAGE_SIZE;
+      continue;
     }
 
-    if (!vm_flags_check(curr_flags, flags)) {
-      k_spinlock_release(&vm_lock);
-      return -EFAULT;
-    }
+    if ((page = vm_page_lookup(vm, va, &flags)) == NULL)
+      continue;
 
-    k_spinlock_release(&vm_lock);
-  }
+    if ((page < start) || (page >= start + npages))
+      continue;
 
-  return 0;
-}
+    // Without reverse mappings, only pages that are mapped exactly once can
+    // be migrated (see vm_user_scan())
+    if ((flags & VM_SHARED) || (page->debug_tag != PAGE_TAG_ANON) ||
+        (page->ref_count != 1) || arch_vm_shared(vm, va))
+      continue;
 
-int
-vm_handle_fault(void *pgtab, uintptr_t va)
-{
-  struct Page *fault_page;
-  int flags;
+    copy = page_alloc_one(PAGE_ALLOC_TRY | PAGE_ALLOC_MOVABLE, PAGE_TAG_ANON);
+    if (copy == NULL)
+      return -ENOMEM;
 
-  if ((va < PAGE_SIZE) || (va >= VIRT_KERNEL_BASE))
-    return -EFAULT;
+    // Unmap the page and flush it from the TLBs of all CPUs before copying,
+    // so that no user write can slip in behind the copy. The fault handler
+    // waits for the address space lock until the new page is mapped. The
+    // table is private, so neither removing nor inserting can fail
+    page_ref_inc(page);
+    vm_page_remove(vm, va);
 
-  k_spinlock_acquire(&vm_lock);
+    memmove(page2kva(copy), page2kva(page), PAGE_SIZE);
 
-  fault_page = vm_page_lookup(pgtab, va, &flags);
+    if (vm_page_insert(vm, copy, va, flags) < 0)
+      panic("cannot map the migrated page");
 
-  if ((fault_page == NULL) || !(flags & VM_COW)) {
-    k_spinlock_release(&vm_lock);
-    return -EFAULT;
-  }
+    if (page_ref_dec(page) == 0)
+      page_free_one(page);
 
-  if (vm_page_cow(pgtab, va, fault_page, flags) == NULL) {
-    k_spinlock_release(&vm_lock);
-    return -ENOMEM;
+    count++;
   }
 
-  k_spinlock_release(&vm_lock);
-  
-  return 0;
+  return count;
 }
 
-int
-vm_space_load_inode(void *pgtab, void *va, struct Inode *ip, size_t n, off_t off)
+/**
+ * Count the pages mapped and the pages swapped out in the given range of user
+ * addresses.
+ *
+ * @param vm             Pointer to the page table
+ * @param va             The starting virtual address
+ * @param end_va         The ending virtual address
+ * @param resident_store Pointer to the memory location to store the number of
+ *                       mapped pages
+ * @param swapped_store  Pointer to the memory location to store the number of
+ *                       swapped out pages
+ */
+void
+vm_user_count(void *vm, uintptr_t va, uintptr_t end_va,
+              unsigned long *resident_store, unsigned long *swapped_store)
 {
-  struct Page *page;
-  uint8_t *dst, *kva;
-  int ncopy, offset;
-  int r;
-
-  dst = (uint8_t *) va;
+  unsigned long resident = 0, swapped = 0, slot;
+  int flags;
 
-  while (n != 0) {
-    k_spinlock_acquire(&vm_lock);
+  vm_user_assert_pages(va, end_va);
 
-    page = vm_page_lookup(pgtab, (uintptr_t) dst, NULL);
-    if (page == NULL) {
-      return -EFAULT;
+  for ( ; va < end_va; va += PAGE_SIZE) {
+    // Skip the whole range covered by a missing second-level table
+    if (arch_vm_lookup(vm, va, 0) == NULL) {
+      va = ROUND_DOWN(va, VM_TABLE_SIZE) + VM_TABLE_SIZE - PAGE_SIZE;
+      continue;
     }
 
-    // TODO: unsafe?
-
-    k_spinlock_release(&vm_lock);
-
-    kva = (uint8_t *) page2kva(page);
-
-    offset = (uintptr_t) dst % PAGE_SIZE;
-    ncopy  = MIN(PAGE_SIZE - offset, n);
-
-    if ((r = fs_inode_read_locked(ip, (uintptr_t) kva + offset, ncopy, &off)) != ncopy)
-      return r;
-
-    dst += ncopy;
-    n   -= ncopy;
+    if (vm_page_lookup(vm, va, &flags) != NULL)
+      resident++;
+    else if (vm_swap_lookup(vm, va, &slot) == 0)
+      swapped++;
   }
 
-  return 0;
+  *resident_store = resident;
+  *swapped_store  = swapped;
 }
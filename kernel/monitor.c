@@ -4,6 +4,7 @@
 #include <kernel/tty.h>
 #include <kernel/console.h>
 #include <kernel/kdebug.h>
+#include <kernel/kmeminfo.h>
 #include <kernel/object_pool.h>
 #include <kernel/mm/memlayout.h>
 #include <kernel/monitor.h>
@@ -89,7 +90,7 @@ static struct Command commands[] = {
   { "help", "Print this list of commands", mon_help },
   { "kerninfo", "Print this list of commands", mon_kerninfo },
   { "backtrace", "Display a list of function call frames", mon_backtrace },
-  { "kmeminfo", "Display the list of object caches", mon_kmeminfo },
+  { "kmeminfo", "Display kernel memory usage", mon_kmeminfo },
 };
 
 #define MAXARGS 16
@@ -198,9 +199,21 @@ mon_backtrace(int argc, char **argv, struct TrapFrame *tf)
 int
 mon_kmeminfo(int argc, char **argv, struct TrapFrame *tf)
 {
+  char *buf;
+
   (void) argc;
   (void) argv;
   (void) tf;
 
+  if ((buf = (char *) k_malloc(KMEMINFO_SIZE_MAX)) == NULL) {
+    cprintf("kmeminfo: out of memory\n");
+    return 0;
+  }
+
+  kmeminfo_print(buf, KMEMINFO_SIZE_MAX);
+  cprintf("%s", buf);
+
+  k_free(buf);
+
   return 0;
 }
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include <kernel/console.h>
 #include <kernel/fs/file.h>
@@ -12,6 +13,11 @@
 
 static struct KObjectPool *pipe_cache;
 
+// User memory cannot be accessed while holding the pipe spinlock (the page
+// fault handler may need to sleep), so the data is copied through a small
+// buffer on the stack
+#define PIPE_BOUNCE_SIZE  128
+
 void
 pipe_init(void)
 {
@@ -125,8 +131,10 @@ pipe_close(struct File *file)
 ssize_t
 pipe_read(struct File *file, uintptr_t va, size_t n)
 {
-  size_t i;
+  char buf[PIPE_BOUNCE_SIZE];
+  size_t i, count, first;
   struct Pipe *pipe = file->pipe;
+  int r;
 
   if (file->type != FD_PIPE)
     return -EBADF;
@@ -134,32 +142,31 @@ pipe_read(struct File *file, uintptr_t va, size_t n)
   k_spinlock_acquire(&pipe->lock);
 
   while (pipe->write_open && (pipe->size == 0)) {
-    int r;
-
     if ((r = k_waitqueue_sleep(&pipe->read_queue, &pipe->lock)) < 0) {
       k_spinlock_release(&pipe->lock);
       return r;
     }
   }
-  
-  // TODO: could copy all available data in one or two steps
 
-  for (i = 0; (i < n) && (pipe->size > 0); i++, pipe->size--) {
-    int r;
+  for (i = 0; (i < n) && (pipe->size > 0); i += count) {
+    count = MIN(MIN(n - i, pipe->size), sizeof(buf));
+    first = MIN(count, PAGE_SIZE - pipe->read_pos);
 
-    r = vm_space_copy_out(&pipe->data[pipe->read_pos++], va + i, 1);
+    memmove(&buf[0], &pipe->data[pipe->read_pos], first);
+    memmove(&buf[first], &pipe->data[0], count - first);
 
-    if (pipe->read_pos == PAGE_SIZE)
-      pipe->read_pos = 0;
+    pipe->read_pos = (pipe->read_pos + count) % PAGE_SIZE;
+    pipe->size    -= count;
 
-    if (r < 0) {
-      k_waitqueue_wakeup_all(&pipe->write_queue);
-      k_spinlock_release(&pipe->lock);
+    k_waitqueue_wakeup_all(&pipe->write_queue);
+
+    k_spinlock_release(&pipe->lock);
+
+    if ((r = vm_space_copy_out(buf, va + i, count)) < 0)
       return r;
-    }
-  }
 
-  k_waitqueue_wakeup_all(&pipe->write_queue);
+    k_spinlock_acquire(&pipe->lock);
+  }
 
   k_spinlock_release(&pipe->lock);
 
@@ -169,41 +176,51 @@ pipe_read(struct File *file, uintptr_t va, size_t n)
 ssize_t
 pipe_write(struct File *file, uintptr_t va, size_t n)
 {
-  size_t i;
+  char buf[PIPE_BOUNCE_SIZE];
+  size_t i, j, count, space, first;
   struct Pipe *pipe = file->pipe;
+  int r;
 
   if (file->type != FD_PIPE)
     return -EBADF;
-  
-  k_spinlock_acquire(&pipe->lock);
 
-  // TODO: could copy all available data in one or two steps
+  for (i = 0; i < n; i += count) {
+    count = MIN(n - i, sizeof(buf));
 
-  for (i = 0; i < n; i++) {
-    int r;
+    if ((r = vm_space_copy_in(buf, va + i, count)) < 0)
+      return r;
+
+    k_spinlock_acquire(&pipe->lock);
+
+    for (j = 0; j < count; j += space) {
+      while (pipe->read_open && (pipe->size == PAGE_SIZE)) {
+        if ((r = k_waitqueue_sleep(&pipe->write_queue, &pipe->lock)) < 0) {
+          k_spinlock_release(&pipe->lock);
+          return r;
+        }
+      }
 
-    while (pipe->read_open && (pipe->size == PAGE_SIZE)) {
-      if ((r = k_waitqueue_sleep(&pipe->write_queue, &pipe->lock)) < 0) {
+      // Nobody is going to read the data
+      if (!pipe->read_open) {
         k_spinlock_release(&pipe->lock);
-        return r;
+        return -EPIPE;
       }
-    }
 
-    r = vm_space_copy_in(&pipe->data[pipe->write_pos++], va + i, 1);
-  
-    if (pipe->write_pos == PAGE_SIZE)
-      pipe->write_pos = 0;
+      space = MIN(count - j, PAGE_SIZE - pipe->size);
+      first = MIN(space, PAGE_SIZE - pipe->write_pos);
 
-    if (pipe->size++ == 0)
-      k_waitqueue_wakeup_all(&pipe->read_queue);
+      memmove(&pipe->data[pipe->write_pos], &buf[j], first);
+      memmove(&pipe->data[0], &buf[j + first], space - first);
 
-    if (r < 0) {
-      k_spinlock_release(&pipe->lock);
-      return r;
+      pipe->write_pos = (pipe->write_pos + space) % PAGE_SIZE;
+
+      if (pipe->size == 0)
+        k_waitqueue_wakeup_all(&pipe->read_queue);
+      pipe->size += space;
     }
-  }
 
-  k_spinlock_release(&pipe->lock);
+    k_spinlock_release(&pipe->lock);
+  }
 
   return i;
 }
@@ -16,6 +16,8 @@
 #include <kernel/types.h>
 #include <kernel/core/irq.h>
 
+#include "process_private.h"
+
 #define STACK_BOTTOM  (VIRT_USTACK_TOP - USTACK_SIZE)
 #define STACK_PROT    (PROT_READ | PROT_WRITE | VM_USER)
 
@@ -28,7 +30,7 @@ user_stack_put(struct VMSpace *vm, const void *buf, size_t n, uintptr_t *va_p)
   if (va < STACK_BOTTOM)
     return -E2BIG;
 
-  if ((r = vm_copy_out(vm->pgtab, buf, va, n)) < 0)
+  if ((r = vm_copy_out(vm, buf, va, n)) < 0)
     return r;
 
   *va_p = va;
@@ -94,7 +96,7 @@ user_stack_init(char *const argv[], char *const envp[], struct ExecContext *e)
   uintptr_t va;
   int r;
 
-  va = vmspace_map(e->vm, STACK_BOTTOM, USTACK_SIZE, STACK_PROT);
+  va = vmspace_map(e->vm, STACK_BOTTOM, USTACK_SIZE, STACK_PROT, NULL, 0);
   if (va != STACK_BOTTOM)
     return (int) va;
 
@@ -227,6 +229,69 @@ resolve(const char *path, struct ExecContext *ctx)
   return 0;
 }
 
+static int
+load_segment(struct ExecContext *ctx, Elf32_Phdr *ph)
+{
+  uintptr_t start, file_end, mem_end, copy_start, a;
+  int prot;
+
+  start   = ROUND_DOWN(ph->vaddr, PAGE_SIZE);
+  mem_end = ROUND_UP(ph->vaddr + ph->memsz, PAGE_SIZE);
+
+  // If the segment cannot be mapped page by page, copy it into anonymous
+  // memory
+  if ((ph->vaddr % PAGE_SIZE) != (ph->offset % PAGE_SIZE)) {
+    a = vmspace_map(ctx->vm, start, mem_end - start,
+                    PROT_READ | PROT_WRITE | PROT_EXEC | VM_USER, NULL, 0);
+    if (a != start)
+      return (int) a;
+
+    return vm_space_load_inode(ctx->vm, (void *) ph->vaddr, ctx->inode,
+                               ph->filesz, ph->offset);
+  }
+
+  prot = VM_USER;
+  if (ph->flags & PF_R)
+    prot |= PROT_READ;
+  if (ph->flags & PF_W)
+    prot |= PROT_WRITE;
+  if (ph->flags & PF_X)
+    prot |= PROT_EXEC;
+
+  // Map the pages backed by the file directly from the page cache: read-only
+  // segments are shared between all processes running the same binary,
+  // writable segments are copy-on-write. The last partial page of a writable
+  // segment is also used by .bss, so its tail must be cleared, not mapped
+  if (prot & PROT_WRITE)
+    file_end = ROUND_DOWN(ph->vaddr + ph->filesz, PAGE_SIZE);
+  else
+    file_end = ROUND_UP(ph->vaddr + ph->filesz, PAGE_SIZE);
+
+  if (file_end > start) {
+    a = vmspace_map(ctx->vm, start, file_end - start, prot, ctx->inode,
+                    ROUND_DOWN(ph->offset, PAGE_SIZE));
+    if (a != start)
+      return (int) a;
+  }
+
+  if (mem_end <= file_end)
+    return 0;
+
+  // The rest of the segment is anonymous zero-filled memory
+  a = vmspace_map(ctx->vm, file_end, mem_end - file_end, prot, NULL, 0);
+  if (a != file_end)
+    return (int) a;
+
+  // Copy the contents of the partial page
+  copy_start = MAX(file_end, (uintptr_t) ph->vaddr);
+  if ((ph->vaddr + ph->filesz) > copy_start)
+    return vm_space_load_inode(ctx->vm, (void *) copy_start, ctx->inode,
+                               ph->vaddr + ph->filesz - copy_start,
+                               ph->offset + (copy_start - ph->vaddr));
+
+  return 0;
+}
+
 static int
 load_elf(struct ExecContext *ctx)
 {
@@ -234,7 +299,6 @@ load_elf(struct ExecContext *ctx)
   Elf32_Phdr ph;
   int r;
   off_t off;
-  uintptr_t a;
 
   off = 0;
   if ((r = fs_inode_read_locked(ctx->inode, (uintptr_t) &elf, sizeof(elf),
@@ -259,13 +323,7 @@ load_elf(struct ExecContext *ctx)
     if ((ph.vaddr >= VIRT_KERNEL_BASE) || (ph.vaddr + ph.memsz > VIRT_KERNEL_BASE))
       return -EINVAL;
 
-    a = vmspace_map(ctx->vm, ph.vaddr, ph.memsz,
-                    PROT_READ | PROT_WRITE | PROT_EXEC | VM_USER);
-    if (a != ph.vaddr)
-      return (int) a;
-
-    if ((r = vm_space_load_inode(ctx->vm->pgtab, (void *) ph.vaddr, ctx->inode,
-                                 ph.filesz, ph.offset)) < 0)
+    if ((r = load_segment(ctx, &ph)) < 0)
       return r;
   }
 
@@ -288,13 +346,13 @@ sys_free_args(char **args)
 static int
 copy_in_args(uintptr_t va, char ***store)
 {
-  void *pgtab = process_current()->vm->pgtab;
+  struct VMSpace *vm = process_current()->vm;
   char **args;
   size_t len;
   size_t total_len;
   int r;
 
-  if ((vm_user_check_args(pgtab, va, &len, VM_READ | VM_USER)) < 0)
+  if ((vm_user_check_args(vm, va, &len, VM_READ | VM_USER)) < 0)
     return r;
   
   total_len = (len + 1) * sizeof(char *);
@@ -310,13 +368,13 @@ copy_in_args(uintptr_t va, char ***store)
     uintptr_t str_va;
     size_t str_len;
 
-    if ((r = vm_copy_in(pgtab, &str_va, va + (sizeof(char *)*i),
+    if ((r = vm_copy_in(vm, &str_va, va + (sizeof(char *)*i),
                         sizeof str_va)) < 0) {
       sys_free_args(args);
       return r;
     }
 
-    if ((r = vm_user_check_str(pgtab, str_va, &str_len,
+    if ((r = vm_user_check_str(vm, str_va, &str_len,
                                VM_READ | VM_USER)) < 0) {
       sys_free_args(args);
       return r;
@@ -333,7 +391,7 @@ copy_in_args(uintptr_t va, char ***store)
       return -ENOMEM;
     }
 
-    if ((vm_copy_in(pgtab, args[i], str_va, str_len + 1) != 0) ||
+    if ((vm_copy_in(vm, args[i], str_va, str_len + 1) != 0) ||
          (args[i][str_len] != '\0')) {
       sys_free_args(args);
       return -EFAULT;
@@ -345,10 +403,24 @@ copy_in_args(uintptr_t va, char ***store)
   return 0;
 }
 
+/**
+ * Load an executable file into a new address space of the given process. The
+ * arguments and the environment are copied from the address space of the
+ * current process. The old address space of the process (if any) is
+ * destroyed.
+ *
+ * @param proc    Pointer to the process (either the current one or a new
+ *                process that hasn't been started yet)
+ * @param path    Pathname of the file to execute
+ * @param argv_va User address of the argument vector
+ * @param envp_va User address of the environment vector
+ *
+ * @return A non-negative value on success, a negative error code otherwise
+ */
 int
-process_exec(const char *path, uintptr_t argv_va, uintptr_t envp_va)
+process_exec_load(struct Process *proc, const char *path, uintptr_t argv_va,
+                  uintptr_t envp_va)
 {
-  struct Process *proc;
   struct VMSpace *old_vm;
   int r;
   struct ExecContext ctx;
@@ -384,17 +456,17 @@ process_exec(const char *path, uintptr_t argv_va, uintptr_t envp_va)
   sys_free_args(envp);
   sys_free_args(argv);
 
-  proc = process_current();
-
-  fd_close_on_exec(proc);
-
   strncpy(proc->name, path, 63);
 
+  process_lock();
   old_vm = proc->vm;
   proc->vm = ctx.vm;
+  process_unlock();
 
-  arch_vm_load(ctx.vm->pgtab);
-  vm_space_destroy(old_vm);
+  if (proc == process_current())
+    arch_vm_load(ctx.vm->pgtab);
+  if (old_vm != NULL)
+    vm_space_destroy(old_vm);
 
   return arch_trap_frame_init(proc->thread->tf, ctx.entry_va, ctx.argc,
                               ctx.argv_va, 
@@ -413,3 +485,17 @@ out2:
 out1:
   return r;
 }
+
+int
+process_exec(const char *path, uintptr_t argv_va, uintptr_t envp_va)
+{
+  struct Process *proc = process_current();
+  int r;
+
+  if ((r = process_exec_load(proc, path, argv_va, envp_va)) < 0)
+    return r;
+
+  fd_close_on_exec(proc);
+
+  return r;
+}
@@ -1,8 +1,11 @@
 #include <kernel/assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <spawn.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/spawn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -10,6 +13,7 @@
 #include <kernel/console.h>
 #include <kernel/elf.h>
 #include <kernel/fd.h>
+#include <kernel/fs/file.h>
 #include <kernel/fs/fs.h>
 #include <kernel/hash.h>
 #include <kernel/object_pool.h>
@@ -45,6 +49,7 @@ struct KListLink __process_list;
 struct KSpinLock __process_lock;
 
 static void process_run(void *);
+static int  process_check_pgid(struct Process *, pid_t);
 
 static struct Process *init_process;
 
@@ -166,11 +171,11 @@ process_load_binary(struct Process *proc, const void *binary)
     if (ph->filesz > ph->memsz)
       return -EINVAL;
 
-    addr = vmspace_map(proc->vm, ph->vaddr, ph->memsz, PROT_READ | PROT_WRITE | PROT_EXEC | VM_USER);
+    addr = vmspace_map(proc->vm, ph->vaddr, ph->memsz, PROT_READ | PROT_WRITE | PROT_EXEC | VM_USER, NULL, 0);
     if (addr != ph->vaddr)
       return (int) addr;
 
-    if ((r = vm_copy_out(proc->vm->pgtab, (uint8_t *) elf + ph->offset,
+    if ((r = vm_copy_out(proc->vm, (uint8_t *) elf + ph->offset,
                          ph->vaddr, ph->filesz)) < 0)
       return r;
 
@@ -178,7 +183,7 @@ process_load_binary(struct Process *proc, const void *binary)
   }
 
   addr = vmspace_map(proc->vm, (VIRT_USTACK_TOP - USTACK_SIZE), USTACK_SIZE,
-                        PROT_READ | PROT_WRITE | VM_USER);
+                        PROT_READ | PROT_WRITE | VM_USER, NULL, 0);
   if (addr != (VIRT_USTACK_TOP - USTACK_SIZE))
     return (int) addr;
 
@@ -221,6 +226,7 @@ process_create(const void *binary, struct Process **pstore)
 fail3:
   vm_space_destroy(proc->vm);
 fail2:
+  k_thread_destroy(proc->thread);
   process_free(proc);
 fail1:
   return r;
@@ -266,11 +272,32 @@ pid_lookup(pid_t pid)
   return NULL;
 }
 
+/**
+ * Call the given function for each process in the system. The function is
+ * called with the process list locked.
+ *
+ * @param func Pointer to the function
+ * @param arg  The argument to be passed to the function
+ */
+void
+process_foreach(void (*func)(struct Process *, void *), void *arg)
+{
+  struct KListLink *l;
+
+  process_lock();
+
+  KLIST_FOREACH(&__process_list, l)
+    func(KLIST_CONTAINER(l, struct Process, link), arg);
+
+  process_unlock();
+}
+
 void
 process_destroy(int status)
 {
   struct KListLink *l;
   struct Process *child, *current = process_current();
+  struct VMSpace *vm;
   int has_zombies;
 
   if(status)
@@ -282,7 +309,13 @@ process_destroy(int status)
   HASH_REMOVE(&current->pid_link);
   k_spinlock_release(&pid_hash.lock);
 
-  vm_space_destroy(current->vm);
+  // Zombies have no address space
+  process_lock();
+  vm = current->vm;
+  current->vm = NULL;
+  process_unlock();
+
+  vm_space_destroy(vm);
 
   fd_close_all(current);
   fs_path_put(current->cwd);
@@ -367,6 +400,187 @@ process_copy(int share_vm)
   return child->pid;
 }
 
+// Perform the posix_spawn() file actions on the descriptors of a new process.
+// Pathnames are resolved relative to the working directory of the current
+// process, which is the same as the one of the new process.
+static int
+process_spawn_actions(struct Process *child,
+                      const struct __spawn_action *actions, int nactions)
+{
+  const struct __spawn_action *a;
+  struct File *file;
+  int r;
+
+  for (a = actions; a < &actions[nactions]; a++) {
+    switch (a->type) {
+    case __SPAWN_OPEN:
+      if ((a->fildes < 0) || (a->fildes >= OPEN_MAX))
+        return -EBADF;
+
+      if ((r = fs_open(a->path, a->oflag, a->mode, &file)) < 0)
+        return r;
+
+      fd_close(child, a->fildes);
+      r = fd_alloc(child, file, a->fildes);
+
+      file_put(file);
+      break;
+
+    case __SPAWN_DUP2:
+      if ((file = fd_lookup(child, a->fildes)) == NULL)
+        return -EBADF;
+      if ((a->newfildes < 0) || (a->newfildes >= OPEN_MAX)) {
+        file_put(file);
+        return -EBADF;
+      }
+
+      // Duplicating a descriptor onto itself only clears FD_CLOEXEC
+      if (a->newfildes == a->fildes) {
+        r = fd_set_flags(child, a->fildes, 0);
+      } else {
+        fd_close(child, a->newfildes);
+        r = fd_alloc(child, file, a->newfildes);
+      }
+
+      file_put(file);
+      break;
+
+    case __SPAWN_CLOSE:
+      r = fd_close(child, a->fildes);
+      break;
+
+    default:
+      r = -EINVAL;
+      break;
+    }
+
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
+}
+
+#define SPAWN_FLAGS \
+  (POSIX_SPAWN_RESETIDS | POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | \
+   POSIX_SPAWN_SETSIGMASK)
+
+/**
+ * Create a new process running the given executable file without duplicating
+ * the address space of the current process.
+ *
+ * The new process inherits the state of the current process, as after fork().
+ * Then the file actions and the attributes are applied to it, and the file is
+ * loaded into a new address space, as by exec().
+ *
+ * @param path     Pathname of the file to execute
+ * @param argv_va  User address of the argument vector
+ * @param envp_va  User address of the environment vector
+ * @param attr     Pointer to the spawn attributes or NULL
+ * @param actions  Array of file actions
+ * @param nactions The number of file actions
+ *
+ * @return The ID of the new process or a negative error code
+ */
+pid_t
+process_spawn(const char *path, uintptr_t argv_va, uintptr_t envp_va,
+              const struct __spawn_attr *attr,
+              const struct __spawn_action *actions, int nactions)
+{
+  struct Process *child, *current = process_current();
+  uid_t euid;
+  gid_t egid;
+  int r = 0;
+
+  if ((attr != NULL) && (attr->flags & ~SPAWN_FLAGS))
+    return -EINVAL;
+
+  if ((child = process_alloc()) == NULL)
+    return -ENOMEM;
+
+  child->vm = NULL;
+
+  process_lock();
+
+  signal_clone(current, child);
+
+  child->pgid  = current->pgid;
+  child->ruid  = current->ruid;
+  child->euid  = current->euid;
+  child->rgid  = current->rgid;
+  child->egid  = current->egid;
+  child->cmask = current->cmask;
+  child->cwd   = fs_path_duplicate(current->cwd);
+
+  if (attr != NULL) {
+    if (attr->flags & POSIX_SPAWN_SETPGROUP) {
+      child->pgid = (attr->pgroup != 0) ? attr->pgroup : child->pid;
+      r = process_check_pgid(child, child->pgid);
+    }
+
+    if (attr->flags & POSIX_SPAWN_RESETIDS) {
+      child->euid = child->ruid;
+      child->egid = child->rgid;
+    }
+
+    signal_spawn(child,
+                 (attr->flags & POSIX_SPAWN_SETSIGMASK) ? &attr->sigmask : NULL,
+                 (attr->flags & POSIX_SPAWN_SETSIGDEF) ? &attr->sigdefault : NULL);
+  }
+
+  process_unlock();
+
+  fd_clone(current, child);
+
+  if (r < 0)
+    goto fail;
+
+  // The file actions are performed by the current thread, but permissions must
+  // be checked using the effective IDs of the new process. The current process
+  // is blocked in this call, so it is safe to switch its IDs temporarily.
+  process_lock();
+  euid = current->euid;
+  egid = current->egid;
+  current->euid = child->euid;
+  current->egid = child->egid;
+  process_unlock();
+
+  r = process_spawn_actions(child, actions, nactions);
+
+  process_lock();
+  current->euid = euid;
+  current->egid = egid;
+  process_unlock();
+
+  if (r < 0)
+    goto fail;
+
+  if ((r = process_exec_load(child, path, argv_va, envp_va)) < 0)
+    goto fail;
+
+  fd_close_on_exec(child);
+
+  process_lock();
+
+  child->parent = current;
+
+  k_list_add_back(&__process_list, &child->link);
+  k_list_add_back(&current->children, &child->sibling_link);
+
+  process_unlock();
+
+  k_thread_resume(child->thread);
+
+  return child->pid;
+
+fail:
+  fd_close_all(child);
+  fs_path_put(child->cwd);
+  k_thread_destroy(child->thread);
+  process_free(child);
+  return r;
+}
+
 /**
  * Check whether the given process ID or group ID matches the given argument.
  * 
@@ -534,6 +748,28 @@ process_get_gid(pid_t pid)
   return r;
 }
 
+// Check whether the process can be moved to the given process group: the
+// group must either be a new one led by the process itself, or already exist.
+// Sessions are not implemented, so all groups are in the same one. Must be
+// called with the process list locked.
+static int
+process_check_pgid(struct Process *process, pid_t pgid)
+{
+  struct KListLink *l;
+
+  if (pgid < 0)
+    return -EINVAL;
+
+  if (pgid == process->pid)
+    return 0;
+
+  KLIST_FOREACH(&__process_list, l)
+    if (KLIST_CONTAINER(l, struct Process, link)->pgid == pgid)
+      return 0;
+
+  return -EPERM;
+}
+
 int
 process_set_gid(pid_t pid, pid_t pgid)
 {
@@ -543,19 +779,19 @@ process_set_gid(pid_t pid, pid_t pgid)
   if (pid == 0)
     pid = current->pid;
   if (pgid == 0)
-    pgid = current->pgid;
+    pgid = pid;
 
   if (pgid < 0)
     return -EINVAL;
 
   process_lock();
 
-  if ((process = pid_lookup(pid)) == NULL) {
+  // Only the current process and its children can be moved
+  if (((process = pid_lookup(pid)) == NULL) ||
+      ((process != current) && (process->parent != current))) {
     r = -ESRCH;
-  } else {
-    // TODO: restrict access?
+  } else if ((r = process_check_pgid(process, pgid)) == 0) {
     process->pgid = pgid;
-    r = 0;
   }
 
   process_unlock();
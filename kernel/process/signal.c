@@ -87,6 +87,34 @@ signal_clone(struct Process *parent, struct Process *child)
 
 #define SIGNAL_INDEX(signo) (signo - 1)
 
+// Adjust the signal state of a new process created by posix_spawn(): set the
+// signal mask (if mask is not NULL) and reset the actions for the signals in
+// the defaults set (if not NULL) to SIG_DFL.
+void
+signal_spawn(struct Process *process, const sigset_t *mask,
+             const sigset_t *defaults)
+{
+  int i;
+
+  if (!k_spinlock_holding(&__process_lock))
+    panic("process_lock not acquired");
+
+  if (mask != NULL) {
+    process->signal_mask = *mask;
+    sigdelset(&process->signal_mask, SIGKILL);
+  }
+
+  if (defaults != NULL) {
+    for (i = 1; i < NSIG; i++) {
+      if (sigismember(defaults, i)) {
+        process->signal_actions[SIGNAL_INDEX(i)].sa_handler = SIG_DFL;
+        process->signal_actions[SIGNAL_INDEX(i)].sa_flags   = 0;
+        sigemptyset(&process->signal_actions[SIGNAL_INDEX(i)].sa_mask);
+      }
+    }
+  }
+}
+
 static int
 signal_is_stop(int signo)
 {
@@ -297,7 +325,7 @@ signal_return(uintptr_t va)
   struct SignalFrame frame;
   int r;
 
-  if ((r = vm_copy_in(current->vm->pgtab, &frame, va, sizeof frame)) != 0)
+  if ((r = vm_copy_in(current->vm, &frame, va, sizeof frame)) != 0)
     return r;
 
   process_lock();
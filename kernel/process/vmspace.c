@@ -3,25 +3,1044 @@
 #include <string.h>
 #include <sys/mman.h>
 
+#include <kernel/compact.h>
 #include <kernel/console.h>
 #include <kernel/tty.h>
 #include <kernel/fs/fs.h>
+#include <kernel/fs/page_cache.h>
 #include <kernel/types.h>
 #include <kernel/object_pool.h>
 #include <kernel/vm.h>
 #include <kernel/page.h>
+#include <kernel/swap.h>
 #include <kernel/vmspace.h>
 #include <kernel/process.h>
 
 static struct KObjectPool *vmcache;
 static struct KObjectPool *vm_areacache;
 
+// Shared page of zeros mapped on read faults in anonymous memory
+static struct Page *zero_page;
+
+// List of all address spaces, walked by the swapper
+static struct KListLink vm_space_list = KLIST_INITIALIZER(vm_space_list);
+static struct KSpinLock vm_space_list_lock = K_SPINLOCK_INITIALIZER("vm_space_list");
+
+/*
+ * ----------------------------------------------------------------------------
+ * Area Index
+ * ----------------------------------------------------------------------------
+ *
+ * Areas are kept both in a list sorted by address, to quickly get to the
+ * neighbours, and in a red-black tree for O(log n) lookups. Each tree node is
+ * augmented with the largest gap preceding any area in its subtree, so that a
+ * free range of the given size can be found without visiting every area.
+ *
+ */
+
+static struct VMSpaceMapEntry *
+vm_space_area_prev(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  if (area->link.prev == &vm->areas)
+    return NULL;
+  return KLIST_CONTAINER(area->link.prev, struct VMSpaceMapEntry, link);
+}
+
+static struct VMSpaceMapEntry *
+vm_space_area_next(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  if (area->link.next == &vm->areas)
+    return NULL;
+  return KLIST_CONTAINER(area->link.next, struct VMSpaceMapEntry, link);
+}
+
+static void
+vm_space_area_augment(struct KRBNode *node)
+{
+  struct VMSpaceMapEntry *area = KRB_CONTAINER(node, struct VMSpaceMapEntry, node);
+  size_t max_gap = area->gap;
+
+  if (node->left != NULL)
+    max_gap = MAX(max_gap, KRB_CONTAINER(node->left, struct VMSpaceMapEntry, node)->max_gap);
+  if (node->right != NULL)
+    max_gap = MAX(max_gap, KRB_CONTAINER(node->right, struct VMSpaceMapEntry, node)->max_gap);
+
+  area->max_gap = max_gap;
+}
+
+// Recompute the gap preceding the area after it or its predecessor changed
+static void
+vm_space_area_gap_update(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  struct VMSpaceMapEntry *prev;
+
+  if (area == NULL)
+    return;
+
+  prev = vm_space_area_prev(vm, area);
+  area->gap = area->start - (prev ? prev->start + prev->length : 0);
+
+  k_rbtree_update(&vm->area_tree, &area->node);
+}
+
+// Insert the area before 'next' (or at the end, if 'next' is NULL)
+static void
+vm_space_area_insert(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                     struct VMSpaceMapEntry *next)
+{
+  struct KRBNode **link, *parent;
+
+  k_list_add_back(next ? &next->link : &vm->areas, &area->link);
+
+  parent = NULL;
+  link   = &vm->area_tree.root;
+  while (*link != NULL) {
+    parent = *link;
+    if (area->start < KRB_CONTAINER(parent, struct VMSpaceMapEntry, node)->start)
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+
+  area->gap     = 0;
+  area->max_gap = 0;
+  k_rbtree_insert(&vm->area_tree, parent, link, &area->node);
+
+  vm_space_area_gap_update(vm, area);
+  vm_space_area_gap_update(vm, next);
+}
+
+static void
+vm_space_area_remove(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  struct VMSpaceMapEntry *next = vm_space_area_next(vm, area);
+
+  if (vm->area_cache == area)
+    vm->area_cache = NULL;
+
+  k_rbtree_remove(&vm->area_tree, &area->node);
+  k_list_remove(&area->link);
+
+  vm_space_area_gap_update(vm, next);
+}
+
+static struct VMSpaceMapEntry *
+vm_space_area_lookup(struct VMSpace *vm, uintptr_t va)
+{
+  struct VMSpaceMapEntry *area;
+  struct KRBNode *node;
+
+  // Consecutive faults usually hit the same area
+  area = vm->area_cache;
+  if ((area != NULL) && (va >= area->start) && (va < (area->start + area->length)))
+    return area;
+
+  for (node = vm->area_tree.root; node != NULL; ) {
+    area = KRB_CONTAINER(node, struct VMSpaceMapEntry, node);
+
+    if (va < area->start) {
+      node = node->left;
+    } else if (va >= (area->start + area->length)) {
+      node = node->right;
+    } else {
+      vm->area_cache = area;
+      return area;
+    }
+  }
+
+  return NULL;
+}
+
+// Find the lowest area, such that there is a gap of at least n bytes between
+// its start and max(va, the end of the previous area).
+static struct VMSpaceMapEntry *
+vm_space_gap_find(struct KRBNode *node, uintptr_t va, size_t n)
+{
+  struct VMSpaceMapEntry *area, *found;
+
+  if (node == NULL)
+    return NULL;
+
+  area = KRB_CONTAINER(node, struct VMSpaceMapEntry, node);
+  if (area->max_gap < n)
+    return NULL;
+
+  // Areas in the left subtree start below this one
+  if ((area->start > (va + n)) &&
+      ((found = vm_space_gap_find(node->left, va, n)) != NULL))
+    return found;
+
+  if ((area->start >= (va + n)) &&
+      ((area->start - MAX(area->start - area->gap, va)) >= n))
+    return area;
+
+  return vm_space_gap_find(node->right, va, n);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Page Fault Handling
+ * ----------------------------------------------------------------------------
+ */
+
+// Handle a fault on a page that is already present in the page table
+static int
+vm_space_fault_present(struct VMSpace *vm, uintptr_t va, struct Page *page,
+                       int flags, int access)
+{
+  int r;
+
+  // The page is still in use, take it off the swapper's list of candidates
+  if (flags & VM_OLD) {
+    flags &= ~VM_OLD;
+    if ((r = vm_page_insert(vm->pgtab, page, va, flags)) < 0)
+      return r;
+  }
+
+  if ((access & VM_WRITE) && (flags & VM_COW))
+    return vm_page_lookup_cow(vm->pgtab, va, NULL, NULL);
+
+  return ((flags & access) == access) ? 0 : -EFAULT;
+}
+
+/*
+ * Try to back the whole aligned block containing the given address with a
+ * single large page. Large pages are used only if the block lies entirely
+ * inside the area, none of its pages are mapped yet, and there is plenty of
+ * free memory. Under memory fragmentation, the caller falls back to small
+ * pages.
+ */
+static int
+vm_space_fault_large(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                     uintptr_t va)
+{
+  struct Page *page;
+  uintptr_t start = ROUND_DOWN(va, VM_LARGE_PAGE_SIZE);
+  unsigned i;
+
+  assert(k_spinlock_holding(&vm->lock));
+
+  if ((start < area->start) ||
+      (start + VM_LARGE_PAGE_SIZE > area->start + area->length))
+    return -EINVAL;
+
+  // Do not allocate a block that could not be mapped anyway
+  if (!vm_range_empty(vm->pgtab, start, VM_LARGE_PAGE_SIZE))
+    return -EEXIST;
+
+  // Leave higher-order blocks to other users when memory runs low
+  if (page_free_count < page_count / 8)
+    return -ENOMEM;
+
+  page = page_alloc_block(VM_LARGE_PAGE_ORDER,
+                          PAGE_ALLOC_ZERO | PAGE_ALLOC_TRY | PAGE_ALLOC_MOVABLE,
+                          PAGE_TAG_ANON);
+  if (page == NULL) {
+    // Try to reassemble free blocks for subsequent faults
+    compact_wakeup();
+    return -ENOMEM;
+  }
+
+  // Each page of the block is freed separately when its last mapping is
+  // removed
+  for (i = 1; i < (1U << VM_LARGE_PAGE_ORDER); i++)
+    page[i].debug_tag = PAGE_TAG_ANON;
+
+  if (vm_page_insert_large(vm->pgtab, page, start, area->flags) < 0) {
+    for (i = 1; i < (1U << VM_LARGE_PAGE_ORDER); i++)
+      page[i].debug_tag = 0;
+    page_free_block(page, VM_LARGE_PAGE_ORDER);
+    return -EEXIST;
+  }
+
+  return 0;
+}
+
+static int
+vm_space_fault_anon(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                    uintptr_t va, int access)
+{
+  struct Page *page;
+  int flags, r;
+
+  k_spinlock_acquire(&vm->lock);
+
+  page = vm_page_lookup(vm->pgtab, va, &flags);
+
+  if ((page != NULL) && (page != zero_page)) {
+    r = vm_space_fault_present(vm, va, page, flags, access);
+  } else if ((page == NULL) && (access & VM_WRITE) &&
+             (vm_space_fault_large(vm, area, va) == 0)) {
+    r = 0;
+  } else if (access & VM_WRITE) {
+    page = page_alloc_one(PAGE_ALLOC_ZERO | PAGE_ALLOC_TRY | PAGE_ALLOC_MOVABLE,
+                          PAGE_TAG_ANON);
+    if (page == NULL) {
+      r = -ENOMEM;
+    } else if ((r = vm_page_insert(vm->pgtab, page, va, area->flags)) < 0) {
+      page_free_one(page);
+    }
+  } else if (page == NULL) {
+    // The first write access will replace the zero page with a private copy
+    flags = area->flags & ~VM_WRITE;
+    if (area->flags & VM_WRITE)
+      flags |= VM_COW;
+
+    r = vm_page_insert(vm->pgtab, zero_page, va, flags);
+  } else {
+    r = 0;
+  }
+
+  k_spinlock_release(&vm->lock);
+
+  return r;
+}
+
+static int
+vm_space_fault_file(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                    uintptr_t va, int access)
+{
+  struct PageCacheEntry *entry;
+  struct Page *page;
+  off_t off = area->offset + (va - area->start);
+  int flags, r, locked;
+
+  // The inode lock may sleep, so it must be acquired before the address space
+  // lock. A read() or write() of the file itself may fault on a mapping of the
+  // same file while already holding the lock.
+  if (!(locked = k_mutex_holding(&area->inode->mutex)))
+    fs_inode_lock(area->inode);
+
+  if (off >= area->inode->size) {
+    if (!locked)
+      fs_inode_unlock(area->inode);
+    return -EFAULT;
+  }
+
+  if ((r = page_cache_get(area->inode, off, &entry)) < 0) {
+    if (!locked)
+      fs_inode_unlock(area->inode);
+    return r;
+  }
+
+  k_spinlock_acquire(&vm->lock);
+
+  page = vm_page_lookup(vm->pgtab, va, &flags);
+
+  if ((page != NULL) && (page != entry->page)) {
+    // A private copy of the page already exists
+    r = vm_space_fault_present(vm, va, page, flags, access);
+  } else if (area->flags & VM_SHARED) {
+    // Shared pages are mapped writable only after the first write access, so
+    // that only the modified pages have to be written back
+    if (access & VM_WRITE) {
+      page_cache_dirty(entry);
+      r = vm_page_insert(vm->pgtab, entry->page, va, area->flags);
+    } else if (page == NULL) {
+      r = vm_page_insert(vm->pgtab, entry->page, va, area->flags & ~VM_WRITE);
+    } else {
+      r = 0;
+    }
+  } else if (access & VM_WRITE) {
+    // Give the process its own copy of the cached page
+    page = page_alloc_one(PAGE_ALLOC_TRY | PAGE_ALLOC_MOVABLE, PAGE_TAG_ANON);
+    if (page == NULL) {
+      r = -ENOMEM;
+    } else {
+      memmove(page2kva(page), page2kva(entry->page), PAGE_SIZE);
+
+      if ((r = vm_page_insert(vm->pgtab, page, va, area->flags)) < 0)
+        page_free_one(page);
+    }
+  } else if (page == NULL) {
+    // Map the cached page until the first write access
+    flags = area->flags & ~VM_WRITE;
+    if (area->flags & VM_WRITE)
+      flags |= VM_COW;
+
+    r = vm_page_insert(vm->pgtab, entry->page, va, flags);
+  } else {
+    r = 0;
+  }
+
+  k_spinlock_release(&vm->lock);
+
+  page_cache_put(entry);
+
+  if (!locked)
+    fs_inode_unlock(area->inode);
+
+  return r;
+}
+
+// If the page has been swapped out, read it back from the swap file
+static int
+vm_space_fault_swap(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                    uintptr_t va)
+{
+  struct Page *page;
+  unsigned long slot, curr_slot;
+  int mapped = 0;
+  int r;
+
+  k_spinlock_acquire(&vm->lock);
+
+  // Make sure the slot is not reused while the page is being read
+  if ((r = vm_swap_lookup(vm->pgtab, va, &slot)) == 0)
+    swap_dup(slot);
+
+  k_spinlock_release(&vm->lock);
+
+  if (r < 0)
+    return 0;
+
+  page = page_alloc_one(PAGE_ALLOC_TRY | PAGE_ALLOC_MOVABLE, PAGE_TAG_ANON);
+  if (page == NULL) {
+    swap_free(slot);
+    return -ENOMEM;
+  }
+
+  if ((r = swap_read(slot, page)) == 0) {
+    k_spinlock_acquire(&vm->lock);
+
+    // Another thread may have brought the page back in the meantime. The page
+    // is private, so it can be made writable right away.
+    if ((vm_swap_lookup(vm->pgtab, va, &curr_slot) == 0) &&
+        (curr_slot == slot) &&
+        ((r = vm_page_insert(vm->pgtab, page, va, area->flags)) == 0))
+      mapped = 1;
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  if (!mapped)
+    page_free_one(page);
+
+  swap_free(slot);
+
+  return r;
+}
+
+static int
+vm_space_fault(struct VMSpace *vm, struct VMSpaceMapEntry *area, uintptr_t va,
+               int access)
+{
+  int r;
+
+  if ((r = vm_space_fault_swap(vm, area, va)) < 0)
+    return r;
+
+  if (area->inode != NULL)
+    return vm_space_fault_file(vm, area, va, access);
+
+  return vm_space_fault_anon(vm, area, va, access);
+}
+
+/**
+ * Handle a page fault. Memory is not allocated at the time it is mapped.
+ *
+ * For anonymous memory, the shared zero page is mapped read-only on the first
+ * read access and a new zero-filled page is allocated on the first write.
+ * File-backed pages are brought in through the page cache: shared mappings
+ * refer to the cached pages directly, private mappings get a copy of the page
+ * on the first write. Pages that have been swapped out are read back from the
+ * swap file.
+ *
+ * When out of memory, wait for the swapper to free some pages and try again.
+ *
+ * @param vm     Pointer to the address space
+ * @param va     The faulting virtual address
+ * @param access The type of access that caused the fault (VM_READ, VM_WRITE
+ *               or VM_EXEC)
+ *
+ * @retval 0       Success
+ * @retval -EFAULT The address is not mapped or access is not permitted
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_handle_fault(struct VMSpace *vm, uintptr_t va, int access)
+{
+  struct VMSpaceMapEntry *area;
+  int r;
+
+  if ((va < PAGE_SIZE) || (va >= VIRT_KERNEL_BASE))
+    return -EFAULT;
+
+  access &= (VM_READ | VM_WRITE | VM_EXEC);
+
+  if ((area = vm_space_area_lookup(vm, va)) == NULL)
+    return -EFAULT;
+  if ((area->flags & access) != access)
+    return -EFAULT;
+
+  va = ROUND_DOWN(va, PAGE_SIZE);
+
+  if (((r = vm_space_fault(vm, area, va, access)) == -ENOMEM) &&
+      (swap_reclaim() == 0))
+    r = vm_space_fault(vm, area, va, access);
+
+  return r;
+}
+
+/*
+ * Find the page mapped at the given address, faulting it in if necessary. If
+ * access includes VM_WRITE, make sure the page is mapped writable (i.e. it is
+ * not a copy-on-write, a clean shared or the zero page). Pages marked VM_OLD
+ * by the swapper are made accessible again. On success, the lock of the
+ * address space is held.
+ */
+static int
+vm_space_page_get(struct VMSpace *vm, uintptr_t va, int access,
+                  struct Page **page_store, int *flags_store)
+{
+  struct Page *page;
+  int flags, r;
+
+  for (;;) {
+    k_spinlock_acquire(&vm->lock);
+
+    page = vm_page_lookup(vm->pgtab, va, &flags);
+
+    if ((page != NULL) && !(flags & VM_OLD) &&
+        (!(access & VM_WRITE) || (flags & VM_WRITE)))
+      break;
+
+    k_spinlock_release(&vm->lock);
+
+    if ((r = vm_handle_fault(vm, va, access)) < 0)
+      return r;
+  }
+
+  if (page_store != NULL)
+    *page_store = page;
+  if (flags_store != NULL)
+    *flags_store = flags;
+
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Swapping
+ * ----------------------------------------------------------------------------
+ *
+ * The swapper walks the page tables of all address spaces in turn, like the
+ * hand of a clock, looking for pages that haven't been used since the hand
+ * passed them the last time (see vm_user_scan()).
+ */
+
+// The amount of address space to scan while holding the locks
+#define VM_SPACE_SCAN_SIZE  (16 * VM_TABLE_SIZE)
+
+// The address space and the address the next scan starts at
+static struct VMSpace *vm_space_scan_vm;
+static uintptr_t       vm_space_scan_va;
+
+// The address space being compacted (see vm_space_compact())
+static struct VMSpace *vm_space_compact_vm;
+
+// Get the address space following the given one in the list (the first one if
+// NULL is given), or NULL after the last one
+static struct VMSpace *
+vm_space_list_next(struct VMSpace *vm)
+{
+  struct KListLink *next;
+
+  assert(k_spinlock_holding(&vm_space_list_lock));
+
+  next = (vm == NULL) ? vm_space_list.next : vm->link.next;
+
+  return (next == &vm_space_list)
+    ? NULL
+    : KLIST_CONTAINER(next, struct VMSpace, link);
+}
+
+// Move the clock hand to the next address space (NULL after the last one)
+static void
+vm_space_scan_next(void)
+{
+  vm_space_scan_vm = vm_space_list_next(vm_space_scan_vm);
+  vm_space_scan_va = 0;
+}
+
+// Remove the address space from the lists walked by the swapper and by
+// compaction
+static void
+vm_space_scan_remove(struct VMSpace *vm)
+{
+  k_spinlock_acquire(&vm_space_list_lock);
+
+  if (vm_space_scan_vm == vm)
+    vm_space_scan_next();
+  if (vm_space_compact_vm == vm)
+    vm_space_compact_vm = vm_space_list_next(vm);
+  k_list_remove(&vm->link);
+
+  k_spinlock_release(&vm_space_list_lock);
+}
+
+/**
+ * Find a page that hasn't been used recently and write it to the swap file.
+ *
+ * @retval 0       Success
+ * @retval -ENOMEM No suitable pages found or no free swap slots
+ * @return Another negative error code if the page could not be written out
+ *         (see swap_write())
+ */
+int
+vm_space_swap_out(void)
+{
+  struct VMSpace *vm;
+  struct Page *page = NULL;
+  unsigned long slot;
+  uintptr_t end;
+  int wraps = 0;
+
+  // Give up after two full passes over all address spaces: by then, every page
+  // has been marked old and examined again
+  while ((page == NULL) && (wraps < 3)) {
+    k_spinlock_acquire(&vm_space_list_lock);
+
+    if ((vm = vm_space_scan_vm) == NULL) {
+      vm_space_scan_next();
+      wraps++;
+
+      // There are no address spaces at all
+      if (vm_space_scan_vm == NULL) {
+        k_spinlock_release(&vm_space_list_lock);
+        break;
+      }
+
+      k_spinlock_release(&vm_space_list_lock);
+      continue;
+    }
+
+    end = MIN(vm_space_scan_va + VM_SPACE_SCAN_SIZE, VIRT_KERNEL_BASE);
+
+    k_spinlock_acquire(&vm->lock);
+
+    page = vm_user_scan(vm->pgtab, &vm_space_scan_va, end);
+
+    if ((page != NULL) && (swap_alloc(page, &slot) < 0)) {
+      // The swap file is full, or the previous write has failed
+      k_spinlock_release(&vm->lock);
+      k_spinlock_release(&vm_space_list_lock);
+      return -ENOMEM;
+    }
+
+    if (page != NULL) {
+      // The table is private, so this cannot fail. Removing the mapping also
+      // invalidates the TLB entries on all CPUs, so the page cannot be modified
+      // while it is written out.
+      if (vm_swap_insert(vm->pgtab, vm_space_scan_va, slot) < 0)
+        panic("cannot swap out page");
+
+      vm_space_scan_va += PAGE_SIZE;
+    }
+
+    k_spinlock_release(&vm->lock);
+
+    if (vm_space_scan_va >= VIRT_KERNEL_BASE)
+      vm_space_scan_next();
+
+    k_spinlock_release(&vm_space_list_lock);
+  }
+
+  if (page == NULL)
+    return -ENOMEM;
+
+  // On failure, the page stays in memory until the write succeeds
+  return swap_write();
+}
+
+/**
+ * Get the memory usage of an address space. The caller need not prevent the
+ * address space from being destroyed: it is walked in chunks, checking each
+ * time that it still exists, so that no global lock is held for long.
+ *
+ * @param vm             Pointer to the address space
+ * @param resident_store Pointer to the memory location to store the number of
+ *                       pages mapped into the address space
+ * @param swapped_store  Pointer to the memory location to store the number of
+ *                       pages swapped out from the address space
+ *
+ * @retval 0      Success
+ * @retval -ESRCH The address space has been destroyed
+ */
+int
+vm_space_stat(struct VMSpace *vm, unsigned long *resident_store,
+              unsigned long *swapped_store)
+{
+  unsigned long resident = 0, swapped = 0, r, s;
+  struct KListLink *l;
+  uintptr_t va, end;
+
+  for (va = 0; va < VIRT_KERNEL_BASE; va = end) {
+    end = MIN(va + VM_SPACE_SCAN_SIZE, VIRT_KERNEL_BASE);
+
+    k_spinlock_acquire(&vm_space_list_lock);
+
+    // Address spaces are removed from the list before being destroyed
+    KLIST_FOREACH(&vm_space_list, l)
+      if (KLIST_CONTAINER(l, struct VMSpace, link) == vm)
+        break;
+
+    if (l == &vm_space_list) {
+      k_spinlock_release(&vm_space_list_lock);
+      return -ESRCH;
+    }
+
+    k_spinlock_acquire(&vm->lock);
+    vm_user_count(vm->pgtab, va, end, &r, &s);
+    k_spinlock_release(&vm->lock);
+
+    k_spinlock_release(&vm_space_list_lock);
+
+    resident += r;
+    swapped  += s;
+  }
+
+  *resident_store = resident;
+  *swapped_store  = swapped;
+
+  return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Compaction
+ * ----------------------------------------------------------------------------
+ */
+
+/**
+ * Migrate the pages of all address spaces out of the given block of physical
+ * pages (see page_compact_begin()).
+ *
+ * @param start  Pointer to the first page of the block
+ * @param npages The number of pages in the block
+ *
+ * @return The number of pages migrated
+ */
+int
+vm_space_compact(struct Page *start, unsigned npages)
+{
+  struct VMSpace *vm;
+  uintptr_t va, end;
+  int r, count = 0;
+
+  k_spinlock_acquire(&vm_space_list_lock);
+
+  vm_space_compact_vm = vm_space_list_next(NULL);
+  va = 0;
+
+  while ((vm = vm_space_compact_vm) != NULL) {
+    // As in vm_space_swap_out(), walk the address space in chunks so that the
+    // locks are not held for too long
+    end = MIN(va + VM_SPACE_SCAN_SIZE, VIRT_KERNEL_BASE);
+
+    k_spinlock_acquire(&vm->lock);
+    r = vm_user_compact(vm->pgtab, va, end, start, npages);
+    k_spinlock_release(&vm->lock);
+
+    if (r < 0)
+      break;
+
+    count += r;
+
+    if ((va = end) >= VIRT_KERNEL_BASE)
+      vm_space_compact_vm = vm_space_list_next(vm);
+
+    k_spinlock_release(&vm_space_list_lock);
+    k_spinlock_acquire(&vm_space_list_lock);
+
+    // Start from the beginning of the next address space, or of the one that
+    // replaced a destroyed address space
+    if (vm_space_compact_vm != vm)
+      va = 0;
+  }
+
+  vm_space_compact_vm = NULL;
+
+  k_spinlock_release(&vm_space_list_lock);
+
+  return count;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Copying Data To and From User Memory
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * The address space of the current process is loaded into the MMU, so its
+ * memory is accessed directly, and any faults are handled by the abort handler.
+ * Other address spaces (e.g. the one being built by exec) are accessed through
+ * the kernel mapping of each page.
+ */
+
+static void
+vm_user_assert(uintptr_t start_va, uintptr_t end_va)
+{
+  if ((start_va >= VIRT_KERNEL_BASE) || (end_va < start_va))
+    panic("invalid va range: [%p,%p)", start_va, end_va);
+}
+
+static int
+vm_space_is_current(struct VMSpace *vm)
+{
+  struct Process *current = process_current();
+
+  return (current != NULL) && (current->vm == vm);
+}
+
+int
+vm_clear(struct VMSpace *vm, uintptr_t dst_va, size_t n)
+{
+  vm_user_assert(dst_va, dst_va + n);
+
+  if (vm_space_is_current(vm))
+    return (arch_vm_clear(dst_va, n) != 0) ? -EFAULT : 0;
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+    int r;
+
+    offset = dst_va % PAGE_SIZE;
+    ncopy = MIN(PAGE_SIZE - offset, n);
+
+    if ((r = vm_space_page_get(vm, dst_va, VM_WRITE, &page, NULL)) < 0)
+      return r;
+
+    kva = (uint8_t *) page2kva(page);
+    memset(kva + offset, 0, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+int
+vm_copy_out(struct VMSpace *vm, const void *src, uintptr_t dst_va, size_t n)
+{
+  uint8_t *p = (uint8_t *) src;
+
+  vm_user_assert(dst_va, dst_va + n);
+
+  if (vm_space_is_current(vm))
+    return (arch_vm_copy_out(dst_va, src, n) != 0) ? -EFAULT : 0;
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+    int r;
+
+    offset = dst_va % PAGE_SIZE;
+    ncopy = MIN(PAGE_SIZE - offset, n);
+
+    if ((r = vm_space_page_get(vm, dst_va, VM_WRITE, &page, NULL)) < 0)
+      return r;
+
+    kva = (uint8_t *) page2kva(page);
+    memmove(kva + offset, p, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    p      += ncopy;
+    dst_va += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
+int
+vm_copy_in(struct VMSpace *vm, void *dst, uintptr_t src_va, size_t n)
+{
+  uint8_t *p = (uint8_t *) dst;
+
+  vm_user_assert(src_va, src_va + n);
+
+  if (vm_space_is_current(vm))
+    return (arch_vm_copy_in(dst, src_va, n) != 0) ? -EFAULT : 0;
+
+  while (n != 0) {
+    struct Page *page;
+    uint8_t *kva;
+    size_t offset, ncopy;
+    int r;
+
+    offset = src_va % PAGE_SIZE;
+    ncopy  = MIN(PAGE_SIZE - offset, n);
+
+    if ((r = vm_space_page_get(vm, src_va, VM_READ, &page, NULL)) < 0)
+      return r;
+
+    kva = (uint8_t *) page2kva(page);
+    memmove(p, kva + offset, ncopy);
+
+    k_spinlock_release(&vm->lock);
+
+    src_va += ncopy;
+    p      += ncopy;
+    n      -= ncopy;
+  }
+
+  return 0;
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Check User Memory Permissions
  * ----------------------------------------------------------------------------
  */
 
+static int
+vm_flags_check(int curr_flags, int flags)
+{
+  if (curr_flags & VM_COW) {
+    curr_flags &= ~VM_COW;
+    curr_flags |= VM_WRITE;
+  }
+
+  return (curr_flags & flags) == flags;
+}
+
+// Check that the range is covered by areas with the given permissions. Pages
+// are not faulted in (and copy-on-write is not resolved) until the memory is
+// actually accessed
+static int
+vm_space_check_range(struct VMSpace *vm, uintptr_t va, uintptr_t end_va,
+                     int flags)
+{
+  struct VMSpaceMapEntry *area;
+
+  while (va < end_va) {
+    if ((area = vm_space_area_lookup(vm, va)) == NULL)
+      return -EFAULT;
+
+    if (!vm_flags_check(area->flags, flags))
+      return -EFAULT;
+
+    va = area->start + area->length;
+  }
+
+  return 0;
+}
+
+int
+vm_user_check_ptr(struct VMSpace *vm, uintptr_t va, int flags)
+{
+  if (va >= VIRT_KERNEL_BASE)
+    return -EFAULT;
+
+  return vm_space_check_range(vm, va, va + 1, flags);
+}
+
+int
+vm_user_check_str(struct VMSpace *vm, uintptr_t va, size_t *len_ptr, int flags)
+{
+  size_t len = 0;
+
+  while (va < VIRT_KERNEL_BASE) {
+    const char *p;
+    struct Page *page;
+    unsigned off;
+    int curr_flags;
+
+    if (vm_space_page_get(vm, va, flags, &page, &curr_flags) < 0)
+      return -EFAULT;
+
+    if (!vm_flags_check(curr_flags, flags)) {
+      k_spinlock_release(&vm->lock);
+      return -EFAULT;
+    }
+
+    p = (const char *) page2kva(page);
+
+    for (off = va % PAGE_SIZE; off < PAGE_SIZE; off++) {
+      if (p[off] == '\0') {
+        if (len_ptr)
+          *len_ptr = len;
+
+        k_spinlock_release(&vm->lock);
+
+        return 0;
+      }
+
+      len++;
+      va++;
+    }
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  return -EFAULT;
+}
+
+int
+vm_user_check_args(struct VMSpace *vm, uintptr_t va, size_t *len_ptr, int flags)
+{
+  size_t len = 0;
+
+  if (va % sizeof(char *) != 0)
+    return -EFAULT;
+
+  while (va < VIRT_KERNEL_BASE) {
+    const char **p;
+    struct Page *page;
+    unsigned off;
+    int curr_flags;
+
+    if (vm_space_page_get(vm, va, flags, &page, &curr_flags) < 0)
+      return -EFAULT;
+
+    if (!vm_flags_check(curr_flags, flags)) {
+      k_spinlock_release(&vm->lock);
+      return -EFAULT;
+    }
+
+    p = (const char **) page2kva(page);
+
+    for (off = (va % PAGE_SIZE) / sizeof *p; off < PAGE_SIZE / sizeof *p; off++) {
+      if (p[off] == NULL) {
+        if (len_ptr)
+          *len_ptr = len;
+
+        k_spinlock_release(&vm->lock);
+
+        return 0;
+      }
+
+      len++;
+      va += sizeof *p;
+    }
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  return -EFAULT;
+}
+
+int
+vm_user_check_buf(struct VMSpace *vm, uintptr_t start_va, size_t n, int flags)
+{
+  uintptr_t end_va = start_va + n;
+
+  if ((start_va >= VIRT_KERNEL_BASE) || (end_va > VIRT_KERNEL_BASE) ||
+      (end_va < start_va))
+    return -EFAULT;
+
+  return vm_space_check_range(vm, start_va, end_va, flags);
+}
+
 /*
  * ----------------------------------------------------------------------------
  * Loading Binaries
@@ -43,37 +1062,99 @@ vm_space_create(void)
 
   k_spinlock_init(&vm->lock, "vmspace");
   k_list_init(&vm->areas);
+  k_rbtree_init(&vm->area_tree, vm_space_area_augment);
+  vm->area_cache = NULL;
+
+  k_spinlock_acquire(&vm_space_list_lock);
+  k_list_add_back(&vm_space_list, &vm->link);
+  k_spinlock_release(&vm_space_list_lock);
 
   return vm;
 }
 
+static void
+vm_space_area_free(struct VMSpaceMapEntry *area)
+{
+  if (area->inode != NULL) {
+    // Write back the pages modified through this mapping
+    if (area->flags & VM_SHARED) {
+      fs_inode_lock(area->inode);
+      page_cache_sync(area->inode);
+      fs_inode_unlock(area->inode);
+    }
+
+    fs_inode_put(area->inode);
+  }
+
+  k_object_pool_put(vm_areacache, area);
+}
+
 void
 vm_space_destroy(struct VMSpace *vm)
 {
   struct VMSpaceMapEntry *area;
 
-  // vm_user_free(vm->pgtab, 0, ROUND_UP(vm->heap, PAGE_SIZE));
-  // vm_user_free(vm->pgtab, vm->stack, USTACK_SIZE);
-  
+  vm_space_scan_remove(vm);
+
+  // Drop all mappings at once (page tables shared with other address spaces
+  // are not copied). This must be done before freeing the areas, so that
+  // pages of shared file mappings are no longer referenced when synced.
+  k_spinlock_acquire(&vm->lock);
+  vm_user_destroy(vm->pgtab);
+  k_spinlock_release(&vm->lock);
+
   while (!k_list_is_empty(&vm->areas)) {
     area = KLIST_CONTAINER(vm->areas.next, struct VMSpaceMapEntry, link);
-    vm_user_free(vm->pgtab, area->start, area->length);
 
-    k_list_remove(&area->link);
-    k_object_pool_put(vm_areacache, area);
+    vm_space_area_remove(vm, area);
+    vm_space_area_free(area);
   }
 
-  arch_vm_destroy(vm->pgtab);
-
   k_object_pool_put(vmcache, vm);
 }
 
+// The number of bytes to process while holding the address space lock
+#define VM_SPACE_BATCH_SIZE   (64 * PAGE_SIZE)
+
+// Prepare the pages of the area to be cloned into another address space
+static int
+vm_space_clone_prepare(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                       int share)
+{
+  uintptr_t va, end = area->start + area->length;
+  int r = 0;
+
+  for (va = area->start; (r == 0) && (va < end); va += VM_SPACE_BATCH_SIZE) {
+    k_spinlock_acquire(&vm->lock);
+    r = vm_user_clone_prepare(vm->pgtab, va, MIN(end - va, VM_SPACE_BATCH_SIZE),
+                              share);
+    k_spinlock_release(&vm->lock);
+  }
+
+  return r;
+}
+
+static int
+vm_space_populate(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  uintptr_t va;
+  int r;
+
+  for (va = area->start; va < area->start + area->length; va += PAGE_SIZE) {
+    if ((r = vm_handle_fault(vm, va, area->flags & VM_WRITE)) < 0)
+      return r;
+  }
+
+  return 0;
+}
+
 struct VMSpace   *
 vm_space_clone(struct VMSpace *vm, int share)
 {
   struct VMSpace *new_vm;
   struct KListLink *l;
   struct VMSpaceMapEntry *area, *new_area;
+  int area_share;
 
   if ((new_vm = vm_space_create()) == NULL)
     return NULL;
@@ -90,14 +1171,37 @@ vm_space_clone(struct VMSpace *vm, int share)
     new_area->start  = area->start;
     new_area->length = area->length;
     new_area->flags  = area->flags;
-    k_list_add_back(&new_vm->areas, &new_area->link);
+    new_area->inode  = area->inode ? fs_inode_duplicate(area->inode) : NULL;
+    new_area->offset = area->offset;
+    vm_space_area_insert(new_vm, new_area, NULL);
 
-    if (vm_user_clone(vm->pgtab, new_vm->pgtab, area->start, area->length, share) < 0) {
+    area_share = share || (area->flags & VM_SHARED);
+
+    // Shared anonymous regions must refer to the same physical pages, but
+    // there is nothing to find a page missing in both address spaces in later,
+    // so make sure all of them are present before cloning (file-backed pages
+    // will be found in the page cache). This is not needed for private regions
+    // shared after vfork(): the parent is suspended until the child calls
+    // exec() or exits, so the existing page table entries are enough
+    if ((area->flags & VM_SHARED) && (area->inode == NULL) &&
+        (vm_space_populate(vm, area) < 0)) {
+      vm_space_destroy(new_vm);
+      return NULL;
+    }
+
+    // Read-only private regions never contain writable pages
+    if ((area_share || (area->flags & VM_WRITE)) &&
+        (vm_space_clone_prepare(vm, area, area_share) < 0)) {
       vm_space_destroy(new_vm);
       return NULL;
     }
   }
 
+  // The new address space is not visible to anyone else yet
+  k_spinlock_acquire(&vm->lock);
+  vm_user_clone(vm->pgtab, new_vm->pgtab);
+  k_spinlock_release(&vm->lock);
+
   return new_vm;
 }
 
@@ -106,80 +1210,129 @@ vm_space_init(void)
 {
   vmcache = k_object_pool_create("vmcache", sizeof(struct VMSpace), 0, NULL, NULL);
   vm_areacache = k_object_pool_create("vm_areacache", sizeof(struct VMSpaceMapEntry), 0, NULL, NULL);
+
+  if ((zero_page = page_alloc_one(PAGE_ALLOC_ZERO, PAGE_TAG_ANON)) == NULL)
+    panic("cannot allocate the zero page");
+  zero_page->ref_count++;
+}
+
+
+// Check whether the given area can be extended to include [va, va + n)
+static int
+vm_space_area_mergeable(struct VMSpaceMapEntry *area, uintptr_t va, size_t n,
+                        int flags, struct Inode *inode, off_t off)
+{
+  if ((area->flags != flags) || (area->inode != inode))
+    return 0;
+
+  if ((area->start + area->length) == va)
+    return (inode == NULL) || ((area->offset + (off_t) area->length) == off);
+
+  if ((va + n) == area->start)
+    return (inode == NULL) || ((off + (off_t) n) == area->offset);
+
+  return 0;
 }
 
+// Find the lowest free range of n bytes at or above va. Return its starting
+// address (or 0 if not found) and the areas surrounding it.
+static uintptr_t
+vm_space_range_find(struct VMSpace *vm, uintptr_t va, size_t n,
+                    struct VMSpaceMapEntry **prev_store,
+                    struct VMSpaceMapEntry **next_store)
+{
+  struct VMSpaceMapEntry *prev, *next;
+
+  // Find the area to insert before
+  if ((next = vm_space_gap_find(vm->area_tree.root, va, n)) != NULL) {
+    prev = vm_space_area_prev(vm, next);
+  } else {
+    prev = k_list_is_empty(&vm->areas)
+         ? NULL
+         : KLIST_CONTAINER(vm->areas.prev, struct VMSpaceMapEntry, link);
+  }
+
+  if ((prev != NULL) && (va < (prev->start + prev->length)))
+    va = prev->start + prev->length;
+
+  if (((va + n) > VIRT_KERNEL_BASE) || ((va + n) <= va))
+    return 0;
+
+  *prev_store = prev;
+  *next_store = next;
+
+  return va;
+}
 
+/**
+ * Create a new mapping in the given address space. Physical pages are not
+ * allocated here, vm_handle_fault() will take care of that on the first
+ * access.
+ *
+ * @param vm    Pointer to the address space
+ * @param addr  Preferred starting address (or 0)
+ * @param n     The size of the mapping in bytes
+ * @param flags Mapping flags
+ * @param inode Pointer to the inode to map, NULL for anonymous memory
+ * @param off   Offset within the file (must be non-negative and
+ *              page-aligned)
+ *
+ * @return The starting address of the mapping or a negative error code
+ */
 intptr_t
-vmspace_map(struct VMSpace *vm, uintptr_t addr, size_t n, int flags)
+vmspace_map(struct VMSpace *vm, uintptr_t addr, size_t n, int flags,
+            struct Inode *inode, off_t off)
 {
   uintptr_t va;
-  struct KListLink *l;
   struct VMSpaceMapEntry *area, *prev, *next;
-  int r;
 
   va = addr ? ROUND_UP((uintptr_t) addr, PAGE_SIZE) : PAGE_SIZE;
   n  = ROUND_UP(n, PAGE_SIZE);
 
   if ((va >= VIRT_KERNEL_BASE) || ((va + n) > VIRT_KERNEL_BASE) || ((va + n) <= va))
     return -EINVAL;
+  if ((off < 0) || ((off % PAGE_SIZE) != 0))
+    return -EINVAL;
 
-  // Find Vm area to insert before
-  for (l = vm->areas.next; l != &vm->areas; l = l->next) {
-    area = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
-
-    // Can insert before
-    if ((va + n) <= area->start)
-      break;
-
-    if (va < (area->start + area->length))
-      va = area->start + area->length;
-  }
-
-  if ((va + n) > VIRT_KERNEL_BASE)
+  if ((va = vm_space_range_find(vm, va, n, &prev, &next)) == 0)
     return -ENOMEM;
 
-  if ((r = vm_user_alloc(vm->pgtab, va, n, flags)) < 0) {
-    vm_user_free(vm->pgtab, va, n);
-    return r;
-  }
-
   // Can merge with previous?
-  prev = NULL;
-  if (l->prev != &vm->areas) {
-    prev = KLIST_CONTAINER(l->prev, struct VMSpaceMapEntry, link);
-    if (((prev->start + prev->length) != va) || (prev->flags != flags))
-      prev = NULL;
-  }
+  if ((prev != NULL) && !vm_space_area_mergeable(prev, va, n, flags, inode, off))
+    prev = NULL;
 
   // Can merge with next?
-  next = NULL;
-  if (l != &vm->areas) {
-    next = KLIST_CONTAINER(l, struct VMSpaceMapEntry, link);
-    if ((next->start != (va + n)) || (next->flags != flags))
-      next = NULL;
-  }
+  area = next;
+  if ((next != NULL) && !vm_space_area_mergeable(next, va, n, flags, inode, off))
+    next = NULL;
 
   if ((prev != NULL) && (next != NULL)) {
     prev->length += next->length + n;
 
-    k_list_remove(&next->link);
-    k_object_pool_put(vm_areacache, next);
+    vm_space_area_remove(vm, next);
+    vm_space_area_free(next);
   } else if (prev != NULL) {
     prev->length += n;
+    vm_space_area_gap_update(vm, area);
   } else if (next != NULL) {
-    next->start = va;
+    next->start   = va;
+    next->length += n;
+    next->offset  = off;
+    vm_space_area_gap_update(vm, next);
   } else {
+    next = area;
+
     area = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache);
-    if (area == NULL) {
-      vm_user_free(vm->pgtab, va, n);
+    if (area == NULL)
       return -ENOMEM;
-    }
 
     area->start  = va;
     area->length = n;
     area->flags  = flags;
+    area->inode  = inode ? fs_inode_duplicate(inode) : NULL;
+    area->offset = off;
 
-    k_list_add_back(l, &area->link);
+    vm_space_area_insert(vm, area, next);
   }
 
   // cprintf("[page_free_count %d]\n", page_free_count);
@@ -187,6 +1340,387 @@ vmspace_map(struct VMSpace *vm, uintptr_t addr, size_t n, int flags)
   return va;
 }
 
+/*
+ * ----------------------------------------------------------------------------
+ * Changing Mappings
+ * ----------------------------------------------------------------------------
+ */
+
+// Find the lowest area that ends above the given address
+static struct VMSpaceMapEntry *
+vm_space_area_find(struct VMSpace *vm, uintptr_t va)
+{
+  struct VMSpaceMapEntry *area, *found = NULL;
+  struct KRBNode *node;
+
+  for (node = vm->area_tree.root; node != NULL; ) {
+    area = KRB_CONTAINER(node, struct VMSpaceMapEntry, node);
+
+    if (va < (area->start + area->length)) {
+      found = area;
+      node  = node->left;
+    } else {
+      node  = node->right;
+    }
+  }
+
+  return found;
+}
+
+// Split the area in two, so that the second one starts at va
+static struct VMSpaceMapEntry *
+vm_space_area_split(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                    uintptr_t va)
+{
+  struct VMSpaceMapEntry *upper;
+
+  assert((va > area->start) && (va < (area->start + area->length)));
+  assert((va % PAGE_SIZE) == 0);
+
+  if ((upper = (struct VMSpaceMapEntry *) k_object_pool_get(vm_areacache)) == NULL)
+    return NULL;
+
+  upper->start  = va;
+  upper->length = area->start + area->length - va;
+  upper->flags  = area->flags;
+  upper->inode  = area->inode ? fs_inode_duplicate(area->inode) : NULL;
+  upper->offset = area->offset + (off_t) (va - area->start);
+
+  area->length  = va - area->start;
+
+  vm_space_area_insert(vm, upper, vm_space_area_next(vm, area));
+
+  return upper;
+}
+
+// Merge the area with the next one, if they are compatible
+static void
+vm_space_area_merge_next(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  struct VMSpaceMapEntry *next;
+
+  if ((area == NULL) || ((next = vm_space_area_next(vm, area)) == NULL))
+    return;
+
+  if (!vm_space_area_mergeable(area, next->start, next->length, next->flags,
+                               next->inode, next->offset))
+    return;
+
+  area->length += next->length;
+
+  vm_space_area_remove(vm, next);
+  vm_space_area_free(next);
+}
+
+// Split the areas crossing the boundaries of [start, end), so that the range
+// consists of whole areas only
+static int
+vm_space_range_split(struct VMSpace *vm, uintptr_t start, uintptr_t end)
+{
+  struct VMSpaceMapEntry *area;
+
+  area = vm_space_area_lookup(vm, start);
+  if ((area != NULL) && (area->start < start) &&
+      (vm_space_area_split(vm, area, start) == NULL))
+    return -ENOMEM;
+
+  area = vm_space_area_lookup(vm, end - 1);
+  if ((area != NULL) && ((area->start + area->length) > end) &&
+      (vm_space_area_split(vm, area, end) == NULL))
+    return -ENOMEM;
+
+  return 0;
+}
+
+static int
+vm_space_range_check(uintptr_t va, size_t n)
+{
+  if (((va % PAGE_SIZE) != 0) || (n == 0))
+    return -EINVAL;
+  if ((va >= VIRT_KERNEL_BASE) || ((va + n) > VIRT_KERNEL_BASE) || ((va + n) <= va))
+    return -EINVAL;
+  return 0;
+}
+
+// Unmap all pages in the given range of addresses
+static int
+vm_space_free_pages(struct VMSpace *vm, uintptr_t va, uintptr_t end)
+{
+  int r;
+
+  for ( ; va < end; va += VM_SPACE_BATCH_SIZE) {
+    k_spinlock_acquire(&vm->lock);
+    r = vm_user_free(vm->pgtab, va, MIN(end - va, VM_SPACE_BATCH_SIZE));
+    k_spinlock_release(&vm->lock);
+
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
+}
+
+/**
+ * Remove all mappings in the given range of addresses. Areas that are only
+ * partially covered by the range are split.
+ *
+ * @param vm Pointer to the address space
+ * @param va The starting address (must be page-aligned)
+ * @param n  The size of the range in bytes
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range is invalid
+ * @retval -ENOMEM Out of memory
+ */
+int
+vm_space_unmap(struct VMSpace *vm, uintptr_t va, size_t n)
+{
+  struct VMSpaceMapEntry *area, *next;
+  uintptr_t end;
+  int r;
+
+  n = ROUND_UP(n, PAGE_SIZE);
+  if ((r = vm_space_range_check(va, n)) < 0)
+    return r;
+
+  end = va + n;
+
+  if ((r = vm_space_range_split(vm, va, end)) < 0)
+    return r;
+
+  // The areas are kept, so that the call can be retried
+  if ((r = vm_space_free_pages(vm, va, end)) < 0)
+    return r;
+
+  for (area = vm_space_area_find(vm, va);
+       (area != NULL) && (area->start < end);
+       area = next) {
+    next = vm_space_area_next(vm, area);
+
+    vm_space_area_remove(vm, area);
+    vm_space_area_free(area);
+  }
+
+  return 0;
+}
+
+// Update the permissions of the pages present in the part of the area covered
+// by a single second-level table. The address space must be locked
+static int
+vm_space_protect_table(struct VMSpace *vm, struct VMSpaceMapEntry *area,
+                       uintptr_t va, uintptr_t end)
+{
+  int r;
+
+  for ( ; va < end; va += PAGE_SIZE) {
+    struct Page *page;
+    int flags, new_flags;
+
+    if ((page = vm_page_lookup(vm->pgtab, va, &flags)) == NULL)
+      continue;
+
+    new_flags = area->flags;
+
+    // Pages that are not writable yet (the zero page, copy-on-write or clean
+    // shared file pages) must still go through the fault handler on the first
+    // write. Only the pages of shared anonymous memory can be written directly.
+    if ((new_flags & VM_WRITE) && !(flags & VM_WRITE)) {
+      new_flags &= ~VM_WRITE;
+
+      if (!(area->flags & VM_SHARED))
+        new_flags |= VM_COW;
+      else if ((area->inode == NULL) && (page != zero_page))
+        new_flags |= VM_WRITE;
+    }
+
+    if ((new_flags != flags) &&
+        ((r = vm_page_protect(vm->pgtab, va, new_flags)) < 0))
+      return r;
+  }
+
+  return 0;
+}
+
+// Update the permissions of all pages present in the area. The address space
+// is locked once per second-level table, and missing tables are skipped
+static int
+vm_space_area_protect_pages(struct VMSpace *vm, struct VMSpaceMapEntry *area)
+{
+  uintptr_t va, table_end, end = area->start + area->length;
+  int r = 0;
+
+  for (va = area->start; (r == 0) && (va < end); va = table_end) {
+    table_end = MIN(ROUND_DOWN(va, VM_TABLE_SIZE) + VM_TABLE_SIZE, end);
+
+    k_spinlock_acquire(&vm->lock);
+
+    if (arch_vm_lookup(vm->pgtab, va, 0) != NULL)
+      r = vm_space_protect_table(vm, area, va, table_end);
+
+    k_spinlock_release(&vm->lock);
+  }
+
+  return r;
+}
+
+/**
+ * Change the access permissions of all pages in the given range of addresses.
+ * The range must be entirely mapped.
+ *
+ * @param vm   Pointer to the address space
+ * @param va   The starting address (must be page-aligned)
+ * @param n    The size of the range in bytes
+ * @param prot The new permissions (a combination of VM_READ, VM_WRITE and
+ *             VM_EXEC)
+ *
+ * @retval 0       Success
+ * @retval -EINVAL The range is invalid
+ * @retval -ENOMEM The range is not entirely mapped, or out of memory
+ * @retval -EACCES Write access requested for a shared mapping of a file that
+ *                 was not opened for writing
+ */
+int
+vm_space_protect(struct VMSpace *vm, uintptr_t va, size_t n, int prot)
+{
+  struct VMSpaceMapEntry *area, *prev;
+  uintptr_t end, a;
+  int r;
+
+  n = ROUND_UP(n, PAGE_SIZE);
+  if ((r = vm_space_range_check(va, n)) < 0)
+    return r;
+
+  end  = va + n;
+  prot &= (VM_READ | VM_WRITE | VM_EXEC);
+
+  // Check the whole range before modifying anything
+  for (a = va, area = vm_space_area_find(vm, va);
+       a < end;
+       a = area->start + area->length, area = vm_space_area_next(vm, area)) {
+    if ((area == NULL) || (area->start > a))
+      return -ENOMEM;
+
+    if ((prot & VM_WRITE) && (area->inode != NULL) &&
+        (area->flags & VM_SHARED) && !(area->flags & VM_MAYWRITE))
+      return -EACCES;
+  }
+
+  if ((r = vm_space_range_split(vm, va, end)) < 0)
+    return r;
+
+  for (area = vm_space_area_lookup(vm, va);
+       (area != NULL) && (area->start < end);
+       area = vm_space_area_next(vm, area)) {
+    area->flags = (area->flags & ~(VM_READ | VM_WRITE | VM_EXEC)) | prot;
+    if ((r = vm_space_area_protect_pages(vm, area)) < 0)
+      return r;
+  }
+
+  // Coalesce the modified areas with each other and with their neighbours
+  area = vm_space_area_lookup(vm, va);
+  if ((prev = vm_space_area_prev(vm, area)) != NULL)
+    area = prev;
+
+  while ((area != NULL) && (area->start < end)) {
+    struct VMSpaceMapEntry *next = vm_space_area_next(vm, area);
+
+    vm_space_area_merge_next(vm, area);
+
+    // If merged, try the same area again
+    if (vm_space_area_next(vm, area) == next)
+      area = next;
+  }
+
+  return 0;
+}
+
+/**
+ * Change the size of an existing mapping. The mapping is extended in place if
+ * possible, otherwise it may be moved to a different address. Pages are moved
+ * along with the mapping without copying their contents.
+ *
+ * @param vm       Pointer to the address space
+ * @param va       The starting address of the mapping (must be page-aligned)
+ * @param old_n    The old size of the mapping in bytes
+ * @param new_n    The new size of the mapping in bytes
+ * @param may_move Whether the mapping can be moved to another address
+ *
+ * @return The new starting address of the mapping or a negative error code
+ */
+intptr_t
+vm_space_remap(struct VMSpace *vm, uintptr_t va, size_t old_n, size_t new_n,
+               int may_move)
+{
+  struct VMSpaceMapEntry *area, *prev, *next;
+  uintptr_t new_va;
+  int r;
+
+  old_n = ROUND_UP(old_n, PAGE_SIZE);
+  new_n = ROUND_UP(new_n, PAGE_SIZE);
+
+  if ((r = vm_space_range_check(va, old_n)) < 0)
+    return r;
+  if ((new_n == 0) || (new_n >= VIRT_KERNEL_BASE))
+    return -EINVAL;
+
+  // The old range must be within a single mapping
+  area = vm_space_area_lookup(vm, va);
+  if ((area == NULL) || ((va + old_n) > (area->start + area->length)))
+    return -EFAULT;
+
+  if (new_n == old_n)
+    return va;
+
+  if (new_n < old_n) {
+    if ((r = vm_space_unmap(vm, va + new_n, old_n - new_n)) < 0)
+      return r;
+    return va;
+  }
+
+  // Try to extend the mapping in place
+  next = vm_space_area_next(vm, area);
+  if (((va + old_n) == (area->start + area->length)) &&
+      ((va + new_n) > va) &&
+      ((va + new_n) <= (next ? next->start : VIRT_KERNEL_BASE))) {
+    area->length += new_n - old_n;
+    vm_space_area_gap_update(vm, next);
+    return va;
+  }
+
+  if (!may_move)
+    return -ENOMEM;
+
+  if ((r = vm_space_range_split(vm, va, va + old_n)) < 0)
+    return r;
+
+  area = vm_space_area_lookup(vm, va);
+
+  if ((new_va = vm_space_range_find(vm, PAGE_SIZE, new_n, &prev, &next)) == 0)
+    return -ENOMEM;
+
+  k_spinlock_acquire(&vm->lock);
+  r = vm_user_move(vm->pgtab, new_va, va, old_n);
+  k_spinlock_release(&vm->lock);
+
+  if (r < 0)
+    return r;
+
+  // Move the area itself
+  if (next == area)
+    next = vm_space_area_next(vm, area);
+
+  vm_space_area_remove(vm, area);
+
+  area->start  = new_va;
+  area->length = new_n;
+  vm_space_area_insert(vm, area, next);
+
+  vm_space_area_merge_next(vm, area);
+  vm_space_area_merge_next(vm, vm_space_area_prev(vm, area));
+
+  return new_va;
+}
+
 void
 vm_print_areas(struct VMSpace *vm)
 {
@@ -211,7 +1745,7 @@ vm_space_copy_out(const void *src, uintptr_t dst_va, size_t n)
     return 0;
   }
 
-  return vm_copy_out(process_current()->vm->pgtab, src, dst_va, n);
+  return vm_copy_out(process_current()->vm, src, dst_va, n);
 }
 
 int
@@ -225,7 +1759,7 @@ vm_space_copy_in(void *dst, uintptr_t src_va, size_t n)
     return 0;
   }
 
-  return vm_copy_in(process_current()->vm->pgtab, dst, src_va, n);
+  return vm_copy_in(process_current()->vm, dst, src_va, n);
 }
 
 int
@@ -239,5 +1773,47 @@ vm_space_clear(uintptr_t va, size_t n)
     return 0;
   }
 
-  return vm_clear(process_current()->vm->pgtab, va, n);
+  return vm_clear(process_current()->vm, va, n);
+}
+
+int
+vm_space_load_inode(struct VMSpace *vm, void *va, struct Inode *ip, size_t n,
+                    off_t off)
+{
+  struct Page *page;
+  uint8_t *dst, *kva;
+  int ncopy, offset;
+  int r;
+
+  dst = (uint8_t *) va;
+
+  while (n != 0) {
+    if ((r = vm_space_page_get(vm, (uintptr_t) dst, VM_WRITE, &page, NULL)) < 0)
+      return r;
+
+    // Reading the inode may sleep, so the lock cannot be held. The extra
+    // reference keeps the page from being freed, swapped out or migrated (both
+    // skip pages mapped more than once) until the data is copied
+    page_ref_inc(page);
+
+    k_spinlock_release(&vm->lock);
+
+    kva = (uint8_t *) page2kva(page);
+
+    offset = (uintptr_t) dst % PAGE_SIZE;
+    ncopy  = MIN(PAGE_SIZE - offset, n);
+
+    r = fs_inode_read_locked(ip, (uintptr_t) kva + offset, ncopy, &off);
+
+    if (page_ref_dec(page) == 0)
+      page_free_one(page);
+
+    if (r != ncopy)
+      return r;
+
+    dst += ncopy;
+    n   -= ncopy;
+  }
+
+  return 0;
 }
@@ -1,9 +1,11 @@
 #include <kernel/assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/spawn.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/select.h>
@@ -14,8 +16,10 @@
 #include <kernel/console.h>
 #include <kernel/core/cpu.h>
 #include <kernel/fd.h>
+#include <kernel/fs/buf.h>
 #include <kernel/fs/file.h>
 #include <kernel/fs/fs.h>
+#include <kernel/fs/page_cache.h>
 #include <kernel/vmspace.h>
 #include <kernel/net.h>
 #include <kernel/pipe.h>
@@ -26,6 +30,7 @@
 #include <kernel/core/irq.h>
 #include <kernel/time.h>
 #include <kernel/signal.h>
+#include <kernel/swap.h>
 
 #include <lwip/sockets.h>
 
@@ -80,6 +85,8 @@ static int32_t (*syscalls[])(void) = {
   [__SYS_PIPE]        = sys_pipe,
   [__SYS_IOCTL]       = sys_ioctl,
   [__SYS_MMAP]        = sys_mmap,
+  [__SYS_MPROTECT]    = sys_mprotect,
+  [__SYS_MUNMAP]      = sys_munmap,
   [__SYS_SELECT]      = sys_select,
   [__SYS_SIGSUSPEND]  = sys_sigsuspend,
   [__SYS_KILL]        = sys_kill,
@@ -91,6 +98,10 @@ static int32_t (*syscalls[])(void) = {
   [__SYS_MOUNT]       = sys_mount,
   [__SYS_GETHOSTBYNAME] = sys_gethostbyname,
   [__SYS_SETITIMER]   = sys_setitimer,
+  [__SYS_MREMAP]      = sys_mremap,
+  [__SYS_SPAWN]       = sys_spawn,
+  [__SYS_SWAPON]      = sys_swapon,
+  [__SYS_SYNC]        = sys_sync,
 };
 
 int32_t
@@ -176,7 +187,7 @@ sys_arg_ptr(int n, uintptr_t *pp, int perm, int can_be_null)
     return -EFAULT;
   }
 
-  if ((r = vm_user_check_ptr(process_current()->vm->pgtab, ptr, perm)) < 0)
+  if ((r = vm_user_check_ptr(process_current()->vm, ptr, perm)) < 0)
     return r;
 
   *pp = ptr;
@@ -210,7 +221,7 @@ sys_arg_va(int n, uintptr_t *pp, size_t len, int perm, int can_be_null)
     return -EFAULT;
   }
 
-  if ((r = vm_user_check_buf(process_current()->vm->pgtab, ptr, len, perm)) < 0)
+  if ((r = vm_user_check_buf(process_current()->vm, ptr, len, perm)) < 0)
     return r;
 
   *pp = ptr;
@@ -222,7 +233,7 @@ static int32_t
 sys_arg_buf(int n, void **store, size_t len, int perm)
 { 
   uintptr_t va = sys_arch_get_arg(n);
-  void *pgtab = process_current()->vm->pgtab;
+  struct VMSpace *vm = process_current()->vm;
   void *p;
   int r;
 
@@ -231,13 +242,13 @@ sys_arg_buf(int n, void **store, size_t len, int perm)
     return 0;
   }
 
-  if ((r = vm_user_check_buf(pgtab, va, len, perm | VM_USER)) < 0)
+  if ((r = vm_user_check_buf(vm, va, len, perm | VM_USER)) < 0)
     return r;
 
   if ((p = k_malloc(len)) == NULL)
     return -ENOMEM;
 
-  if ((r = vm_copy_in(pgtab, p, va, len)) < 0) {
+  if ((r = vm_copy_in(vm, p, va, len)) < 0) {
     k_free(p);
     return r;
   }
@@ -247,20 +258,17 @@ sys_arg_buf(int n, void **store, size_t len, int perm)
   return 0;
 }
 
-// Fetch the nth system call argument as a C string pointer. Check that the
-// pointer is valid, the user has right permissions and the string is properly
-// terminated. If strp is not null, allocate a temporary buffer to copy the
-// string into. Tha caller must deallocate this buffer by calling k_free().
+// Check that the given user address points to a valid C string and copy it
+// into a temporary buffer (see sys_arg_str)
 static int32_t
-sys_arg_str(int n, size_t max, int perm, char **strp)
+sys_copy_in_str(uintptr_t va, size_t max, int perm, char **strp)
 {
-  uintptr_t va = sys_arch_get_arg(n);
-  void *pgtab = process_current()->vm->pgtab;
+  struct VMSpace *vm = process_current()->vm;
   size_t len;
   char *s;
   int r;
 
-  if ((r = vm_user_check_str(pgtab, va, &len, perm)) < 0)
+  if ((r = vm_user_check_str(vm, va, &len, perm)) < 0)
     return r;
 
   if (len >= max)
@@ -272,7 +280,7 @@ sys_arg_str(int n, size_t max, int perm, char **strp)
   if ((s = k_malloc(len + 1)) == NULL)
     return -ENOMEM;
 
-  if ((vm_copy_in(pgtab, s, va, len + 1) != 0) || (s[len] != '\0')) {
+  if ((vm_copy_in(vm, s, va, len + 1) != 0) || (s[len] != '\0')) {
     k_free(s);
     return -EFAULT;
   }
@@ -282,10 +290,20 @@ sys_arg_str(int n, size_t max, int perm, char **strp)
   return 0;
 }
 
+// Fetch the nth system call argument as a C string pointer. Check that the
+// pointer is valid, the user has right permissions and the string is properly
+// terminated. If strp is not null, allocate a temporary buffer to copy the
+// string into. Tha caller must deallocate this buffer by calling k_free().
+static int32_t
+sys_arg_str(int n, size_t max, int perm, char **strp)
+{
+  return sys_copy_in_str(sys_arch_get_arg(n), max, perm, strp);
+}
+
 static int
 sys_copy_out(const void *src, uintptr_t va, size_t n)
 {
-  return vm_copy_out(process_current()->vm->pgtab, src, va, n);
+  return vm_copy_out(process_current()->vm, src, va, n);
 }
 
 /*
@@ -327,6 +345,72 @@ out1:
   return r;
 }
 
+int32_t
+sys_spawn(void)
+{
+  struct __spawn_attr *attr;
+  struct __spawn_action *actions;
+  char *path;
+  uintptr_t argv, envp;
+  int i, nactions, r;
+
+  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+    goto out1;
+  if ((r = sys_arg_va(1, &argv, 1, 0, 0)) < 0)
+    goto out2;
+  if ((r = sys_arg_va(2, &envp, 1, 0, 0)) < 0)
+    goto out2;
+  if ((r = sys_arg_buf(3, (void **) &attr, sizeof *attr, VM_READ)) < 0)
+    goto out2;
+  if ((r = sys_arg_int(5, &nactions)) < 0)
+    goto out3;
+
+  if ((nactions < 0) || (nactions > __SPAWN_ACTIONS_MAX)) {
+    r = -EINVAL;
+    goto out3;
+  }
+
+  actions = NULL;
+  if ((nactions > 0) &&
+      ((r = sys_arg_buf(4, (void **) &actions, nactions * sizeof *actions,
+                        VM_READ)) < 0))
+    goto out3;
+  if ((nactions > 0) && (actions == NULL)) {
+    r = -EFAULT;
+    goto out3;
+  }
+
+  // Replace the user pathnames with their kernel copies
+  for (i = 0; i < nactions; i++) {
+    char *s = NULL;
+
+    if ((actions[i].type == __SPAWN_OPEN) &&
+        ((r = sys_copy_in_str((uintptr_t) actions[i].path, PATH_MAX, VM_READ,
+                              &s)) < 0)) {
+      nactions = i;
+      goto out4;
+    }
+
+    actions[i].path = s;
+  }
+
+  r = process_spawn(path, argv, envp, attr, actions, nactions);
+
+out4:
+  for (i = 0; i < nactions; i++)
+    if (actions[i].path != NULL)
+      k_free((char *) actions[i].path);
+  if (actions != NULL)
+    k_free(actions);
+out3:
+  if (attr != NULL)
+    k_free(attr);
+out2:
+  k_free(path);
+out1:
+  return r;
+}
+
 int32_t
 sys_getpgid(void)
 {
@@ -515,6 +599,33 @@ out1:
   return r;
 }
 
+int32_t
+sys_swapon(void)
+{
+  char *path;
+  int r;
+
+  if (process_current()->euid != 0)
+    return -EPERM;
+
+  if ((r = sys_arg_str(0, PATH_MAX, VM_READ, &path)) < 0)
+    return r;
+
+  r = swap_on(path);
+
+  k_free(path);
+  return r;
+}
+
+int32_t
+sys_sync(void)
+{
+  // Written back file pages dirty the metadata buffers
+  page_cache_sync_all();
+  buf_sync_all();
+  return 0;
+}
+
 int32_t
 sys_chdir(void)
 {
@@ -1579,12 +1690,31 @@ sys_test(void)
   return 0;
 }
 
+// Create the mapping once all arguments have been validated. With MAP_FIXED,
+// any existing mappings at the requested address are replaced.
+static int32_t
+sys_mmap_area(uintptr_t addr, size_t n, int flags, int vm_flags,
+              struct Inode *inode, off_t off)
+{
+  int r;
+
+  if ((flags & MAP_FIXED) &&
+      ((r = vm_space_unmap(process_current()->vm, addr, n)) < 0))
+    return r;
+
+  return (int32_t) vmspace_map(process_current()->vm, addr, n, vm_flags,
+                               inode, off);
+}
+
 int32_t
 sys_mmap(void)
 {
+  struct File *file;
+  struct Inode *inode;
   uintptr_t addr;
   size_t n;
-  int prot;
+  int prot, flags, fd, vm_flags;
+  off_t off;
   int r;
 
   if ((r = sys_arg_uint(0, &addr)) < 0)
@@ -1593,8 +1723,118 @@ sys_mmap(void)
     return r;
   if ((r = sys_arg_int(2, &prot)) < 0)
     return r;
+  if ((r = sys_arg_int(3, &flags)) < 0)
+    return r;
+  if ((r = sys_arg_int(4, &fd)) < 0)
+    return r;
+  if ((r = sys_arg_long(5, &off)) < 0)
+    return r;
+
+  // Exactly one of MAP_SHARED and MAP_PRIVATE must be specified
+  if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -EINVAL;
+
+  // The file offset must be a valid page-aligned position
+  if (!(flags & MAP_ANONYMOUS) && ((off < 0) || ((off % PAGE_SIZE) != 0)))
+    return -EINVAL;
+
+  vm_flags = (prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) | VM_USER;
+  if (flags & MAP_SHARED)
+    vm_flags |= VM_SHARED;
+
+  if ((flags & MAP_FIXED) && ((addr == 0) || ((addr % PAGE_SIZE) != 0)))
+    return -EINVAL;
+
+  if (flags & MAP_ANONYMOUS)
+    return sys_mmap_area(addr, n, flags, vm_flags, NULL, 0);
+
+  if ((file = fd_lookup(process_current(), fd)) == NULL)
+    return -EBADF;
+
+  if ((file->type != FD_INODE) || ((file->flags & O_ACCMODE) == O_WRONLY)) {
+    r = -EACCES;
+    goto out1;
+  }
+
+  // Writes to a shared mapping are carried through to the file
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+      ((file->flags & O_ACCMODE) != O_RDWR)) {
+    r = -EACCES;
+    goto out1;
+  }
+
+  // Shared mappings can be made writable later only if the file is writable
+  if ((flags & MAP_SHARED) && ((file->flags & O_ACCMODE) == O_RDWR))
+    vm_flags |= VM_MAYWRITE;
+
+  inode = fs_path_inode(file->node);
+
+  fs_inode_lock(inode);
+  r = S_ISREG(inode->mode) ? 0 : -ENODEV;
+  fs_inode_unlock(inode);
+
+  if (r == 0)
+    r = sys_mmap_area(addr, n, flags, vm_flags, inode, off);
+
+  fs_inode_put(inode);
+out1:
+  file_put(file);
+  return r;
+}
+
+int32_t
+sys_mprotect(void)
+{
+  uintptr_t addr;
+  size_t n;
+  int prot, r;
+
+  if ((r = sys_arg_uint(0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(1, &n)) < 0)
+    return r;
+  if ((r = sys_arg_int(2, &prot)) < 0)
+    return r;
+
+  return vm_space_protect(process_current()->vm, addr, n, prot);
+}
+
+int32_t
+sys_munmap(void)
+{
+  uintptr_t addr;
+  size_t n;
+  int r;
+
+  if ((r = sys_arg_uint(0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(1, &n)) < 0)
+    return r;
+
+  return vm_space_unmap(process_current()->vm, addr, n);
+}
+
+int32_t
+sys_mremap(void)
+{
+  uintptr_t addr;
+  size_t old_n, new_n;
+  int flags, r;
+
+  if ((r = sys_arg_uint(0, &addr)) < 0)
+    return r;
+  if ((r = sys_arg_uint(1, &old_n)) < 0)
+    return r;
+  if ((r = sys_arg_uint(2, &new_n)) < 0)
+    return r;
+  if ((r = sys_arg_int(3, &flags)) < 0)
+    return r;
+
+  if (flags & ~MREMAP_MAYMOVE)
+    return -EINVAL;
 
-  return (int32_t) vmspace_map(process_current()->vm, addr, n, prot | VM_USER);
+  return (int32_t) vm_space_remap(process_current()->vm, addr, old_n, new_n,
+                                  flags & MREMAP_MAYMOVE);
 }
 
 int32_t
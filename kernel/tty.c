@@ -37,6 +37,10 @@ struct Tty *tty_system;
 #define IN_EOF  (1 << 0)
 #define IN_EOL  (1 << 1)
 
+// User memory is copied through a small stack buffer so that it is never
+// accessed while holding the input or output spinlocks
+#define TTY_BOUNCE_SIZE   64
+
 /**
  * Initialize the console devices.
  */
@@ -308,57 +312,65 @@ ssize_t
 tty_read(dev_t dev, uintptr_t buf, size_t nbytes)
 {
   struct Tty *tty = tty_from_dev(dev);
+  char chunk[TTY_BOUNCE_SIZE];
   size_t i = 0;
+  int done = 0;
 
   if (tty == NULL)
     return -ENODEV;
 
-  k_spinlock_acquire(&tty->in.lock);
-
-  while (i < nbytes) {
-    char c;
+  while (!done && (i < nbytes)) {
+    size_t count = 0;
     int r;
 
-    // Wait for input
-    while (tty->in.size == 0) {
-      if ((r = k_waitqueue_sleep(&tty->in.queue, &tty->in.lock)) < 0) {
-        k_spinlock_release(&tty->in.lock);
-        return r;
-      }
-    }
+    k_spinlock_acquire(&tty->in.lock);
 
-    // Grab the next character
-    c = tty->in.buf[tty->in.read_pos];
-    tty->in.read_pos = (tty->in.read_pos + 1) % TTY_INPUT_MAX;
-    tty->in.size--;
+    while (!done && (i + count < nbytes) && (count < sizeof(chunk))) {
+      char c;
 
-    if (tty->termios.c_lflag & ICANON) {
-      // EOF is only recognized in canonical mode
-      if (c == tty->termios.c_cc[VEOF])
+      // Wait for input, but only if nothing has been gathered yet
+      if ((tty->in.size == 0) && (count != 0))
         break;
 
-      if ((r = vm_space_copy_out(&c, buf++, 1)) < 0) {
-        k_spinlock_release(&tty->in.lock);
-        return r;
+      while (tty->in.size == 0) {
+        if ((r = k_waitqueue_sleep(&tty->in.queue, &tty->in.lock)) < 0) {
+          k_spinlock_release(&tty->in.lock);
+          return r;
+        }
       }
-      i++;
 
-      // In canonical mode, we process at most a single line of input
-      if ((c == tty->termios.c_cc[VEOL]) || (c == '\n'))
-        break;
-    } else {
-      if ((r = vm_space_copy_out(&c, buf++, 1)) < 0) {
-        k_spinlock_release(&tty->in.lock);
-        return r;
-      }
-      i++;
+      // Grab the next character
+      c = tty->in.buf[tty->in.read_pos];
+      tty->in.read_pos = (tty->in.read_pos + 1) % TTY_INPUT_MAX;
+      tty->in.size--;
 
-      if (i >= tty->termios.c_cc[VMIN])
-        break;
+      if (tty->termios.c_lflag & ICANON) {
+        // EOF is only recognized in canonical mode
+        if (c == tty->termios.c_cc[VEOF]) {
+          done = 1;
+          break;
+        }
+
+        chunk[count++] = c;
+
+        // In canonical mode, we process at most a single line of input
+        if ((c == tty->termios.c_cc[VEOL]) || (c == '\n'))
+          done = 1;
+      } else {
+        chunk[count++] = c;
+
+        if (i + count >= tty->termios.c_cc[VMIN])
+          done = 1;
+      }
     }
-  }
 
-  k_spinlock_release(&tty->in.lock);
+    k_spinlock_release(&tty->in.lock);
+
+    if ((r = vm_space_copy_out(chunk, buf + i, count)) < 0)
+      return r;
+
+    i += count;
+  }
 
   return i;
 }
@@ -367,31 +379,37 @@ ssize_t
 tty_write(dev_t dev, uintptr_t buf, size_t nbytes)
 {
   struct Tty *tty = tty_from_dev(dev);
-  size_t i;
+  char chunk[TTY_BOUNCE_SIZE];
+  size_t i, j, count;
 
   if (tty == NULL)
     return -ENODEV;
 
-  k_spinlock_acquire(&tty->out.lock);
+  // The lock is dropped between chunks, so other writers are not blocked for
+  // the entire duration of a large write
+  for (i = 0; i < nbytes; i += count) {
+    int r;
 
-  if (!tty->out.stopped) {
-    // TODO: unlock periodically to not block the entire system?
-    for (i = 0; i != nbytes; i++) {
-      int c, r;
+    count = MIN(nbytes - i, sizeof(chunk));
 
-      if ((r = vm_space_copy_in(&c, buf + i, 1)) < 0) {
-        k_spinlock_release(&tty->out.lock);
-        return r;
-      }
+    if ((r = vm_space_copy_in(chunk, buf + i, count)) < 0)
+      return r;
+
+    k_spinlock_acquire(&tty->out.lock);
 
-      arch_tty_out_char(tty, c);
+    if (tty->out.stopped) {
+      k_spinlock_release(&tty->out.lock);
+      break;
     }
 
+    for (j = 0; j < count; j++)
+      arch_tty_out_char(tty, chunk[j]);
+
     arch_tty_flush(tty);
+
+    k_spinlock_release(&tty->out.lock);
   }
 
-  k_spinlock_release(&tty->out.lock);
-  
   return i;
 }
 
@@ -399,25 +417,30 @@ int
 tty_ioctl(dev_t dev, int request, int arg)
 {
   struct Tty *tty = tty_from_dev(dev);
+  struct VMSpace *vm = process_current()->vm;
+  struct termios termios;
   struct winsize ws;
+  int r;
 
   if (tty == NULL)
     return -ENODEV;
 
   switch (request) {
   case TIOCGETA:
-    return vm_copy_out(process_current()->vm->pgtab,
-                       &tty->termios,
-                       arg,
-                       sizeof(struct termios));
+    if ((r = vm_user_check_buf(vm, arg, sizeof termios, VM_WRITE)) < 0)
+      return r;
+    return vm_copy_out(vm, &tty->termios, arg, sizeof termios);
 
   case TIOCSETAW:
     // TODO: drain
   case TIOCSETA:
-    return vm_copy_in(process_current()->vm->pgtab,
-                      &tty->termios,
-                      arg,
-                      sizeof(struct termios));
+    if ((r = vm_user_check_buf(vm, arg, sizeof termios, VM_READ)) < 0)
+      return r;
+    // Do not leave a partially updated structure behind on a fault
+    if ((r = vm_copy_in(vm, &termios, arg, sizeof termios)) < 0)
+      return r;
+    tty->termios = termios;
+    return 0;
 
   case TIOCGPGRP:
     return tty_current->pgrp;
@@ -426,19 +449,18 @@ tty_ioctl(dev_t dev, int request, int arg)
     tty_current->pgrp = arg;
     return 0;
   case TIOCGWINSZ:
+    if ((r = vm_user_check_buf(vm, arg, sizeof ws, VM_WRITE)) < 0)
+      return r;
     ws.ws_col = SCREEN_COLS;
     ws.ws_row = SCREEN_ROWS;
     ws.ws_xpixel = DEFAULT_FB_WIDTH;
     ws.ws_ypixel = DEFAULT_FB_HEIGHT;
-    return vm_copy_out(process_current()->vm->pgtab, &ws, arg, sizeof ws);
+    return vm_copy_out(vm, &ws, arg, sizeof ws);
   case TIOCSWINSZ:
-    // cprintf("set winsize\n");
-    if (vm_copy_in(process_current()->vm->pgtab, &ws, arg, sizeof ws) < 0)
+    if ((r = vm_user_check_buf(vm, arg, sizeof ws, VM_READ)) < 0)
+      return r;
+    if (vm_copy_in(vm, &ws, arg, sizeof ws) < 0)
       return -EFAULT;
-    // cprintf("ws_col = %d\n", ws.ws_col);
-    // cprintf("ws_row = %d\n", ws.ws_row);
-    // cprintf("ws_xpixel = %d\n", ws.ws_xpixel);
-    // cprintf("ws_ypixel = %d\n", ws.ws_ypixel);
     return 0;
   default:
     panic("TODO: %p - %d %c %d\n", request, request & 0xFF, (request >> 8) & 0xF, (request >> 16) & 0x1FFF);
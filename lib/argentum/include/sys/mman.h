@@ -20,10 +20,13 @@
 
 #define MAP_FAILED    ((void *) -1)
 
+#define MREMAP_MAYMOVE  (1 << 0)
+
 __BEGIN_DECLS
 
 void  *mmap(void *, size_t, int, int, int, off_t);
 int    mprotect(void *, size_t, int);
+void  *mremap(void *, size_t, size_t, int);
 int    munmap(void *, size_t);
 
 __END_DECLS
@@ -0,0 +1,34 @@
+#ifndef _SYS_SPAWN_H
+#define _SYS_SPAWN_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <signal.h>
+
+// Kernel interface of the __SYS_SPAWN system call used to implement
+// posix_spawn(). File actions are passed as an array performed in order.
+
+#define __SPAWN_OPEN        1
+#define __SPAWN_DUP2        2
+#define __SPAWN_CLOSE       3
+
+// Maximum number of file actions per call
+#define __SPAWN_ACTIONS_MAX 64
+
+struct __spawn_action {
+  int         type;       // One of __SPAWN_*
+  int         fildes;     // Descriptor to open, duplicate or close
+  int         newfildes;  // Target descriptor for __SPAWN_DUP2
+  int         oflag;      // Flags for __SPAWN_OPEN
+  mode_t      mode;       // Mode for __SPAWN_OPEN
+  const char *path;       // Path for __SPAWN_OPEN
+};
+
+struct __spawn_attr {
+  short       flags;      // POSIX_SPAWN_* flags
+  pid_t       pgroup;
+  sigset_t    sigdefault;
+  sigset_t    sigmask;
+};
+
+#endif /* !_SYS_SPAWN_H */
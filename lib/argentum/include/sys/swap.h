@@ -0,0 +1,12 @@
+#ifndef _SYS_SWAP_H
+#define _SYS_SWAP_H
+
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+int swapon(const char *);
+
+__END_DECLS
+
+#endif  // !_SYS_SWAP_H
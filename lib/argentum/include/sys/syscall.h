@@ -71,6 +71,10 @@
 #define __SYS_TIMES         65
 #define __SYS_MOUNT         66
 #define __SYS_SETITIMER     67
+#define __SYS_MREMAP        68
+#define __SYS_SPAWN         69
+#define __SYS_SWAPON        70
+#define __SYS_SYNC          71
 
 #ifndef __ASSEMBLER__
 
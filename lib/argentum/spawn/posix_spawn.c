@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/spawn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// The child process is created by the kernel directly from the executable
+// file, without duplicating the address space of the caller. File actions and
+// attributes are collected here and passed to the kernel in a single call.
+
+struct __posix_spawnattr {
+  struct __spawn_attr   attr;
+  int                   schedpolicy;
+  struct sched_param    schedparam;
+};
+
+struct __posix_spawn_file_actions {
+  struct __spawn_action *actions;
+  int                    count;
+};
+
+static int
+do_posix_spawn(pid_t *pid, const char *path,
+               const posix_spawn_file_actions_t *file_actions,
+               const posix_spawnattr_t *attrp,
+               char *const argv[], char *const envp[])
+{
+  const struct __spawn_action *actions = NULL;
+  const struct __spawn_attr *attr = NULL;
+  int nactions = 0;
+  int r;
+
+  if ((file_actions != NULL) && (*file_actions != NULL)) {
+    actions  = (*file_actions)->actions;
+    nactions = (*file_actions)->count;
+  }
+
+  if ((attrp != NULL) && (*attrp != NULL))
+    attr = &(*attrp)->attr;
+
+  r = __syscall_r(__SYS_SPAWN, (uintptr_t) path, (uintptr_t) argv,
+                  (uintptr_t) (envp != NULL ? envp : environ),
+                  (uintptr_t) attr, (uintptr_t) actions, nactions);
+  if (r < 0)
+    return -r;
+
+  if (pid != NULL)
+    *pid = r;
+
+  return 0;
+}
+
+int
+posix_spawn(pid_t *pid, const char *path,
+            const posix_spawn_file_actions_t *file_actions,
+            const posix_spawnattr_t *attrp,
+            char *const argv[], char *const envp[])
+{
+  return do_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+}
+
+int
+posix_spawnp(pid_t *pid, const char *file,
+             const posix_spawn_file_actions_t *file_actions,
+             const posix_spawnattr_t *attrp,
+             char *const argv[], char *const envp[])
+{
+  char buf[PATH_MAX];
+  const char *p, *end;
+  int found_eacces;
+  size_t n, len;
+
+  if (strchr(file, '/') != NULL)
+    return do_posix_spawn(pid, file, file_actions, attrp, argv, envp);
+
+  if ((p = getenv("PATH")) == NULL)
+    p = "/bin:/usr/bin";
+
+  len = strlen(file);
+  found_eacces = 0;
+
+  // Resolve the pathname before spawning: once the file actions have been
+  // performed, their errors cannot be told apart from the errors of exec
+  for ( ; ; p = end + 1) {
+    if ((end = strchr(p, ':')) == NULL)
+      end = p + strlen(p);
+
+    // An empty prefix denotes the current directory
+    n = end - p;
+    if (n + len + 2 <= sizeof(buf)) {
+      memcpy(buf, p, n);
+      if (n > 0)
+        buf[n++] = '/';
+      memcpy(&buf[n], file, len + 1);
+
+      if (access(buf, X_OK) == 0)
+        return do_posix_spawn(pid, buf, file_actions, attrp, argv, envp);
+      if (errno == EACCES)
+        found_eacces = 1;
+    }
+
+    if (*end == '\0')
+      break;
+  }
+
+  return found_eacces ? EACCES : ENOENT;
+}
+
+int
+posix_spawn_file_actions_init(posix_spawn_file_actions_t *file_actions)
+{
+  struct __posix_spawn_file_actions *fa;
+
+  if ((fa = malloc(sizeof(*fa))) == NULL)
+    return ENOMEM;
+
+  fa->actions = NULL;
+  fa->count   = 0;
+
+  *file_actions = fa;
+
+  return 0;
+}
+
+int
+posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *file_actions)
+{
+  struct __posix_spawn_file_actions *fa = *file_actions;
+  int i;
+
+  for (i = 0; i < fa->count; i++)
+    free((char *) fa->actions[i].path);
+
+  free(fa->actions);
+  free(fa);
+
+  return 0;
+}
+
+// Append a new entry to the list of file actions
+static struct __spawn_action *
+file_actions_add(posix_spawn_file_actions_t *file_actions, int type,
+                 int fildes)
+{
+  struct __posix_spawn_file_actions *fa = *file_actions;
+  struct __spawn_action *actions, *a;
+
+  if (fa->count >= __SPAWN_ACTIONS_MAX)
+    return NULL;
+
+  actions = realloc(fa->actions, (fa->count + 1) * sizeof(*actions));
+  if (actions == NULL)
+    return NULL;
+
+  fa->actions = actions;
+
+  a = &actions[fa->count++];
+  a->type      = type;
+  a->fildes    = fildes;
+  a->newfildes = -1;
+  a->oflag     = 0;
+  a->mode      = 0;
+  a->path      = NULL;
+
+  return a;
+}
+
+int
+posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *file_actions,
+                                 int fildes, const char *path, int oflag,
+                                 mode_t mode)
+{
+  struct __spawn_action *a;
+  char *s;
+
+  if ((fildes < 0) || (fildes >= OPEN_MAX))
+    return EBADF;
+
+  if ((s = strdup(path)) == NULL)
+    return ENOMEM;
+
+  if ((a = file_actions_add(file_actions, __SPAWN_OPEN, fildes)) == NULL) {
+    free(s);
+    return ENOMEM;
+  }
+
+  a->oflag = oflag;
+  a->mode  = mode;
+  a->path  = s;
+
+  return 0;
+}
+
+int
+posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *file_actions,
+                                 int fildes, int newfildes)
+{
+  struct __spawn_action *a;
+
+  if ((fildes < 0) || (fildes >= OPEN_MAX) ||
+      (newfildes < 0) || (newfildes >= OPEN_MAX))
+    return EBADF;
+
+  if ((a = file_actions_add(file_actions, __SPAWN_DUP2, fildes)) == NULL)
+    return ENOMEM;
+
+  a->newfildes = newfildes;
+
+  return 0;
+}
+
+int
+posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *file_actions,
+                                  int fildes)
+{
+  if ((fildes < 0) || (fildes >= OPEN_MAX))
+    return EBADF;
+
+  if (file_actions_add(file_actions, __SPAWN_CLOSE, fildes) == NULL)
+    return ENOMEM;
+
+  return 0;
+}
+
+int
+posix_spawnattr_init(posix_spawnattr_t *attr)
+{
+  struct __posix_spawnattr *sa;
+
+  if ((sa = malloc(sizeof(*sa))) == NULL)
+    return ENOMEM;
+
+  memset(sa, 0, sizeof(*sa));
+  sigemptyset(&sa->attr.sigdefault);
+  sigemptyset(&sa->attr.sigmask);
+
+  *attr = sa;
+
+  return 0;
+}
+
+int
+posix_spawnattr_destroy(posix_spawnattr_t *attr)
+{
+  free(*attr);
+  return 0;
+}
+
+int
+posix_spawnattr_getflags(const posix_spawnattr_t *attr, short *flags)
+{
+  *flags = (*attr)->attr.flags;
+  return 0;
+}
+
+int
+posix_spawnattr_setflags(posix_spawnattr_t *attr, short flags)
+{
+  // Scheduling parameters are not supported by the kernel
+  if (flags & ~(POSIX_SPAWN_RESETIDS | POSIX_SPAWN_SETPGROUP |
+                POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK))
+    return EINVAL;
+
+  (*attr)->attr.flags = flags;
+  return 0;
+}
+
+int
+posix_spawnattr_getpgroup(const posix_spawnattr_t *attr, pid_t *pgroup)
+{
+  *pgroup = (*attr)->attr.pgroup;
+  return 0;
+}
+
+int
+posix_spawnattr_setpgroup(posix_spawnattr_t *attr, pid_t pgroup)
+{
+  (*attr)->attr.pgroup = pgroup;
+  return 0;
+}
+
+int
+posix_spawnattr_getschedparam(const posix_spawnattr_t *attr,
+                              struct sched_param *schedparam)
+{
+  *schedparam = (*attr)->schedparam;
+  return 0;
+}
+
+int
+posix_spawnattr_setschedparam(posix_spawnattr_t *attr,
+                              const struct sched_param *schedparam)
+{
+  (*attr)->schedparam = *schedparam;
+  return 0;
+}
+
+int
+posix_spawnattr_getschedpolicy(const posix_spawnattr_t *attr, int *policy)
+{
+  *policy = (*attr)->schedpolicy;
+  return 0;
+}
+
+int
+posix_spawnattr_setschedpolicy(posix_spawnattr_t *attr, int policy)
+{
+  (*attr)->schedpolicy = policy;
+  return 0;
+}
+
+int
+posix_spawnattr_getsigdefault(const posix_spawnattr_t *attr,
+                              sigset_t *sigdefault)
+{
+  *sigdefault = (*attr)->attr.sigdefault;
+  return 0;
+}
+
+int
+posix_spawnattr_setsigdefault(posix_spawnattr_t *attr,
+                              const sigset_t *sigdefault)
+{
+  (*attr)->attr.sigdefault = *sigdefault;
+  return 0;
+}
+
+int
+posix_spawnattr_getsigmask(const posix_spawnattr_t *attr, sigset_t *sigmask)
+{
+  *sigmask = (*attr)->attr.sigmask;
+  return 0;
+}
+
+int
+posix_spawnattr_setsigmask(posix_spawnattr_t *attr, const sigset_t *sigmask)
+{
+  (*attr)->attr.sigmask = *sigmask;
+  return 0;
+}
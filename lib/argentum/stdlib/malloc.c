@@ -579,6 +579,7 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #if defined(__ARGENTUM__)
 #define HAVE_MORECORE 0
 #define HAVE_MMAP 1
+#define HAVE_MREMAP 1
 #endif  /* __ARGENTUM__ */
 
 #if defined(DARWIN) || defined(_DARWIN)
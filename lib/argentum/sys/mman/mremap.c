@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+void *
+mremap(void *addr, size_t old_len, size_t new_len, int flags)
+{
+  int r = __syscall_r(__SYS_MREMAP, (uintptr_t) addr, old_len, new_len, flags,
+                      0, 0);
+
+  if ((r < 0) && (r > -__ELASTERROR)) {
+    errno = -r;
+    return (void *) -1;
+  }
+
+  return (void *) r;
+}
@@ -0,0 +1,8 @@
+#include <sys/swap.h>
+#include <sys/syscall.h>
+
+int
+swapon(const char *path)
+{
+  return __syscall1(__SYS_SWAPON, path);
+}
@@ -30,6 +30,8 @@ LIB_SRCFILES := \
 	lib/argentum/include/sys/mount.h \
 	lib/argentum/include/sys/resource.h \
 	lib/argentum/include/sys/socket.h \
+	lib/argentum/include/sys/spawn.h \
+	lib/argentum/include/sys/swap.h \
 	lib/argentum/include/sys/syscall.h \
 	lib/argentum/include/sys/termios.h \
 	lib/argentum/include/sys/un.h \
@@ -58,6 +60,7 @@ LIB_SRCFILES := \
 	lib/argentum/signal/sigpending.c \
 	lib/argentum/signal/sigprocmask.c \
 	lib/argentum/signal/sigsuspend.c \
+	lib/argentum/spawn/posix_spawn.c \
 	lib/argentum/stdio/flockfile.c \
 	lib/argentum/stdio/funlockfile.c \
 	lib/argentum/stdlib/callocr.c \
@@ -71,8 +74,10 @@ LIB_SRCFILES := \
 	lib/argentum/sys/ioctl/ioctl.c \
 	lib/argentum/sys/mman/mmap.c \
 	lib/argentum/sys/mman/mprotect.c \
+	lib/argentum/sys/mman/mremap.c \
 	lib/argentum/sys/mman/munmap.c \
 	lib/argentum/sys/mount/mount.c \
+	lib/argentum/sys/swap/swapon.c \
 	lib/argentum/sys/resource/getrlimit.c \
 	lib/argentum/sys/resource/setrlimit.c \
 	lib/argentum/sys/socket/accept.c \
@@ -8,6 +8,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <limits.h>
+#include <spawn.h>
 
 struct Cmd;
 
@@ -149,6 +150,45 @@ static struct BuiltinCmd builtins[] = {
 
 #define NBUILTINS   (sizeof(builtins) / sizeof(builtins[0]))
 
+extern char **environ;
+
+static struct BuiltinCmd *
+builtin_lookup(const char *name)
+{
+  struct BuiltinCmd *builtin;
+
+  for (builtin = builtins; builtin < &builtins[NBUILTINS]; builtin++)
+    if (strcmp(name, builtin->name) == 0)
+      return builtin;
+
+  return NULL;
+}
+
+// Check whether the command can be run by cmd_spawn()
+static int
+cmd_is_simple(const struct Cmd *cmd)
+{
+  return (cmd->type == CMD_EXEC) &&
+         (builtin_lookup(((const struct ExecCmd *) cmd)->argv[0]) == NULL);
+}
+
+// Run a simple command in a new process after performing the given file
+// actions in it. Return the ID of the process or -1 on error.
+static pid_t
+cmd_spawn(const struct ExecCmd *ecmd, const posix_spawn_file_actions_t *actions)
+{
+  pid_t pid;
+  int r;
+
+  if ((r = posix_spawnp(&pid, ecmd->argv[0], actions, NULL, ecmd->argv,
+                        environ)) != 0) {
+    fprintf(stderr, "%s: %s\n", ecmd->argv[0], strerror(r));
+    return -1;
+  }
+
+  return pid;
+}
+
 int
 main(void)
 {
@@ -175,6 +215,50 @@ main(void)
   return 0;
 }
 
+// Run one side of a pipeline in a new process, with the given end of the pipe
+// (0 for reading, 1 for writing) as its standard input or output. Return the
+// ID of the process or -1 on error.
+static pid_t
+cmd_run_pipe_end(const struct Cmd *cmd, int fildes[2], int end)
+{
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+
+  if (cmd_is_simple(cmd)) {
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+      perror("posix_spawn_file_actions_init");
+      return -1;
+    }
+
+    if ((posix_spawn_file_actions_adddup2(&actions, fildes[end], end) != 0) ||
+        (posix_spawn_file_actions_addclose(&actions, fildes[0]) != 0) ||
+        (posix_spawn_file_actions_addclose(&actions, fildes[1]) != 0)) {
+      perror("posix_spawn_file_actions");
+      pid = -1;
+    } else {
+      pid = cmd_spawn((const struct ExecCmd *) cmd, &actions);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+  }
+
+  if ((pid = fork()) == 0) {
+    close(end);
+    dup(fildes[end]);
+
+    close(fildes[0]);
+    close(fildes[1]);
+
+    cmd_run(cmd);
+    exit(0);
+  } else if (pid < 0) {
+    perror("fork");
+  }
+
+  return pid;
+}
+
 static void
 cmd_run(const struct Cmd * cmd)
 {
@@ -187,27 +271,20 @@ cmd_run(const struct Cmd * cmd)
   struct RedirCmd *rcmd;
   struct BuiltinCmd *builtin;
   struct PipeCmd *pcmd;
+  posix_spawn_file_actions_t actions;
   int fildes[2];
 
   switch (cmd->type) {
   case CMD_EXEC:
     ecmd = (struct ExecCmd *) cmd;
 
-    for (builtin = builtins; builtin < &builtins[NBUILTINS]; builtin++)
-      if (strcmp(ecmd->argv[0], builtin->name) == 0) {
-        builtin->func(ecmd->argc, ecmd->argv);
-        return;
-      }
+    if ((builtin = builtin_lookup(ecmd->argv[0])) != NULL) {
+      builtin->func(ecmd->argc, ecmd->argv);
+      return;
+    }
 
-    if ((pid = fork()) == 0) {
-      execvp(ecmd->argv[0], ecmd->argv);
-      perror(ecmd->argv[0]);
-      exit(1);
-    } else if (pid > 0) {
+    if ((pid = cmd_spawn(ecmd, NULL)) > 0)
       waitpid(pid, &status, 0);
-    } else {
-      perror("fork");
-    }
     break;
 
   case CMD_BG:
@@ -238,6 +315,23 @@ cmd_run(const struct Cmd * cmd)
   case CMD_REDIR:
     rcmd = (struct RedirCmd *) cmd;
 
+    // Let the kernel open the file in the new process
+    if (cmd_is_simple(rcmd->cmd)) {
+      if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn_file_actions_init");
+        break;
+      }
+
+      if (posix_spawn_file_actions_addopen(&actions, rcmd->fd, rcmd->name,
+                                           rcmd->oflag, 0666) != 0)
+        perror("posix_spawn_file_actions_addopen");
+      else if ((pid = cmd_spawn((struct ExecCmd *) rcmd->cmd, &actions)) > 0)
+        waitpid(pid, &status, 0);
+
+      posix_spawn_file_actions_destroy(&actions);
+      break;
+    }
+
     if ((pid = fork()) == 0) {
       close(rcmd->fd);
 
@@ -263,31 +357,15 @@ cmd_run(const struct Cmd * cmd)
       return;
     }
 
-    if ((pid = fork()) == 0) {
-      close(1);
-      dup(fildes[1]);
-
+    if ((pid = cmd_run_pipe_end(pcmd->left, fildes, 1)) < 0) {
       close(fildes[0]);
       close(fildes[1]);
-
-      cmd_run(pcmd->left);
-      exit(0);
-    } else if (pid < 0) {
-      perror("fork");
       return;
     }
 
-    if ((pid2 = fork()) == 0) {
-      close(0);
-      dup(fildes[0]);
-
+    if ((pid2 = cmd_run_pipe_end(pcmd->right, fildes, 0)) < 0) {
       close(fildes[0]);
       close(fildes[1]);
-
-      cmd_run(pcmd->right);
-      exit(0);
-    } else if (pid2 < 0) {
-      perror("fork");
       waitpid(pid, &status, 0);
       return;
     }
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/swap.h>
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2) {
+    printf("usage: %s file\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (swapon(argv[1]) != 0) {
+    perror(argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
@@ -22,6 +22,7 @@ USER_SRCFILES += \
 	user/bin/ping.c \
 	user/bin/pwd.c \
 	user/bin/rm.c \
+	user/bin/swapon.c \
 	user/bin/server.c \
 	user/bin/client.c
 